@@ -0,0 +1,249 @@
+#pragma once
+
+#ifndef _common_flat_hash_map_hpp
+#define _common_flat_hash_map_hpp
+
+#include <stdint.h>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace prologcoin { namespace common {
+
+//
+// Open addressing hash map with all entries in one flat array (linear
+// probing with robin hood insertion and backward shift deletion.) It
+// has fewer allocations and better locality than std::unordered_map,
+// which matters when there are millions of entries.
+//
+// Keys and values must be default constructible. Inserting or erasing
+// invalidates iterators (and references to values), and the iteration
+// order is arbitrary.
+//
+template<typename K, typename V, typename Hash = std::hash<K>,
+	 typename Eq = std::equal_to<K> > class flat_hash_map {
+public:
+    using value_type = std::pair<K, V>;
+
+private:
+    struct slot {
+	slot() : dist_(0) { }
+
+	uint32_t dist_; // 0 = empty, otherwise 1 + distance from home
+	value_type kv_;
+    };
+
+    template<typename S, typename T> class basic_iterator {
+    public:
+	inline basic_iterator() : p_(nullptr), end_(nullptr) { }
+	inline basic_iterator(S *p, S *end) : p_(p), end_(end) { skip(); }
+	template<typename S2, typename T2>
+	inline basic_iterator(const basic_iterator<S2, T2> &other)
+	    : p_(other.p_), end_(other.end_) { }
+
+	inline T & operator * () const { return p_->kv_; }
+	inline T * operator -> () const { return &p_->kv_; }
+	inline basic_iterator & operator ++ () { ++p_; skip(); return *this; }
+	inline bool operator == (const basic_iterator &other) const
+	{ return p_ == other.p_; }
+	inline bool operator != (const basic_iterator &other) const
+	{ return p_ != other.p_; }
+
+    private:
+	inline void skip() { while (p_ != end_ && p_->dist_ == 0) ++p_; }
+
+	S *p_, *end_;
+
+	template<typename S2, typename T2> friend class basic_iterator;
+	friend class flat_hash_map;
+    };
+
+public:
+    using iterator = basic_iterator<slot, value_type>;
+    using const_iterator = basic_iterator<const slot, const value_type>;
+
+    inline flat_hash_map() : size_(0), shift_(64) { }
+
+    inline size_t size() const { return size_; }
+    inline bool empty() const { return size_ == 0; }
+    inline size_t capacity() const { return slots_.size(); }
+
+    inline iterator begin() { return iterator(first(), last()); }
+    inline iterator end() { return iterator(last(), last()); }
+    inline const_iterator begin() const
+    { return const_iterator(first(), last()); }
+    inline const_iterator end() const
+    { return const_iterator(last(), last()); }
+
+    void clear()
+    {
+	slots_.clear();
+	size_ = 0;
+	shift_ = 64;
+    }
+
+    void reserve(size_t n)
+    {
+	size_t cap = slots_.size();
+	if (cap == 0) cap = MIN_CAPACITY;
+	while (n * 8 > cap * 7) cap *= 2;
+	if (cap > slots_.size()) {
+	    rehash(cap);
+	}
+    }
+
+    iterator find(const K &key)
+    {
+	size_t i = lookup(key);
+	return i == NOT_FOUND ? end() : iterator(&slots_[i], last());
+    }
+
+    const_iterator find(const K &key) const
+    {
+	size_t i = lookup(key);
+	return i == NOT_FOUND ? end() : const_iterator(&slots_[i], last());
+    }
+
+    inline size_t count(const K &key) const
+    { return lookup(key) == NOT_FOUND ? 0 : 1; }
+
+    inline std::pair<iterator, bool> insert(const value_type &kv)
+    { return insert(value_type(kv)); }
+
+    std::pair<iterator, bool> insert(value_type &&kv)
+    {
+	size_t i = lookup(kv.first);
+	if (i != NOT_FOUND) {
+	    return std::make_pair(iterator(&slots_[i], last()), false);
+	}
+	if ((size_ + 1) * 8 > slots_.size() * 7) {
+	    rehash(slots_.empty() ? MIN_CAPACITY : 2 * slots_.size());
+	}
+	i = place(std::move(kv));
+	size_++;
+	return std::make_pair(iterator(&slots_[i], last()), true);
+    }
+
+    V & operator [] (const K &key)
+    {
+	size_t i = lookup(key);
+	if (i != NOT_FOUND) {
+	    return slots_[i].kv_.second;
+	}
+	return insert(value_type(key, V())).first->second;
+    }
+
+    size_t erase(const K &key)
+    {
+	size_t i = lookup(key);
+	if (i == NOT_FOUND) {
+	    return 0;
+	}
+	erase_at(i);
+	return 1;
+    }
+
+    inline void erase(iterator it)
+    { erase_at(static_cast<size_t>(it.p_ - first())); }
+
+private:
+    static const size_t MIN_CAPACITY = 16;
+    static const size_t NOT_FOUND = static_cast<size_t>(-1);
+
+    inline slot * first() { return slots_.data(); }
+    inline slot * last() { return slots_.data() + slots_.size(); }
+    inline const slot * first() const { return slots_.data(); }
+    inline const slot * last() const { return slots_.data() + slots_.size(); }
+
+    // Fibonacci hashing spreads out poor hash values (e.g. std::hash
+    // of integers is the identity.)
+    inline size_t home(const K &key) const
+    {
+	uint64_t h = static_cast<uint64_t>(hash_(key));
+	return static_cast<size_t>((h * 0x9e3779b97f4a7c15ULL) >> shift_);
+    }
+
+    size_t lookup(const K &key) const
+    {
+	if (size_ == 0) {
+	    return NOT_FOUND;
+	}
+	size_t mask = slots_.size() - 1;
+	size_t i = home(key);
+	for (uint32_t d = 1;; d++, i = (i + 1) & mask) {
+	    const slot &s = slots_[i];
+	    // An entry closer to its home means the key can't be further on
+	    if (s.dist_ < d) {
+		return NOT_FOUND;
+	    }
+	    if (s.dist_ == d && eq_(s.kv_.first, key)) {
+		return i;
+	    }
+	}
+    }
+
+    // Returns the index where kv ended up. Entries that are closer to
+    // their home than the one being placed are moved further on.
+    size_t place(value_type &&kv)
+    {
+	size_t mask = slots_.size() - 1;
+	size_t i = home(kv.first);
+	size_t at = NOT_FOUND;
+	value_type cur(std::move(kv));
+	for (uint32_t d = 1;; d++, i = (i + 1) & mask) {
+	    slot &s = slots_[i];
+	    if (s.dist_ == 0) {
+		s.dist_ = d;
+		s.kv_ = std::move(cur);
+		return at == NOT_FOUND ? i : at;
+	    }
+	    if (s.dist_ < d) {
+		std::swap(s.dist_, d);
+		std::swap(s.kv_, cur);
+		if (at == NOT_FOUND) at = i;
+	    }
+	}
+    }
+
+    void erase_at(size_t i)
+    {
+	size_t mask = slots_.size() - 1;
+	for (;;) {
+	    size_t j = (i + 1) & mask;
+	    slot &next = slots_[j];
+	    if (next.dist_ <= 1) {
+		slots_[i].dist_ = 0;
+		slots_[i].kv_ = value_type();
+		break;
+	    }
+	    slots_[i].dist_ = next.dist_ - 1;
+	    slots_[i].kv_ = std::move(next.kv_);
+	    i = j;
+	}
+	size_--;
+    }
+
+    void rehash(size_t cap)
+    {
+	std::vector<slot> old;
+	old.swap(slots_);
+	slots_.resize(cap);
+	shift_ = 64;
+	for (size_t c = cap; c > 1; c >>= 1) shift_--;
+	for (auto &s : old) {
+	    if (s.dist_ != 0) {
+		place(std::move(s.kv_));
+	    }
+	}
+    }
+
+    std::vector<slot> slots_;
+    size_t size_;
+    size_t shift_;
+    Hash hash_;
+    Eq eq_;
+};
+
+}}
+
+#endif
@@ -234,6 +234,7 @@ heap::heap()
     dotted_pair_(".", 2),
     comma_(",", 2)
 {
+    atom_index_to_name_table_.push_back("$reserved");
     new_block(0);
 }
 
@@ -323,54 +324,63 @@ size_t heap::resolve_atom_index(const std::string &name) const
     return found->second;
 }
 
-bool heap::is_name(con_cell c, const std::string &name) const
+cell heap::copy_segment(const heap &src, size_t from, size_t to, cell c)
 {
-    if (c.is_direct()) {
-        return c.name() == name;
-    } else {
-        return atom_name(c) == name;
-    }
-}
-
-//
-// Dereference chain of REF cells.
-//
-// TODO: What do to with GBL? Perhaps we just treat them specially?
-// GBL cells point to global heap, which then have REF cells. It feels
-// good to have a firewall between the two. Yet, some extra logic is
-// needed to manually "go through" that firewall. Perhaps another helper
-// function would do, e.g. deref_global(c)
-//
-cell heap::deref(cell c) const
-{
-    while (c.tag() == tag_t::REF) {
-      auto &rc = static_cast<ref_cell &>(c);
-      size_t index = rc.index();
-      cell referred = get(index);
-      if (referred == c) {
+    std::unordered_map<con_cell, con_cell> con_map;
+    size_t dst_from = size_;
+
+    auto relocate = [&](cell c) -> cell {
+	switch (c.tag()) {
+	case tag_t::REF:
+	    return ref_cell(static_cast<ref_cell &>(c).index() - from + dst_from);
+	case tag_t::STR:
+	    return str_cell(static_cast<str_cell &>(c).index() - from + dst_from);
+	case tag_t::CON: {
+	    auto &cc = static_cast<con_cell &>(c);
+	    if (cc.is_direct() || cc.atom_index() == RESERVED_ATOM_INDEX) {
+		return c;
+	    }
+	    auto search = con_map.find(cc);
+	    if (search != con_map.end()) {
+		return search->second;
+	    }
+	    con_cell dst_cc = functor(src.atom_name(cc), cc.arity());
+	    con_map[cc] = dst_cc;
+	    return dst_cc;
+	}
+	case tag_t::INT:
+	    return c;
+	case tag_t::BIG:
+	    // Not yet supported (as for term_utils::copy)
+	    assert(false);
+	    return c;
+	}
 	return c;
-      }
-      c = referred;
+    };
+
+    size_t n = to - from;
+    if (n > 0) {
+	assert(src.is_contiguous(from, to));
+	cell *p;
+	size_t index;
+	std::tie(p, index) = allocate(tag_t::REF, n);
+	dst_from = index;
+	const cell *q = &src.find_block(from)[from];
+	for (size_t i = 0; i < n; i++) {
+	    p[i] = relocate(q[i]);
+	}
     }
-    return c;
+
+    return relocate(c);
 }
 
-cell heap::deref_with_cost(cell c, uint64_t &cost) const
+bool heap::is_name(con_cell c, const std::string &name) const
 {
-    uint64_t cost_tmp = 1;
-    while (c.tag() == tag_t::REF) {
-      auto &rc = static_cast<ref_cell &>(c);
-      size_t index = rc.index();
-      cell referred = get(index);
-      if (referred == c) {
-        cost = cost_tmp;
-	return c;
-      }
-      c = referred;
-      cost_tmp++;
+    if (c.is_direct()) {
+        return c.name() == name;
+    } else {
+        return atom_name(c) == name;
     }
-    cost = cost_tmp;
-    return c;
 }
 
 bool heap::is_list(const cell c) const
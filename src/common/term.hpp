@@ -358,6 +358,13 @@ public:
 
     inline int_cell(const int_cell &other) : cell(other) { }
 
+    // Does v fit in the 61 bits? (The arithmetic operators below
+    // silently wrap.)
+    static inline bool fits(T v) {
+	return v >= -(static_cast<T>(1) << 60) &&
+	       v < (static_cast<T>(1) << 60);
+    }
+
     inline operator T () const {
 	return static_cast<T>(value_signed());
     }
@@ -463,7 +470,7 @@ public:
     }
 
     inline bool can_allocate(size_t n) const {
-	return size_ + n < MAX_SIZE;
+	return size_ + n <= MAX_SIZE;
     }
 
     inline size_t allocate(size_t n) {
@@ -583,6 +590,34 @@ private:
 };
 #endif
 
+//
+// Heap access policies
+//
+// The heap accessors take one of these as a template parameter.
+// heap_checked (the default) throws on an address outside the heap and
+// is what terms from the outside (e.g. decoded from a buffer) must be
+// accessed with. heap_unchecked is for addresses the engine produced
+// itself; these are only checked with DEBUG_TERM.
+//
+
+struct heap_checked {
+    static inline void check_index(size_t index, size_t size)
+    {
+	if (index >= size) {
+	    throw heap_index_out_of_range_exception(index, size);
+	}
+    }
+};
+
+struct heap_unchecked {
+    static inline void check_index(size_t index, size_t size)
+    {
+#ifdef DEBUG_TERM
+	assert(index < size);
+#endif
+    }
+};
+
 //
 // heap
 //
@@ -601,11 +636,17 @@ public:
 
     void trim(size_t new_size);
 
+    template<typename P = heap_checked>
     inline void check_index(size_t index) const
     {
-	if (index >= size()) {
-	    throw heap_index_out_of_range_exception(index, size());
-	}
+	P::check_index(index, size());
+    }
+
+    template<typename P = heap_checked>
+    inline const cell & get(size_t addr) const
+    {
+	check_index<P>(addr);
+	return find_block(addr)[addr];
     }
 
     inline cell & operator [] (size_t addr)
@@ -620,6 +661,24 @@ public:
 
     size_t list_length(const cell lst) const;
 
+    // True if [from, to) is within one heap block, i.e. the cells are
+    // consecutive in memory.
+    inline bool is_contiguous(size_t from, size_t to) const
+    {
+	return from == to || find_block_index(from) == find_block_index(to-1);
+    }
+
+    // Copy the cells [from, to) of 'src' to the top of this heap in one
+    // pass, relocating REF/STR cells and translating atoms. The segment
+    // must be contiguous and closed (nothing in it refers outside of
+    // it.) Returns 'c' (a cell of or into the segment) relocated.
+    cell copy_segment(const heap &src, size_t from, size_t to, cell c);
+
+    // Atom index 0 is never handed out for a name, so a con_cell with
+    // it can't be built by parsing or atom_codes. It is used as a
+    // marker that user terms can't fake (e.g. term_serializer::FRAGMENT.)
+    static const size_t RESERVED_ATOM_INDEX = 0;
+
     inline con_cell atom(const std::string &name) const
     {
         if (name.length() > 7) {
@@ -641,7 +700,7 @@ public:
 
     inline con_cell functor(const std::string &name, size_t arity)
     {
-        if (name.length() > 7) {
+        if (!con_cell::use_compacted(name, arity)) {
    	    return con_cell(resolve_atom_index(name), arity);
 	}
 	
@@ -677,23 +736,24 @@ public:
 
     size_t resolve_atom_index(const std::string &name) const;
 
+    template<typename P = heap_checked>
     inline con_cell functor(const term s) const
     {
-	term ds = deref(s);
+	term ds = deref<P>(s);
         if (ds.tag() == tag_t::CON) {
 	    return static_cast<const con_cell &>(ds);
         }
         if (ds.tag() != tag_t::STR) {
 	    throw expected_str_cell_exception(ds);
         }
-	return functor(static_cast<const str_cell &>(ds));
+	return functor<P>(static_cast<const str_cell &>(ds));
     }
 
+    template<typename P = heap_checked>
     inline con_cell functor(const str_cell &s) const
     {
 	size_t index = s.index();
-	check_index(index);
-	cell c = get(index);
+	cell c = get<P>(index);
 	if (c.tag() != tag_t::CON) {
 	    throw expected_con_cell_exception(index, c);
 	}
@@ -736,14 +796,53 @@ public:
 	}
     }
 
-    cell deref(cell c) const;
-    cell deref_with_cost(cell c, uint64_t &cost) const;
+    //
+    // Dereference chain of REF cells.
+    //
+    // TODO: What do to with GBL? Perhaps we just treat them specially?
+    // GBL cells point to global heap, which then have REF cells. It feels
+    // good to have a firewall between the two. Yet, some extra logic is
+    // needed to manually "go through" that firewall. Perhaps another helper
+    // function would do, e.g. deref_global(c)
+    //
+    template<typename P = heap_checked>
+    inline cell deref(cell c) const
+    {
+	while (c.tag() == tag_t::REF) {
+	    auto &rc = static_cast<ref_cell &>(c);
+	    cell referred = get<P>(rc.index());
+	    if (referred == c) {
+		return c;
+	    }
+	    c = referred;
+	}
+	return c;
+    }
+
+    template<typename P = heap_checked>
+    inline cell deref_with_cost(cell c, uint64_t &cost) const
+    {
+	uint64_t cost_tmp = 1;
+	while (c.tag() == tag_t::REF) {
+	    auto &rc = static_cast<ref_cell &>(c);
+	    cell referred = get<P>(rc.index());
+	    if (referred == c) {
+		cost = cost_tmp;
+		return c;
+	    }
+	    c = referred;
+	    cost_tmp++;
+	}
+	cost = cost_tmp;
+	return c;
+    }
 
+    template<typename P = heap_checked>
     inline term arg(const cell c, size_t index) const
     {
-	auto dc = deref(c);
+	auto dc = deref<P>(c);
         const str_cell &s = static_cast<const str_cell &>(dc);
-	return term(*this, deref(get(s.index() + index + 1)));
+	return term(*this, deref<P>(get<P>(s.index() + index + 1)));
     }
 
     void set_arg(cell str, size_t index, const cell c)
@@ -833,7 +932,7 @@ public:
 	cell *p;
 	std::tie(p, index) = allocate(tag_t::REF, cnt);
 	for (size_t i = 0; i < cnt; i++) {
-	    static_cast<ref_cell &>(p[i]).set_index(index+i);
+	    p[i] = ref_cell(index+i);
 	}
     }
 
@@ -915,12 +1014,6 @@ private:
 	return std::make_pair(p, addr);
     }
 
-    inline const cell & get(size_t addr) const
-    {
-	check_index(addr);
-	return find_block(addr)[addr];
-    }
-
     inline cell arg0(const cell &c, size_t index) const
     {
         const str_cell &s = static_cast<const str_cell &>(c);
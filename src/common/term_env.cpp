@@ -172,6 +172,7 @@ uint64_t term_utils::cost(term t)
     return cost_acc;
 }
 
+template<typename P>
 bool term_utils::unify(term a, term b, uint64_t &cost)
 {
     size_t start_trail = trail_size();
@@ -182,7 +183,7 @@ bool term_utils::unify(term a, term b, uint64_t &cost)
     // unification fails.
     set_register_hb(heap_size());
 
-    bool r = unify_helper(a, b, cost);
+    bool r = unify_helper<P>(a, b, cost);
 
     if (!r) {
       unwind_trail(start_trail, trail_size());
@@ -197,6 +198,7 @@ bool term_utils::unify(term a, term b, uint64_t &cost)
     return true;
 }
 
+template<typename P>
 bool term_utils::unify_helper(term a, term b, uint64_t &cost)
 {
     size_t d = stack_size();
@@ -214,9 +216,9 @@ bool term_utils::unify_helper(term a, term b, uint64_t &cost)
 	// will add 2 to the accumulated cost.
 
 	uint64_t cost_deref1 = 0, cost_deref2 = 0;
-        a = deref_with_cost(pop(), cost_deref1);
+        a = deref_with_cost<P>(pop(), cost_deref1);
 	cost_tmp += cost_deref1;
-	b = deref_with_cost(pop(), cost_deref2);
+	b = deref_with_cost<P>(pop(), cost_deref2);
 	cost_tmp += cost_deref2;
 
 	if (a == b) {
@@ -265,16 +267,16 @@ bool term_utils::unify_helper(term a, term b, uint64_t &cost)
 	case tag_t::STR: {
 	  str_cell &astr = static_cast<str_cell &>(a);
 	  str_cell &bstr = static_cast<str_cell &>(b);
-	  con_cell f = functor(astr);
-	  if (f != functor(bstr)) {
+	  con_cell f = functor<P>(astr);
+	  if (f != functor<P>(bstr)) {
 	    cost = cost_tmp;
 	    return false;
 	  }
 	  // Push pairwise args
 	  size_t num_args = f.arity();
 	  for (size_t i = 0; i < num_args; i++) {
-	    auto ai = arg(astr, num_args-i-1);
-	    auto bi = arg(bstr, num_args-i-1);
+	    auto ai = arg<P>(astr, num_args-i-1);
+	    auto bi = arg<P>(bstr, num_args-i-1);
 	    push(bi);
 	    push(ai);
 	  }
@@ -290,6 +292,9 @@ bool term_utils::unify_helper(term a, term b, uint64_t &cost)
     return true;
 }
 
+template bool term_utils::unify<heap_checked>(term a, term b, uint64_t &cost);
+template bool term_utils::unify<heap_unchecked>(term a, term b, uint64_t &cost);
+
 int term_utils::functor_standard_order(con_cell a, con_cell b)
 {
     if (a == b) {
@@ -140,24 +140,30 @@ public:
     inline heap_dock() { }
 
     // Heap management
+    //
+    // The accessors that read the heap take an access policy
+    // (heap_checked or heap_unchecked, see term.hpp.)
     inline void heap_set(size_t index, term t)
         { T::get_heap()[index] = t; }
-    inline term heap_get(size_t index)
-        { return T::get_heap()[index]; }
+    template<typename P = heap_checked> inline term heap_get(size_t index)
+        { return T::get_heap().template get<P>(index); }
 
     // Term management
     inline term new_ref()
         { return T::get_heap().new_ref(); }
     inline void new_ref(size_t cnt)
         { T::get_heap().new_ref(cnt); }
-    inline term deref(const term t) const
-        { return T::get_heap().deref(t); }
+    template<typename P = heap_checked> inline term deref(const term t) const
+        { return T::get_heap().template deref<P>(t); }
+    template<typename P = heap_checked>
     inline term deref_with_cost(const term t, uint64_t &cost) const
-        { return T::get_heap().deref_with_cost(t, cost); }
+        { return T::get_heap().template deref_with_cost<P>(t, cost); }
+    template<typename P = heap_checked>
     inline con_cell functor(const term t) const
-        { return T::get_heap().functor(t); }
+        { return T::get_heap().template functor<P>(t); }
+    template<typename P = heap_checked>
     inline term arg(const term t, size_t index) const
-        { return T::get_heap().arg(t, index); }
+        { return T::get_heap().template arg<P>(t, index); }
     inline void set_arg(term t, size_t index, const term arg)
         { return T::get_heap().set_arg(t, index, arg); }
     inline void trim_heap(size_t new_size)
@@ -351,6 +357,8 @@ class term_utils : public heap_proxy, stacks_proxy {
 public:
     term_utils(heap &h, stacks &s) : heap_proxy(h), stacks_proxy(s) { }
 
+    // Instantiated for heap_checked and heap_unchecked
+    template<typename P = heap_checked>
     bool unify(term a, term b, uint64_t &cost);
     term copy(const term t, naming_map &names, uint64_t &cost);
     term copy(const term t, naming_map &names,
@@ -363,7 +371,7 @@ public:
     int standard_order(const term a, const term b, uint64_t &cost);
 
 private:
-    bool unify_helper(term a, term b, uint64_t &cost);
+    template<typename P> bool unify_helper(term a, term b, uint64_t &cost);
     int functor_standard_order(con_cell a, con_cell b);
 
     inline void bind(const ref_cell &a, term b)
@@ -485,10 +493,11 @@ public:
       stacks_dock<ST>::trim_trail(to);
   }
 
+  template<typename P = heap_checked>
   inline bool unify(term a, term b, uint64_t &cost)
   {
       term_utils utils(heap_dock<HT>::get_heap(), stacks_dock<ST>::get_stacks());
-      return utils.unify(a, b, cost);
+      return utils.template unify<P>(a, b, cost);
   }
 
   inline term copy(term t, uint64_t &cost)
@@ -504,6 +513,19 @@ public:
       return utils.copy(t, var_naming(), src.get_heap(), src.var_naming(), cost);
   }
 
+  // Copy 't' that lives in the segment [from, top) of 'src', e.g.
+  // results collected on a secondary heap. Falls back to a term copy
+  // if the segment spans heap blocks.
+  inline term copy_segment(term t, term_env_dock<HT,ST,OT> &src, size_t from, uint64_t &cost)
+  {
+      size_t to = src.heap_size();
+      if (!src.get_heap().is_contiguous(from, to)) {
+	  return copy(t, src, cost);
+      }
+      cost += to - from;
+      return heap_dock<HT>::get_heap().copy_segment(src.get_heap(), from, to, t);
+  }
+
   inline uint64_t hash(term t)
   {
       term_utils utils(heap_dock<HT>::get_heap(), stacks_dock<ST>::get_stacks());
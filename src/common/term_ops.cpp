@@ -11,6 +11,7 @@ term_ops::term_ops()
 	    { ":-",     2, 1200,       XFX, SPACE_XFX },
 	    { ":-",     1, 1200,       FX,  SPACE_XF },
 	    { "?-",     1, 1200,       FX,  SPACE_XF },
+	    { "table",  1, 1150,       FX,  SPACE_FX },
 	    { ";",      2, 1100,       XFY, SPACE_XFX },
 	    { "|",      2, 1100,       XFY, SPACE_XFX },
 	    { "->",     2, 1050,       XFY, SPACE_XFX },
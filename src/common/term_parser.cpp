@@ -1037,10 +1037,22 @@ public:
         throw token_exception_unrecognized_operator(tok.pos(), tok.lexeme());
     }
 
-    // Pick first candidate that doesn't yield parse error.
-    // (Note that entries are sorted in precedence order.)
+    select_operator(tok, candidates);
 
+    if (!consumed_name) {
+        tokenizer().consume_token();
+    }
+
+    return lookahead_;
+  }
+
+  // Pick first candidate that doesn't yield parse error.
+  // (Note that entries are sorted in precedence order.)
+  void select_operator(const term_tokenizer::token &tok,
+		       const std::vector<term_ops::op_entry> &candidates)
+  {
     term_ops::op_entry entry;
+    symbol_t symt = SYMBOL_UNKNOWN;
     for (auto e : candidates) {
 	entry = e;
 	symt = to_symbol(e);
@@ -1052,12 +1064,26 @@ public:
 
     lookahead_ = sym(current_state_, tok, symt);
     lookahead_.set_precedence(entry.precedence);
+  }
 
-    if (!consumed_name) {
-        tokenizer().consume_token();
+  void init()
+  {
+    term_parser_interim::init();
+
+    // The lookahead left by the previous term (read past its full
+    // stop) is an operator picked in the state of that term, e.g.
+    // the infix ':-' instead of the prefix one. Pick it again.
+    switch (lookahead_.ordinal()) {
+    case SYMBOL_OP_FX: case SYMBOL_OP_FY:
+    case SYMBOL_OP_XF: case SYMBOL_OP_YF:
+    case SYMBOL_OP_XFX: case SYMBOL_OP_XFY: case SYMBOL_OP_YFX: {
+	auto tok = lookahead_.token();
+	select_operator(tok, ops_.prec(tok.lexeme()));
+	break;
+    }
+    default:
+	break;
     }
-
-    return lookahead_;
   }
 
   bool check(sym symbol) {
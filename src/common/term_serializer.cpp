@@ -4,7 +4,10 @@
 
 namespace prologcoin { namespace common {
 
-term_serializer::term_serializer(term_env &env) : env_(env)
+const con_cell term_serializer::FRAGMENT(heap::RESERVED_ATOM_INDEX, 1);
+
+term_serializer::term_serializer(term_env &env)
+    : env_(env), fragments_(nullptr)
 {
 }
 
@@ -14,6 +17,8 @@ term_serializer::~term_serializer()
 
 void term_serializer::write(buffer_t &bytes, const term t)
 {
+    fragment_state_.clear();
+
     write_all_header(bytes, t);
 
     size_t offset = bytes.size();
@@ -41,9 +46,16 @@ void term_serializer::write(buffer_t &bytes, const term t)
 	case tag_t::REF:
 	    write_ref_cell(bytes,offset,reinterpret_cast<const ref_cell &>(t1));
 	    break;
-	case tag_t::STR:
-	    write_str_cell(bytes,offset,reinterpret_cast<const str_cell &>(t1));
+	case tag_t::STR: {
+	    size_t index;
+	    if (is_fragment(t1, index)) {
+		write_fragment(bytes, offset, index);
+	    } else {
+		write_str_cell(bytes,offset,
+			       reinterpret_cast<const str_cell &>(t1));
+	    }
 	    break;
+	    }
 	case tag_t::BIG:
 	    assert("TODO: Not implemented yet" == nullptr);
 	    break;
@@ -67,6 +79,11 @@ void term_serializer::write_all_header(buffer_t &bytes,const term t)
     write_con_cell(bytes, bytes.size(), con_cell("ver1",0));
     write_con_cell(bytes, bytes.size(), con_cell("remap", 0));
     for (auto t1 : env_.iterate_over(t)) {
+	size_t index;
+	if (t1.tag() == tag_t::STR && is_fragment(t1, index)) {
+	    write_fragment_header(bytes, index);
+	    continue;
+	}
 	switch (t1.tag()) {
 	case tag_t::CON: case tag_t::STR: {
 	    con_cell f = env_.functor(t1);
@@ -113,6 +130,132 @@ void term_serializer::write_str_cell(buffer_t &bytes, size_t offset,
     }
 }
 
+bool term_serializer::is_fragment(const term t, size_t &index)
+{
+    if (fragments_ == nullptr || env_.functor(t) != FRAGMENT) {
+	return false;
+    }
+    term arg = env_.deref(env_.arg(t, 0));
+    if (arg.tag() != tag_t::INT) {
+	return false;
+    }
+    int64_t i = reinterpret_cast<const int_cell &>(arg).value();
+    if (i < 0 || static_cast<size_t>(i) >= fragments_->size()) {
+	return false;
+    }
+    index = static_cast<size_t>(i);
+    return true;
+}
+
+//
+// The header entries of the fragment are copied as they are, except
+// for their own index (which is where they end up in the output.)
+//
+void term_serializer::write_fragment_header(buffer_t &bytes, size_t index)
+{
+    if (fragment_state_.count(index)) {
+	return;
+    }
+    auto &state = fragment_state_[index];
+    state.written_ = false;
+
+    const buffer_t &frag = *(*fragments_)[index];
+    size_t offset = 2 * sizeof(cell); // Skip ver1 and remap
+    for (;;) {
+	cell c = read_cell(frag, offset, "reading fragment header");
+	size_t hdr_index = cell_count(offset);
+	offset += sizeof(cell);
+	if (c == con_cell("pamer",0)) {
+	    break;
+	}
+	size_t new_index = cell_count(bytes);
+	switch (c.tag()) {
+	case tag_t::CON:
+	    write_cell(bytes, bytes.size(),
+		       con_cell(new_index,
+				reinterpret_cast<const con_cell &>(c).arity()));
+	    break;
+	case tag_t::REF:
+	    write_cell(bytes, bytes.size(), ref_cell(new_index));
+	    break;
+	default:
+	    throw serializer_exception_unexpected_data(c, offset, "ref/con in remap section");
+	}
+	if (state.header_.size() <= hdr_index) {
+	    state.header_.resize(hdr_index + 1);
+	}
+	state.header_[hdr_index] = new_index;
+
+	// Encoded string
+	bool cont = true;
+	while (cont) {
+	    cell ch = read_cell(frag, offset, "reading fragment header");
+	    if (ch.tag() != tag_t::INT) {
+		throw serializer_exception_unexpected_data(ch, offset, "encoded string as INTs");
+	    }
+	    write_cell(bytes, bytes.size(), ch);
+	    cont = !reinterpret_cast<const int_cell &>(ch).is_last_char_chunk();
+	    offset += sizeof(cell);
+	}
+    }
+    state.body_ = offset;
+}
+
+//
+// The body of the fragment is appended at the end (as the arguments
+// of a structure would be) and the slot at offset gets its root cell.
+// The same fragment is only written once; other occurrences share it.
+//
+void term_serializer::write_fragment(buffer_t &bytes, size_t offset,
+				     size_t index)
+{
+    auto &state = fragment_state_[index];
+    if (!state.written_) {
+	const buffer_t &frag = *(*fragments_)[index];
+	size_t hdr = cell_count(state.body_);
+	size_t base = cell_count(bytes);
+	for (size_t i = state.body_; i < frag.size(); i += sizeof(cell)) {
+	    cell c = read_cell(frag, i, "reading fragment");
+	    write_cell(bytes, bytes.size(), relocate(state, c, hdr, base));
+	}
+	state.root_ = read_cell(bytes, base * sizeof(cell), "reading fragment");
+	state.written_ = true;
+    }
+    write_cell(bytes, offset, state.root_);
+}
+
+cell term_serializer::relocate(const fragment_state &state, const cell c,
+			       size_t hdr, size_t base)
+{
+    switch (c.tag()) {
+    case tag_t::CON: {
+	auto &con = reinterpret_cast<const con_cell &>(c);
+	if (con.is_direct()) {
+	    return c;
+	}
+	size_t i = con.atom_index();
+	if (i >= state.header_.size()) {
+	    throw serializer_exception_missing_index(c);
+	}
+	return con_cell(state.header_[i], con.arity());
+        }
+    case tag_t::REF:
+    case tag_t::STR: {
+	auto &pc = reinterpret_cast<const ptr_cell &>(c);
+	size_t i = pc.index();
+	if (i < hdr) {
+	    if (i >= state.header_.size()) {
+		throw serializer_exception_missing_index(c);
+	    }
+	    return ptr_cell(c.tag(), state.header_[i]);
+	}
+	return ptr_cell(c.tag(), i - hdr + base);
+        }
+    default:
+	return c;
+    }
+}
+
 term term_serializer::read(const buffer_t &bytes)
 {
     return read(bytes, bytes.size());
@@ -177,10 +177,23 @@ class test_term_serializer;
 class term_serializer {
 public:
     typedef std::vector<uint8_t> buffer_t;
+    typedef std::vector<std::shared_ptr<const buffer_t> > fragments_t;
+
+    // Placeholder for a fragment; see set_fragments. It uses the
+    // reserved atom, so no term read from a user is ever spliced.
+    static const con_cell FRAGMENT;
 
     term_serializer(term_env &env);
     ~term_serializer();
 
+    // Terms that are already serialized (by write) can be spliced into
+    // the output without building them again: a FRAGMENT(I) term is
+    // written as the I:th fragment (its atoms are added to the header
+    // and its cells are relocated.) Reading gives back the original
+    // terms.
+    inline void set_fragments(const fragments_t *fragments)
+        { fragments_ = fragments; }
+
     void write(buffer_t &bytes, const term t);
     term read(const buffer_t &bytes);
     term read(const buffer_t &bytes, size_t n);
@@ -267,6 +280,19 @@ private:
     void write_encoded_string(buffer_t &bytes, const std::string &str);
     void write_all_header(buffer_t &bytes, const term t);
 
+    struct fragment_state {
+	size_t body_;                 // Offset of the body in the fragment
+	std::vector<size_t> header_;  // Header cell index to output index
+	bool written_;
+	cell root_;                   // Root cell once written
+    };
+
+    bool is_fragment(const term t, size_t &index);
+    void write_fragment_header(buffer_t &bytes, size_t index);
+    void write_fragment(buffer_t &bytes, size_t offset, size_t index);
+    cell relocate(const fragment_state &state, const cell c,
+		  size_t hdr, size_t base);
+
     term read(const buffer_t &bytes, size_t n,
 	      size_t &offset, size_t &old_hdr_size, size_t &new_hdr_size);
     void read_all_header(const buffer_t &bytes, size_t &offset);
@@ -278,6 +304,9 @@ private:
     indexor<term> term_index_;
     std::unordered_map<cell,cell> new_to_old_;
     std::vector<std::pair<size_t, term> > stack_;
+
+    const fragments_t *fragments_;
+    std::unordered_map<size_t, fragment_state> fragment_state_;
 };
 
 }}
@@ -0,0 +1,116 @@
+#include <iostream>
+#include <iomanip>
+#include <assert.h>
+#include <map>
+#include <unordered_map>
+#include <common/fast_hash.hpp>
+#include <common/flat_hash_map.hpp>
+#include <common/utime.hpp>
+
+using namespace prologcoin::common;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static void test_flat_hash_map_random()
+{
+    header( "test_flat_hash_map_random" );
+
+    // Random inserts and erases on a small key range (so there are many
+    // hits) compared with std::unordered_map.
+
+    flat_hash_map<uint64_t, std::string> map;
+    std::unordered_map<uint64_t, std::string> ref;
+
+    fast_hash h;
+    for (size_t i = 0; i < 200000; i++) {
+	h << i;
+	uint32_t r = h;
+	uint64_t key = r % 5000;
+	switch ((r >> 16) % 3) {
+	case 0: case 1: {
+	    std::string val = std::to_string(i);
+	    bool ins = map.insert(std::make_pair(key, val)).second;
+	    assert(ins == ref.insert(std::make_pair(key, val)).second);
+	    break;
+	}
+	case 2:
+	    assert(map.erase(key) == ref.erase(key));
+	    break;
+	}
+	assert(map.size() == ref.size());
+    }
+
+    size_t n = 0;
+    for (auto &p : map) {
+	auto it = ref.find(p.first);
+	assert(it != ref.end());
+	assert(it->second == p.second);
+	n++;
+    }
+    assert(n == ref.size());
+    for (auto &p : ref) {
+	assert(map.find(p.first) != map.end());
+	assert(map[p.first] == p.second);
+    }
+    assert(map.size() == ref.size());
+
+    std::cout << "size=" << map.size() << " capacity=" << map.capacity()
+	      << std::endl;
+
+    while (!map.empty()) {
+	map.erase(map.begin());
+    }
+    assert(map.begin() == map.end());
+    assert(map.find(0) == map.end());
+}
+
+template<typename M> static uint64_t bench(const char *name, M &map, size_t n)
+{
+    utime t1 = utime::now();
+    for (size_t i = 0; i < n; i++) {
+	map[i * 7919] = i;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+	sum += map.find(i * 7919)->second;
+    }
+    for (size_t i = 0; i < n; i += 2) {
+	map.erase(i * 7919);
+    }
+    utime t2 = utime::now();
+    std::cout << std::setw(20) << name << ": " << (t2 - t1).in_ms()
+	      << " ms" << std::endl;
+    return sum;
+}
+
+static void test_flat_hash_map_bench()
+{
+    header( "test_flat_hash_map_bench" );
+
+    const size_t N = 1000000;
+
+    std::cout << "Insert, find and erase half of " << N << " keys"
+	      << std::endl;
+
+    flat_hash_map<uint64_t, uint64_t> flat;
+    std::unordered_map<uint64_t, uint64_t> unordered;
+    std::map<uint64_t, uint64_t> ordered;
+    auto s1 = bench("flat_hash_map", flat, N);
+    auto s2 = bench("std::unordered_map", unordered, N);
+    auto s3 = bench("std::map", ordered, N);
+    assert(s1 == s2 && s2 == s3);
+    assert(flat.size() == N / 2);
+}
+
+int main(int argc, char *argv[])
+{
+    test_flat_hash_map_random();
+    test_flat_hash_map_bench();
+
+    return 0;
+}
@@ -49,6 +49,77 @@ static void test_term_serializer_simple()
     assert(str1 == str2);
 }
 
+static void test_term_serializer_fragments()
+{
+    header( "test_term_serializer_fragments()" );
+
+    // Serialize some terms on their own, and then splice them into
+    // another term.
+
+    const char *texts[] = {
+	"entry('127.0.0.1', 8783, ver(1, 2), [hello, World, World]).",
+	"foo(kallekula, Y, bar(Y, kallekula)).",
+	"a_rather_long_atom." };
+
+    term_serializer::fragments_t fragments;
+    for (auto text : texts) {
+	term_env env;
+	term_serializer ser(env);
+	auto buf = std::make_shared<term_serializer::buffer_t>();
+	ser.write(*buf, env.parse(text));
+	fragments.push_back(buf);
+    }
+
+    term_env env;
+    term list = env.empty_list();
+    for (int i : {0, 2, 1, 0}) {
+	list = env.new_dotted_pair(
+		   env.new_term(term_serializer::FRAGMENT, {int_cell(i)}),
+		   list);
+    }
+    term t = env.new_term(env.functor("result", 3),
+			  {list, env.functor("kallekula", 0), list});
+
+    term_serializer ser(env);
+    ser.set_fragments(&fragments);
+    term_serializer::buffer_t buf;
+    ser.write(buf, t);
+
+    term_env env2;
+    term_serializer ser2(env2);
+    auto str = env2.to_string(ser2.read(buf));
+
+    std::cout << "READ TERM: " << str << "\n";
+
+    // The same thing parsed as one term (the first fragment occurs
+    // twice and so its variable is shared.)
+    std::string list_str =
+	"[entry('127.0.0.1', 8783, ver(1, 2), [hello, World, World]),"
+	" foo(kallekula, Y, bar(Y, kallekula)),"
+	" a_rather_long_atom,"
+	" entry('127.0.0.1', 8783, ver(1, 2), [hello, World, World])]";
+    term_env env3;
+    term expect = env3.parse("result(" + list_str + ", kallekula, "
+			     + list_str + ").");
+    auto expect_str = env3.to_string(expect);
+
+    std::cout << "EXPECTED:  " << expect_str << "\n";
+
+    assert(str == expect_str);
+
+    // Terms that only look like placeholders are written as they are.
+    term fake = env.parse("fake('$frag'(0), '$reserved'(1), '$reserved').");
+    term_serializer::buffer_t fake_buf;
+    ser.write(fake_buf, fake);
+    term_env env4;
+    term_serializer ser4(env4);
+    auto fake_str = env4.to_string(ser4.read(fake_buf));
+
+    std::cout << "FAKE:      " << fake_str << "\n";
+
+    assert(fake_str == env.to_string(fake));
+}
+
 namespace prologcoin { namespace common { namespace test {
 
 class test_term_serializer {
@@ -224,6 +295,7 @@ static void test_term_serializer_exceptions()
 int main( int argc, char *argv[] )
 {
     test_term_serializer_simple();
+    test_term_serializer_fragments();
     test_term_serializer_exceptions();
 
     return 0;
@@ -100,6 +100,30 @@ static void test_heap_simple()
     (void)cp;
 }
 
+static void test_heap_access()
+{
+    header( "test_heap_access()" );
+
+    heap h;
+
+    auto t = h.new_str( con_cell("foo", 1) );
+    h.set_arg(t, 0, int_cell(4711));
+
+    // Both policies agree on addresses within the heap
+    assert( h.functor<heap_unchecked>(t) == h.functor<heap_checked>(t) );
+    assert( h.arg<heap_unchecked>(t, 0) == int_cell(4711) );
+
+    // Only the checked policy rejects a dangling reference
+    bool thrown = false;
+    try {
+	h.deref<heap_checked>(ref_cell(h.size() + 100));
+    } catch (heap_index_out_of_range_exception &ex) {
+	std::cout << " Expected: " << ex.what() << "\n";
+	thrown = true;
+    }
+    assert( thrown );
+}
+
 static void test_term_ops()
 {
     header( "test_term_ops()" );
@@ -120,6 +144,7 @@ int main(int argc, char *argv[])
     test_int_cells();
 
     test_heap_simple();
+    test_heap_access();
 
     test_term_ops();
 
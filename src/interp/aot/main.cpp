@@ -0,0 +1,143 @@
+//
+// Ahead-of-time compiler (see wam_aot.hpp.)
+//
+//    wam_aot -o <file.cpp> -u <unit> <file.pl>...
+//
+// Loads each Prolog file into an interpreter of its own and compiles
+// its predicates to WAM code as the test driver does: the predicates
+// defined since the previous query are compiled at every query (?-)
+// and whatever is left at the end of the file. Includes (:- [f]) are
+// followed. The native functions for all of them are written to one
+// C++ file with aot_register_<unit>().
+//
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include "../../common/term_parser.hpp"
+#include "../interpreter.hpp"
+#include "../wam_aot.hpp"
+
+using namespace prologcoin::common;
+using namespace prologcoin::interp;
+
+static void compile_recent(interpreter &interp, wam_aot &aot,
+			   std::vector<con_cell> &predicates)
+{
+    for (auto p : predicates) {
+	auto qn = qname(interp.empty_list_con(), p);
+	interp.compile(qn);
+	aot.add(interp, qn);
+	if (interp.is_tabled(qn)) {
+	    aot.add(interp, interp.tabled_companion(qn));
+	}
+    }
+    predicates.clear();
+}
+
+static void load_file(interpreter &interp, wam_aot &aot,
+		      const std::string &path,
+		      std::vector<con_cell> &predicates)
+{
+    std::ifstream infile(path);
+    if (!infile.good()) {
+	throw std::runtime_error("Cannot open '" + path + "'");
+    }
+    term_tokenizer tokenizer(infile);
+    term_parser parser(tokenizer, interp.get_heap(), interp.get_ops());
+
+    con_cell query_op("?-", 1);
+    con_cell action_op(":-", 1);
+
+    while (!infile.eof()) {
+	term t = parser.parse();
+	parser.clear_var_names();
+
+	if (interp.is_functor(t, query_op)) {
+	    compile_recent(interp, aot, predicates);
+	} else if (interp.is_functor(t, action_op)) {
+	    term a = interp.arg(t, 0);
+	    if (!interp.is_list(a)) {
+		// A directive, e.g. :- table p/2.
+		interp.execute(a);
+		continue;
+	    }
+	    for (auto fileatom : interp.iterate_over(a)) {
+		if (interp.is_list(fileatom)) {
+		    continue;
+		}
+		con_cell f = interp.functor(fileatom);
+		if (f.arity() == 0) {
+		    load_file(interp, aot,
+			      interp.get_full_path(interp.atom_name(f) + ".pl"),
+			      predicates);
+		}
+	    }
+	} else {
+	    auto p = interp.clause_predicate(t);
+	    if (std::find(predicates.begin(), predicates.end(), p)
+		== predicates.end()) {
+		predicates.push_back(p);
+	    }
+	    interp.load_clause(t);
+	}
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string out_path, unit;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; i++) {
+	std::string arg = argv[i];
+	if (arg == "-o" && i + 1 < argc) {
+	    out_path = argv[++i];
+	} else if (arg == "-u" && i + 1 < argc) {
+	    unit = argv[++i];
+	} else {
+	    files.push_back(arg);
+	}
+    }
+
+    if (out_path.empty() || unit.empty()) {
+	std::cerr << "Usage: wam_aot -o <file.cpp> -u <unit> <file.pl>...\n";
+	return 1;
+    }
+
+    wam_aot aot;
+
+    for (auto &file : files) {
+	try {
+	    interpreter interp;
+	    interp.set_current_directory(
+		  boost::filesystem::path(file).parent_path().string());
+	    interp.set_native_enabled(true);
+
+	    std::vector<con_cell> predicates;
+	    load_file(interp, aot, file, predicates);
+	    compile_recent(interp, aot, predicates);
+	} catch (token_exception &ex) {
+	    std::cerr << file << ":" << ex.pos().line() << ": " << ex.what() << "\n";
+	    return 1;
+	} catch (term_parse_exception &ex) {
+	    std::cerr << file << ":" << ex.token().pos().line() << ": " << ex.what() << "\n";
+	    return 1;
+	} catch (std::exception &ex) {
+	    std::cerr << file << ": " << ex.what() << "\n";
+	    return 1;
+	}
+    }
+
+    std::ofstream out(out_path);
+    aot.emit_unit(out, unit);
+    out.close();
+
+    if (!out.good()) {
+	std::cerr << "Failed to write '" << out_path << "'\n";
+	return 1;
+    }
+
+    return 0;
+}
@@ -15,17 +15,25 @@ namespace prologcoin { namespace interp {
 
     term arithmetics_fn::plus_2(interpreter_base &interp, term *args)
     {
-	return get_int(args[0]) + get_int(args[1]);
+	int64_t r = get_int(args[0]).value() + get_int(args[1]).value();
+	return int_cell::fits(r) ? term(int_cell(r)) : interp.arith().overflow();
     }
 
     term arithmetics_fn::minus_2(interpreter_base &interp, term *args)
     {
-	return get_int(args[0]) - get_int(args[1]);
+	int64_t r = get_int(args[0]).value() - get_int(args[1]).value();
+	return int_cell::fits(r) ? term(int_cell(r)) : interp.arith().overflow();
     }
 
     term arithmetics_fn::times_2(interpreter_base &interp, term *args)
     {
-	return get_int(args[0]) * get_int(args[1]);
+	int64_t r;
+	if (__builtin_mul_overflow(get_int(args[0]).value(),
+				   get_int(args[1]).value(), &r) ||
+	    !int_cell::fits(r)) {
+	    return interp.arith().overflow();
+	}
+	return int_cell(r);
     }
 
     void arithmetics::load_fn(const std::string &name, size_t arity, arithmetics::fn fn)
@@ -73,7 +81,7 @@ namespace prologcoin { namespace interp {
 		size_t arity = f.arity();
 		auto fn_call = lookup(f);
 		if (fn_call == nullptr) {
-		    interp_.abort(interpreter_exception_undefined_function(
+		    return error(stack_start, interpreter_exception_undefined_function(
 			   context + ": Undefined function: " +
 			   interp_.atom_name(f) + "/" +
 			   boost::lexical_cast<std::string>(arity) +
@@ -94,6 +102,12 @@ namespace prologcoin { namespace interp {
 		    std::cout << ")\n";
 		}
 		result = fn_call(interp_, &args_[off]);
+		if (overflow_) {
+		    overflow_ = false;
+		    return error(stack_start, interpreter_exception_evaluation_error(
+			   context + ": Integer overflow in " +
+			   interp_.safe_to_string(expr)));
+		}
 		args_.resize(off);
 		interp_.push(result);
 		interp_.push(int_cell(1));
@@ -114,12 +128,10 @@ namespace prologcoin { namespace interp {
 		break;
 	    }
 	    case tag_t::REF: {
-		interp_.abort(interpreter_exception_not_sufficiently_instantiated(context + ": Arguments are not sufficiently instantiated"));
-		break;
+		return error(stack_start, interpreter_exception_not_sufficiently_instantiated(context + ": Arguments are not sufficiently instantiated"));
 	    }
 	    case tag_t::BIG: {
-		interp_.abort(interpreter_exception_unsupported(context + ": Big integers are unsupported."));
-		break;
+		return error(stack_start, interpreter_exception_unsupported(context + ": Big integers are unsupported."));
 	    }
 	    case tag_t::INT: {
 		assert(false); // Should not occur
@@ -127,10 +139,45 @@ namespace prologcoin { namespace interp {
 	    }
 	    }
 	}
+	// The value of the expression (also if it is just a number)
+	result = args_.back();
 	args_.clear();
 	return result;
     }
 
+    int arithmetics::compare(term &lhs, term &rhs,
+			     const std::string &context)
+    {
+	term a = eval(lhs, context);
+	if (interp_.has_pending_exception()) {
+	    return 0;
+	}
+	term b = eval(rhs, context);
+	if (interp_.has_pending_exception()) {
+	    return 0;
+	}
+	int64_t x = static_cast<int_cell &>(a).value();
+	int64_t y = static_cast<int_cell &>(b).value();
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+    }
+
+    term arithmetics::overflow()
+    {
+	overflow_ = true;
+	return int_cell(0);
+    }
+
+    // Raise the error and leave eval (the caller checks for a pending
+    // exception.)
+    term arithmetics::error(size_t stack_start,
+			    const interpreter_exception &ex)
+    {
+	interp_.trim_stack(stack_start);
+	args_.clear();
+	interp_.abort(ex);
+	return int_cell(0);
+    }
+
     //
     // Simple
     //
@@ -142,6 +189,7 @@ namespace prologcoin { namespace interp {
 	    interp_.abort(interpreter_exception_argument_not_number(
 			      context + ": argument is not a number: " +
 			      interp_.safe_to_string(arg)));
+	    return int_cell(0);
 	}
 	cell c = arg;
 	int_cell &r = static_cast<int_cell &>(c);
@@ -7,6 +7,7 @@
 
 namespace prologcoin { namespace interp {
     class interpreter_base;
+    class interpreter_exception;
 
     class arithmetics_fn {
     public:
@@ -23,7 +24,8 @@ namespace prologcoin { namespace interp {
 				            common::term *args)> fn;
 
     public:
-        arithmetics(interpreter_base &interp) : interp_(interp), debug_(false)
+        arithmetics(interpreter_base &interp)
+	    : interp_(interp), debug_(false), overflow_(false)
  	   { }
 
 	inline void set_debug(bool dbg) { debug_ = dbg; }
@@ -32,6 +34,14 @@ namespace prologcoin { namespace interp {
 
 	common::term eval(common::term &expr, const std::string &context);
 
+	// Evaluates both sides of a comparison; -1, 0 or 1 (0 with an
+	// exception pending if either side raised an error.)
+	int compare(common::term &lhs, common::term &rhs,
+		    const std::string &context);
+
+	// For the functions: the result didn't fit in an integer.
+	common::term overflow();
+
     private:
 	void load_fn(const std::string &name, size_t arity, fn f);
 	void load_fns();
@@ -43,6 +53,9 @@ namespace prologcoin { namespace interp {
 	common::int_cell get_int_arg_type(common::term &arg,
 					  const std::string &context);
 
+	common::term error(size_t stack_start,
+			   const interpreter_exception &ex);
+
 	interpreter_base &interp_;
 	std::vector<common::term> args_;
 
@@ -51,7 +64,7 @@ namespace prologcoin { namespace interp {
 	inline bool is_debug() const { return debug_; }
 
 	bool debug_;
-
+	bool overflow_;
     };
 
 
@@ -295,8 +295,7 @@ namespace prologcoin { namespace interp {
        std::string s;
        switch (from.tag()) {
          case tag_t::REF:
-	     interp.abort(interpreter_exception_not_sufficiently_instantiated("upcase_atom/2: Arguments are not sufficiently instantiated"));
-	     return false;
+	     return interp.abort(interpreter_exception_not_sufficiently_instantiated("upcase_atom/2: Arguments are not sufficiently instantiated"));
          case tag_t::INT: {
 	     int_cell &ic = static_cast<int_cell &>(from);
 	     s = boost::lexical_cast<std::string>(ic.value());
@@ -309,7 +308,7 @@ namespace prologcoin { namespace interp {
 		 std::string msg = "upcase_atom/2: "
 		     "First argument was not 'atomic', found '"
 		     + interp.to_string(from) + "'";
-		 interp.abort(interpreter_exception_wrong_arg_type(msg));
+		 return interp.abort(interpreter_exception_wrong_arg_type(msg));
 	     }
 	     s = interp.atom_name(f);
 	     break;
@@ -318,7 +317,7 @@ namespace prologcoin { namespace interp {
 	     std::string msg = "upcase_atom/2: "
 		 "Unexpected first argument, found '"
 		 + interp.to_string(from) + "'";
-	     interp.abort(interpreter_exception_wrong_arg_type(msg));
+	     return interp.abort(interpreter_exception_wrong_arg_type(msg));
 	 }
        }
        boost::to_upper(s);
@@ -347,10 +346,49 @@ namespace prologcoin { namespace interp {
 	term lhs = args[0];
 	term rhs = args[1];
 	term result = interp.arith().eval(rhs, "is/2");
+	if (interp.has_pending_exception()) {
+	    return false;
+	}
 	bool ok = interp.unify(lhs, result);
 	return ok;
     }	
 
+    bool builtins::operator_less_than(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	int c = interp.arith().compare(args[0], args[1], "</2");
+	return !interp.has_pending_exception() && c < 0;
+    }
+
+    bool builtins::operator_equals_less_than(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	int c = interp.arith().compare(args[0], args[1], "=</2");
+	return !interp.has_pending_exception() && c <= 0;
+    }
+
+    bool builtins::operator_greater_than(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	int c = interp.arith().compare(args[0], args[1], ">/2");
+	return !interp.has_pending_exception() && c > 0;
+    }
+
+    bool builtins::operator_greater_than_equals(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	int c = interp.arith().compare(args[0], args[1], ">=/2");
+	return !interp.has_pending_exception() && c >= 0;
+    }
+
+    bool builtins::operator_arith_equals(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	int c = interp.arith().compare(args[0], args[1], "=:=/2");
+	return !interp.has_pending_exception() && c == 0;
+    }
+
+    bool builtins::operator_arith_not_equals(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	int c = interp.arith().compare(args[0], args[1], "=\\=/2");
+	return !interp.has_pending_exception() && c != 0;
+    }
+
     //
     // Analyzing & constructing terms
     //
@@ -372,8 +410,7 @@ namespace prologcoin { namespace interp {
 
 	switch (t.tag()) {
   	  case tag_t::REF:
-            interp.abort(interpreter_exception_not_sufficiently_instantiated("functor/3: Arguments are not sufficiently instantiated"));
-	    return false;
+            return interp.abort(interpreter_exception_not_sufficiently_instantiated("functor/3: Arguments are not sufficiently instantiated"));
 	  case tag_t::INT:
  	  case tag_t::BIG: {
 	    term zero = int_cell(0);
@@ -448,20 +485,20 @@ namespace prologcoin { namespace interp {
 	// common scenarios first.
 
 	if (lhs.tag() == tag_t::REF && rhs.tag() == tag_t::REF) {
-		interp.abort(interpreter_exception_not_sufficiently_instantiated("=../2: Arguments are not sufficiently instantiated"));
+		return interp.abort(interpreter_exception_not_sufficiently_instantiated("=../2: Arguments are not sufficiently instantiated"));
 	}
 
 	if (lhs.tag() == tag_t::REF) {
 	    if (!interp.is_list(rhs)) {
-		interp.abort(interpreter_exception_not_list("=../2: Second argument is not a list; found " + interp.to_string(rhs)));
+		return interp.abort(interpreter_exception_not_list("=../2: Second argument is not a list; found " + interp.to_string(rhs)));
 	    }
 	    size_t lst_len = interp.list_length(rhs);
 	    if (lst_len == 0) {
-		interp.abort(interpreter_exception_not_list("=../2: Second argument must be non-empty; found " + interp.to_string(rhs)));
+		return interp.abort(interpreter_exception_not_list("=../2: Second argument must be non-empty; found " + interp.to_string(rhs)));
 	    }
 	    term first_elem = interp.arg(rhs,0);
 	    if (first_elem.tag() == tag_t::REF) {
-		interp.abort(interpreter_exception_not_sufficiently_instantiated("=../2: Arguments are not sufficiently instantiated"));
+		return interp.abort(interpreter_exception_not_sufficiently_instantiated("=../2: Arguments are not sufficiently instantiated"));
 	    }
 	    if (first_elem.tag() == tag_t::INT && lst_len == 1) {
 		return interp.unify(lhs, first_elem);
@@ -546,8 +583,31 @@ namespace prologcoin { namespace interp {
 	term result_;
 	term interim_;
 	term tail_;
+	bool set_;
     };
 
+    term builtins::sort_unique(interpreter_base &interp, term lst)
+    {
+	std::vector<term> vec;
+	while (interp.is_dotted_pair(lst)) {
+	    vec.push_back(interp.arg(lst, 0));
+	    lst = interp.arg(lst, 1);
+	}
+
+	std::stable_sort(vec.begin(), vec.end(),
+			 [&](const term &t1, const term &t2)
+			 { return interp.standard_order(t1,t2) < 0; } );
+	vec.erase( std::unique(vec.begin(), vec.end(),
+			       [&](const term &t1, const term &t2)
+			       { return interp.standard_order(t1,t2) == 0; }),
+		   vec.end());
+
+	term r = interp.empty_list();
+	for (auto it = vec.rbegin(); it != vec.rend(); ++it) {
+	    r = interp.new_dotted_pair(*it, r);
+	}
+	return r;
+    }
 
     bool builtins::findall_3(interpreter_base &interp, size_t arity, common::term args[])
     {
@@ -555,6 +615,7 @@ namespace prologcoin { namespace interp {
 	auto *mc = interp.new_meta_context<meta_context_findall>(&findall_3_post);
 	mc->template_ = args[0];
 	mc->result_ = args[2];
+	mc->set_ = false;
 	mc->interim_ = interp.secondary_env().empty_list();
 	mc->tail_ = interp.secondary_env().empty_list();
 	mc->secondary_hb_ = interp.secondary_env().get_register_hb();
@@ -578,7 +639,11 @@ namespace prologcoin { namespace interp {
 
 	if (failed) {
 	    interp.unwind_to_top_choice_point();
-	    term result = interp.copy(mc->interim_, interp.secondary_env());
+	    // The solutions are the only terms on the secondary heap
+	    // above its hb, so they are moved in one pass.
+	    term result = interp.copy_segment(mc->interim_,
+				interp.secondary_env(),
+				interp.secondary_env().get_register_hb());
 	    term output = mc->result_;
 	    interp.secondary_env().trim_heap(interp.secondary_env().get_register_hb());
 	    interp.secondary_env().set_register_hb(mc->secondary_hb_);
@@ -592,6 +657,10 @@ namespace prologcoin { namespace interp {
 	    interp.set_top_fail(false);
 	    interp.set_complete(false);
 
+	    if (mc->set_) {
+		result = sort_unique(interp, result);
+	    }
+
 	    return interp.unify(result, output);
 	}
 
@@ -614,4 +683,321 @@ namespace prologcoin { namespace interp {
 	return true;
     }
 
+    //
+    // aggregate_all(count, Goal, Count)
+    // aggregate_all(sum(Expr), Goal, Sum)
+    // aggregate_all(max(Expr), Goal, Max)
+    // aggregate_all(min(Expr), Goal, Min)
+    // aggregate_all(bag(Template), Goal, List)
+    // aggregate_all(set(Template), Goal, List)
+    //
+    // count, sum, max and min are folded into the meta context as the
+    // solutions come, so nothing is copied. bag and set are findall/3
+    // (set sorts the result and removes duplicates.)
+    //
+
+    struct meta_context_aggregate : public meta_context {
+	con_cell kind_;
+	term expr_;
+	term result_;
+	int64_t acc_;
+	bool any_;
+    };
+
+    bool builtins::aggregate_all_3(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	static const con_cell count("count", 0);
+	static const con_cell sum("sum", 1);
+	static const con_cell max("max", 1);
+	static const con_cell min("min", 1);
+	static const con_cell bag("bag", 1);
+	static const con_cell set("set", 1);
+
+	term spec = args[0];
+	if (spec.tag() == tag_t::REF) {
+	    return interp.abort(interpreter_exception_not_sufficiently_instantiated("aggregate_all/3: Arguments are not sufficiently instantiated"));
+	}
+
+	con_cell f = interp.functor(spec);
+	if (f == bag || f == set) {
+	    term findall_args[3] = { interp.arg(spec, 0), args[1], args[2] };
+	    findall_3(interp, 3, findall_args);
+	    interp.get_last_meta_context<meta_context_findall>()->set_ = (f == set);
+	    return true;
+	}
+
+	if (f != count && f != sum && f != max && f != min) {
+	    return interp.abort(interpreter_exception_wrong_arg_type("aggregate_all/3: Unknown aggregate " + interp.to_string(spec)));
+	}
+
+	term qr = args[1];
+	auto *mc = interp.new_meta_context<meta_context_aggregate>(&aggregate_all_3_post);
+	mc->kind_ = f;
+	mc->expr_ = (f == count) ? term(f) : interp.arg(spec, 0);
+	mc->result_ = args[2];
+	mc->acc_ = 0;
+	mc->any_ = false;
+	interp.set_top_e();
+	interp.allocate_choice_point(code_point::fail());
+	interp.set_top_b(interp.b());
+	interp.set_p(code_point(qr));
+	interp.set_cp(interp.empty_list());
+
+	return true;
+    }
+
+    bool builtins::aggregate_all_3_post(interpreter_base &interp, meta_context *context)
+    {
+	static const con_cell count("count", 0);
+	static const con_cell sum("sum", 1);
+	static const con_cell max("max", 1);
+
+	bool failed = interp.is_top_fail();
+
+	auto *mc = interp.get_last_meta_context<meta_context_aggregate>();
+
+	interp.set_complete(false);
+
+	if (failed) {
+	    interp.unwind_to_top_choice_point();
+	    bool any = mc->any_ || mc->kind_ == count || mc->kind_ == sum;
+	    term result = int_cell(mc->acc_);
+	    term output = mc->result_;
+	    interp.release_last_meta_context();
+	    if (interp.e0() != interp.top_e()) {
+		interp.deallocate_environment();
+	    }
+	    interp.set_p(interp.cp());
+	    interp.set_cp(interp.empty_list());
+
+	    interp.set_top_fail(false);
+	    interp.set_complete(false);
+
+	    // max and min fail without solutions
+	    return any && interp.unify(result, output);
+	}
+
+	if (mc->kind_ == count) {
+	    mc->acc_++;
+	} else {
+	    term expr = interp.deref(mc->expr_);
+	    term val = interp.arith().eval(expr, "aggregate_all/3");
+	    if (interp.has_pending_exception()) {
+		return false;
+	    }
+	    int64_t v = static_cast<const int_cell &>(val).value();
+	    if (mc->kind_ == sum) {
+		mc->acc_ += v;
+	    } else if (!mc->any_ || (mc->kind_ == max ? v > mc->acc_ : v < mc->acc_)) {
+		mc->acc_ = v;
+	    }
+	    mc->any_ = true;
+	}
+
+	interp.set_p(common::con_cell("fail",0));
+	interp.set_cp(interp.empty_list());
+
+	return true;
+    }
+
+    //
+    // Tabling (see tabling.hpp)
+    //
+
+    // table(p/N), table((p/N, q/M)) or table([p/N, q/M])
+    bool builtins::table_1(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	static const con_cell slash("/", 2);
+	static const con_cell comma(",", 2);
+
+	term spec = args[0];
+	while (spec.tag() == tag_t::STR) {
+	    con_cell f = interp.functor(spec);
+	    if (f == comma || interp.is_dotted_pair(spec)) {
+		term a0 = interp.arg(spec, 0);
+		if (!table_1(interp, 1, &a0)) {
+		    return false;
+		}
+		spec = interp.arg(spec, 1);
+		continue;
+	    }
+	    if (f != slash) {
+		break;
+	    }
+	    term name = interp.arg(spec, 0);
+	    term n = interp.arg(spec, 1);
+	    if (name.tag() == tag_t::REF || n.tag() == tag_t::REF) {
+		return interp.abort(interpreter_exception_not_sufficiently_instantiated("table/1: Arguments are not sufficiently instantiated"));
+	    }
+	    if (name.tag() != tag_t::CON || n.tag() != tag_t::INT) {
+		break;
+	    }
+	    con_cell pred = interp.to_functor(static_cast<const con_cell &>(name),
+			       static_cast<const int_cell &>(n).value());
+	    interp.set_tabled(qname(interp.empty_list(), pred));
+	    return true;
+	}
+	if (interp.is_empty_list(spec)) {
+	    return true;
+	}
+	return interp.abort(interpreter_exception_wrong_arg_type("table/1: Expected Name/Arity; found " + interp.to_string(spec)));
+    }
+
+    struct meta_context_table : public meta_context {
+	tabling::subgoal *subgoal_;
+	term goal_;
+	term call_;
+    };
+
+    // Iterate the answers of a subgoal, continuing where the tabled
+    // call would have.
+    bool builtins::table_answers(interpreter_base &interp, tabling::subgoal *sg, term goal)
+    {
+	term lst = interp.tables().answers(sg);
+	term iter = interp.new_term(interp.functor("$tbl_answer",2), {lst, goal});
+	interp.allocate_environment(false);
+	interp.set_p(code_point(iter));
+	interp.set_cp(interp.empty_list());
+	return true;
+    }
+
+    // '$tbl_call'(Goal) where Goal is a call of a tabled predicate.
+    // Complete subgoals and subgoals being evaluated return their
+    // answers; otherwise this call leads the evaluation: the clauses
+    // of the companion predicate run within a meta context, once
+    // per iteration.
+    bool builtins::table_call_1(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	term goal = args[0];
+	auto &tables = interp.tables();
+	auto *sg = tables.lookup(goal);
+
+	if (sg->state == tabling::EVALUATING) {
+	    tables.consume(sg);
+	}
+	if (sg->state != tabling::INCOMPLETE) {
+	    return table_answers(interp, sg, goal);
+	}
+
+	con_cell f = interp.functor(goal);
+	con_cell cf = interp.tabled_companion(qname(interp.empty_list(), f)).second;
+	term call = cf;
+	if (f.arity() > 0) {
+	    call = interp.new_term(cf);
+	    for (size_t i = 0; i < f.arity(); i++) {
+		interp.set_arg(call, i, interp.arg(goal, i));
+	    }
+	}
+
+	auto *mc = interp.new_meta_context<meta_context_table>(&table_call_1_post);
+	mc->subgoal_ = sg;
+	mc->goal_ = goal;
+	mc->call_ = call;
+	tables.push_leader(sg, interp.num_of_meta_contexts());
+	interp.set_top_e();
+	interp.allocate_choice_point(code_point::fail());
+	interp.set_top_b(interp.b());
+	interp.set_p(code_point(call));
+	interp.set_cp(interp.empty_list());
+
+	return true;
+    }
+
+    bool builtins::table_call_1_post(interpreter_base &interp, meta_context *context)
+    {
+	bool failed = interp.is_top_fail();
+
+	auto *mc = interp.get_last_meta_context<meta_context_table>();
+	auto *sg = mc->subgoal_;
+
+	interp.set_complete(false);
+
+	if (!failed) {
+	    if (interp.tables().add_answer(sg, mc->goal_)) {
+		sg->changed = true;
+	    }
+	    interp.set_p(common::con_cell("fail",0));
+	    interp.set_cp(interp.empty_list());
+	    return true;
+	}
+
+	interp.unwind_to_top_choice_point();
+	interp.set_top_fail(false);
+	interp.set_complete(false);
+
+	// Another iteration if this one found new answers
+	if (sg->changed) {
+	    sg->changed = false;
+	    interp.set_p(code_point(mc->call_));
+	    interp.set_cp(interp.empty_list());
+	    return true;
+	}
+
+	interp.tables().pop_leader(sg);
+	term goal = mc->goal_;
+	interp.release_last_meta_context();
+	interp.set_complete(false);
+
+	return table_answers(interp, sg, goal);
+    }
+
+    bool builtins::abolish_all_tables_0(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	if (!interp.tables().is_leader_stack_empty()) {
+	    return interp.abort(interpreter_exception("abolish_all_tables/0: Tables are being evaluated", "permission_error"));
+	}
+	interp.tables().clear();
+	return true;
+    }
+
+    //
+    // Exceptions
+    //
+
+    // Push a catch frame (see interpreter_base) and run
+    //    Goal, '$catch_exit'(Flag)
+    bool builtins::catch_3(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	term flag = interp.new_ref();
+	for (size_t i = 0; i < 3; i++) {
+	    interp.a(i) = args[i];
+	}
+	interp.a(3) = flag;
+	interp.a(4) = int_cell(interp.secondary_env().heap_size());
+	interp.set_num_of_args(5);
+	interp.allocate_choice_point(interpreter_base::catch_frame());
+
+	term exit = interp.new_term(interp.functor("$catch_exit", 1), {flag});
+	interp.allocate_environment(false);
+	interp.set_cp(code_point(exit));
+	interp.allocate_environment(false);
+	interp.set_p(code_point(args[0]));
+	interp.set_cp(interp.empty_list());
+
+	return true;
+    }
+
+    // Goal exited. Without choice points left in Goal the frame is
+    // dropped, otherwise it is deactivated until Goal is backtracked
+    // into.
+    bool builtins::catch_exit_1(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	auto *ch = interp.b();
+	if (ch != nullptr && interp.is_catch_frame(ch) && ch->ai[3] == args[0]) {
+	    interp.set_b(ch->b);
+	    interp.reset_register_hb();
+	    return true;
+	}
+	return interp.unify(args[0], con_cell("exit", 0));
+    }
+
+    bool builtins::throw_1(interpreter_base &interp, size_t arity, common::term args[])
+    {
+	term ball = args[0];
+	if (ball.tag() == tag_t::REF) {
+	    return interp.abort(interpreter_exception_not_sufficiently_instantiated("throw/1: Arguments are not sufficiently instantiated"));
+	}
+	return interp.raise_exception(ball);
+    }
+
 }}
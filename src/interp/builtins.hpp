@@ -4,6 +4,7 @@
 #define _interp_builtins_hpp
 
 #include "../common/term.hpp"
+#include "tabling.hpp"
 
 namespace prologcoin { namespace interp {
 
@@ -151,6 +152,12 @@ namespace prologcoin { namespace interp {
 	//
 
 	static bool is_2(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool operator_less_than(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool operator_equals_less_than(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool operator_greater_than(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool operator_greater_than_equals(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool operator_arith_equals(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool operator_arith_not_equals(interpreter_base &interp, size_t arity, common::term args[]);
 
 	//
 	// Analyzing & constructing terms
@@ -166,6 +173,10 @@ namespace prologcoin { namespace interp {
         static bool deconstruct_read_list(interpreter_base &interp,
 					  common::term lst,
 					  common::term &t, size_t index);
+        static common::term sort_unique(interpreter_base &interp,
+				        common::term lst);
+        static bool table_answers(interpreter_base &interp,
+				  tabling::subgoal *sg, common::term goal);
 
     public:
 
@@ -177,6 +188,25 @@ namespace prologcoin { namespace interp {
 	static bool operator_disprove_post(interpreter_base &interp, meta_context *context);
 	static bool findall_3(interpreter_base &interp, size_t arity, common::term args[]);
 	static bool findall_3_post(interpreter_base &interp, meta_context *context);
+	static bool aggregate_all_3(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool aggregate_all_3_post(interpreter_base &interp, meta_context *context);
+
+	//
+	// Tabling
+	//
+
+	static bool table_1(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool table_call_1(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool table_call_1_post(interpreter_base &interp, meta_context *context);
+	static bool abolish_all_tables_0(interpreter_base &interp, size_t arity, common::term args[]);
+
+	//
+	// Exceptions
+	//
+
+	static bool catch_3(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool catch_exit_1(interpreter_base &interp, size_t arity, common::term args[]);
+	static bool throw_1(interpreter_base &interp, size_t arity, common::term args[]);
     };
 
 }}
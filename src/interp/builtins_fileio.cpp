@@ -16,13 +16,13 @@ namespace prologcoin { namespace interp {
 	term stream = args[2];
 
 	if (!interp.is_atom(filename0)) {
-	    interp.abort(interpreter_exception_wrong_arg_type(
+	    return interp.abort(interpreter_exception_wrong_arg_type(
 		      "open/3: Filename must be an atom; was: "
 		      + interp.to_string(filename0)));
 	}
 
 	if (!interp.is_atom(mode0)) {
-	    interp.abort(interpreter_exception_wrong_arg_type(
+	    return interp.abort(interpreter_exception_wrong_arg_type(
 		      "open/3: Mode must be an atom; was: "
 		      + interp.to_string(mode0)));
 	}
@@ -31,12 +31,12 @@ namespace prologcoin { namespace interp {
 	std::string mode = interp.atom_name(mode0);
 
 	if (!boost::filesystem::exists(full_path)) {
-	    interp.abort(interpreter_exception_file_not_found(
+	    return interp.abort(interpreter_exception_file_not_found(
 		    "open/3: File '" + full_path + "' not found"));
 	}
 
 	if (mode != "read" && mode != "write") {
-	    interp.abort(interpreter_exception_wrong_arg_type(
+	    return interp.abort(interpreter_exception_wrong_arg_type(
 		    "open/3: Mode must be 'read' or 'write'; was: " + mode));
 	}
 
@@ -61,12 +61,14 @@ namespace prologcoin { namespace interp {
 	    interp.abort(interpreter_exception_wrong_arg_type(
 		      from_fun + ": Expected stream argument; was: "
 		      + interp.to_string(stream)));
+	    return 0;
 	}
 	term stream_id = interp.arg(stream, 0);
 	if (stream_id.tag() != tag_t::INT) {
 	    interp.abort(interpreter_exception_wrong_arg_type(
 		      from_fun + ": Unrecognized stream identifier: "
 		      + interp.to_string(stream_id)));
+	    return 0;
 	}
 
 	cell sid = stream_id;
@@ -76,6 +78,7 @@ namespace prologcoin { namespace interp {
 	    interp.abort(interpreter_exception_file_not_found(
 		      from_fun + ": Identifier is not an open file: " +
 		      boost::lexical_cast<std::string>(id)));
+	    return 0;
 	}
 
 	return id;
@@ -85,6 +88,9 @@ namespace prologcoin { namespace interp {
     {
 	term stream = args[0];
 	size_t id = get_stream_id(interp, stream, "close/1");
+	if (interp.has_pending_exception()) {
+	    return false;
+	}
 	interp.close_file_stream(id);
 	return true;
     }
@@ -94,6 +100,9 @@ namespace prologcoin { namespace interp {
 	term stream = args[0];
 
 	size_t id = get_stream_id(interp, stream, "read/2");
+	if (interp.has_pending_exception()) {
+	    return false;
+	}
 	file_stream &fs = interp.get_file_stream(id);
 	term t;
 	if (fs.is_eof()) {
@@ -111,6 +120,9 @@ namespace prologcoin { namespace interp {
     {
 	term stream = args[0];
 	size_t id = get_stream_id(interp, stream, "at_end_of_stream/1");
+	if (interp.has_pending_exception()) {
+	    return false;
+	}
 	file_stream &fs = interp.get_file_stream(id);
 	return fs.is_eof();
     }
@@ -133,7 +145,7 @@ namespace prologcoin { namespace interp {
         term arg = args[0];
 
 	if (!interp.is_atom(arg)) {
-	    interp.abort(interpreter_exception_wrong_arg_type(
+	    return interp.abort(interpreter_exception_wrong_arg_type(
 		      "tell/1: Argument must be an atom; was: "
 		      + interp.to_string(arg)));
 	}
@@ -149,7 +161,7 @@ namespace prologcoin { namespace interp {
     bool builtins_fileio::told_0(interpreter_base &interp, size_t arity, term args[])
     {
 	if (!interp.has_told_standard_outputs()) {
-	    interp.abort(interpreter_exception_nothing_told(
+	    return interp.abort(interpreter_exception_nothing_told(
 	        "told/0: Missing 'tell' for this 'told' operation"));
 	}
 	int id = interp.standard_output().get_id();
@@ -12,11 +12,11 @@ namespace prologcoin { namespace interp {
 	term arg1 = args[1];
 
 	if (arg0.tag() == tag_t::REF) {
-            interp.abort(interpreter_exception_not_sufficiently_instantiated("sort/2: Arguments are not sufficiently instantiated"));
+            return interp.abort(interpreter_exception_not_sufficiently_instantiated("sort/2: Arguments are not sufficiently instantiated"));
 	}
 
 	if (!interp.is_list(arg0)) {
-            interp.abort(interpreter_exception_not_sufficiently_instantiated("sort/2: First argument is not a list; found " + interp.to_string(arg0)));
+            return interp.abort(interpreter_exception_not_sufficiently_instantiated("sort/2: First argument is not a list; found " + interp.to_string(arg0)));
 	}
 
 	interp.add_accumulated_cost(interp.cost(arg0));
@@ -1,13 +1,26 @@
 #include "interpreter.hpp"
 #include "wam_compiler.hpp"
+#include "wam_aot.hpp"
 
 namespace prologcoin { namespace interp {
 
+const size_t interpreter::MAX_INDEX_ARGS;
+const size_t interpreter::MAX_INDEXES_PER_PREDICATE;
+const size_t interpreter::MAX_INDEXES;
+const size_t interpreter::CLAUSE_INDEX_BITS;
+
 interpreter::interpreter() 
 {
     compiler_ = new wam_compiler(*this);
     id_to_predicate_.push_back(predicate()); // Reserve index 0
+    id_to_key_.push_back(jit_index_key());
     wam_enabled_ = true;
+    tier_threshold_ = 0;
+
+    set_clause_loaded_fn(
+       [&] (const qname &qn, const managed_clause &m_clause) {
+	   clause_loaded(qn, m_clause);
+       });
 
     set_debug_check_fn(
        [&] {
@@ -22,8 +35,11 @@ interpreter::~interpreter()
 {
     delete compiler_;
     query_vars_.clear();
+    jit_info_.clear();
     predicate_id_.clear();
     id_to_predicate_.clear();
+    id_to_key_.clear();
+    tier_stats_.clear();
 }
 
 void interpreter::setup_standard_lib()
@@ -79,6 +95,16 @@ bool interpreter::execute(const term query)
 
     prepare_execution();
 
+    // No choice point refers to the JIT indexes anymore, so this is
+    // a good point to bound their growth.
+    if (id_to_predicate_.size() > MAX_INDEXES) {
+	reset_jit_indexes();
+    }
+
+    // Nothing refers to WAM code at this point, so code of recompiled
+    // or unloaded predicates can be released.
+    free_retired_segments();
+
     query_vars_.clear();
 
     std::unordered_set<std::string> seen;
@@ -102,11 +128,9 @@ bool interpreter::execute(const term query)
 
     set_p(code_point(query));
 
-    bool b = cont();
-
-    set_qr(query);
+    top_qr_ = query;
 
-    return b;
+    return cont();
 }
 
 bool interpreter::cont()
@@ -121,6 +145,13 @@ bool interpreter::cont()
 		}
 	    } else {
 		dispatch();
+		if (!is_complete()) {
+		    tick();
+		}
+	    }
+	    if (is_yielded()) {
+		// The QR of the running clause is kept until we resume
+		return false;
 	    }
 	}
 
@@ -134,26 +165,42 @@ bool interpreter::cont()
         }
     }
 
+    set_qr(top_qr_);
+
     return !is_top_fail();
 }
 
 bool interpreter::next()
 {
-    term old_qr = qr();
+    top_qr_ = qr();
 
     reset_accumulated_cost();
+    start_time_slice();
 
     fail();
     if (!is_top_fail()) {
-	cont();
+	return cont();
     }
 
-    set_qr(old_qr);
-    return !is_top_fail();
+    set_qr(top_qr_);
+    return false;
+}
+
+bool interpreter::resume()
+{
+    assert(is_yielded());
+
+    resume_yielded();
+    return cont();
 }
 
 void interpreter::fail()
 {
+    if (has_pending_exception()) {
+	handle_exception();
+	return;
+    }
+
     bool ok = false;
 
     while (!ok) {
@@ -170,7 +217,7 @@ void interpreter::fail()
 	    auto ch = reset_to_choice_point(b());
 	    auto bp = ch->bp;
 
-	    if (bp.is_fail()) {
+	    if (bp.is_fail() || is_catch_frame(ch)) {
 		// Do nothing
 	    } else if (bp.term_code().tag() != common::tag_t::INT) {
 		// Direct query
@@ -181,21 +228,24 @@ void interpreter::fail()
 		size_t bpval = static_cast<const int_cell &>(bpterm).value();
 		// Is there another clause to backtrack to?
 		if (bpval != 0) {
-		    size_t index_id = bpval >> 8;
+		    size_t index_id = bpval >> CLAUSE_INDEX_BITS;
 		    
 		    if (is_debug()) {
 			std::string redo_str = to_string(qr());
 			std::cout << "interpreter::fail(): redo " << redo_str << std::endl;
 		    }
+		    if (tier_threshold_ != 0 && is_wam_enabled()) {
+			tier_count(id_to_key_[index_id].qn, true);
+		    }
 		    auto &clauses = get_predicate_by_id(index_id);
-		    size_t from_clause = bpval & 0xff;
+		    size_t from_clause = bpval & ((static_cast<size_t>(1) << CLAUSE_INDEX_BITS) - 1);
 
 		    ok = select_clause(qr(), index_id, clauses, from_clause);
 		}
 	    }
 	    if (!ok) {
 		set_b(ch->b);
-		if (b() != nullptr) set_register_hb(b()->h);
+		reset_register_hb();
 	    }
 	}
     }
@@ -278,7 +328,7 @@ bool interpreter::select_clause(const code_point &instruction,
 		if (i == num_clauses - 1) {
 	  	    choice_point->bp = code_point::fail();
 		} else {
-		    choice_point->bp = code_point(int_cell((index_id << 8) + (i+1)));
+		    choice_point->bp = code_point(int_cell((index_id << CLAUSE_INDEX_BITS) + (i+1)));
 		}
 	    }
 
@@ -415,15 +465,16 @@ void interpreter::dispatch()
     }
 
     if (is_wam_enabled()) {
+	if (tier_threshold_ != 0 && !is_compiled(module, f)) {
+	    tier_count(qname(module, f), false);
+	}
 	if (auto instr = resolve_predicate(module, f)) {
 	    dispatch_wam(instr);
 	    return;
 	}
     }
 
-    auto first_arg = get_first_arg();
-
-    size_t predicate_id = matched_predicate_id(module, f, first_arg);
+    size_t predicate_id = matched_predicate_id(module, f);
     predicate  &pred = get_predicate_by_id(predicate_id);
 
     set_pr(f);
@@ -432,8 +483,7 @@ void interpreter::dispatch()
     auto &clauses = pred;
 
     if (clauses.empty()) {
-        clauses = get_predicate(module, f);
-	if (clauses.empty()) {
+	if (get_predicate(module, f).empty()) {
 	    std::stringstream msg;
 	    msg << "Undefined predicate ";
 	    if (!is_empty_list(module)) {
@@ -441,6 +491,7 @@ void interpreter::dispatch()
 	    }
 	    msg << atom_name(f) << "/" << f.arity();
 	    abort(interpreter_exception_undefined_predicate(msg.str()));
+	    fail();
 	    return;
 	}
 	set_p(empty_list());
@@ -456,7 +507,7 @@ void interpreter::dispatch()
 
     // More than one clause that matches? We need a choice point.
     if (has_choices) {
-	int_cell index_id_int(index_id << 8);
+	int_cell index_id_int(index_id << CLAUSE_INDEX_BITS);
 	code_point ch(index_id_int);
 	allocate_choice_point(ch);
     }
@@ -471,58 +522,190 @@ void interpreter::dispatch_wam(wam_instruction_base *instruction)
     set_p(instruction);
 }
 
-void interpreter::compute_matched_predicate(con_cell module,
-					    con_cell func,
-					    const term first_arg,
+interpreter::jit_predicate_info & interpreter::get_jit_info(const qname &qn)
+{
+    auto it = jit_info_.find(qn);
+    if (it != jit_info_.end()) {
+	return it->second;
+    }
+    auto &info = jit_info_[qn];
+    for (auto &m_clause : interpreter_base::get_predicate(qn)) {
+	update_jit_info(info, m_clause);
+    }
+    return info;
+}
+
+void interpreter::update_jit_info(jit_predicate_info &info,
+				  const managed_clause &m_clause)
+{
+    auto head = clause_head(m_clause.clause());
+    size_t n = std::min(functor(head).arity(), MAX_INDEX_ARGS);
+    for (size_t i = 0; i < n; i++) {
+	auto k = index_key(arg(head, i));
+	if (k.tag() == common::tag_t::REF) {
+	    info.var_heads[i]++;
+	} else {
+	    info.keys[i].insert(k);
+	}
+    }
+    info.num_clauses++;
+}
+
+void interpreter::clause_loaded(const qname &qn, const managed_clause &m_clause)
+{
+    auto it = jit_info_.find(qn);
+    if (it == jit_info_.end()) {
+	// Nothing has been indexed for this predicate yet.
+	return;
+    }
+    auto &info = it->second;
+    update_jit_info(info, m_clause);
+
+    // Incrementally extend the indexes that have already been built.
+    // Clauses are only appended, so clause positions recorded in live
+    // choice points remain valid.
+    auto head = clause_head(m_clause.clause());
+    for (auto id : info.ids) {
+	if (matches_index(id_to_key_[id], head)) {
+	    id_to_predicate_[id].push_back(m_clause);
+	}
+    }
+}
+
+common::cell interpreter::index_key(const term t0)
+{
+    using namespace prologcoin::common;
+
+    term t = interpreter_base::deref(t0);
+    switch (t.tag()) {
+    case tag_t::STR: return functor(t);
+    case tag_t::CON: return t;
+    case tag_t::INT: return t;
+    default: return ref_cell(0);
+    }
+}
+
+bool interpreter::matches_index(const jit_index_key &key, const term head)
+{
+    size_t n = std::min(functor(head).arity(), MAX_INDEX_ARGS);
+    const common::cell *k = &key.key0;
+    for (size_t i = 0; i < n; i++) {
+	if ((key.args & (1 << i)) == 0) {
+	    continue;
+	}
+	auto head_key = index_key(arg(head, i));
+	if (head_key.tag() != common::tag_t::REF && head_key != *k) {
+	    return false;
+	}
+	k = &key.key1;
+    }
+    return true;
+}
+
+void interpreter::compute_matched_predicate(const jit_index_key &key,
 					    predicate &matched)
 {
-    auto &m_clauses = get_predicate(module, func);
+    auto &m_clauses = interpreter_base::get_predicate(key.qn);
     for (auto &m_clause : m_clauses) {
-	// Extract head
-	auto head = clause_head(m_clause.clause());
-	auto head_functor = functor(head);
-	if (head_functor.arity() > 0) {
-	    auto head_first_arg = arg(head, 0);
-	    if (definitely_inequal(head_first_arg, first_arg)) {
-		continue;
-	    }
+	if (matches_index(key, clause_head(m_clause.clause()))) {
+	    matched.push_back(m_clause);
 	}
-	matched.push_back(m_clause);
     }
 }
 
-size_t interpreter::matched_predicate_id(con_cell module,
-					 con_cell func, const term first_arg)
+size_t interpreter::matched_predicate_id(con_cell module, con_cell func)
 {
     using namespace prologcoin::common;
 
-    term index_arg = first_arg;
-    switch (first_arg.tag()) {
-    case tag_t::STR:
-	index_arg = functor(first_arg); break;
-    case tag_t::CON:
-    case tag_t::INT:
-	break;
-    case tag_t::REF:
-	index_arg = term();
-	break;
+    auto qn = std::make_pair(module, func);
+    auto &info = get_jit_info(qn);
+
+    info.num_calls++;
+
+    // Record call pattern and find the most selective bound position.
+    // A position is considered more selective if clause heads have more
+    // distinct keys there (and fewer variables.)
+    size_t n = std::min(func.arity(), MAX_INDEX_ARGS);
+    cell keys[MAX_INDEX_ARGS];
+    size_t best = MAX_INDEX_ARGS, second = MAX_INDEX_ARGS;
+    auto better = [&](size_t i, size_t j) {
+	if (j == MAX_INDEX_ARGS) return true;
+	size_t di = info.keys[i].size(), dj = info.keys[j].size();
+	if (di != dj) return di > dj;
+	return info.var_heads[i] < info.var_heads[j];
+    };
+    for (size_t i = 0; i < n; i++) {
+	keys[i] = index_key(a(i));
+	if (keys[i].tag() == tag_t::REF) {
+	    continue;
+	}
+	info.bound[i]++;
+	if (info.keys[i].empty()) {
+	    // Only variables in heads at this position.
+	    continue;
+	}
+	if (better(i, best)) {
+	    second = best;
+	    best = i;
+	} else if (better(i, second)) {
+	    second = i;
+	}
     }
 
-    functor_index findex(std::make_pair(module,func), index_arg);
-    auto it = predicate_id_.find(findex);
-    size_t id;
-    if (it == predicate_id_.end()) {
-	id = id_to_predicate_.size();
-	id_to_predicate_.push_back( predicate() );
-	predicate_id_[findex] = id;
-	auto &pred = id_to_predicate_[id];
-	compute_matched_predicate(module, func, first_arg, pred);
-    } else {
-	id = it->second;
+    jit_index_key key(qn, 0, ref_cell(0), ref_cell(0));
+    if (best != MAX_INDEX_ARGS) {
+	// Use a combined index if callers typically bind both positions
+	// and the second one actually discriminates.
+	bool combined = second != MAX_INDEX_ARGS &&
+	    info.keys[second].size() > 1 &&
+	    2*info.bound[best] >= info.num_calls &&
+	    2*info.bound[second] >= info.num_calls;
+	if (combined) {
+	    size_t lo = std::min(best, second), hi = std::max(best, second);
+	    key.args = (1 << lo) | (1 << hi);
+	    key.key0 = keys[lo];
+	    key.key1 = keys[hi];
+	} else {
+	    key.args = 1 << best;
+	    key.key0 = keys[best];
+	}
+    }
+
+    auto it = predicate_id_.find(key);
+    if (it != predicate_id_.end()) {
+	return it->second;
     }
+
+    // Too many indexes for this predicate? Fall back on the
+    // unindexed clause vector.
+    if (key.args != 0 && info.ids.size() >= MAX_INDEXES_PER_PREDICATE) {
+	key = jit_index_key(qn, 0, ref_cell(0), ref_cell(0));
+	it = predicate_id_.find(key);
+	if (it != predicate_id_.end()) {
+	    return it->second;
+	}
+    }
+
+    size_t id = id_to_predicate_.size();
+    id_to_predicate_.push_back( predicate() );
+    id_to_key_.push_back(key);
+    predicate_id_[key] = id;
+    info.ids.push_back(id);
+    compute_matched_predicate(key, id_to_predicate_[id]);
     return id;
 }
 
+void interpreter::reset_jit_indexes()
+{
+    // Keep observed call patterns, but drop the clause vectors.
+    for (auto &info : jit_info_) {
+	info.second.ids.clear();
+    }
+    predicate_id_.clear();
+    id_to_predicate_.resize(1);
+    id_to_key_.resize(1);
+}
+
 std::string interpreter::get_result(bool newlines) const
 {
     using namespace prologcoin::common;
@@ -625,18 +808,124 @@ void interpreter::compile()
 
 void interpreter::compile(const qname &qn)
 {
+    // The clauses and the answer iteration that '$tbl_call' runs
+    // are compiled along with a tabled predicate.
+    if (is_tabled(qn)) {
+	compile(tabled_companion(qn));
+	qname answer(empty_list(), functor("$tbl_answer", 2));
+	if (!is_compiled(answer)) {
+	    compile(answer);
+	}
+    }
+
     wam_interim_code instrs(*this);
     compiler_->compile_predicate(qn, instrs);
+    load_predicate(qn, instrs);
+}
+
+void interpreter::compile(common::con_cell module, common::con_cell name)
+{
+    compile(std::make_pair(module, name));
+}
+
+void interpreter::uncompile(const qname &qn)
+{
+    unload_predicate(qn);
+    tier_stats_.erase(qn);
+}
+
+void interpreter::uncompile(common::con_cell module, common::con_cell name)
+{
+    uncompile(std::make_pair(module, name));
+}
+
+void interpreter::load_predicate(const qname &qn, wam_interim_code &instrs)
+{
     size_t yn_size = compiler_->get_environment_size_of(instrs);
     size_t first_offset = next_offset();
     load_code(instrs);
     auto *next_instr = to_code(first_offset);
     set_predicate(qn, next_instr, yn_size);
+    if (is_native_enabled() && num_natives() > 0) {
+	bind_native(qn);
+    }
 }
 
-void interpreter::compile(common::con_cell module, common::con_cell name)
+void interpreter::bind_native(const qname &qn)
 {
-    compile(std::make_pair(module, name));
+    auto fn = find_native(wam_aot::fingerprint(wam_aot::emit_body(*this, qn)));
+    if (fn == nullptr) {
+	return;
+    }
+    auto *code = reinterpret_cast<code_t *>(predicate_code(qn));
+    size_t size = predicate_code_size(qn);
+    for (size_t i = 0; i < size;) {
+	auto *instr = reinterpret_cast<wam_instruction_base *>(&code[i]);
+	if (instr->type() == NATIVE) {
+	    reinterpret_cast<wam_instruction<NATIVE> *>(instr)->set_native(fn);
+	}
+	i += instr->size();
+    }
+}
+
+bool interpreter::is_native(const qname &qn) const
+{
+    auto *instr = predicate_code(qn);
+    return instr != nullptr && instr->type() == NATIVE &&
+	reinterpret_cast<wam_instruction<NATIVE> *>(instr)->native() != nullptr;
+}
+
+void interpreter::tier_count(const qname &qn, bool backtrack)
+{
+    auto &stats = tier_stats_[qn];
+    if (backtrack) {
+	stats.backtracks++;
+    } else {
+	stats.calls++;
+    }
+    if (stats.done || stats.calls + stats.backtracks < tier_threshold_) {
+	return;
+    }
+    stats.done = true;
+    promote(qn);
+}
+
+void interpreter::promote(const qname &qn)
+{
+    if (is_compiled(qn) || interpreter_base::get_predicate(qn).empty()) {
+	// Already compiled or not a program predicate (undefined
+	// predicates are reported by the naive interpreter.)
+	return;
+    }
+
+    // The compiler copies the clauses onto the heap. The generated code
+    // only refers to constants, so we can discard the copies right away
+    // (otherwise they would linger on the heap for the rest of the query.)
+    size_t heap_mark = heap_size();
+    wam_interim_code instrs(*this);
+    try {
+	compiler_->compile_predicate(qn, instrs);
+    } catch (wam_exception &ex) {
+	// Too big for WAM code (see wam_compiler); it stays with the
+	// naive interpreter.
+	trim_heap(heap_mark);
+	if (is_debug()) {
+	    std::cout << "interpreter::promote(): " << to_string(qn.second)
+		      << " not promoted: " << ex.what() << "\n";
+	}
+	return;
+    }
+    trim_heap(heap_mark);
+
+    load_predicate(qn, instrs);
+
+    auto &stats = tier_stats_[qn];
+    record_promotion(qn, stats.calls, stats.backtracks);
+
+    if (is_debug()) {
+	std::cout << "interpreter::promote(): " << to_string(qn.second)
+		  << " promoted to WAM\n";
+    }
 }
 
 void interpreter::bind_code_point(std::unordered_map<size_t, size_t> &label_map, code_point &cp)
@@ -672,11 +961,48 @@ void interpreter::bind_code_point(std::unordered_map<size_t, size_t> &label_map,
 void interpreter::load_code(wam_interim_code &instrs)
 {
     std::unordered_map<size_t, size_t> label_map;
+
+    // With native code enabled, add the entries to ahead-of-time
+    // compiled code (nullptr below): at the start, after calls and at
+    // labels. Not after reset_level or builtin_r as the environment
+    // size is found just before the continuation.
+    std::vector<wam_instruction_base *> code;
+    bool native = is_native_enabled();
+    bool entry = native;
+    wam_instruction_type prev = LAST;
+    for (auto *instr : instrs) {
+	if (wam_compiler::is_label_instruction(instr)) {
+	    entry = entry || (native && prev != RESET_LEVEL && prev != BUILTIN_R);
+	} else {
+	    if (entry) {
+		code.push_back(nullptr);
+	    }
+	    prev = instr->type();
+	    entry = native && prev == CALL;
+	}
+	code.push_back(instr);
+    }
+
+    // Keep the code in a segment of its own
+    size_t sz = 0;
+    for (auto *instr : code) {
+	if (instr == nullptr) {
+	    sz += wam_instruction<NATIVE>(0).size();
+	} else if (!wam_compiler::is_label_instruction(instr)) {
+	    sz += instr->size();
+	}
+    }
+    new_segment(sz);
+
     size_t first_offset = next_offset();
     size_t offset = first_offset;
     // Collect labels
-    for (auto *instr : instrs) {
-	if (wam_compiler::is_label_instruction(instr)) {
+    for (auto *instr : code) {
+	if (instr == nullptr) {
+	    wam_instruction<NATIVE> native(offset - first_offset);
+	    add(native);
+	    offset += native.size();
+	} else if (wam_compiler::is_label_instruction(instr)) {
 	    auto *lbl_instr = static_cast<wam_interim_instruction<INTERIM_LABEL> *>(instr);
 	    size_t lbl = static_cast<size_t>(lbl_instr->label().value());
 	    label_map.insert(std::make_pair(lbl, offset));
@@ -698,6 +1024,7 @@ void interpreter::load_code(wam_interim_code &instrs)
 	case TRUST:
 	case CALL:
 	case EXECUTE:
+	case PUT_VALUE_X_EXECUTE:
 	case GOTO:
 	    {
 	    auto cp_instr = static_cast<wam_instruction_code_point *>(instr);
@@ -716,10 +1043,10 @@ void interpreter::load_code(wam_interim_code &instrs)
         case SWITCH_ON_CONSTANT:
         case SWITCH_ON_STRUCTURE:
 	    {
-	    auto cp_instr = static_cast<wam_instruction_hash_map *>(instr);
-	    for (auto &e : cp_instr->map()) {
-		bind_code_point(label_map, e.second);
-	    }
+	    auto table = static_cast<wam_instruction_switch_table *>(instr);
+	    table->for_each([&](term, code_point &cp) {
+		    bind_code_point(label_map, cp);
+		});
 	    }
 	    break;
 	default:
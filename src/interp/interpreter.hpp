@@ -10,6 +10,40 @@ namespace prologcoin { namespace interp {
 class wam_interim_code;
 class wam_compiler;
 
+// Key of a just-in-time clause index: the predicate, a bitmask of the
+// argument positions that are indexed (at most two) and the principal
+// functors of the arguments at those positions.
+struct jit_index_key {
+    jit_index_key() : qn(), args(0), key0(), key1() { }
+    jit_index_key(const qname &q, uint32_t a, common::cell k0, common::cell k1)
+        : qn(q), args(a), key0(k0), key1(k1) { }
+
+    inline bool operator == (const jit_index_key &other) const
+    { return qn == other.qn && args == other.args &&
+	     key0 == other.key0 && key1 == other.key1; }
+
+    qname qn;
+    uint32_t args;
+    common::cell key0;
+    common::cell key1;
+};
+
+}}
+
+namespace std {
+    template<> struct hash<prologcoin::interp::jit_index_key> {
+	size_t operator()(const prologcoin::interp::jit_index_key &k) const {
+	    return k.qn.first.raw_value() +
+		   17*k.qn.second.raw_value() +
+		   131*k.args +
+		   257*k.key0.raw_value() +
+		   65537*k.key1.raw_value();
+	}
+    };
+}
+
+namespace prologcoin { namespace interp {
+
 class interpreter : public wam_interpreter
 {
 public:
@@ -22,11 +56,24 @@ public:
     void compile(const qname &pred);
     void compile(common::con_cell module, common::con_cell name);
 
+    // Drop the WAM code of a predicate (it runs on the naive
+    // interpreter again.) The code is released before the next query.
+    void uncompile(const qname &pred);
+    void uncompile(common::con_cell module, common::con_cell name);
+
+    // True if the predicate runs ahead-of-time compiled code
+    bool is_native(const qname &pred) const;
+
     bool execute(const term query);
     bool next();
     bool cont();
     void fail();
 
+    // Continue a query that ran out of its time slice. Like execute()
+    // and next(), this returns false if the query yields again (check
+    // is_yielded().)
+    bool resume();
+
     inline bool has_more() const
     { return b() != top_b() || has_meta_contexts(); }
 
@@ -36,6 +83,14 @@ public:
     inline bool is_wam_enabled() const
     { return wam_enabled_; }
 
+    // Promote predicates to WAM code after this many calls and
+    // backtracks (0 = never.)
+    inline void set_tier_threshold(size_t n)
+    { tier_threshold_ = n; }
+
+    inline size_t tier_threshold() const
+    { return tier_threshold_; }
+
     std::string get_result(bool newlines = true) const;
     term get_result_term(const std::string &varname) const;
     term get_result_term() const;
@@ -48,6 +103,8 @@ public:
 
 private:
     void load_code(wam_interim_code &code);
+    void load_predicate(const qname &qn, wam_interim_code &code);
+    void bind_native(const qname &qn);
     void bind_code_point(std::unordered_map<size_t, size_t> &label_map,
 			 code_point &cp);
     void dispatch();
@@ -68,16 +125,67 @@ private:
 	return id_to_predicate_[id];
     }
 
-    void compute_matched_predicate(con_cell module, con_cell functor,
-				   const term first_arg,
-				   predicate &matched);
-    size_t matched_predicate_id(con_cell module,
-				con_cell functor, const term first_arg);
+    //
+    // Just-in-time clause indexing (naive interpreter.)
+    //
+    // For every predicate we record which argument positions callers
+    // actually bind. When a call comes in we pick the most selective
+    // bound position (or a pair of positions if callers habitually
+    // bind both) and build the filtered clause vector for that key on
+    // demand. The vectors are kept up to date as clauses are loaded.
+    //
+    static const size_t MAX_INDEX_ARGS = 8;
+    static const size_t MAX_INDEXES_PER_PREDICATE = 4096;
+    static const size_t MAX_INDEXES = 65536;
+    static const size_t CLAUSE_INDEX_BITS = 32;
+
+    struct jit_predicate_info {
+	jit_predicate_info() : num_calls(0), num_clauses(0), bound(), var_heads(), keys(MAX_INDEX_ARGS) { }
+
+	size_t num_calls;
+	size_t num_clauses;
+	size_t bound[MAX_INDEX_ARGS];     // #calls with position bound
+	size_t var_heads[MAX_INDEX_ARGS]; // #clauses with var at position
+	std::vector<std::unordered_set<common::cell> > keys; // Distinct keys
+	std::vector<size_t> ids;          // Indexes built for predicate
+    };
 
+    jit_predicate_info & get_jit_info(const qname &qn);
+    void update_jit_info(jit_predicate_info &info, const managed_clause &m_clause);
+    void clause_loaded(const qname &qn, const managed_clause &m_clause);
+    common::cell index_key(const term t);
+    bool matches_index(const jit_index_key &key, const term head);
+    void compute_matched_predicate(const jit_index_key &key,
+				   predicate &matched);
+    size_t matched_predicate_id(con_cell module, con_cell functor);
+    void reset_jit_indexes();
 
-    std::unordered_map<functor_index, size_t> predicate_id_;
+    std::unordered_map<qname, jit_predicate_info> jit_info_;
+    std::unordered_map<jit_index_key, size_t> predicate_id_;
     std::vector<predicate> id_to_predicate_;
+    std::vector<jit_index_key> id_to_key_;
+
+    //
+    // Tiered execution.
+    //
+    // Calls and backtracks into predicates that still run on the naive
+    // interpreter are counted, and once a predicate crosses the
+    // threshold it is compiled to WAM code. This may happen in the
+    // middle of a query as WAM code never moves once loaded.
+    //
+    struct tier_stats {
+	tier_stats() : calls(0), backtracks(0), done(false) { }
+
+	size_t calls;
+	size_t backtracks;
+	bool done;	// Promoted or not eligible
+    };
+
+    void tier_count(const qname &qn, bool backtrack);
+    void promote(const qname &qn);
 
+    size_t tier_threshold_;
+    std::unordered_map<qname, tier_stats> tier_stats_;
 
     class binding {
     public:
@@ -98,6 +206,7 @@ private:
 
     bool wam_enabled_;
     std::vector<binding> query_vars_;
+    term top_qr_; // QR to restore once the query stops (or yields)
     wam_compiler *compiler_;
 
     friend class test_wam_compiler;
@@ -3,6 +3,7 @@
 #include "builtins_fileio.hpp"
 #include "builtins_opt.hpp"
 #include "wam_interpreter.hpp"
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/timer/timer.hpp>
 #include <boost/range/adaptor/reversed.hpp>
@@ -15,7 +16,7 @@ using namespace prologcoin::common;
 
 const common::term code_point::fail_term_ = common::ref_cell(0);
 
-interpreter_base::interpreter_base() : register_pr_("", 0), comma_(",",2), empty_list_("[]", 0), implied_by_(":-", 2), arith_(*this)
+interpreter_base::interpreter_base() : register_pr_("", 0), comma_(",",2), empty_list_("[]", 0), implied_by_(":-", 2), arith_(*this), tables_(*this)
 {
     init();
 
@@ -23,15 +24,18 @@ interpreter_base::interpreter_base() : register_pr_("", 0), comma_(",",2), empty
     load_builtins_opt();
 
     tidy_size = 0;
+    memset(tidy_avg_, 0, sizeof(tidy_avg_));
+    tidy_idx_ = 0;
 }
 
 void interpreter_base::init()
 {
     debug_ = false;
     track_cost_ = false;
+    time_slice_ = 0;
     file_id_count_ = 3;
     num_of_args_= 0;
-    memset(register_ai_, 0, sizeof(register_ai_));
+    std::fill(std::begin(register_ai_), std::end(register_ai_), term());
     stack_ = reinterpret_cast<word_t *>(new char[MAX_STACK_SIZE]);
     num_y_fn_ = &num_y;
     standard_output_ = nullptr;
@@ -159,12 +163,86 @@ void interpreter_base::load_clause(const term t)
     
     auto qn = std::make_pair(module, predicate);
 
+    // Clauses of tabled predicates go to the companion
+    term clause = t;
+    if (is_tabled(qn)) {
+	qn = tabled_companion(qn);
+	size_t arity = predicate.arity();
+	term new_head = qn.second;
+	if (arity > 0) {
+	    new_head = new_term(qn.second);
+	    for (size_t i = 0; i < arity; i++) {
+		set_arg(new_head, i, arg(head, i));
+	    }
+	}
+	if (functor(clause) == implied_by_) {
+	    clause = new_term(implied_by_, {new_head, clause_body(clause)});
+	} else {
+	    clause = new_head;
+	}
+    }
+
     auto found = program_db_.find(qn);
     if (found == program_db_.end()) {
         program_db_[qn] = managed_clauses();
 	program_predicates_.push_back(qn);
     }
-    program_db_[qn].push_back(managed_clause(t, cost(t)));
+    auto &m_clauses = program_db_[qn];
+    m_clauses.push_back(managed_clause(clause, cost(clause)));
+
+    if (clause_loaded_fn_) {
+	clause_loaded_fn_(qn, m_clauses.back());
+    }
+}
+
+qname interpreter_base::tabled_companion(const qname &qn)
+{
+    return qname(qn.first, functor("$tbl_" + atom_name(qn.second),
+				   qn.second.arity()));
+}
+
+void interpreter_base::set_tabled(const qname &qn)
+{
+    if (is_tabled(qn)) {
+	return;
+    }
+
+    if (tabled_.empty()) {
+	load_program(R"PROG(
+'$tbl_answer'([A|_], A).
+'$tbl_answer'([_|As], A) :- '$tbl_answer'(As, A).
+)PROG");
+    }
+
+    tabled_.insert(qn);
+
+    // p(X1,...,Xn) :- '$tbl_call'(p(X1,...,Xn)).
+    size_t arity = qn.second.arity();
+    term head = qn.second;
+    if (arity > 0) {
+	head = new_term(qn.second);
+    }
+    term wrapper = new_term(implied_by_,
+			    {head, new_term(functor("$tbl_call",1), {head})});
+
+    managed_clauses old;
+    auto found = program_db_.find(qn);
+    if (found == program_db_.end()) {
+	program_predicates_.push_back(qn);
+    } else {
+	old = found->second;
+    }
+    auto &m_clauses = program_db_[qn];
+    m_clauses.clear();
+    m_clauses.push_back(managed_clause(wrapper, cost(wrapper)));
+    if (clause_loaded_fn_) {
+	clause_loaded_fn_(qn, m_clauses.back());
+    }
+
+    // Clauses loaded before the declaration move to the companion
+    for (auto &cl : old) {
+	load_clause(cl.clause());
+    }
 }
 
 void interpreter_base::load_builtin(const qname &qn, builtin b)
@@ -234,6 +312,12 @@ void interpreter_base::load_builtins()
 
     // Arithmetics
     load_builtin(con_cell("is",2), &builtins::is_2);
+    load_builtin(con_cell("<",2), &builtins::operator_less_than);
+    load_builtin(con_cell("=<",2), &builtins::operator_equals_less_than);
+    load_builtin(con_cell(">",2), &builtins::operator_greater_than);
+    load_builtin(con_cell(">=",2), &builtins::operator_greater_than_equals);
+    load_builtin(con_cell("=:=",2), &builtins::operator_arith_equals);
+    load_builtin(con_cell("=\\=",2), &builtins::operator_arith_not_equals);
 
     // Analyzing & constructing terms
     load_builtin(functor("functor",3), &builtins::functor_3);
@@ -243,6 +327,17 @@ void interpreter_base::load_builtins()
     // Meta
     load_builtin(con_cell("\\+", 1), builtin(&builtins::operator_disprove,true));
     load_builtin(con_cell("findall",3), builtin(&builtins::findall_3,true));
+    load_builtin(functor("aggregate_all",3), builtin(&builtins::aggregate_all_3,true));
+
+    // Tabling
+    load_builtin(con_cell("table",1), &builtins::table_1);
+    load_builtin(functor("$tbl_call",1), builtin(&builtins::table_call_1,true));
+    load_builtin(functor("abolish_all_tables",0), &builtins::abolish_all_tables_0);
+
+    // Exceptions
+    load_builtin(con_cell("catch",3), builtin(&builtins::catch_3,true));
+    load_builtin(functor("$catch_exit",1), &builtins::catch_exit_1);
+    load_builtin(con_cell("throw",1), &builtins::throw_1);
 }
 
 void interpreter_base::load_builtins_opt()
@@ -492,30 +587,117 @@ void interpreter_base::print_profile(std::ostream &out) const
     for (auto p : all) {
 	auto f = p.f;
 	auto t = p.t;
-	std::cout << to_string(f) << ": " << t << "\n";
+	out << to_string(f) << ": " << t << "\n";
+    }
+
+    if (tables_.num_subgoals() > 0) {
+	out << "Tables: " << tables_.num_subgoals() << " subgoals, "
+	    << tables_.num_answers() << " answers, "
+	    << tables_.heap_size() * sizeof(common::cell) << " bytes\n";
     }
 
+    for (auto &p : promotions_) {
+	out << "Promoted to WAM: ";
+	if (!is_empty_list(p.qn.first)) {
+	    out << atom_name(p.qn.first) << ":";
+	}
+	out << atom_name(p.qn.second) << "/" << p.qn.second.arity()
+	    << " (calls: " << p.calls << ", backtracks: " << p.backtracks
+	    << ")\n";
+    }
 }
 
-void interpreter_base::abort(const interpreter_exception &ex)
+bool interpreter_base::abort(const interpreter_exception &ex)
 {
-    throw ex;
+    ex_mark_ = secondary_env_.heap_size();
+    register_ex_ = secondary_env_.new_term(
+		       secondary_env_.functor("error", 2),
+		       {secondary_env_.functor(ex.kind(), 0),
+		        secondary_env_.functor(ex.what(), 0)});
+    has_exception_ = true;
+    return false;
+}
+
+bool interpreter_base::raise_exception(term ball)
+{
+    uint64_t cost = 0;
+    ex_mark_ = secondary_env_.heap_size();
+    register_ex_ = secondary_env_.copy(ball, *this, cost);
+    add_accumulated_cost(cost);
+    has_exception_ = true;
+    return false;
+}
+
+void interpreter_base::handle_exception()
+{
+    static const con_cell error_2("error", 2);
+
+    for (auto *ch = b(); ch != nullptr; ch = ch->b) {
+	if (!is_catch_frame(ch) || deref(ch->ai[3]).tag() != tag_t::REF) {
+	    continue;
+	}
+
+	// Leave findall/3, \+ etc. that were entered within Goal
+	while (has_meta_contexts() && get_last_meta_context()->old_b >= ch) {
+	    release_last_meta_context();
+	}
+	tables_.abandon(num_of_meta_contexts());
+
+	reset_to_choice_point(ch);
+	term ball = copy(register_ex_, secondary_env_);
+	if (!unify(ch->ai[1], ball)) {
+	    continue;
+	}
+
+	// Caught; continue with Recovery where catch/3 would have
+	// continued
+	has_exception_ = false;
+	secondary_env_.trim_heap(static_cast<const int_cell &>(ch->ai[4]).value());
+	set_b(ch->b);
+	reset_register_hb();
+	allocate_environment(false);
+	set_p(code_point(ch->ai[2]));
+	set_cp(empty_list());
+	return;
+    }
+
+    has_exception_ = false;
+    term ball = register_ex_;
+    std::string msg;
+    if (secondary_env_.functor(ball) == error_2 &&
+	secondary_env_.arg(ball, 1).tag() == tag_t::CON) {
+	msg = secondary_env_.atom_name(secondary_env_.arg(ball, 1));
+    } else {
+	msg = "Unhandled exception: " + secondary_env_.to_string(ball);
+    }
+    secondary_env_.trim_heap(ex_mark_);
+    while (has_meta_contexts()) {
+	release_last_meta_context();
+    }
+    tables_.abandon(0);
+    throw interpreter_exception(msg);
 }
 
 void interpreter_base::prepare_execution()
 {
     num_of_args_= 0;
-    memset(register_ai_, 0, sizeof(register_ai_));
+    std::fill(std::begin(register_ai_), std::end(register_ai_), term());
     top_fail_ = false;
     complete_ = false;
+    yielded_ = false;
+    yield_p_.reset();
+    start_time_slice();
     register_b_ = nullptr;
     register_e_ = nullptr;
     register_e_is_wam_ = false;
     set_register_hb(heap_size());
+    top_hb_ = heap_size();
     register_b0_ = nullptr;
     register_top_b_ = nullptr;
     register_top_e_ = nullptr;
     register_p_.reset();
+    has_exception_ = false;
+    tables_.abandon(0);
 }
 
 
@@ -524,14 +706,11 @@ void interpreter_base::tidy_trail()
     size_t from = (b() == nullptr) ? 0 : b()->tr;
     size_t to = trail_size();
 
-    static size_t avg[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-    static size_t idx = 0;
-
-    avg[idx] = to - from;
-    idx = (idx + 1) % 16;
+    tidy_avg_[tidy_idx_] = to - from;
+    tidy_idx_ = (tidy_idx_ + 1) % 16;
     size_t sum = 0;
     for (size_t i = 0; i < 16; i++) {
-	sum += avg[i];
+	sum += tidy_avg_[i];
     }
     tidy_size = sum / 16;
 
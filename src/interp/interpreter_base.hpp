@@ -12,6 +12,7 @@
 #include "builtins_opt.hpp"
 #include "file_stream.hpp"
 #include "arithmetics.hpp"
+#include "tabling.hpp"
 
 namespace prologcoin { namespace interp {
 // This pair represents functor with first argument. If first argument
@@ -115,81 +116,96 @@ public:
 
 // Interpreter exceptions...
 
+// The kind is the first argument of the error(Kind, Message) ball
+// that catch/3 sees.
 class interpreter_exception : public std::runtime_error
 {
 public:
-    interpreter_exception(const std::string &msg)
-	: std::runtime_error(msg) { }
+    interpreter_exception(const std::string &msg,
+			  const char *kind = "system_error")
+	: std::runtime_error(msg), kind_(kind) { }
+
+    inline const char * kind() const { return kind_; }
+
+private:
+    const char *kind_;
 };
 
 class interpreter_exception_stack_overflow : public interpreter_exception
 {
 public:
     interpreter_exception_stack_overflow(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "resource_error") { }
 };
 
 class interpreter_exception_undefined_predicate : public interpreter_exception
 {
 public:
     interpreter_exception_undefined_predicate(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "existence_error") { }
 };
 
 class interpreter_exception_wrong_arg_type : public interpreter_exception
 {
 public:
       interpreter_exception_wrong_arg_type(const std::string &msg)
-	  : interpreter_exception(msg) { }
+	  : interpreter_exception(msg, "type_error") { }
 };
 
 class interpreter_exception_file_not_found : public interpreter_exception
 {
 public:
       interpreter_exception_file_not_found(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "existence_error") { }
 };
 
 class interpreter_exception_nothing_told : public interpreter_exception
 {
 public:
     interpreter_exception_nothing_told(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "permission_error") { }
 };
 
 class interpreter_exception_argument_not_number : public interpreter_exception
 {
 public:
     interpreter_exception_argument_not_number(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "type_error") { }
 };
 
 class interpreter_exception_not_sufficiently_instantiated : public interpreter_exception
 {
 public:
     interpreter_exception_not_sufficiently_instantiated(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "instantiation_error") { }
 };
 
 class interpreter_exception_not_list : public interpreter_exception
 {
 public:
     interpreter_exception_not_list(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "type_error") { }
 };
 
 class interpreter_exception_unsupported : public interpreter_exception
 {
 public:
     interpreter_exception_unsupported(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "representation_error") { }
 };
 
 class interpreter_exception_undefined_function : public interpreter_exception
 {
 public:
     interpreter_exception_undefined_function(const std::string &msg)
-	: interpreter_exception(msg) { }
+	: interpreter_exception(msg, "existence_error") { }
+};
+
+class interpreter_exception_evaluation_error : public interpreter_exception
+{
+public:
+    interpreter_exception_evaluation_error(const std::string &msg)
+	: interpreter_exception(msg, "evaluation_error") { }
 };
 
 class wam_instruction_base;
@@ -204,7 +220,8 @@ public:
     inline code_point(const common::con_cell l) : wam_code_(nullptr), term_code_(l){}
     inline code_point(const common::int_cell i) : wam_code_(nullptr), term_code_(i){}
     inline code_point(const code_point &other)
-        : wam_code_(other.wam_code_), term_code_(other.term_code_) { }
+        : wam_code_(other.wam_code_), module_(other.module_),
+	  term_code_(other.term_code_) { }
     inline code_point(wam_instruction_base *i)
         : wam_code_(i), term_code_(common::ref_cell(0)) { }
 
@@ -336,6 +353,7 @@ class interpreter_base : public common::term_env {
     friend class builtins_opt;
     friend class builtins_fileio;
     friend class arithmetics;
+    friend class tabling;
 
 public:
     typedef common::term term;
@@ -356,6 +374,12 @@ public:
     bool is_track_cost() const { return track_cost_; }
     void set_track_cost(bool b) { track_cost_ = b; }
 
+    // Time slicing: a query yields after this many calls (0 = run to
+    // completion.) See interpreter::resume.
+    inline uint64_t time_slice() const { return time_slice_; }
+    inline void set_time_slice(uint64_t n) { time_slice_ = n; }
+    inline bool is_yielded() const { return yielded_; }
+
     void enable_file_io();
     const std::string & get_current_directory() const;
     void set_current_directory(const std::string &dir);
@@ -365,6 +389,14 @@ public:
     void reset_files();
 
     inline arithmetics & arith() { return arith_; }
+    inline tabling & tables() { return tables_; }
+
+    // Tabled predicates (:- table p/N.) Their clauses are kept under
+    // '$tbl_p'/N and p/N calls '$tbl_call'/1 (see tabling.hpp.)
+    void set_tabled(const qname &qn);
+    inline bool is_tabled(const qname &qn) const
+        { return !tabled_.empty() && tabled_.count(qn) > 0; }
+    qname tabled_companion(const qname &qn);
 
     void load_clause(const std::string &str);
     void load_clause(std::istream &is);
@@ -447,7 +479,7 @@ public:
 
     inline bool unify(term a, term b)
        { uint64_t cost = 0;
-	 bool ok = common::term_env::unify(a, b, cost);
+	 bool ok = common::term_env::unify<common::heap_unchecked>(a, b, cost);
 	 add_accumulated_cost(cost);
 	 return ok;
        }
@@ -466,6 +498,13 @@ public:
 	 return c;
        }
 
+    inline term copy_segment(term t, term_env &src, size_t from)
+       { uint64_t cost = 0;
+         term c = common::term_env::copy_segment(t, src, from, cost);
+	 add_accumulated_cost(cost);
+	 return c;
+       }
+
     inline term copy(term t)
        { uint64_t cost = 0;
          term c = common::term_env::copy(t, cost);
@@ -584,7 +623,7 @@ protected:
     inline void cut_direct()
     {
 	set_b(b0());
-	if (b() != nullptr) set_register_hb(b()->h);
+	reset_register_hb();
 	tidy_trail();
     }
     inline void cut()
@@ -673,6 +712,14 @@ protected:
         register_b_ = b;
     }
 
+    // HB follows the newest choice point. Without one only the
+    // bindings of variables older than the query are recorded, so the
+    // query can still be undone.
+    inline void reset_register_hb()
+    {
+        set_register_hb((b() != nullptr) ? b()->h : top_hb_);
+    }
+
     inline choice_point_t * b0() const
     {
         return register_b0_;
@@ -714,6 +761,30 @@ protected:
         return complete_;
     }
 
+    inline void start_time_slice()
+    {
+        slice_left_ = (time_slice_ == 0) ? UINT64_MAX : time_slice_;
+    }
+
+    // Count a call. When the time slice is used up, P is put aside
+    // and replaced with fail, which takes us out of the WAM loop.
+    inline void tick()
+    {
+        if (--slice_left_ == 0) {
+	    yielded_ = true;
+	    yield_p_ = register_p_;
+	    register_p_ = code_point::fail();
+	}
+    }
+
+    inline void resume_yielded()
+    {
+        yielded_ = false;
+	register_p_ = yield_p_;
+	yield_p_.reset();
+	start_time_slice();
+    }
+
     inline environment_base_t * allocate_environment(bool for_wam)
     {
         word_t *new_e0;
@@ -727,7 +798,12 @@ protected:
 	        new_e0 = base(b()) + words<term>()*b()->arity + words<choice_point_t>();
 	    }
 	}
+	return allocate_environment(for_wam, new_e0);
+    }
 
+    inline environment_base_t * allocate_environment(bool for_wam,
+						      word_t *new_e0)
+    {
 	if (to_stack_relative_addr(new_e0) + MAX_STACK_FRAME_WORDS
 	    >= MAX_STACK_SIZE_WORDS) {
 	    throw interpreter_exception_stack_overflow("Exceeded maximum stack size (" + boost::lexical_cast<std::string>(MAX_STACK_SIZE) + " bytes.)");
@@ -768,7 +844,8 @@ protected:
 	// std::cout << "[after]  deallocate_environment: e=" << e() << " p=" << to_string_cp(p()) << " cp=" << to_string_cp(cp()) << "\n";
     }
 
-    inline void allocate_choice_point(const code_point &cont)
+    // Where the next choice point goes on the stack
+    inline word_t * choice_point_slot()
     {
         word_t *new_b0;
 	if (base(e0()) > base(b())) {
@@ -785,8 +862,12 @@ protected:
 	            >= MAX_STACK_SIZE_WORDS) {
 	    throw interpreter_exception_stack_overflow("Exceeded maximum stack size (" + boost::lexical_cast<std::string>(MAX_STACK_SIZE) + " bytes.)");
 	}
+	return new_b0;
+    }
 
-	auto *new_b = reinterpret_cast<choice_point_t *>(new_b0);
+    inline void allocate_choice_point(const code_point &cont)
+    {
+	auto *new_b = reinterpret_cast<choice_point_t *>(choice_point_slot());
 	new_b->arity = num_of_args_;
 	for (size_t i = 0; i < num_of_args_; i++) {
 	    new_b->ai[i] = a(i);
@@ -848,6 +929,9 @@ protected:
     inline void set_qr(term qr)
         { register_qr_ = qr; }
 
+    inline common::con_cell pr() const
+        { return register_pr_; }
+
     inline void set_pr(common::con_cell pr)
         { register_pr_ = pr; }
 
@@ -857,7 +941,31 @@ protected:
 
     term get_first_arg();
 
-    void abort(const interpreter_exception &ex);
+    //
+    // Exceptions. throw/1 and the errors builtins raise (with abort)
+    // set the pending exception, a ball kept in the secondary
+    // environment, and the builtin fails. Failing with an exception
+    // pending goes to the innermost active catch/3 frame instead (see
+    // handle_exception.) A catch frame is a choice point whose
+    // alternative is catch_frame() and whose arguments are
+    //    Goal, Catcher, Recovery, Flag, secondary heap size
+    // The flag gets bound when Goal exits, so the frame is not active
+    // until Goal is backtracked into again.
+    //
+    bool abort(const interpreter_exception &ex);
+    bool raise_exception(term ball);
+    void handle_exception();
+
+    inline bool has_pending_exception() const
+        { return has_exception_; }
+
+    inline static code_point catch_frame()
+        { return code_point(common::con_cell("$catch", 0)); }
+
+    inline bool is_catch_frame(choice_point_t *ch) const
+        { return !ch->bp.has_wam_code() &&
+		 ch->bp.term_code() == common::con_cell("$catch", 0); }
+
     bool definitely_inequal(const term a, const term b);
 
     template<typename T> inline T * new_meta_context(meta_fn fn) {
@@ -907,12 +1015,27 @@ protected:
     inline  meta_fn get_last_meta_function()
         { return meta_.back().second; }
 
+    inline size_t num_of_meta_contexts() const
+    {
+	return meta_.size();
+    }
+
     inline bool has_meta_contexts() const
         { return !meta_.empty(); }
 
     inline term_env & secondary_env()
         { return secondary_env_; }
 
+    typedef std::function<void (const qname &, const managed_clause &)> clause_loaded_fn;
+
+    inline void set_clause_loaded_fn(clause_loaded_fn fn)
+        { clause_loaded_fn_ = fn; }
+
+    // Record that a predicate was promoted to WAM code (for profiling)
+    inline void record_promotion(const qname &qn, uint64_t calls,
+				 uint64_t backtracks)
+        { promotions_.push_back(promotion{qn, calls, backtracks}); }
+
     inline void reset_accumulated_cost()
         { accumulated_cost_ = 0; }
 
@@ -997,6 +1120,11 @@ private:
     bool top_fail_;
     bool complete_;
 
+    uint64_t time_slice_;
+    uint64_t slice_left_;
+    bool yielded_;
+    code_point yield_p_;
+
     code_point register_p_;
     code_point register_cp_;
 
@@ -1007,8 +1135,13 @@ private:
     choice_point_t *register_b_;
     choice_point_t *register_b0_;
     choice_point_t *register_top_b_;
+    size_t top_hb_;        // HB without choice points
+
+public:
+    static const size_t MAX_A_REGS = 256;
 
-    term register_ai_[256];
+private:
+    term register_ai_[MAX_A_REGS];
 
     size_t num_of_args_;
 
@@ -1017,6 +1150,10 @@ private:
     term register_qr_;     // Current query 
     con_cell register_pr_; // Current predicate (for profiling)
 
+    bool has_exception_;   // Pending exception
+    term register_ex_;     // Its ball (in secondary_env_)
+    size_t ex_mark_;       // Secondary heap size before the ball
+
     std::vector<meta_entry> meta_;
 
     con_cell comma_;
@@ -1031,16 +1168,30 @@ private:
     std::stack<file_stream *> standard_output_stack_;
 
     arithmetics arith_;
+    tabling tables_;
+    std::unordered_set<qname> tabled_;
 
     std::unordered_map<common::con_cell, uint64_t> profiling_;
 
+    struct promotion {
+	qname qn;
+	uint64_t calls;
+	uint64_t backtracks;
+    };
+    std::vector<promotion> promotions_;
+
     std::function<void ()> debug_check_fn_;
 
+    // Notified whenever a clause is added to the program database
+    clause_loaded_fn clause_loaded_fn_;
+
     // Keep track of accumulated cost while interpreter is executing
     uint64_t accumulated_cost_;
 
 protected:
     size_t tidy_size;
+    size_t tidy_avg_[16];
+    size_t tidy_idx_;
 };
 
 }}
@@ -0,0 +1,245 @@
+#include "tabling.hpp"
+#include "interpreter_base.hpp"
+
+namespace prologcoin { namespace interp {
+
+    using namespace prologcoin::common;
+
+    tabling::~tabling()
+    {
+	clear();
+    }
+
+    // Atoms are hashed by name, so that a term hashes the same on
+    // every heap.
+    static inline uint64_t con_hash(term_env &env, con_cell c)
+    {
+	if (c.is_direct()) {
+	    return c.raw_value();
+	}
+	return std::hash<std::string>()(env.atom_name(c)) * 31 + c.arity();
+    }
+
+    static inline uint64_t mix(uint64_t h, uint64_t x)
+    {
+	return (h ^ x) * 0x100000001b3;
+    }
+
+    // Variables are numbered in order of first occurrence, so
+    // variants get the same hash.
+    uint64_t tabling::variant_hash(term_env &env, term t)
+    {
+	std::vector<term> stack;
+	std::unordered_map<term, size_t> vars;
+	uint64_t h = 0xcbf29ce484222325;
+
+	stack.push_back(t);
+	while (!stack.empty()) {
+	    t = env.deref(stack.back());
+	    stack.pop_back();
+	    switch (t.tag()) {
+	    case tag_t::REF: {
+		auto found = vars.find(t);
+		size_t n = vars.size();
+		if (found == vars.end()) {
+		    vars[t] = n;
+		} else {
+		    n = found->second;
+		}
+		h = mix(h, 0x100 + n);
+		break;
+	    }
+	    case tag_t::CON:
+		h = mix(h, con_hash(env, reinterpret_cast<con_cell &>(t)));
+		break;
+	    case tag_t::STR: {
+		con_cell f = env.functor(t);
+		h = mix(h, con_hash(env, f));
+		size_t n = f.arity();
+		for (size_t i = 0; i < n; i++) {
+		    stack.push_back(env.arg(t, n - i - 1));
+		}
+		break;
+	    }
+	    case tag_t::INT:
+	    case tag_t::BIG:
+		h = mix(h, t.raw_value());
+		break;
+	    }
+	}
+
+	return h;
+    }
+
+    // 'a' is on the interpreter heap and 'b' in the tables.
+    bool tabling::is_variant(term a, term b)
+    {
+	std::vector<std::pair<term, term> > stack;
+	std::unordered_map<term, term> a_to_b, b_to_a;
+
+	auto same_con = [&](con_cell ca, con_cell cb) {
+	    if (ca.is_direct() || cb.is_direct()) {
+		return ca == cb;
+	    }
+	    return ca.arity() == cb.arity() &&
+		   interp_.atom_name(ca) == env_.atom_name(cb);
+	};
+
+	stack.push_back(std::make_pair(a, b));
+	while (!stack.empty()) {
+	    a = interp_.deref(stack.back().first);
+	    b = env_.deref(stack.back().second);
+	    stack.pop_back();
+	    if (a.tag() != b.tag()) {
+		return false;
+	    }
+	    switch (a.tag()) {
+	    case tag_t::REF: {
+		auto fa = a_to_b.find(a);
+		auto fb = b_to_a.find(b);
+		if (fa == a_to_b.end() && fb == b_to_a.end()) {
+		    a_to_b[a] = b;
+		    b_to_a[b] = a;
+		} else if (fa == a_to_b.end() || fb == b_to_a.end() ||
+			   fa->second != b) {
+		    return false;
+		}
+		break;
+	    }
+	    case tag_t::CON:
+		if (!same_con(reinterpret_cast<con_cell &>(a), reinterpret_cast<con_cell &>(b))) {
+		    return false;
+		}
+		break;
+	    case tag_t::STR: {
+		con_cell fa = interp_.functor(a);
+		if (!same_con(fa, env_.functor(b))) {
+		    return false;
+		}
+		size_t n = fa.arity();
+		for (size_t i = 0; i < n; i++) {
+		    stack.push_back(std::make_pair(interp_.arg(a, i),
+						   env_.arg(b, i)));
+		}
+		break;
+	    }
+	    case tag_t::INT:
+	    case tag_t::BIG:
+		if (a != b) {
+		    return false;
+		}
+		break;
+	    }
+	}
+
+	return true;
+    }
+
+    tabling::subgoal * tabling::lookup(term goal)
+    {
+	uint64_t h = variant_hash(interp_, goal);
+	auto range = subgoals_.equal_range(h);
+	for (auto it = range.first; it != range.second; ++it) {
+	    if (is_variant(goal, it->second->call)) {
+		return it->second;
+	    }
+	}
+
+	uint64_t cost = 0;
+	auto *sg = new subgoal();
+	sg->hash = h;
+	sg->call = env_.copy(goal, interp_, cost);
+	sg->state = INCOMPLETE;
+	interp_.add_accumulated_cost(cost);
+	subgoals_.insert(std::make_pair(h, sg));
+	num_subgoals_++;
+	return sg;
+    }
+
+    bool tabling::add_answer(subgoal *sg, term answer)
+    {
+	uint64_t h = variant_hash(interp_, answer);
+	auto range = sg->answer_index.equal_range(h);
+	for (auto it = range.first; it != range.second; ++it) {
+	    if (is_variant(answer, sg->answers[it->second])) {
+		return false;
+	    }
+	}
+
+	uint64_t cost = 0;
+	sg->answer_index.insert(std::make_pair(h, sg->answers.size()));
+	sg->answers.push_back(env_.copy(answer, interp_, cost));
+	interp_.add_accumulated_cost(cost);
+	num_answers_++;
+	return true;
+    }
+
+    term tabling::answers(subgoal *sg)
+    {
+	term lst = interp_.empty_list();
+	for (auto it = sg->answers.rbegin(); it != sg->answers.rend(); ++it) {
+	    lst = interp_.new_dotted_pair(interp_.copy(*it, env_), lst);
+	}
+	return lst;
+    }
+
+    void tabling::push_leader(subgoal *sg, size_t meta_depth)
+    {
+	sg->state = EVALUATING;
+	sg->depth = leaders_.size();
+	sg->min_depth = sg->depth;
+	sg->changed = false;
+	sg->meta_depth = meta_depth;
+	sg->start_answers = sg->answers.size();
+	leaders_.push_back(sg);
+    }
+
+    void tabling::pop_leader(subgoal *sg)
+    {
+	assert(leaders_.back() == sg);
+	leaders_.pop_back();
+
+	if (sg->min_depth >= sg->depth) {
+	    sg->state = COMPLETE;
+	    return;
+	}
+
+	// Part of an older leader's component; that leader will
+	// evaluate it again (at least once more if it got new answers.)
+	sg->state = INCOMPLETE;
+	auto *parent = leaders_.back();
+	parent->min_depth = std::min(parent->min_depth, sg->min_depth);
+	if (sg->answers.size() > sg->start_answers) {
+	    parent->changed = true;
+	}
+    }
+
+    void tabling::consume(subgoal *sg)
+    {
+	if (!leaders_.empty()) {
+	    auto *top = leaders_.back();
+	    top->min_depth = std::min(top->min_depth, sg->depth);
+	}
+    }
+
+    void tabling::abandon(size_t meta_depth)
+    {
+	while (!leaders_.empty() && leaders_.back()->meta_depth > meta_depth) {
+	    leaders_.back()->state = INCOMPLETE;
+	    leaders_.pop_back();
+	}
+    }
+
+    void tabling::clear()
+    {
+	for (auto &e : subgoals_) {
+	    delete e.second;
+	}
+	subgoals_.clear();
+	leaders_.clear();
+	env_.trim_heap(0);
+	num_subgoals_ = 0;
+	num_answers_ = 0;
+    }
+
+}}
@@ -0,0 +1,102 @@
+#pragma once
+
+#ifndef _interp_tabling_hpp
+#define _interp_tabling_hpp
+
+#include <vector>
+#include <unordered_map>
+#include "../common/term_env.hpp"
+
+namespace prologcoin { namespace interp {
+    class interpreter_base;
+
+    //
+    // Answer tables for tabled predicates (:- table p/N.)
+    //
+    // A call to a tabled predicate is looked up by variant (same
+    // term up to renaming of variables) among the subgoals seen so
+    // far. The first call of a subgoal becomes its leader: it runs
+    // the clauses and adds the answers that are not variants of
+    // answers it has already, again and again until an iteration adds
+    // nothing (see builtins::table_call_1.) Calls of a subgoal that is
+    // being evaluated are consumers: they get the answers found so far
+    // and, as the leader iterates, all of them eventually. This is how
+    // left recursion terminates.
+    //
+    // A leader whose consumers belong to an older leader is in the
+    // same strongly connected component; its table stays incomplete
+    // and is evaluated again (keeping its answers) as the older
+    // leader iterates. The oldest leader completes the component.
+    //
+    // Subgoals and answers are copied to a heap of their own, so they
+    // survive backtracking.
+    //
+    class tabling {
+    public:
+	enum state_t { INCOMPLETE, EVALUATING, COMPLETE };
+
+	struct subgoal {
+	    uint64_t hash;
+	    common::term call;
+	    state_t state;
+	    std::vector<common::term> answers;
+	    std::unordered_multimap<uint64_t, size_t> answer_index;
+
+	    // While evaluating: position on the leader stack, the
+	    // oldest leader that a consumer within this evaluation
+	    // belongs to, whether an iteration added answers, the
+	    // number of meta contexts and the number of answers when
+	    // the evaluation started.
+	    size_t depth;
+	    size_t min_depth;
+	    bool changed;
+	    size_t meta_depth;
+	    size_t start_answers;
+	};
+
+	tabling(interpreter_base &interp) : interp_(interp) { }
+	~tabling();
+
+	// Find the subgoal of which 'goal' is a variant, or add it.
+	subgoal * lookup(common::term goal);
+
+	// Returns true if 'answer' is new.
+	bool add_answer(subgoal *sg, common::term answer);
+
+	// The answers as a list on the interpreter heap.
+	common::term answers(subgoal *sg);
+
+	void push_leader(subgoal *sg, size_t meta_depth);
+	void pop_leader(subgoal *sg);
+	inline bool is_leader_stack_empty() const { return leaders_.empty(); }
+	inline subgoal * top_leader() { return leaders_.back(); }
+
+	// A consumer of 'sg' (which is being evaluated) is running
+	// within the evaluation of the top leader.
+	void consume(subgoal *sg);
+
+	// Drop the evaluations whose meta contexts are gone (e.g. after
+	// an exception); their tables are kept as incomplete.
+	void abandon(size_t meta_depth);
+
+	void clear();
+
+	inline size_t num_subgoals() const { return num_subgoals_; }
+	inline size_t num_answers() const { return num_answers_; }
+	inline size_t heap_size() const { return env_.heap_size(); }
+
+    private:
+	uint64_t variant_hash(common::term_env &env, common::term t);
+	bool is_variant(common::term a, common::term b);
+
+	interpreter_base &interp_;
+	common::term_env env_;
+	std::unordered_multimap<uint64_t, subgoal *> subgoals_;
+	std::vector<subgoal *> leaders_;
+	size_t num_subgoals_ = 0;
+	size_t num_answers_ = 0;
+    };
+
+}}
+
+#endif
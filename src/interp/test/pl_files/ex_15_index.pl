@@ -0,0 +1,47 @@
+%
+% Clause indexing on other arguments than the first one
+%
+
+edge(a, b, 1).
+edge(b, c, 2).
+edge(c, d, 3).
+edge(a, d, 4).
+edge(d, a, 5).
+
+?- edge(X, c, W).
+% Expect: X = b, W = 2
+% Expect: end
+
+?- edge(X, Y, 4).
+% Expect: X = a, Y = d
+% Expect: end
+
+?- edge(a, Y, W).
+% Expect: Y = b, W = 1
+% Expect: Y = d, W = 4
+% Expect: end
+
+?- edge(a, d, W).
+% Expect: W = 4
+% Expect: end
+
+?- edge(X, f(c), W).
+% Expect: fail
+
+%
+% Adding clauses extends the indexes that have already been built.
+%
+
+edge(e, c, 6).
+edge(X, c, 7) :- X = f.
+
+?- edge(X, c, W).
+% Expect: X = b, W = 2
+% Expect: X = e, W = 6
+% Expect: X = f, W = 7
+% Expect: end
+
+?- edge(a, Y, W).
+% Expect: Y = b, W = 1
+% Expect: Y = d, W = 4
+% Expect: end
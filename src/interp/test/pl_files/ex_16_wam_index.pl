@@ -0,0 +1,73 @@
+%
+% WAM clause indexing on other arguments than the first one, and on
+% arguments of structures.
+%
+
+% Only the second argument tells these apart
+
+price(_, apple, 3).
+price(_, pear, 5).
+price(_, plum, 2).
+price(_, fig, 7).
+
+?- price(shop, pear, P).
+% Expect: P = 5
+% Expect: end
+
+?- price(shop, F, 2).
+% Expect: F = plum
+% Expect: end
+
+?- price(shop, kiwi, P).
+% Expect: fail
+
+% A state machine; first on the state then on the input
+
+delta(q0, a, q1).
+delta(q0, b, q0).
+delta(q1, a, q1).
+delta(q1, b, q2).
+delta(q2, a, q2).
+delta(q2, b, q2).
+
+run(Q, [], Q).
+run(Q, [C|Cs], R) :- delta(Q, C, Q1), run(Q1, Cs, R).
+
+?- run(q0, [a,a,b,a], R).
+% Expect: R = q2
+% Expect: end
+
+?- run(q0, [b,b,b], R).
+% Expect: R = q0
+% Expect: end
+
+?- delta(q1, C, Q).
+% Expect: C = a, Q = q1
+% Expect: C = b, Q = q2
+% Expect: end
+
+% The functor of a nested structure tells these apart
+
+eval(op(add, X, Y), R) :- R is X + Y.
+eval(op(sub, X, Y), R) :- R is X - Y.
+eval(op(mul, X, Y), R) :- R is X * Y.
+eval(num(X), X).
+
+?- eval(op(mul, 6, 7), R).
+% Expect: R = 42
+% Expect: end
+
+?- eval(op(sub, 6, 7), R).
+% Expect: R = -1
+% Expect: end
+
+?- eval(num(3), R).
+% Expect: R = 3
+% Expect: end
+
+?- eval(op(div, 6, 7), R).
+% Expect: fail
+
+?- eval(op(Op, 6, 7), 13).
+% Expect: Op = add
+% Expect: end
@@ -0,0 +1,88 @@
+%
+% Clauses that fail in the head or in the guard continue with the next
+% clause without a choice point being created (shallow backtracking.)
+%
+
+% Fails in the head
+
+kind(0, zero).
+kind(s(_), succ).
+kind([], nil).
+kind([_|_], cons).
+kind(X, other(X)).
+
+?- kind(s(0), K).
+% Expect: K = succ
+% Expect: K = other(s(0))
+% Expect: end
+
+?- kind(foo, K).
+% Expect: K = other(foo)
+% Expect: end
+
+% Fails in the guard; the builtins see the arguments in place
+
+max(X, Y, X) :- X @>= Y, !.
+max(_, Y, Y).
+
+?- max(3, 7, M).
+% Expect: M = 7
+% Expect: end
+
+?- max(9, 2, M).
+% Expect: M = 9
+% Expect: end
+
+level(X, low) :- X @< 5.
+level(X, mid) :- X == 5.
+level(X, high) :- X @> 5.
+
+levels([], []).
+levels([X|Xs], [L|Ls]) :- level(X, L), levels(Xs, Ls).
+
+?- levels([8, 1, 5, 9], Ls).
+% Expect: Ls = [high,low,mid,high]
+% Expect: end
+
+% Bindings made by a failed head must be undone
+
+pair(X, X, same).
+pair(_, _, different).
+
+?- pair(A, b, R).
+% Expect: A = b, R = same
+% Expect: R = different
+% Expect: end
+
+?- pair(f(A), f(g(B)), R), B = 1.
+% Expect: A = g(1), B = 1, R = same
+% Expect: B = 1, R = different
+% Expect: end
+
+% The first clause allocates an environment before the guard fails
+
+classify(X, Y, small) :- Y is X * 2, Y @< 10, !.
+classify(X, Y, large) :- Y is X * 3.
+
+?- classify(2, Y, C).
+% Expect: Y = 4, C = small
+% Expect: end
+
+?- classify(7, Y, C).
+% Expect: Y = 21, C = large
+% Expect: end
+
+% Alternatives left after the head succeeds
+
+color(red, warm).
+color(blue, cold).
+color(orange, warm).
+
+?- color(C, warm).
+% Expect: C = red
+% Expect: C = orange
+% Expect: end
+
+?- findall(C, color(C, warm), Cs).
+% Expect: Cs = [red,orange]
+% Expect: end
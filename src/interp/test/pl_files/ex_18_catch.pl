@@ -0,0 +1,84 @@
+%
+% catch/3 and throw/1
+%
+
+?- catch(throw(foo), X, true).
+% Expect: X = foo
+% Expect: end
+
+?- catch(throw(oops), oops, R = recovered).
+% Expect: R = recovered
+% Expect: end
+
+% The innermost catcher that unifies with the ball
+
+?- catch(catch(throw(b), a, X = inner), b, X = outer).
+% Expect: X = outer
+% Expect: end
+
+?- catch(catch(throw(f(1)), f(Y), X = inner(Y)), _, X = outer).
+% Expect: Y = 1, X = inner(1)
+% Expect: end
+
+% Bindings made before the throw are undone
+
+?- catch((X = 1, throw(t)), t, true).
+% Expect: true
+% Expect: end
+
+% Errors raised by builtins
+
+?- catch(functor(F, N, A), error(E, M), true).
+% Expect: E = instantiation_error, M = 'functor/3: Arguments are not sufficiently instantiated'
+% Expect: end
+
+?- catch(nope(1), error(E, M), true).
+% Expect: E = existence_error, M = 'Undefined predicate nope/1'
+% Expect: end
+
+?- catch(X is 1 + foo, error(E, M), true).
+% Expect: E = existence_error, M = 'is/2: Undefined function: foo/0 in 1+foo'
+% Expect: end
+
+% Errors in compiled predicates and across findall/3
+
+double(X, Y) :- Y is X * 2.
+
+safe_double(X, Y) :- catch(double(X, Y), error(_, _), Y = none).
+
+?- safe_double(4, Y).
+% Expect: Y = 8
+% Expect: end
+
+?- safe_double(_, Y).
+% Expect: Y = none
+% Expect: end
+
+?- catch(findall(Y, double(_, Y), L), error(E, M), true).
+% Expect: E = instantiation_error, M = 'is/2: Arguments are not sufficiently instantiated'
+% Expect: end
+
+% catch/3 is transparent to backtracking
+
+color(red).
+color(green).
+color(blue).
+
+?- catch(color(C), _, true).
+% Expect: C = red
+% Expect: C = green
+% Expect: C = blue
+% Expect: end
+
+% Once the goal has exited, the catcher is no longer active
+
+?- catch(true, _, true), throw(late).
+% Expect: Unhandled exception: late
+
+?- catch(color(C), _, true), C = green, throw(late).
+% Expect: Unhandled exception: late
+
+% Uncaught errors keep their message
+
+?- catch(functor(F, N, A), wrong, true).
+% Expect: functor/3: Arguments are not sufficiently instantiated
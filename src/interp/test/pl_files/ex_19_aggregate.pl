@@ -0,0 +1,70 @@
+%
+% Test aggregate_all/3 (and findall/3 with long atoms)
+%
+
+member(X, [X|_]).
+member(X, [_|Xs]) :- member(X, Xs).
+
+peer(alice_in_chains, 3).
+peer(bob_the_builder, 7).
+peer(carol_of_the_bells, 2).
+peer(dave_grohl, 7).
+
+?- findall(P-S, peer(P, S), L).
+% Expect: L = [alice_in_chains-3,bob_the_builder-7,carol_of_the_bells-2,dave_grohl-7]
+% Expect: end
+
+?- findall(X-Y, (member(X, [a,b]), member(Y, [X,c])), L).
+% Expect: L = [a-a,a-c,b-b,b-c]
+% Expect: end
+
+?- aggregate_all(count, peer(_, _), N).
+% Expect: N = 4
+% Expect: end
+
+?- aggregate_all(count, peer(nobody, _), N).
+% Expect: N = 0
+% Expect: end
+
+?- aggregate_all(sum(S), peer(_, S), Sum).
+% Expect: Sum = 19
+% Expect: end
+
+?- aggregate_all(sum(S * 2 + 1), peer(_, S), Sum).
+% Expect: Sum = 42
+% Expect: end
+
+?- aggregate_all(max(S), peer(_, S), Max).
+% Expect: Max = 7
+% Expect: end
+
+?- aggregate_all(min(S), peer(_, S), Min).
+% Expect: Min = 2
+% Expect: end
+
+?- aggregate_all(max(S), peer(nobody, S), Max).
+% Expect: fail
+
+?- aggregate_all(bag(S), peer(_, S), L).
+% Expect: L = [3,7,2,7]
+% Expect: end
+
+?- aggregate_all(set(S), peer(_, S), L).
+% Expect: L = [2,3,7]
+% Expect: end
+
+?- aggregate_all(set(P), member(P, [dave_grohl,alice_in_chains,dave_grohl]), L).
+% Expect: L = [alice_in_chains,dave_grohl]
+% Expect: end
+
+% Aggregates within aggregates
+
+total(Total) :- aggregate_all(sum(N), (member(Xs, [[a,b],[c],[]]), aggregate_all(count, member(_, Xs), N)), Total).
+
+?- total(T).
+% Expect: T = 3
+% Expect: end
+
+?- catch(aggregate_all(sum(X), member(X, [1,a]), S), error(E, M), true).
+% Expect: E = existence_error, M = 'aggregate_all/3: Undefined function: a/0 in a'
+% Expect: end
@@ -0,0 +1,70 @@
+%
+% Test tabling (:- table p/N.)
+%
+
+% Left recursion over a graph with a cycle
+
+:- table path/2.
+
+edge(a, b).
+edge(b, c).
+edge(c, a).
+edge(c, d).
+
+path(X, Y) :- path(X, Z), edge(Z, Y).
+path(X, Y) :- edge(X, Y).
+
+?- abolish_all_tables, aggregate_all(set(Y), path(a, Y), L).
+% Expect: L = [a,b,c,d]
+% Expect: end
+
+?- abolish_all_tables, aggregate_all(count, path(_, _), N).
+% Expect: N = 12
+% Expect: end
+
+?- abolish_all_tables, aggregate_all(set(X), path(X, X), L).
+% Expect: L = [a,b,c]
+% Expect: end
+
+?- path(d, Y).
+% Expect: fail
+
+% Answers are returned once (variant check)
+
+?- abolish_all_tables, findall(Y, path(b, Y), L0), aggregate_all(count, path(b, _), N).
+% Expect: L0 = [c,a,d,b], N = 4
+% Expect: end
+
+% Mutual recursion (one component)
+
+:- table p/1, q/1.
+
+p(X) :- q(X).
+p(a).
+q(X) :- p(X).
+q(b).
+
+?- abolish_all_tables, aggregate_all(set(X), p(X), L).
+% Expect: L = [a,b]
+% Expect: end
+
+?- abolish_all_tables, aggregate_all(set(X), q(X), L).
+% Expect: L = [a,b]
+% Expect: end
+
+% Right recursion over a longer chain
+
+:- table reach/2.
+
+link(n1, n2).
+link(n2, n3).
+link(n3, n4).
+link(n4, n5).
+link(n5, n1).
+
+reach(X, Y) :- link(X, Y).
+reach(X, Y) :- link(X, Z), reach(Z, Y).
+
+?- abolish_all_tables, aggregate_all(count, reach(_, _), N).
+% Expect: N = 25
+% Expect: end
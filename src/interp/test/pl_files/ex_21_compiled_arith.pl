@@ -0,0 +1,95 @@
+%
+% Arithmetic and comparisons (compiled to the arithmetic instructions
+% of the WAM when the expressions allow it.)
+%
+
+% Counter and accumulator loops
+
+count(N, N) :- !.
+count(I, N) :- I1 is I + 1, count(I1, N).
+
+?- count(0, 100000).
+% Expect: true
+% Expect: end
+
+sum_to(0, Acc, Acc).
+sum_to(N, Acc0, Sum) :- N > 0, Acc is Acc0 + N, N1 is N - 1, sum_to(N1, Acc, Sum).
+
+?- sum_to(1000, 0, S).
+% Expect: S = 500500
+% Expect: end
+
+fact(0, 1) :- !.
+fact(N, F) :- N1 is N - 1, fact(N1, F1), F is N * F1.
+
+?- fact(19, F).
+% Expect: F = 121645100408832000
+% Expect: end
+
+% Nested expressions and constants (folded)
+
+poly(X, Y) :- Y is (X + 2) * (X - 3) - 2 * 3 * X + (4 - 1).
+
+?- poly(5, Y).
+% Expect: Y = -13
+% Expect: end
+
+% Comparisons
+
+cmp(X, Y, R) :- X < Y, !, R = lt.
+cmp(X, Y, R) :- X =:= Y, !, R = eq.
+cmp(_, _, gt).
+
+?- cmp(1, 2, R1), cmp(2, 2, R2), cmp(3, 2, R3).
+% Expect: R1 = lt, R2 = eq, R3 = gt
+% Expect: end
+
+?- X = 3, X + 1 >= 4, X * 2 =< 6, X - 1 > 1, X =\= 4.
+% Expect: X = 3
+% Expect: end
+
+?- 2 + 2 =:= 5.
+% Expect: fail
+
+% The result is unified if the variable has a value
+
+succ_of(X, Y) :- Y is X + 1.
+
+?- succ_of(1, 2).
+% Expect: true
+% Expect: end
+
+?- succ_of(1, 3).
+% Expect: fail
+
+% Variables bound to expressions go to the generic evaluator
+
+twice(E, V) :- V is E * 2.
+
+?- twice(1 + 2, V).
+% Expect: V = 6
+% Expect: end
+
+% Errors
+
+?- catch(succ_of(_, _), error(E, M), true).
+% Expect: E = instantiation_error, M = 'is/2: Arguments are not sufficiently instantiated'
+% Expect: end
+
+?- catch(cmp(a, 1, _), error(E, _), true).
+% Expect: E = existence_error
+% Expect: end
+
+% The largest integer (2^60-1)
+big(X) :- X is 1073741824 * 1073741823 + 1073741823.
+
+square_big(Y) :- big(X), Y is X * X.
+next_big(Y) :- big(X), Y is X + 1.
+
+?- catch(square_big(_), error(E, _), true).
+% Expect: E = evaluation_error
+% Expect: end
+
+?- catch(next_big(_), error(E, M), true).
+% Expect: E = evaluation_error, M = 'is/2: Integer overflow in 1152921504606846975+1'
+% Expect: end
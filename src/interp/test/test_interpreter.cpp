@@ -229,12 +229,181 @@ static void test_interpreter_serialize()
     assert(interp.to_string(t) == interp.to_string(t2));
 }
 
+static void test_tiered_interpreter()
+{
+    header("test_tiered_interpreter()");
+
+    interpreter interp;
+
+    const std::string program =
+	R"PROGRAM(
+           [append([], Zs, Zs),
+              (append([X|Xs],Ys,[X|Zs]) :- append(Xs,Ys,Zs)),
+            nrev([],[]),
+              (nrev([X|Xs],Ys) :- nrev(Xs,Rs), append(Rs,[X],Ys)),
+            d(1), d(2), d(3), d(4), d(5), d(6), d(7), d(8), d(9), d(10),
+            d(11), d(12)].
+          )PROGRAM";
+
+    term prog = interp.parse(program);
+    interp.load_program(prog);
+    interp.set_tier_threshold(10);
+
+    // Both nrev/2 and append/3 get hot in the middle of this query.
+    term qr = interp.parse("nrev([1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],Q).");
+    std::cout << "?- " << interp.to_string(qr) << ".\n";
+    interp.execute(qr);
+    interp.print_result(std::cout);
+    assert(check_terms(interp.get_result(),
+	   "Q = [15,14,13,12,11,10,9,8,7,6,5,4,3,2,1]"));
+
+    const con_cell nrev("nrev", 2), append("append", 3), d("d", 1);
+    assert(interp.is_compiled(interp.empty_list(), nrev));
+    assert(interp.is_compiled(interp.empty_list(), append));
+    assert(!interp.is_compiled(interp.empty_list(), d));
+
+    // d/1 is called once but backtracked into; the promotion must
+    // not disturb the choice point of the running query.
+    qr = interp.parse("d(X).");
+    size_t n = 0;
+    bool r = interp.execute(qr);
+    while (r) {
+	n++;
+	r = interp.has_more() && interp.next();
+    }
+    std::cout << "Number of solutions: " << n << "\n";
+    assert(n == 12);
+    assert(interp.is_compiled(interp.empty_list(), d));
+
+    std::stringstream ss;
+    interp.print_profile(ss);
+    std::cout << ss.str();
+    assert(ss.str().find("Promoted to WAM: nrev/2") != std::string::npos);
+}
+
+static void test_code_segments()
+{
+    header("test_code_segments()");
+
+    interpreter interp;
+
+    const std::string program =
+	R"PROGRAM(
+           [append([], Zs, Zs),
+              (append([X|Xs],Ys,[X|Zs]) :- append(Xs,Ys,Zs)),
+            nrev([],[]),
+              (nrev([X|Xs],Ys) :- nrev(Xs,Rs), append(Rs,[X],Ys))].
+          )PROGRAM";
+
+    term prog = interp.parse(program);
+    interp.load_program(prog);
+    interp.compile();
+
+    const con_cell nrev("nrev", 2), append("append", 3);
+    size_t num_segments = interp.num_segments();
+
+    auto run = [&] {
+	term qr = interp.parse("nrev([1,2,3,4,5],Q).");
+	interp.execute(qr);
+	assert(check_terms(interp.get_result(), "Q = [5,4,3,2,1]"));
+    };
+
+    run();
+
+    // Recompiling append/3 retires its old segment; nrev/2 now
+    // calls the new code.
+    interp.compile(interp.empty_list(), append);
+    assert(interp.num_retired_segments() == 1);
+    assert(interp.num_segments() == num_segments);
+    run();
+    assert(interp.num_retired_segments() == 0);
+
+    // Without WAM code append/3 runs on the naive interpreter
+    interp.uncompile(interp.empty_list(), append);
+    assert(!interp.is_compiled(interp.empty_list(), append));
+    assert(interp.num_segments() == num_segments - 1);
+    run();
+    assert(interp.num_retired_segments() == 0);
+
+    interp.compile(interp.empty_list(), append);
+    assert(interp.is_compiled(interp.empty_list(), nrev));
+    assert(interp.num_segments() == num_segments);
+    run();
+}
+
+static void test_time_slicing()
+{
+    header("test_time_slicing()");
+
+    interpreter interp;
+
+    const std::string program =
+	R"PROGRAM(
+           [count(N, N),
+              (count(I, N) :- I < N, I1 is I + 1, count(I1, N)),
+            d(a), d(b), d(c),
+              (loop(N, X) :- count(0, N), d(X), count(0, N))].
+          )PROGRAM";
+
+    term prog = interp.parse(program);
+    interp.load_program(prog);
+
+    // Collect all solutions, resuming whenever the query yields
+    auto run = [&](size_t &yields) {
+	std::vector<std::string> solutions;
+	term qr = interp.parse("loop(1000, X).");
+	yields = 0;
+	bool r = interp.execute(qr);
+	for (;;) {
+	    while (interp.is_yielded()) {
+		yields++;
+		r = interp.resume();
+	    }
+	    if (!r) {
+		break;
+	    }
+	    solutions.push_back(interp.get_result());
+	    if (!interp.has_more()) {
+		break;
+	    }
+	    r = interp.next();
+	}
+	std::cout << "Solutions: " << solutions.size()
+		  << " Yields: " << yields << "\n";
+	assert(solutions.size() == 3);
+	assert(check_terms(solutions[0], "X = a"));
+	assert(check_terms(solutions[1], "X = b"));
+	assert(check_terms(solutions[2], "X = c"));
+    };
+
+    size_t yields = 0;
+    run(yields);
+    assert(yields == 0);
+
+    // Naive interpreter
+    interp.set_time_slice(100);
+    run(yields);
+    assert(yields > 3);
+
+    // WAM code
+    interp.compile();
+    run(yields);
+    assert(yields > 3);
+
+    interp.set_time_slice(0);
+    run(yields);
+    assert(yields == 0);
+}
+
 int main( int argc, char *argv[] )
 {
     test_up_and_down();
     test_simple_interpreter();
     test_backtracking_interpreter();
     test_interpreter_serialize();
+    test_tiered_interpreter();
+    test_code_segments();
+    test_time_slicing();
 
     return 0;
 }
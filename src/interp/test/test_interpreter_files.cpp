@@ -12,6 +12,12 @@ using namespace prologcoin::interp;
 
 static bool do_compile = true;
 static bool fast_mode = false;
+static size_t num_native = 0;
+
+// Ahead-of-time compiled from the files here (see AOT in Makefile.env)
+namespace prologcoin { namespace interp {
+    void aot_register_interp(wam_interpreter &interp);
+}}
 
 static void header( const std::string &str )
 {
@@ -201,6 +207,7 @@ static bool test_interpreter_file(const std::string &filepath)
     std::vector<term_parser *> files;
 
     interpreter interp;
+    aot_register_interp(interp);
     const std::string dir = boost::filesystem::path(filepath).parent_path().string();
     
     interp.set_current_directory(dir);
@@ -293,7 +300,10 @@ static bool test_interpreter_file(const std::string &filepath)
 		// Check if this is a consult operation
 		term a = interp.arg(t, 0);
 		if (!interp.is_list(a)) {
-		    std::cout << "Unrecognized action. Only [...] is supported (to include other files)" << std::endl;
+		    // Otherwise a directive, e.g. :- table p/2.
+		    if (!interp.execute(a)) {
+			std::cout << "Directive failed: " << interp.to_string(a) << std::endl;
+		    }
 		    continue;
 		}
 		for (auto fileatom : interp.iterate_over(a)) {
@@ -343,6 +353,7 @@ static bool test_interpreter_file(const std::string &filepath)
 		interp.set_wam_enabled(true);
 
 		// Compile recent predicates
+		std::vector<con_cell> compiled;
 		if (do_compile) {
 		    std::unordered_set<std::string> dont_compile_set;
 		    for (auto p : predicates) {
@@ -353,6 +364,7 @@ static bool test_interpreter_file(const std::string &filepath)
 			} else {
 	    	            std::cout << "[Compile]: "<< p_name << "\n";
 			    interp.compile(interp.empty_list(), p);
+			    compiled.push_back(p);
 			}
 	   	    }
 		    if (interp.is_debug()) {
@@ -368,6 +380,28 @@ static bool test_interpreter_file(const std::string &filepath)
 		interp.unwind(tr_mark);
 		interp.reset_files();
 		interp.set_register_hb(interp.heap_size());
+
+		// And once more with the recent predicates running their
+		// ahead-of-time compiled code.
+		if (!compiled.empty()) {
+		    interp.set_native_enabled(true);
+		    for (auto p : compiled) {
+			interp.compile(interp.empty_list(), p);
+			if (interp.is_native(qname(interp.empty_list(), p))) {
+			    std::cout << "[AOT]: " << interp.to_string(p) << "/"
+				      << p.arity() << "\n";
+			    num_native++;
+			}
+		    }
+		    interp.set_native_enabled(false);
+
+		    for (size_t i = 0; i < expected.size(); i++) {
+			test_run_once(interp, i, query, expected, expected_files);
+		    }
+		    interp.unwind(tr_mark);
+		    interp.reset_files();
+		    interp.set_register_hb(interp.heap_size());
+		}
 	    }
 	}
 
@@ -439,6 +473,9 @@ static void test_interpreter_files(const char *filter = nullptr)
 	bool r = test_interpreter_file(filepath.string());
 	assert(r);
     }
+
+    std::cout << "\nRan " << num_native << " predicates as ahead-of-time compiled code\n";
+    assert(filter != nullptr || num_native > 0);
 }
 
 int main( int argc, char *argv[] )
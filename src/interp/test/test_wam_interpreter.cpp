@@ -49,6 +49,8 @@ public:
     void test_compile2();
     void test_varset();
     void test_unsafe_set_unify();
+    void test_index();
+    void test_register_limits();
 
 private:
     interpreter interp_;
@@ -332,23 +334,100 @@ static void test_instruction_sequence()
 					       code_point::fail(),
 					       int_cell(8)));
 
-    auto *hm1 = interp.new_hash_map();
-    hm1->insert(std::make_pair(con_cell("f", 2), int_cell(126)));
-    hm1->insert(std::make_pair(int_cell(1234), int_cell(207)));
-    interp.add(wam_instruction<SWITCH_ON_CONSTANT>(hm1));
+    std::vector<code_t> buf;
+    wam_switch_entries hm1;
+    hm1.push_back(std::make_pair(con_cell("f", 2), int_cell(126)));
+    hm1.push_back(std::make_pair(int_cell(1234), int_cell(207)));
+    interp.add(wam_instruction<SWITCH_ON_CONSTANT>::make(hm1, buf));
 
-    auto *hm2 = interp.new_hash_map();
-    hm2->insert(std::make_pair(con_cell("f", 2), int_cell(221)));
-    hm2->insert(std::make_pair(con_cell("g", 3), int_cell(235)));
-    interp.add(wam_instruction<SWITCH_ON_STRUCTURE>(hm2));
+    wam_switch_entries hm2;
+    hm2.push_back(std::make_pair(con_cell("f", 2), int_cell(221)));
+    hm2.push_back(std::make_pair(con_cell("g", 3), int_cell(235)));
+    interp.add(wam_instruction<SWITCH_ON_STRUCTURE>::make(hm2, buf));
 
     interp.add(wam_instruction<NECK_CUT>());
     interp.add(wam_instruction<GET_LEVEL>(111));
     interp.add(wam_instruction<CUT>(112));
+    interp.add(wam_instruction<PUT_VALUE_X2>(1, 0, 2, 1));
+    interp.add(wam_instruction<PUT_VALUE_X_EXECUTE>(3, 2,
+			       code_point(con_cell("[]",0), con_cell("h",3))));
+    interp.add(wam_instruction<UNIFY_VARIABLE_X2>(4, 5));
+    interp.add(wam_instruction<ALLOCATE_GET_VARIABLE_Y>(0, 1));
+    interp.add(wam_instruction<ARITH_LOAD_X>(1, 0));
+    interp.add(wam_instruction<ARITH_LOAD_CONSTANT>(int_cell(2), 1));
+    interp.add(wam_instruction<ARITH_ADD>(con_cell("is",2), 0));
+    interp.add(wam_instruction<ARITH_GET_VALUE_Y>(3, 0));
+    interp.add(wam_instruction<ARITH_LOAD_Y>(2, 0));
+    interp.add(wam_instruction<ARITH_LT>(con_cell("<",2), 0));
 
     interp.print_code(std::cout);
 }
 
+static void test_switch_tables()
+{
+    header("test_switch_tables");
+
+    typedef wam_instruction_switch_table table_t;
+
+    auto check = [](const wam_switch_entries &entries, table_t::kind_t kind,
+		    const std::vector<term> &absent) {
+	std::vector<code_t> buf;
+	auto &instr = wam_instruction<SWITCH_ON_CONSTANT>::make(entries, buf);
+	auto &table = reinterpret_cast<table_t &>(instr);
+	std::cout << "Keys: " << entries.size() << " Kind: " << table.kind()
+		  << " Slots: " << table.num_slots() << "\n";
+	assert(table.kind() == kind);
+	for (auto &e : entries) {
+	    auto *cp = table.find(e.first);
+	    assert(cp != nullptr);
+	    assert(cp->term_code() == e.second.term_code());
+	}
+	for (auto t : absent) {
+	    assert(table.find(t) == nullptr);
+	}
+    };
+
+    auto atom = [](size_t i) {
+	return con_cell("a" + boost::lexical_cast<std::string>(i), 0);
+    };
+
+    wam_switch_entries entries;
+    std::vector<term> absent;
+    for (size_t i = 0; i < 5; i++) {
+	entries.push_back(std::make_pair(atom(i), int_cell(i)));
+    }
+    absent.push_back(atom(1000));
+    absent.push_back(int_cell(0));
+    check(entries, table_t::LINEAR, absent);
+
+    for (size_t i = 5; i < 40; i++) {
+	entries.push_back(std::make_pair(atom(i), int_cell(i)));
+    }
+    check(entries, table_t::SORTED, absent);
+
+    for (size_t i = 40; i < 500; i++) {
+	entries.push_back(std::make_pair(atom(i), int_cell(i)));
+    }
+    entries.push_back(std::make_pair(int_cell(42), int_cell(500)));
+    check(entries, table_t::HASHED, absent);
+
+    // Small integers with a few gaps
+    entries.clear();
+    absent.clear();
+    for (size_t i = 0; i < 1000; i++) {
+	if (i % 7 != 3) {
+	    entries.push_back(std::make_pair(int_cell(1000 + i), int_cell(i)));
+	} else {
+	    absent.push_back(int_cell(1000 + i));
+	}
+    }
+    absent.push_back(int_cell(999));
+    absent.push_back(int_cell(2000));
+    absent.push_back(int_cell(-5));
+    absent.push_back(con_cell("foo", 0));
+    check(entries, table_t::DIRECT, absent);
+}
+
 static void test_partition()
 {
     header("test_partition");
@@ -456,15 +535,143 @@ static void test_unsafe_set_unify()
     test.test_unsafe_set_unify();
 }
 
+void test_wam_compiler::test_index()
+{
+    std::string prog =
+        R"PROG(
+          price(_, apple, 3).
+          price(_, pear, 5).
+          price(_, plum, 2).
+          eval(op(add, X, Y), R) :- R is X + Y.
+          eval(op(sub, X, Y), R) :- R is X - Y.
+          eval(num(X), X).
+          delta(q0, a, q1).
+          delta(q0, b, q0).
+          delta(q1, a, q1).
+       )PROG";
+
+    interp_.load_program(prog);
+
+    auto compile = [&](const char *name, size_t arity) {
+	wam_interim_code instrs(interp_);
+	comp_.compile_predicate(qname(con_cell("[]",0),
+				      con_cell(name, arity)), instrs);
+	std::stringstream ss;
+	instrs.print(ss);
+	std::cout << ss.str() << "\n";
+	return ss.str();
+    };
+
+    // The second argument is selected
+    auto code = compile("price", 3);
+    assert(code.find("switch_on_term a1,") != std::string::npos);
+    assert(code.find("switch_on_constant a1,") != std::string::npos);
+
+    // Deep indexing on the first argument of op/3
+    code = compile("eval", 2);
+    assert(code.find("switch_on_term a0,") != std::string::npos);
+    assert(code.find("switch_on_term arg(1, a0),") != std::string::npos);
+
+    // First on the state then on the input
+    code = compile("delta", 3);
+    assert(code.find("switch_on_constant a0,") != std::string::npos);
+    assert(code.find("switch_on_term a1,") != std::string::npos);
+}
+
+static void test_index()
+{
+    header("test_index");
+
+    test_wam_compiler test;
+    test.test_index();
+}
+
+void test_wam_compiler::test_register_limits()
+{
+    auto compile_error = [&](const std::string &clause) {
+	term t = interp_.parse(clause);
+	wam_interim_code seq(interp_);
+	try {
+	    comp_.compile_clause(t, seq);
+	} catch (wam_exception_too_many_registers &ex) {
+	    std::cout << "Error: " << ex.what() << "\n";
+	    return true;
+	}
+	return false;
+    };
+
+    // One X register for each g(I)
+    std::string args;
+    for (size_t i = 0; i < wam_interpreter::MAX_X_REGS + 100; i++) {
+	args += (i == 0 ? "g(" : ", g(") + boost::lexical_cast<std::string>(i) + ")";
+    }
+    std::string big = "big(f(" + args + "))";
+    assert(compile_error(big + "."));
+
+    // More arguments than A registers
+    args.clear();
+    for (size_t i = 0; i < interpreter_base::MAX_A_REGS + 10; i++) {
+	args += (i == 0 ? "a" : ", a");
+    }
+    assert(compile_error("wide(" + args + ")."));
+
+    assert(!compile_error("small(f(g(1), g(2)), a)."));
+
+    // A promotion that fails leaves the predicate interpreted
+    interpreter interp;
+    interp.load_program(interp.parse("[" + big + "]."));
+    interp.set_tier_threshold(2);
+    term qr = interp.parse("big(_), big(_), big(F), functor(F, f, " + boost::lexical_cast<std::string>(wam_interpreter::MAX_X_REGS + 100) + ").");
+    bool ok = interp.execute(qr);
+    assert(ok);
+    assert(!interp.is_compiled(interp.empty_list(), con_cell("big", 1)));
+}
+
+static void test_register_limits()
+{
+    header("test_register_limits");
+
+    test_wam_compiler test;
+    test.test_register_limits();
+}
+
+// Once the last choice point is cut there is nothing to go back to,
+// so the bindings made after that must not pile up on the trail.
+static void test_deterministic_trail()
+{
+    header("test_deterministic_trail");
+
+    interpreter interp;
+    interp.load_program(interp.parse(
+        "[(walk([], [])), "
+        " (walk([X|Xs], [Y|Ys]) :- code(X, Y), !, walk(Xs, Ys)), "
+        " (code(X, 1) :- X == a), "
+        " (code(X, 2) :- X == b), "
+        " (list(0, []) :- !), "
+        " (list(N, [a,b|Xs]) :- N1 is N - 1, list(N1, Xs))]."));
+    interp.compile();
+
+    term qr = interp.parse("list(1000, L), walk(L, Ys).");
+    bool ok = interp.execute(qr);
+    assert(ok);
+
+    std::cout << "Trail size: " << interp.trail_size() << "\n";
+    assert(interp.trail_size() < 10);
+}
+
 int main( int argc, char *argv[] )
 {
     test_flatten();
     test_instruction_sequence();
+    test_switch_tables();
     test_partition();
     test_compile();
     test_compile2();
     test_varset();
     test_unsafe_set_unify();
+    test_index();
+    test_register_limits();
+    test_deterministic_trail();
 
     return 0;
 }
@@ -0,0 +1,507 @@
+#include <sstream>
+#include <iomanip>
+#include <cassert>
+#include "wam_aot.hpp"
+#include "../common/fast_hash.hpp"
+
+namespace prologcoin { namespace interp {
+
+namespace {
+
+template<wam_instruction_type I> inline wam_instruction<I> * as(wam_instruction_base *instr)
+{
+    return reinterpret_cast<wam_instruction<I> *>(instr);
+}
+
+// Instructions after get_structure/get_list that have read and write
+// mode variants in wam_native.
+inline bool is_mode_split(wam_instruction_type t)
+{
+    switch (t) {
+    case UNIFY_VARIABLE_A: case UNIFY_VARIABLE_X: case UNIFY_VARIABLE_Y:
+    case UNIFY_VALUE_A: case UNIFY_VALUE_X: case UNIFY_VALUE_Y:
+    case UNIFY_LOCAL_VALUE_X: case UNIFY_VOID: case UNIFY_VARIABLE_X2:
+	return true;
+    default:
+	return false;
+    }
+}
+
+class body_emitter {
+public:
+    body_emitter(std::ostream &out) : out_(out), uses_fail_(false) { }
+
+    void emit(wam_instruction_base *start, size_t size);
+
+private:
+    typedef std::pair<size_t, wam_instruction_base *> located;
+
+    // Falls through to the next instruction
+    inline void seq(const std::string &call)
+    {
+	out_ << "    " << call << ";\n";
+    }
+
+    // Falls through unless it fails (or a built-in transfers control)
+    inline void fall(const std::string &call, size_t next)
+    {
+	out_ << "    " << call << ";\n";
+	if (next == NONE) {
+	    out_ << "    goto dispatch;\n";
+	} else {
+	    out_ << "    if (!n.next_is(" << next << ")) goto dispatch;\n";
+	}
+    }
+
+    // Transfers control
+    inline void branch(const std::string &call)
+    {
+	out_ << "    " << call << ";\n";
+	out_ << "    goto dispatch;\n";
+    }
+
+    template<wam_instruction_type I> inline std::string invoke(size_t offset)
+    {
+	std::stringstream ss;
+	ss << "n.invoke<" << wam_interpreter::instruction_name(I)
+	   << ">(" << offset << ")";
+	return ss.str();
+    }
+
+    template<typename... Args> inline std::string op(const char *name, Args... args)
+    {
+	std::stringstream ss;
+	ss << "n." << name << "(";
+	op_args(ss, args...);
+	ss << ")";
+	return ss.str();
+    }
+
+    inline void op_args(std::stringstream &) { }
+
+    inline void op_args(std::stringstream &ss, size_t arg)
+    {
+	ss << arg;
+    }
+
+    template<typename... Args> inline void op_args(std::stringstream &ss, size_t arg, Args... args)
+    {
+	ss << arg << ", ";
+	op_args(ss, args...);
+    }
+
+    void emit_instruction(size_t offset, wam_instruction_base *instr,
+			  size_t next);
+    void emit_split(const std::vector<located> &run, bool read);
+
+    static const size_t NONE = static_cast<size_t>(-1);
+
+    std::ostream &out_;
+    bool uses_fail_;
+};
+
+void body_emitter::emit(wam_instruction_base *start, size_t size)
+{
+    std::vector<located> instrs;
+    for (size_t offset = 0; offset < size;) {
+	auto *instr = reinterpret_cast<wam_instruction_base *>(
+			 reinterpret_cast<code_t *>(start) + offset);
+	instrs.push_back(located(offset, instr));
+	offset += instr->size();
+    }
+
+    std::vector<size_t> labels;
+
+    out_ << "    wam_native n(interp, entry);\n";
+    out_ << "    goto dispatch;\n";
+
+    for (size_t k = 0; k < instrs.size(); k++) {
+	size_t offset = instrs[k].first;
+	auto *instr = instrs[k].second;
+	size_t next = (k + 1 < instrs.size()) ? instrs[k+1].first
+	                                      : NONE;
+
+	labels.push_back(offset);
+	out_ << "L" << offset << ": // "
+	     << wam_interpreter::instruction_name(instr->type()) << "\n";
+	emit_instruction(offset, instr, next);
+
+	switch (instr->type()) {
+	case GET_STRUCTURE_A: case GET_STRUCTURE_X: case GET_STRUCTURE_Y:
+	case GET_LIST_A: case GET_LIST_X: case GET_LIST_Y: {
+	    // The arguments are emitted for each mode; we can't resume in
+	    // the middle of them (the WAM loop does if needed.)
+	    std::vector<located> run;
+	    size_t r = k + 1;
+	    while (r < instrs.size() && is_mode_split(instrs[r].second->type())) {
+		run.push_back(instrs[r]);
+		r++;
+	    }
+	    if (run.empty() || r == instrs.size()) {
+		break;
+	    }
+	    out_ << "    if (n.is_read()) {\n";
+	    emit_split(run, true);
+	    out_ << "    } else {\n";
+	    emit_split(run, false);
+	    out_ << "    }\n";
+	    out_ << "    n.at(" << instrs[r].first << ");\n";
+	    k = r - 1;
+	    break;
+	    }
+	default:
+	    break;
+	}
+    }
+
+    out_ << "dispatch:\n";
+    out_ << "    switch (n.resume()) {\n";
+    for (auto offset : labels) {
+	out_ << "    case " << offset << ": goto L" << offset << ";\n";
+    }
+    out_ << "    default: return;\n";
+    out_ << "    }\n";
+    if (uses_fail_) {
+	out_ << "fail:\n";
+	out_ << "    n.backtrack();\n";
+	out_ << "    goto dispatch;\n";
+    }
+}
+
+void body_emitter::emit_split(const std::vector<located> &run, bool read)
+{
+    const char *sfx = read ? "_read" : "_write";
+    for (auto &e : run) {
+	auto *instr = e.second;
+	std::string call;
+	bool may_fail = false;
+	switch (instr->type()) {
+	case UNIFY_VARIABLE_A:
+	    call = op((std::string("unify_variable_a") + sfx).c_str(),
+		      as<UNIFY_VARIABLE_A>(instr)->ai());
+	    break;
+	case UNIFY_VARIABLE_X:
+	    call = op((std::string("unify_variable_x") + sfx).c_str(),
+		      as<UNIFY_VARIABLE_X>(instr)->xn());
+	    break;
+	case UNIFY_VARIABLE_Y:
+	    call = op((std::string("unify_variable_y") + sfx).c_str(),
+		      as<UNIFY_VARIABLE_Y>(instr)->yn());
+	    break;
+	case UNIFY_VALUE_A:
+	    call = op((std::string("unify_value_a") + sfx).c_str(),
+		      as<UNIFY_VALUE_A>(instr)->ai());
+	    may_fail = read;
+	    break;
+	case UNIFY_VALUE_X:
+	    call = op((std::string("unify_value_x") + sfx).c_str(),
+		      as<UNIFY_VALUE_X>(instr)->xn());
+	    may_fail = read;
+	    break;
+	case UNIFY_VALUE_Y:
+	    call = op((std::string("unify_value_y") + sfx).c_str(),
+		      as<UNIFY_VALUE_Y>(instr)->yn());
+	    may_fail = read;
+	    break;
+	case UNIFY_LOCAL_VALUE_X:
+	    call = op((std::string("unify_local_value_x") + sfx).c_str(),
+		      as<UNIFY_LOCAL_VALUE_X>(instr)->xn());
+	    may_fail = read;
+	    break;
+	case UNIFY_VOID:
+	    call = op((std::string("unify_void") + sfx).c_str(),
+		      as<UNIFY_VOID>(instr)->n());
+	    break;
+	case UNIFY_VARIABLE_X2:
+	    call = op((std::string("unify_variable_x2") + sfx).c_str(),
+		      as<UNIFY_VARIABLE_X2>(instr)->xn1(),
+		      as<UNIFY_VARIABLE_X2>(instr)->xn2());
+	    break;
+	default:
+	    assert(false);
+	    break;
+	}
+	if (may_fail) {
+	    out_ << "\tif (!" << call << ") goto fail;\n";
+	    uses_fail_ = true;
+	} else {
+	    out_ << "\t" << call << ";\n";
+	}
+    }
+}
+
+void body_emitter::emit_instruction(size_t offset, wam_instruction_base *instr,
+				    size_t next)
+{
+    switch (instr->type()) {
+    case PUT_VARIABLE_X:
+	seq(op("put_variable_x", as<PUT_VARIABLE_X>(instr)->xn(),
+	                         as<PUT_VARIABLE_X>(instr)->ai()));
+	break;
+    case PUT_VARIABLE_Y:
+	seq(op("put_variable_y", as<PUT_VARIABLE_Y>(instr)->yn(),
+	                         as<PUT_VARIABLE_Y>(instr)->ai()));
+	break;
+    case PUT_VALUE_X:
+	seq(op("put_value_x", as<PUT_VALUE_X>(instr)->xn(),
+	                      as<PUT_VALUE_X>(instr)->ai()));
+	break;
+    case PUT_VALUE_Y:
+	seq(op("put_value_y", as<PUT_VALUE_Y>(instr)->yn(),
+	                      as<PUT_VALUE_Y>(instr)->ai()));
+	break;
+    case PUT_UNSAFE_VALUE_Y:
+	seq(op("put_unsafe_value_y", as<PUT_UNSAFE_VALUE_Y>(instr)->yn(),
+	                             as<PUT_UNSAFE_VALUE_Y>(instr)->ai()));
+	break;
+    case PUT_STRUCTURE_A: seq(invoke<PUT_STRUCTURE_A>(offset)); break;
+    case PUT_STRUCTURE_X: seq(invoke<PUT_STRUCTURE_X>(offset)); break;
+    case PUT_STRUCTURE_Y: seq(invoke<PUT_STRUCTURE_Y>(offset)); break;
+    case PUT_LIST_A: seq(op("put_list_a", as<PUT_LIST_A>(instr)->ai())); break;
+    case PUT_LIST_X: seq(op("put_list_x", as<PUT_LIST_X>(instr)->xn())); break;
+    case PUT_LIST_Y: seq(op("put_list_y", as<PUT_LIST_Y>(instr)->yn())); break;
+    case PUT_CONSTANT: seq(invoke<PUT_CONSTANT>(offset)); break;
+
+    case GET_VARIABLE_X:
+	seq(op("get_variable_x", as<GET_VARIABLE_X>(instr)->xn(),
+	                         as<GET_VARIABLE_X>(instr)->ai()));
+	break;
+    case GET_VARIABLE_Y:
+	seq(op("get_variable_y", as<GET_VARIABLE_Y>(instr)->yn(),
+	                         as<GET_VARIABLE_Y>(instr)->ai()));
+	break;
+    case GET_VALUE_X:
+	fall(op("get_value_x", as<GET_VALUE_X>(instr)->xn(),
+	                       as<GET_VALUE_X>(instr)->ai()), next);
+	break;
+    case GET_VALUE_Y:
+	fall(op("get_value_y", as<GET_VALUE_Y>(instr)->yn(),
+	                       as<GET_VALUE_Y>(instr)->ai()), next);
+	break;
+    case GET_STRUCTURE_A: fall(invoke<GET_STRUCTURE_A>(offset), next); break;
+    case GET_STRUCTURE_X: fall(invoke<GET_STRUCTURE_X>(offset), next); break;
+    case GET_STRUCTURE_Y: fall(invoke<GET_STRUCTURE_Y>(offset), next); break;
+    case GET_LIST_A: fall(op("get_list_a", as<GET_LIST_A>(instr)->ai()), next); break;
+    case GET_LIST_X: fall(op("get_list_x", as<GET_LIST_X>(instr)->xn()), next); break;
+    case GET_LIST_Y: fall(op("get_list_y", as<GET_LIST_Y>(instr)->yn()), next); break;
+    case GET_CONSTANT: fall(invoke<GET_CONSTANT>(offset), next); break;
+
+    case SET_VARIABLE_A: seq(op("set_variable_a", as<SET_VARIABLE_A>(instr)->ai())); break;
+    case SET_VARIABLE_X: seq(op("set_variable_x", as<SET_VARIABLE_X>(instr)->xn())); break;
+    case SET_VARIABLE_Y: seq(op("set_variable_y", as<SET_VARIABLE_Y>(instr)->yn())); break;
+    case SET_VALUE_A: seq(op("set_value_a", as<SET_VALUE_A>(instr)->ai())); break;
+    case SET_VALUE_X: seq(op("set_value_x", as<SET_VALUE_X>(instr)->xn())); break;
+    case SET_VALUE_Y: seq(op("set_value_y", as<SET_VALUE_Y>(instr)->yn())); break;
+    case SET_LOCAL_VALUE_X:
+	seq(op("set_local_value_x", as<SET_LOCAL_VALUE_X>(instr)->xn()));
+	break;
+    case SET_LOCAL_VALUE_Y:
+	seq(op("set_local_value_y", as<SET_LOCAL_VALUE_Y>(instr)->yn()));
+	break;
+    case SET_CONSTANT: seq(invoke<SET_CONSTANT>(offset)); break;
+    case SET_VOID: seq(op("set_void", as<SET_VOID>(instr)->n())); break;
+
+    case UNIFY_VARIABLE_A:
+	seq(op("unify_variable_a", as<UNIFY_VARIABLE_A>(instr)->ai()));
+	break;
+    case UNIFY_VARIABLE_X:
+	seq(op("unify_variable_x", as<UNIFY_VARIABLE_X>(instr)->xn()));
+	break;
+    case UNIFY_VARIABLE_Y:
+	seq(op("unify_variable_y", as<UNIFY_VARIABLE_Y>(instr)->yn()));
+	break;
+    case UNIFY_VALUE_A:
+	fall(op("unify_value_a", as<UNIFY_VALUE_A>(instr)->ai()), next);
+	break;
+    case UNIFY_VALUE_X:
+	fall(op("unify_value_x", as<UNIFY_VALUE_X>(instr)->xn()), next);
+	break;
+    case UNIFY_VALUE_Y:
+	fall(op("unify_value_y", as<UNIFY_VALUE_Y>(instr)->yn()), next);
+	break;
+    case UNIFY_LOCAL_VALUE_X:
+	fall(op("unify_local_value_x", as<UNIFY_LOCAL_VALUE_X>(instr)->xn()), next);
+	break;
+    case UNIFY_LOCAL_VALUE_Y:
+	fall(op("unify_local_value_y", as<UNIFY_LOCAL_VALUE_Y>(instr)->yn()), next);
+	break;
+    case UNIFY_CONSTANT: fall(invoke<UNIFY_CONSTANT>(offset), next); break;
+    case UNIFY_VOID: seq(op("unify_void", as<UNIFY_VOID>(instr)->n())); break;
+
+    case ALLOCATE: seq(op("allocate")); break;
+    case DEALLOCATE: seq(op("deallocate")); break;
+    case CALL: branch(invoke<CALL>(offset)); break;
+    case EXECUTE: branch(invoke<EXECUTE>(offset)); break;
+    case PROCEED: branch(op("proceed")); break;
+    case BUILTIN: fall(invoke<BUILTIN>(offset), next); break;
+    case BUILTIN_R: fall(invoke<BUILTIN_R>(offset), next); break;
+
+    case TRY_ME_ELSE: seq(invoke<TRY_ME_ELSE>(offset)); break;
+    case RETRY_ME_ELSE: seq(invoke<RETRY_ME_ELSE>(offset)); break;
+    case TRUST_ME: seq(op("trust_me")); break;
+    case TRY: branch(invoke<TRY>(offset)); break;
+    case RETRY: branch(invoke<RETRY>(offset)); break;
+    case TRUST: branch(invoke<TRUST>(offset)); break;
+
+    case SWITCH_ON_TERM: branch(invoke<SWITCH_ON_TERM>(offset)); break;
+    case SWITCH_ON_CONSTANT: branch(invoke<SWITCH_ON_CONSTANT>(offset)); break;
+    case SWITCH_ON_STRUCTURE: branch(invoke<SWITCH_ON_STRUCTURE>(offset)); break;
+
+    case NECK_CUT: seq(op("neck_cut")); break;
+    case GET_LEVEL: seq(op("get_level", as<GET_LEVEL>(instr)->yn())); break;
+    case CUT: seq(op("cut", as<CUT>(instr)->yn())); break;
+    case GOTO: branch(invoke<GOTO>(offset)); break;
+    case RESET_LEVEL: seq(op("reset_level")); break;
+    case COST: seq(invoke<COST>(offset)); break;
+
+    case PUT_VALUE_X2: {
+	auto *i = as<PUT_VALUE_X2>(instr);
+	seq(op("put_value_x2", i->xn1(), i->ai1(), i->xn2(), i->ai2()));
+	break;
+        }
+    case PUT_VALUE_X_EXECUTE: branch(invoke<PUT_VALUE_X_EXECUTE>(offset)); break;
+    case UNIFY_VARIABLE_X2:
+	seq(op("unify_variable_x2", as<UNIFY_VARIABLE_X2>(instr)->xn1(),
+	                            as<UNIFY_VARIABLE_X2>(instr)->xn2()));
+	break;
+    case ALLOCATE_GET_VARIABLE_Y:
+	seq(op("allocate_get_variable_y", as<ALLOCATE_GET_VARIABLE_Y>(instr)->yn(),
+	                                  as<ALLOCATE_GET_VARIABLE_Y>(instr)->ai()));
+	break;
+
+    case ARITH_LOAD_X:
+	seq(op("arith_load_x", as<ARITH_LOAD_X>(instr)->xn(),
+	                       as<ARITH_LOAD_X>(instr)->rn()));
+	break;
+    case ARITH_LOAD_Y:
+	seq(op("arith_load_y", as<ARITH_LOAD_Y>(instr)->yn(),
+	                       as<ARITH_LOAD_Y>(instr)->rn()));
+	break;
+    case ARITH_LOAD_CONSTANT: seq(invoke<ARITH_LOAD_CONSTANT>(offset)); break;
+    case ARITH_ADD: fall(invoke<ARITH_ADD>(offset), next); break;
+    case ARITH_SUB: fall(invoke<ARITH_SUB>(offset), next); break;
+    case ARITH_MUL: fall(invoke<ARITH_MUL>(offset), next); break;
+    case ARITH_LT: fall(invoke<ARITH_LT>(offset), next); break;
+    case ARITH_LE: fall(invoke<ARITH_LE>(offset), next); break;
+    case ARITH_GT: fall(invoke<ARITH_GT>(offset), next); break;
+    case ARITH_GE: fall(invoke<ARITH_GE>(offset), next); break;
+    case ARITH_EQ: fall(invoke<ARITH_EQ>(offset), next); break;
+    case ARITH_NE: fall(invoke<ARITH_NE>(offset), next); break;
+    case ARITH_GET_VARIABLE_X:
+	seq(op("arith_get_variable_x", as<ARITH_GET_VARIABLE_X>(instr)->xn(),
+	                               as<ARITH_GET_VARIABLE_X>(instr)->rn()));
+	break;
+    case ARITH_GET_VARIABLE_Y:
+	seq(op("arith_get_variable_y", as<ARITH_GET_VARIABLE_Y>(instr)->yn(),
+	                               as<ARITH_GET_VARIABLE_Y>(instr)->rn()));
+	break;
+    case ARITH_GET_VALUE_X:
+	fall(op("arith_get_value_x", as<ARITH_GET_VALUE_X>(instr)->xn(),
+	                             as<ARITH_GET_VALUE_X>(instr)->rn()), next);
+	break;
+    case ARITH_GET_VALUE_Y:
+	fall(op("arith_get_value_y", as<ARITH_GET_VALUE_Y>(instr)->yn(),
+	                             as<ARITH_GET_VALUE_Y>(instr)->rn()), next);
+	break;
+
+    case NATIVE:
+	// Step over the entry
+	if (next == NONE) {
+	    out_ << "    return;\n";
+	} else {
+	    seq(op("at", next));
+	}
+	break;
+
+    default:
+	// Let the WAM loop take it from here
+	out_ << "    return;\n";
+	break;
+    }
+}
+
+}
+
+std::string wam_aot::emit_body(wam_interpreter &interp, const qname &qn)
+{
+    auto *start = interp.predicate_code(qn);
+    if (start == nullptr || start->type() != NATIVE) {
+	return "";
+    }
+    std::stringstream out;
+    body_emitter emitter(out);
+    emitter.emit(start, interp.predicate_code_size(qn));
+    return out.str();
+}
+
+uint64_t wam_aot::fingerprint(const std::string &body)
+{
+    // Four bytes at a time; fast_hash::update(bytes) only keeps the
+    // lower half of every 8 bytes, so bodies that differ in a register
+    // number would collide.
+    common::fast_hash h;
+    for (size_t i = 0; i < body.size(); i += 4) {
+	uint32_t v = 0;
+	for (size_t j = i; j < i + 4 && j < body.size(); j++) {
+	    v = (v << 8) | static_cast<uint8_t>(body[j]);
+	}
+	h.update(v);
+    }
+    return (static_cast<uint64_t>(body.size()) << 32) | static_cast<uint32_t>(h);
+}
+
+bool wam_aot::add(wam_interpreter &interp, const qname &qn)
+{
+    std::string body = emit_body(interp, qn);
+    if (body.empty()) {
+	return false;
+    }
+    uint64_t fp = fingerprint(body);
+    if (fingerprints_.count(fp)) {
+	return false;
+    }
+    fingerprints_.insert(fp);
+
+    std::string name = interp.to_string(qn.second) + "/"
+	+ boost::lexical_cast<std::string>(qn.second.arity());
+    for (auto &ch : name) {
+	if (ch < ' ') ch = ' ';
+    }
+    functions_.push_back(function{name, fp, body});
+    return true;
+}
+
+void wam_aot::emit_unit(std::ostream &out, const std::string &unit) const
+{
+    out << "// Generated by wam_aot. Do not edit.\n";
+    out << "\n";
+    out << "#include \"interp/wam_native.hpp\"\n";
+    out << "\n";
+    out << "namespace prologcoin { namespace interp {\n";
+    out << "\n";
+    out << "namespace aot_" << unit << " {\n";
+    for (size_t i = 0; i < functions_.size(); i++) {
+	auto &f = functions_[i];
+	out << "\n";
+	out << "// " << f.name << "\n";
+	out << "static void f" << i << "(wam_interpreter &interp, wam_instruction_base *entry)\n";
+	out << "{\n";
+	out << f.body;
+	out << "}\n";
+    }
+    out << "\n";
+    out << "}\n";
+    out << "\n";
+    out << "void aot_register_" << unit << "(wam_interpreter &interp)\n";
+    out << "{\n";
+    for (size_t i = 0; i < functions_.size(); i++) {
+	out << "    interp.register_native(0x" << std::hex << std::setw(16)
+	    << std::setfill('0') << functions_[i].fingerprint << std::dec
+	    << "ULL, &aot_" << unit << "::f" << i << ");\n";
+    }
+    out << "}\n";
+    out << "\n";
+    out << "}}\n";
+}
+
+}}
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef _interp_wam_aot_hpp
+#define _interp_wam_aot_hpp
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include "wam_interpreter.hpp"
+
+namespace prologcoin { namespace interp {
+
+//
+// Ahead-of-time compilation of WAM code to C++.
+//
+// Every predicate becomes a C++ function (running on wam_native) with
+// a label per instruction. Register operands are immediates, control
+// stays within the function as long as execution stays within the
+// predicate, and the argument sequences of get_structure/get_list are
+// emitted twice, once for read mode and once for write mode. Cost
+// instructions are kept, so native code is charged as WAM code is.
+//
+// The function does not depend on the constants or call targets of the
+// code (they are read from the loaded code), only on its shape. The
+// function body captures that shape, so its hash is the fingerprint
+// the loader matches against (see wam_interpreter::register_native.)
+// Predicates must be compiled with native code enabled to have the
+// NATIVE entries the functions start from.
+//
+class wam_aot {
+public:
+    wam_aot() { }
+
+    // Body of the native function for a compiled predicate (empty if
+    // it has no NATIVE entries.)
+    static std::string emit_body(wam_interpreter &interp, const qname &qn);
+
+    static uint64_t fingerprint(const std::string &body);
+
+    // Add a predicate to the unit. Returns false if it is not compiled
+    // with NATIVE entries or if a predicate of the same shape has been
+    // added already.
+    bool add(wam_interpreter &interp, const qname &qn);
+
+    inline size_t size() const { return functions_.size(); }
+
+    // A C++ source file with the functions and
+    //    void aot_register_<unit>(wam_interpreter &interp)
+    // that registers them.
+    void emit_unit(std::ostream &out, const std::string &unit) const;
+
+private:
+    struct function {
+	std::string name;    // e.g. append/3 (for reference)
+	uint64_t fingerprint;
+	std::string body;
+    };
+
+    std::vector<function> functions_;
+    std::unordered_set<uint64_t> fingerprints_;
+};
+
+}}
+
+#endif
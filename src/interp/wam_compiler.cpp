@@ -5,6 +5,8 @@
 
 namespace prologcoin { namespace interp {
 
+const size_t wam_compiler::MAX_VARS;
+
 typedef wam_compiler::term term;
 
 // --------------------------------------------------------------
@@ -534,6 +536,9 @@ std::function<size_t ()> wam_compiler::x_getter(wam_instruction_base *instr)
 	case PUT_VALUE_X:
 	case GET_VARIABLE_X:
 	case GET_VALUE_X:
+	case ARITH_LOAD_X:
+	case ARITH_GET_VARIABLE_X:
+	case ARITH_GET_VALUE_X:
 	    return [=]{return reinterpret_cast<wam_instruction_binary_reg *>(instr)->reg_1();};
 	case PUT_STRUCTURE_X:
 	case GET_STRUCTURE_X:
@@ -561,6 +566,9 @@ std::function<void (size_t)> wam_compiler::x_setter(wam_instruction_base *instr)
 	case PUT_VALUE_X:
 	case GET_VARIABLE_X:
 	case GET_VALUE_X:
+	case ARITH_LOAD_X:
+	case ARITH_GET_VARIABLE_X:
+	case ARITH_GET_VALUE_X:
 	    return [=](size_t xn){reinterpret_cast<wam_instruction_binary_reg *>(instr)->set_reg_1(xn);};
 	case PUT_STRUCTURE_X:
 	case GET_STRUCTURE_X:
@@ -588,6 +596,10 @@ std::function<size_t ()> wam_compiler::y_getter(wam_instruction_base *instr)
 	case PUT_VALUE_Y:
 	case GET_VARIABLE_Y:
 	case GET_VALUE_Y:
+	case ALLOCATE_GET_VARIABLE_Y:
+	case ARITH_LOAD_Y:
+	case ARITH_GET_VARIABLE_Y:
+	case ARITH_GET_VALUE_Y:
 	    return [=]{return reinterpret_cast<wam_instruction_binary_reg *>(instr)->reg_1();};
 	case PUT_STRUCTURE_Y:
 	case GET_STRUCTURE_Y:
@@ -615,6 +627,10 @@ std::function<void (size_t)> wam_compiler::y_setter(wam_instruction_base *instr)
 	case PUT_VALUE_Y:
 	case GET_VARIABLE_Y:
 	case GET_VALUE_Y:
+	case ALLOCATE_GET_VARIABLE_Y:
+	case ARITH_LOAD_Y:
+	case ARITH_GET_VARIABLE_Y:
+	case ARITH_GET_VALUE_Y:
 	    return [=](size_t yn){reinterpret_cast<wam_instruction_binary_reg *>(instr)->set_reg_1(yn);};
 	case PUT_STRUCTURE_Y:
 	case GET_STRUCTURE_Y:
@@ -652,6 +668,9 @@ void wam_compiler::change_x_to_y(wam_instruction_base *instr)
         case UNIFY_VARIABLE_X: instr->set_type<UNIFY_VARIABLE_Y>(); break;
         case UNIFY_VALUE_X: instr->set_type<UNIFY_VALUE_Y>(); break;
         case UNIFY_LOCAL_VALUE_X: instr->set_type<UNIFY_LOCAL_VALUE_Y>(); break;
+        case ARITH_LOAD_X: instr->set_type<ARITH_LOAD_Y>(); break;
+        case ARITH_GET_VARIABLE_X: instr->set_type<ARITH_GET_VARIABLE_Y>(); break;
+        case ARITH_GET_VALUE_X: instr->set_type<ARITH_GET_VALUE_Y>(); break;
         case GET_LEVEL:
         case CUT: break;
 	default:
@@ -692,6 +711,11 @@ void wam_compiler::remap_x_registers(wam_interim_code &instrs)
 	}
     }
 
+    if (cnt > wam_interpreter::MAX_X_REGS) {
+	std::string msg = "Number of X registers in clause exceeded the maximum of " + boost::lexical_cast<std::string>(wam_interpreter::MAX_X_REGS);
+	throw wam_exception_too_many_registers(msg);
+    }
+
     for (auto instr : instrs) {
 	if (auto x_set = x_setter(instr)) {
 	    auto x_get = x_getter(instr);
@@ -796,6 +820,11 @@ void wam_compiler::allocate_y_registers(wam_interim_code &instrs)
 	y_cnt++;
     }
 
+    if (y_cnt > MAX_VARS) {
+	std::string msg = "Number of Y registers in clause exceeded the maximum of " + boost::lexical_cast<std::string>(MAX_VARS);
+	throw wam_exception_too_many_registers(msg);
+    }
+
     // Change X to Y instructions and set new register number
     for (auto instr : instrs) {
         if (auto x_get = x_getter(instr)) {
@@ -1270,6 +1299,169 @@ void wam_compiler::compile_builtin(common::con_cell module,
     }
 }
 
+//
+// Arithmetic (is/2 and the comparisons) is compiled into the
+// arithmetic instructions if it's made of integers, +, - and * and
+// variables that have been seen before (so they have a value.) The
+// R registers are used as a stack: an expression is evaluated into
+// rn, with rn+1 and up as temporaries. Anything else is left to the
+// builtin.
+//
+bool wam_compiler::is_arith_compilable(const term expr, size_t rn, size_t depth)
+{
+    static const common::con_cell plus("+", 2);
+    static const common::con_cell minus("-", 2);
+    static const common::con_cell times("*", 2);
+
+    if (rn >= wam_interpreter::MAX_ARITH_REGS ||
+	depth >= wam_interpreter::MAX_ARITH_REGS) {
+	return false;
+    }
+
+    switch (expr.tag()) {
+    case common::tag_t::INT:
+	return true;
+    case common::tag_t::REF:
+	return is_seen_var(expr);
+    case common::tag_t::STR: {
+	auto f = env_.functor(expr);
+	if (f != plus && f != minus && f != times) {
+	    return false;
+	}
+	return is_arith_compilable(env_.arg(expr, 0), rn, depth+1) &&
+	       is_arith_compilable(env_.arg(expr, 1), rn+1, depth+1);
+        }
+    default:
+	return false;
+    }
+}
+
+bool wam_compiler::is_seen_var(const term t)
+{
+    auto it = var_index_.find(t);
+    return it != var_index_.end() && seen_vars_[it->second];
+}
+
+// Integer constant expressions are computed here (unless they
+// overflow; then we leave the error to the run.)
+bool wam_compiler::fold_arith(const term expr, int64_t &v)
+{
+    static const common::con_cell plus("+", 2);
+    static const common::con_cell minus("-", 2);
+
+    if (expr.tag() == common::tag_t::INT) {
+	term t = expr;
+	v = static_cast<common::int_cell &>(t).value();
+	return true;
+    }
+    if (expr.tag() != common::tag_t::STR) {
+	return false;
+    }
+    int64_t v1, v2;
+    if (!fold_arith(env_.arg(expr, 0), v1) ||
+	!fold_arith(env_.arg(expr, 1), v2)) {
+	return false;
+    }
+    auto f = env_.functor(expr);
+    if (f == plus) {
+	v = v1 + v2;
+    } else if (f == minus) {
+	v = v1 - v2;
+    } else if (__builtin_mul_overflow(v1, v2, &v)) {
+	return false;
+    }
+    return common::int_cell::fits(v);
+}
+
+void wam_compiler::compile_arith_expr(const term expr, common::con_cell ctx,
+				      size_t rn, wam_interim_code &seq)
+{
+    static const common::con_cell plus("+", 2);
+    static const common::con_cell minus("-", 2);
+
+    int64_t v;
+    if (fold_arith(expr, v)) {
+	seq.push_back(wam_instruction<ARITH_LOAD_CONSTANT>(
+			  common::int_cell(v), rn));
+	return;
+    }
+
+    if (expr.tag() == common::tag_t::REF) {
+	term t = expr;
+	reg r;
+	std::tie(r, std::ignore) = allocate_reg<X_REG>(
+				       static_cast<common::ref_cell &>(t));
+	seq.push_back(wam_instruction<ARITH_LOAD_X>(r.num, rn));
+	return;
+    }
+
+    compile_arith_expr(env_.arg(expr, 0), ctx, rn, seq);
+    compile_arith_expr(env_.arg(expr, 1), ctx, rn+1, seq);
+    auto f = env_.functor(expr);
+    if (f == plus) {
+	seq.push_back(wam_instruction<ARITH_ADD>(ctx, rn));
+    } else if (f == minus) {
+	seq.push_back(wam_instruction<ARITH_SUB>(ctx, rn));
+    } else {
+	seq.push_back(wam_instruction<ARITH_MUL>(ctx, rn));
+    }
+}
+
+bool wam_compiler::compile_arith(const term goal, common::con_cell f,
+				 builtin_fn fn, wam_interim_code &seq)
+{
+    const term lhs = env_.arg(goal, 0);
+    const term rhs = env_.arg(goal, 1);
+
+    if (fn == &builtins::is_2) {
+	// X is Y is left to is/2 (it must evaluate whatever Y is.)
+	if (lhs.tag() != common::tag_t::REF ||
+	    rhs.tag() == common::tag_t::REF ||
+	    !is_arith_compilable(rhs, 0, 0)) {
+	    return false;
+	}
+	compile_arith_expr(rhs, f, 0, seq);
+	term t = lhs;
+	reg r;
+	std::tie(r, std::ignore) = allocate_reg<X_REG>(
+				 static_cast<common::ref_cell &>(t));
+	if (!is_seen_var(lhs)) {
+	    seq.push_back(wam_instruction<ARITH_GET_VARIABLE_X>(r.num, 0));
+	} else {
+	    seq.push_back(wam_instruction<ARITH_GET_VALUE_X>(r.num, 0));
+	}
+	return true;
+    }
+
+    if (fn != &builtins::operator_less_than &&
+	fn != &builtins::operator_equals_less_than &&
+	fn != &builtins::operator_greater_than &&
+	fn != &builtins::operator_greater_than_equals &&
+	fn != &builtins::operator_arith_equals &&
+	fn != &builtins::operator_arith_not_equals) {
+	return false;
+    }
+    if (!is_arith_compilable(lhs, 0, 0) || !is_arith_compilable(rhs, 1, 0)) {
+	return false;
+    }
+    compile_arith_expr(lhs, f, 0, seq);
+    compile_arith_expr(rhs, f, 1, seq);
+    if (fn == &builtins::operator_less_than) {
+	seq.push_back(wam_instruction<ARITH_LT>(f, 0));
+    } else if (fn == &builtins::operator_equals_less_than) {
+	seq.push_back(wam_instruction<ARITH_LE>(f, 0));
+    } else if (fn == &builtins::operator_greater_than) {
+	seq.push_back(wam_instruction<ARITH_GT>(f, 0));
+    } else if (fn == &builtins::operator_greater_than_equals) {
+	seq.push_back(wam_instruction<ARITH_GE>(f, 0));
+    } else if (fn == &builtins::operator_arith_equals) {
+	seq.push_back(wam_instruction<ARITH_EQ>(f, 0));
+    } else {
+	seq.push_back(wam_instruction<ARITH_NE>(f, 0));
+    }
+    return true;
+}
+
 bool wam_compiler::is_if_then_else(const term goal)
 {
     static const common::con_cell bn_impl = common::con_cell("->",2);
@@ -1353,6 +1545,7 @@ void wam_compiler::compile_if_then_else(const term goal, wam_interim_code &seq)
     seq.push_back(wam_interim_instruction<INTERIM_LABEL>(to_merge_0));
     seq.push_back(wam_instruction<GET_LEVEL>(static_cast<uint32_t>(lvl)));
     compile_goal(goal_a, false, seq);
+    seen_vars_ |= varsets_[goal_a];
 
     seq.push_back(wam_instruction<CUT>(static_cast<uint32_t>(lvl)));
     compile_goal(goal_b, false, seq);
@@ -1464,6 +1657,10 @@ void wam_compiler::compile_goal(const term goal, bool first_goal,
 	f = env_.functor(env_.arg(goal, 1));
     }
     bool isbn = is_builtin(module, f);
+    if (isbn && f.arity() == 2 && env_.functor(goal) != colon &&
+	compile_arith(goal, f, get_builtin(module, f).fn(), seq)) {
+	return;
+    }
     compile_query_or_program(goal, COMPILE_QUERY, seq);
     if (isbn) {
 	compile_builtin(module, f, first_goal, seq);
@@ -1492,6 +1689,7 @@ void wam_compiler::peephole_opt_execute(wam_interim_code &seq)
 	    // Memorize CALL and extract predicate (saved as 'f')
 	    wam_instruction<CALL> *call_instr
 	       = reinterpret_cast<wam_instruction<CALL> *>(*it_0);
+	    common::con_cell module = call_instr->p().module();
 	    common::con_cell f = call_instr->pn();
 	    delete *it_0;
 	    delete *it_1;
@@ -1502,12 +1700,13 @@ void wam_compiler::peephole_opt_execute(wam_interim_code &seq)
 
 	    // Add these new ones
 	    it = seq.insert_after(it, wam_instruction<DEALLOCATE>());
-	    it = seq.insert_after(it, wam_instruction<EXECUTE>(f));
+	    it = seq.insert_after(it, wam_instruction<EXECUTE>(module, f));
 	} else if (seq.is_at_type(it_0,CALL) &&
     	           seq.is_at_type(it_1,PROCEED)) {
 	    // Memorize CALL and extract predicate (saved as 'f')
 	    wam_instruction<CALL> *call_instr
 	       = reinterpret_cast<wam_instruction<CALL> *>(*it_0);
+	    common::con_cell module = call_instr->p().module();
 	    common::con_cell f = call_instr->pn();
 	    delete *it_0;
 	    delete *it_1;
@@ -1516,7 +1715,71 @@ void wam_compiler::peephole_opt_execute(wam_interim_code &seq)
 	    seq.erase_after(it, it_2);
 
 	    // Add these new ones
-	    it = seq.insert_after(it, wam_instruction<EXECUTE>(f));
+	    it = seq.insert_after(it, wam_instruction<EXECUTE>(module, f));
+	} else {
+	    ++it;
+	}
+    }
+}
+
+void wam_compiler::peephole_opt_fuse(wam_interim_code &seq)
+{
+    // Fuse frequent instruction sequences into superinstructions.
+    // These are the hottest pairs reported by
+    // wam_interpreter::print_wam_profile() on list recursions.
+    //
+    // PUT_VALUE_X + PUT_VALUE_X => PUT_VALUE_X2
+    // PUT_VALUE_X + EXECUTE => PUT_VALUE_X_EXECUTE
+    // UNIFY_VARIABLE_X + UNIFY_VARIABLE_X => UNIFY_VARIABLE_X2
+    // ALLOCATE + GET_VARIABLE_Y => ALLOCATE_GET_VARIABLE_Y
+    //
+    // Labels are instructions too, so we never fuse across a jump
+    // target.
+
+    auto it = seq.begin();
+
+    while (it != seq.end()) {
+	auto it_0 = it; ++it_0;
+	auto it_1 = it_0; if (it_1 != seq.end()) ++it_1;
+	auto it_2 = it_1; if (it_2 != seq.end()) ++it_2;
+
+	if (seq.is_at_type(it_0,PUT_VALUE_X) &&
+	    seq.is_at_type(it_1,PUT_VALUE_X)) {
+	    auto *pv1 = reinterpret_cast<wam_instruction<PUT_VALUE_X> *>(*it_0);
+	    auto *pv2 = reinterpret_cast<wam_instruction<PUT_VALUE_X> *>(*it_1);
+	    const wam_instruction<PUT_VALUE_X2> fused(pv1->xn(), pv1->ai(),
+						      pv2->xn(), pv2->ai());
+	    delete *it_0;
+	    delete *it_1;
+	    seq.erase_after(it, it_2);
+	    it = seq.insert_after(it, fused);
+	} else if (seq.is_at_type(it_0,PUT_VALUE_X) &&
+		   seq.is_at_type(it_1,EXECUTE)) {
+	    auto *pv = reinterpret_cast<wam_instruction<PUT_VALUE_X> *>(*it_0);
+	    auto *ex = reinterpret_cast<wam_instruction<EXECUTE> *>(*it_1);
+	    const wam_instruction<PUT_VALUE_X_EXECUTE> fused(pv->xn(), pv->ai(),
+							     ex->p());
+	    delete *it_0;
+	    delete *it_1;
+	    seq.erase_after(it, it_2);
+	    it = seq.insert_after(it, fused);
+	} else if (seq.is_at_type(it_0,UNIFY_VARIABLE_X) &&
+		   seq.is_at_type(it_1,UNIFY_VARIABLE_X)) {
+	    auto *uv1 = reinterpret_cast<wam_instruction<UNIFY_VARIABLE_X> *>(*it_0);
+	    auto *uv2 = reinterpret_cast<wam_instruction<UNIFY_VARIABLE_X> *>(*it_1);
+	    const wam_instruction<UNIFY_VARIABLE_X2> fused(uv1->xn(), uv2->xn());
+	    delete *it_0;
+	    delete *it_1;
+	    seq.erase_after(it, it_2);
+	    it = seq.insert_after(it, fused);
+	} else if (seq.is_at_type(it_0,ALLOCATE) &&
+		   seq.is_at_type(it_1,GET_VARIABLE_Y)) {
+	    auto *gv = reinterpret_cast<wam_instruction<GET_VARIABLE_Y> *>(*it_1);
+	    const wam_instruction<ALLOCATE_GET_VARIABLE_Y> fused(gv->yn(), gv->ai());
+	    delete *it_0;
+	    delete *it_1;
+	    seq.erase_after(it, it_2);
+	    it = seq.insert_after(it, fused);
 	} else {
 	    ++it;
 	}
@@ -1765,6 +2028,8 @@ void wam_compiler::compile_clause(const managed_clause &m_clause,
     remap_to_unsafe_y_registers(seq);
     fix_unsafe_set_unify(seq);
     eliminate_interim_but_labels(seq);
+
+    peephole_opt_fuse(seq);
 }
 
 void wam_compiler::emit_cp(std::vector<common::int_cell> &labels, size_t index, size_t n, wam_interim_code &instrs)
@@ -1803,52 +2068,68 @@ std::vector<common::int_cell> wam_compiler::new_labels_dup(size_t n)
 }
 
 std::vector<size_t> wam_compiler::find_clauses_on_cat(
-      const managed_clauses &m_clauses, wam_compiler::first_arg_cat_t cat)
+      const managed_clauses &m_clauses,
+      const std::vector<size_t> &clause_indices,
+      wam_compiler::index_pos pos,
+      wam_compiler::first_arg_cat_t cat)
 {
     std::vector<size_t> found;
-    size_t index = 0;
-    for (auto &m_clause : m_clauses) {
-        if (first_arg_cat(m_clause.clause()) == cat) {
+    for (auto index : clause_indices) {
+        if (index_cat(m_clauses[index].clause(), pos) == cat) {
 	    found.push_back(index);
         }
-	index++;
     }
     return found;
 }
 
 void wam_compiler::emit_switch_on_term(const managed_clauses &subsection,
 	       const std::vector<common::int_cell> &labels,
+	       const std::vector<size_t> &clause_indices,
+	       wam_compiler::index_pos pos,
+	       code_point on_var_cp,
 	       wam_interim_code &instrs)
 {
-    auto on_var_cp = code_point(labels[0]);
-
-    auto on_con = find_clauses_on_cat(subsection, FIRST_CON);
+    auto on_con = find_clauses_on_cat(subsection, clause_indices, pos, FIRST_CON);
     auto on_con_cp = on_con.empty() ? code_point::fail() 
 	           : (on_con.size() == 1) ? code_point(labels[2*on_con[0]+1])
 	           : new_label();
 
-    auto on_lst = find_clauses_on_cat(subsection, FIRST_LST);
+    auto on_lst = find_clauses_on_cat(subsection, clause_indices, pos, FIRST_LST);
     auto on_lst_cp = on_lst.empty() ? code_point::fail() 
 	           : (on_lst.size() == 1) ? code_point(labels[2*on_lst[0]+1])
 	           : new_label();
 
-    auto on_str = find_clauses_on_cat(subsection, FIRST_STR);
+    auto on_str = find_clauses_on_cat(subsection, clause_indices, pos, FIRST_STR);
     auto on_str_cp = on_str.empty() ? code_point::fail() 
 	           : (on_str.size() == 1) ? code_point(labels[2*on_str[0]+1])
 	           : new_label();
 
-    instrs.push_back(wam_instruction<SWITCH_ON_TERM>(on_var_cp, on_con_cp, on_lst_cp, on_str_cp));
+    instrs.push_back(wam_instruction<SWITCH_ON_TERM>(on_var_cp, on_con_cp, on_lst_cp, on_str_cp, pos.arg, pos.sub));
 
-    emit_second_level_indexing(FIRST_CON,subsection,labels,on_con,on_con_cp,instrs);
-    emit_second_level_indexing(FIRST_LST,subsection,labels,on_lst,on_lst_cp,instrs);
-    emit_second_level_indexing(FIRST_STR,subsection,labels,on_str,on_str_cp,instrs);
+    emit_second_level_indexing(FIRST_CON,subsection,labels,on_con,on_con_cp,pos,instrs);
+    emit_second_level_indexing(FIRST_LST,subsection,labels,on_lst,on_lst_cp,pos,instrs);
+    emit_second_level_indexing(FIRST_STR,subsection,labels,on_str,on_str_cp,pos,instrs);
 }
 
 void wam_compiler::emit_third_level_indexing(
+	     const managed_clauses &subsection,
 	     const std::vector<size_t> &clause_indices,
 	     const std::vector<common::int_cell> &labels,
+	     wam_compiler::index_pos pos,
 	     wam_interim_code &instrs)
 {
+    // These clauses agree on pos. If some other argument (or an
+    // argument of the structure at pos) tells them apart, then
+    // switch on that first. The try chain below is then only
+    // used if that term is unbound.
+    index_pos refined;
+    if (select_refinement(subsection, clause_indices, pos, refined)) {
+	auto on_var = new_label();
+	emit_switch_on_term(subsection, labels, clause_indices, refined,
+			    code_point(on_var), instrs);
+	instrs.push_back(wam_interim_instruction<INTERIM_LABEL>(on_var));
+    }
+
     size_t n = clause_indices.size();
     for (size_t i = 0; i < n; i++) {
 	auto ci = clause_indices[i];
@@ -1864,6 +2145,7 @@ void wam_compiler::emit_second_level_indexing(
 	      const std::vector<common::int_cell> &labels,
 	      const std::vector<size_t> &clause_indices,
 	      code_point cp,
+	      wam_compiler::index_pos pos,
 	      wam_interim_code &instrs)
 {
     if (clause_indices.size() < 2) {
@@ -1873,17 +2155,19 @@ void wam_compiler::emit_second_level_indexing(
     const common::int_cell &ic = static_cast<const common::int_cell &>(cp.term_code());
     instrs.push_back(wam_interim_instruction<INTERIM_LABEL>(ic));
 
-    auto *map = interp_.new_hash_map();
+    // Keys in the order of the clauses
+    wam_switch_entries entries;
+    std::unordered_map<term, size_t> entry_index;
     std::vector<term> for_third_arg;
     std::vector<std::vector<size_t> > for_third_indices;
     for (auto clause_index : clause_indices) {
 	common::int_cell new_lbl(0);
 	auto &m_clause = subsection[clause_index];
 
-	auto arg0 = first_arg(m_clause.clause());
+	auto arg0 = index_term(m_clause.clause(), pos);
 
 	// Already managed?
-	if (map->count(arg0)) {
+	if (entry_index.count(arg0)) {
 	    continue;
 	}
 
@@ -1891,45 +2175,56 @@ void wam_compiler::emit_second_level_indexing(
 	std::vector<size_t> same_arg0;
 	for (auto ci : clause_indices) {
 	    auto &other_m_clause = subsection[ci];
-	    auto other_arg0 = first_arg(other_m_clause.clause());
+	    auto other_arg0 = index_term(other_m_clause.clause(), pos);
 	    if (arg0 == other_arg0) {
 		same_arg0.push_back(ci);
 	    }
 	}
+	entry_index[arg0] = entries.size();
 	if (same_arg0.size() == 1) {
 	    // Unique? Then direct jump
-	    map->insert(std::make_pair(arg0, code_point(labels[2*same_arg0[0]+1])));
+	    entries.push_back(std::make_pair(arg0, code_point(labels[2*same_arg0[0]+1])));
 	} else {
 	    // Multiple, so create third level indexing
 	    new_lbl = new_label();
-	    map->insert(std::make_pair(arg0, code_point(new_lbl)));
+	    entries.push_back(std::make_pair(arg0, code_point(new_lbl)));
 	    for_third_arg.push_back(arg0);
 	    for_third_indices.push_back(same_arg0);
 	}
     }
+
+    // The switch instruction picks a table layout from the number of
+    // keys and how they are distributed.
+    std::vector<code_t> buf;
     switch (cat) {
-    case FIRST_CON: instrs.push_back(wam_instruction<SWITCH_ON_CONSTANT>(map)); break;
-    case FIRST_STR: instrs.push_back(wam_instruction<SWITCH_ON_STRUCTURE>(map)); break;
+    case FIRST_CON: instrs.push_back(wam_instruction<SWITCH_ON_CONSTANT>::make(entries, buf, pos.arg, pos.sub)); break;
+    case FIRST_STR: instrs.push_back(wam_instruction<SWITCH_ON_STRUCTURE>::make(entries, buf, pos.arg, pos.sub)); break;
     default: break;
     }
     size_t n = for_third_arg.size();
     for (size_t i = 0; i < n; i++) {
 	auto arg = for_third_arg[i];
 	auto &clause_indices = for_third_indices[i];
-	auto &cp = (*map)[arg];
+	auto &cp = entries[entry_index[arg]].second;
 	const common::int_cell &lbl = static_cast<const common::int_cell &>(cp.term_code());
 	instrs.push_back(wam_interim_instruction<INTERIM_LABEL>(lbl));
-	emit_third_level_indexing(clause_indices, labels, instrs);
+	emit_third_level_indexing(subsection, clause_indices, labels, pos, instrs);
     }
 }
 
 void wam_compiler::compile_subsection(const managed_clauses &subsection,
+				      size_t index_arg,
 				      wam_interim_code &instrs)
 {
     auto n = subsection.size();
     if (n > 1) {
         std::vector<common::int_cell> labels = new_labels(2*n);
-	emit_switch_on_term(subsection, labels, instrs);
+	std::vector<size_t> all(n);
+	for (size_t i = 0; i < n; i++) {
+	    all[i] = i;
+	}
+	emit_switch_on_term(subsection, labels, all, index_pos(index_arg),
+			    code_point(labels[0]), instrs);
 	for (size_t i = 0; i < n; i++) {
 	    emit_cp(labels, i, n, instrs);
 	    auto &m_clause = subsection[i];
@@ -1953,16 +2248,17 @@ void wam_compiler::compile_predicate(const qname &qn, wam_interim_code &instrs)
 	return;
     }
 
-    auto sections = partition_clauses_nonvar(clauses);
+    size_t index_arg = select_index_arg(clauses);
+    auto sections = partition_clauses_nonvar(clauses, index_arg);
     auto n = sections.size();
     if (n > 1) {
         std::vector<common::int_cell> labels = new_labels_dup(n);
 	for (size_t i = 0; i < n; i++) {
 	    emit_cp(labels, i, n, instrs);
-	    compile_subsection(sections[i], instrs);
+	    compile_subsection(sections[i], index_arg, instrs);
 	}
     } else {
-        compile_subsection(sections[0], instrs);
+        compile_subsection(sections[0], index_arg, instrs);
     }
 }
 
@@ -2032,7 +2328,15 @@ std::vector<managed_clauses> wam_compiler::partition_clauses(
 
 term wam_compiler::first_arg(const term clause)
 {
-    auto arg = env_.arg(clause_head(clause), 0);
+    return index_term(clause, index_pos());
+}
+
+term wam_compiler::index_term(const term clause, wam_compiler::index_pos pos)
+{
+    auto arg = env_.arg(clause_head(clause), pos.arg);
+    if (pos.sub != 0) {
+	arg = env_.arg(arg, pos.sub - 1);
+    }
     switch (arg.tag()) {
     case common::tag_t::REF: return arg;
     case common::tag_t::CON: return arg;
@@ -2045,7 +2349,13 @@ term wam_compiler::first_arg(const term clause)
 
 wam_compiler::first_arg_cat_t wam_compiler::first_arg_cat(const term cl)
 {
-    term arg = first_arg(cl);
+    return index_cat(cl, index_pos());
+}
+
+wam_compiler::first_arg_cat_t wam_compiler::index_cat(const term cl,
+						      wam_compiler::index_pos pos)
+{
+    term arg = index_term(cl, pos);
 
     if (interp_.is_dotted_pair(arg)) {
 	return FIRST_LST;
@@ -2061,6 +2371,99 @@ wam_compiler::first_arg_cat_t wam_compiler::first_arg_cat(const term cl)
     return FIRST_VAR;
 }
 
+size_t wam_compiler::count_index_keys(const managed_clauses &clauses,
+				      const std::vector<size_t> &clause_indices,
+				      wam_compiler::index_pos pos,
+				      size_t &num_vars)
+{
+    std::unordered_set<term> keys;
+    num_vars = 0;
+    for (auto ci : clause_indices) {
+	auto key = index_term(clauses[ci].clause(), pos);
+	if (key.tag() == common::tag_t::REF) {
+	    num_vars++;
+	} else {
+	    keys.insert(key);
+	}
+    }
+    return keys.size();
+}
+
+size_t wam_compiler::select_index_arg(const managed_clauses &clauses)
+{
+    auto f = env_.functor(clause_head(clauses[0].clause()));
+    std::vector<size_t> all(clauses.size());
+    for (size_t i = 0; i < all.size(); i++) {
+	all[i] = i;
+    }
+
+    // Stick to the first argument unless it is a poor choice (as
+    // programs are usually written with first argument indexing in
+    // mind.) Clauses with a variable at the index argument split the
+    // predicate into sections, so they count against it.
+    size_t best = 0;
+    long best_score = 0;
+    for (size_t i = 0; i < f.arity(); i++) {
+	size_t num_vars = 0;
+	size_t num_keys = count_index_keys(clauses, all, index_pos(i),
+					   num_vars);
+	if (i == 0) {
+	    if (num_keys >= 2 && num_vars == 0) {
+		return 0;
+	    }
+	    best_score = static_cast<long>(num_keys) - static_cast<long>(num_vars);
+	    continue;
+	}
+	long score = static_cast<long>(num_keys) - static_cast<long>(num_vars);
+	if (num_keys >= 2 && score > best_score) {
+	    best = i;
+	    best_score = score;
+	}
+    }
+    return best;
+}
+
+bool wam_compiler::select_refinement(const managed_clauses &clauses,
+				     const std::vector<size_t> &clause_indices,
+				     wam_compiler::index_pos pos,
+				     wam_compiler::index_pos &refined)
+{
+    auto f = env_.functor(clause_head(clauses[clause_indices[0]].clause()));
+
+    // Candidates are the other arguments and the arguments of the
+    // structure at pos.arg (all clauses here agree on its functor, and
+    // we only get here if the call does too.) Only positions where all
+    // clauses have a non-variable qualify.
+    std::vector<index_pos> candidates;
+    for (size_t i = 0; i < f.arity(); i++) {
+	if (i != pos.arg) {
+	    candidates.push_back(index_pos(i));
+	}
+    }
+    auto first = clauses[clause_indices[0]].clause();
+    auto cat = index_cat(first, index_pos(pos.arg));
+    if (cat == FIRST_STR || cat == FIRST_LST) {
+	auto key = index_term(first, index_pos(pos.arg));
+	auto sf = static_cast<const common::con_cell &>(key);
+	for (size_t j = 1; j <= sf.arity(); j++) {
+	    if (j != pos.sub) {
+		candidates.push_back(index_pos(pos.arg, j));
+	    }
+	}
+    }
+
+    size_t best_keys = 1;
+    for (auto &c : candidates) {
+	size_t num_vars = 0;
+	size_t num_keys = count_index_keys(clauses, clause_indices, c, num_vars);
+	if (num_vars == 0 && num_keys > best_keys) {
+	    refined = c;
+	    best_keys = num_keys;
+	}
+    }
+    return best_keys > 1;
+}
+
 bool wam_compiler::first_arg_is_var(const term clause)
 {
     term arg = first_arg(clause);
@@ -2079,14 +2482,15 @@ bool wam_compiler::first_arg_is_str(const term clause)
     return arg.tag() == common::tag_t::STR;
 }
 
-std::vector<managed_clauses> wam_compiler::partition_clauses_nonvar(const managed_clauses &clauses)
+std::vector<managed_clauses> wam_compiler::partition_clauses_nonvar(const managed_clauses &clauses, size_t index_arg)
 {
     return partition_clauses(clauses,
        [&] (const managed_clause &c1, const managed_clause &c2)
 	     { 
 		 term c1_term = c1.clause();
 		 term c2_term = c2.clause();
-	       return first_arg_is_var(c1_term) || first_arg_is_var(c2_term);
+		 return index_cat(c1_term, index_pos(index_arg)) == FIRST_VAR
+		     || index_cat(c2_term, index_pos(index_arg)) == FIRST_VAR;
 	     });
 }
 
@@ -2175,6 +2579,10 @@ std::pair<wam_compiler::reg,bool> wam_compiler::register_pool::allocate(common::
 
 void wam_compiler::register_pool::allocate(common::ref_cell ref, wam_compiler::reg r)
 {
+    if (r.num >= max_) {
+	std::string msg = "Number of registers in clause exceeded the maximum of " + boost::lexical_cast<std::string>(max_);
+	throw wam_exception_too_many_registers(msg);
+    }
     reg_map_[ref] = r;
 }
 
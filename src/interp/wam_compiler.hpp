@@ -30,6 +30,13 @@ public:
 	: wam_exception(msg) { }
 };
 
+class wam_exception_too_many_registers : public wam_exception
+{
+public:
+    wam_exception_too_many_registers(const std::string &msg)
+	: wam_exception(msg) { }
+};
+
 class wam_interim_instruction_base : public wam_instruction_base {
 public:
     inline wam_interim_instruction_base(fn_type fn, uint64_t sz_bytes,
@@ -55,9 +62,15 @@ public:
      inline wam_interim_instruction(common::int_cell lab) :
        wam_interim_instruction_base(&invoke, sizeof(*this), INTERIM_LABEL),
        label_(lab) {
-        static bool init = [this] {
-	  register_printer(&invoke, &print); return true; } ();
-        static_cast<void>(init);
+        init();
+    }
+
+    static inline void init() {
+	static bool init = [] {
+	    register_fn(INTERIM_LABEL, &invoke);
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init);
     }
 
     common::int_cell label() const
@@ -88,19 +101,12 @@ public:
 
     static inline void init() {
 	static bool init = [] {
+	    register_fn(INTERIM_MERGE, &invoke);
 	    register_printer(&invoke, &print);
-	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	for (auto &p : *from_) {
-	    update_ptr(p, old_base, new_base);
-	}
-    }
-
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
         assert("this instruction should never be executed." == nullptr);
@@ -120,12 +126,6 @@ public:
 	out << "]";
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_interim_instruction<INTERIM_MERGE> *>(self);
-	self1->update(old_base, new_base);
-    }
-
     const std::vector<code_point> & sources() const {
 	return *from_;
     }
@@ -310,7 +310,7 @@ public:
     typedef common::term term;
 
     wam_compiler(wam_interpreter &interp)
-        : interp_(interp), env_(interp), regs_a_(A_REG), regs_x_(X_REG), regs_y_(Y_REG), label_count_(1), goal_count_(0), level_count_(0), current_module_(common::con_cell("[]",0)) { }
+        : interp_(interp), env_(interp), regs_a_(A_REG, interpreter_base::MAX_A_REGS), regs_x_(X_REG, wam_instruction_base::MAX_REG+1), regs_y_(Y_REG, MAX_VARS), label_count_(1), goal_count_(0), level_count_(0), current_module_(common::con_cell("[]",0)) { }
 
     ~wam_compiler();
 
@@ -404,7 +404,10 @@ private:
 
     class register_pool {
     public:
-        register_pool(reg_type type) : reg_type_(type) { }
+        // At most 'max' registers; more throws
+        // wam_exception_too_many_registers.
+        register_pool(reg_type type, size_t max)
+	    : reg_type_(type), max_(max) { }
 
 	bool contains(common::ref_cell ref);
 	std::pair<reg,bool> allocate(common::ref_cell ref);
@@ -414,6 +417,7 @@ private:
 
     private:
         reg_type reg_type_;
+	size_t max_;
 	std::unordered_map<common::ref_cell, reg> reg_map_;
     };
 
@@ -480,6 +484,13 @@ private:
     bool is_conjunction(const term goal);
     bool is_disjunction(const term goal);
     bool is_if_then_else(const term goal);
+    bool is_seen_var(const term t);
+    bool is_arith_compilable(const term expr, size_t rn, size_t depth);
+    bool fold_arith(const term expr, int64_t &v);
+    void compile_arith_expr(const term expr, common::con_cell ctx, size_t rn,
+			    wam_interim_code &seq);
+    bool compile_arith(const term goal, common::con_cell f, builtin_fn fn,
+		       wam_interim_code &seq);
     void insert_phi_nodes(const term goal_a, const term goal_b,
 			  wam_interim_code &code);
     void compile_conjunction(const term conj, wam_interim_code &code);
@@ -488,6 +499,7 @@ private:
     void compile_goal(const term goal, bool first_goal, wam_interim_code &seq);
     void peephole_opt_execute(wam_interim_code &seq);
     void peephole_opt_void(wam_interim_code &instr);
+    void peephole_opt_fuse(wam_interim_code &seq);
     void reset_clause_temps();
     bool is_relevant_varset_op(const term t);
     void compute_var_indices(const term t);
@@ -501,6 +513,7 @@ private:
     void emit_cp(std::vector<common::int_cell> &labels, size_t index, size_t n,
 		 wam_interim_code &instrs);
     void compile_subsection(const managed_clauses &subsection,
+			    size_t index_arg,
 			    wam_interim_code &instrs);
 
     common::int_cell new_label();
@@ -548,13 +561,36 @@ private:
     bool first_arg_is_con(const term clause);
     bool first_arg_is_str(const term clause);
 
+    // What a switch instruction dispatches on: an argument of the
+    // head, or an argument (1-based sub) of the structure there.
+    struct index_pos {
+	index_pos(size_t a = 0, size_t s = 0) : arg(a), sub(s) { }
+	size_t arg;
+	size_t sub;
+    };
+
+    term index_term(const term clause, index_pos pos);
+    first_arg_cat_t index_cat(const term clause, index_pos pos);
+    size_t count_index_keys(const managed_clauses &clauses,
+			    const std::vector<size_t> &clause_indices,
+			    index_pos pos, size_t &num_vars);
+    size_t select_index_arg(const managed_clauses &clauses);
+    bool select_refinement(const managed_clauses &clauses,
+			   const std::vector<size_t> &clause_indices,
+			   index_pos pos, index_pos &refined);
+
     std::vector<managed_clauses> partition_clauses(const managed_clauses &clauses, std::function<bool (const managed_clause &c1, const managed_clause &t2)> pred);
-    std::vector<managed_clauses> partition_clauses_nonvar(const managed_clauses &clauses);
+    std::vector<managed_clauses> partition_clauses_nonvar(const managed_clauses &clauses, size_t index_arg = 0);
     std::vector<managed_clauses> partition_clauses_first_arg(const managed_clauses &clauses);
     std::vector<size_t> find_clauses_on_cat(const managed_clauses &clauses,
+					    const std::vector<size_t> &clause_indices,
+					    index_pos pos,
 					    first_arg_cat_t cat);
     void emit_switch_on_term(const managed_clauses &subsection,
 			     const std::vector<common::int_cell> &labels,
+			     const std::vector<size_t> &clause_indices,
+			     index_pos pos,
+			     code_point on_var_cp,
 			     wam_interim_code &instrs);
     void emit_second_level_indexing(
 	      wam_compiler::first_arg_cat_t cat,
@@ -562,10 +598,13 @@ private:
 	      const std::vector<common::int_cell> &labels,
 	      const std::vector<size_t> &clause_indices,
 	      code_point cp,
+	      index_pos pos,
 	      wam_interim_code &instrs);
     void emit_third_level_indexing(
+	     const managed_clauses &subsection,
 	     const std::vector<size_t> &clause_indices,
 	     const std::vector<common::int_cell> &labels,
+	     index_pos pos,
 	     wam_interim_code &instrs);
 
     void print_partition(std::ostream &out,
@@ -1,25 +1,158 @@
+#include <algorithm>
+#include <limits>
 #include "wam_interpreter.hpp"
+#include "wam_compiler.hpp"
 
 namespace prologcoin { namespace interp {
 
+wam_instruction_base::fn_type wam_instruction_base::fns_[wam_instruction_base::MAX_OPCODES];
 std::unordered_map<wam_instruction_base::fn_type, wam_instruction_base::print_fn_type> wam_instruction_base::print_fns_;
-std::unordered_map<wam_instruction_base::fn_type, wam_instruction_base::updater_fn_type> wam_instruction_base::updater_fns_;
+
+const size_t wam_instruction_switch_table::MAX_LINEAR;
+const size_t wam_instruction_switch_table::MAX_SORTED;
+const size_t wam_interpreter::MAX_X_REGS;
+
+wam_instruction_base & wam_instruction_switch_table::build(
+		   fn_type fn, wam_instruction_type t,
+		   const wam_switch_entries &entries,
+		   std::vector<code_t> &buf,
+		   uint32_t ai, uint32_t sub)
+{
+    size_t n = entries.size();
+
+    bool same_tag = true;
+    uint64_t lo = std::numeric_limits<uint64_t>::max(), hi = 0;
+    for (auto &e : entries) {
+	auto raw = e.first.raw_value();
+	same_tag = same_tag && e.first.tag() == entries[0].first.tag();
+	lo = std::min(lo, raw);
+	hi = std::max(hi, raw);
+    }
+
+    kind_t k;
+    size_t num = n;
+    uint64_t param = 0;
+    if (n > MAX_LINEAR && same_tag && ((hi - lo) >> 3) < 2*n) {
+	k = DIRECT;
+	num = ((hi - lo) >> 3) + 1;
+	param = lo;
+    } else if (n <= MAX_LINEAR) {
+	k = LINEAR;
+    } else if (n <= MAX_SORTED) {
+	k = SORTED;
+    } else {
+	// At most half full
+	k = HASHED;
+	size_t bits = 1;
+	while ((static_cast<size_t>(1) << bits) < 2*n) {
+	    bits++;
+	}
+	num = static_cast<size_t>(1) << bits;
+	param = 64 - bits;
+    }
+
+    size_t sz = (size_in_bytes_for(num) + sizeof(code_t) - 1) / sizeof(code_t);
+    buf.assign(sz, 0);
+    auto *table = new (buf.data())
+	wam_instruction_switch_table(fn, t, k, num, param, ai, sub);
+    auto *ks = table->keys();
+    auto *cps = table->code_points();
+    for (size_t i = 0; i < num; i++) {
+	new (&cps[i]) code_point(code_point::fail());
+    }
+
+    switch (k) {
+    case LINEAR:
+	for (size_t i = 0; i < n; i++) {
+	    ks[i] = entries[i].first;
+	    cps[i] = entries[i].second;
+	}
+	break;
+    case SORTED: {
+	std::vector<size_t> order(n);
+	for (size_t i = 0; i < n; i++) order[i] = i;
+	std::sort(order.begin(), order.end(),
+		  [&](size_t a, size_t b) {
+		      return entries[a].first.raw_value()
+			   < entries[b].first.raw_value(); });
+	for (size_t i = 0; i < n; i++) {
+	    ks[i] = entries[order[i]].first;
+	    cps[i] = entries[order[i]].second;
+	}
+	break;
+	}
+    case HASHED:
+	for (auto &e : entries) {
+	    size_t i = hash(e.first, param);
+	    while (ks[i].raw_value() != 0) {
+		i = (i + 1) & (num - 1);
+	    }
+	    ks[i] = e.first;
+	    cps[i] = e.second;
+	}
+	break;
+    case DIRECT:
+	for (auto &e : entries) {
+	    size_t i = (e.first.raw_value() - lo) >> 3;
+	    ks[i] = e.first;
+	    cps[i] = e.second;
+	}
+	break;
+    }
+
+    return *table;
+}
+
+wam_code::~wam_code()
+{
+    for (auto &e : segments_) {
+	delete [] e.second->data;
+	delete e.second;
+    }
+    for (auto *seg : retired_) {
+	delete [] seg->data;
+	delete seg;
+    }
+}
+
+void wam_code::new_segment(size_t sz)
+{
+    if (current_ != nullptr && current_->size == 0) {
+	if (sz <= current_->capacity) {
+	    return;
+	}
+	// Empty segment too small; drop it
+	segments_.erase(current_->base);
+	segments_by_data_.erase(current_->data);
+	delete [] current_->data;
+	delete current_;
+	current_ = nullptr;
+    }
+
+    auto *seg = new segment();
+    seg->base = next_base_;
+    seg->size = 0;
+    seg->capacity = sz;
+    seg->data = new code_t[seg->capacity];
+
+    // Offsets of different segments never overlap
+    next_base_ = seg->base + seg->capacity;
+
+    segments_[seg->base] = seg;
+    segments_by_data_[seg->data] = seg;
+    current_ = seg;
+}
 
 size_t wam_code::add(const wam_instruction_base &i)
 {
-    size_t offset = next_offset();
     size_t sz = i.size();
-    code_t *old_base = instrs_;
     code_t *data = ensure_fit(sz);
-    code_t *new_base = instrs_;
+    size_t offset = to_code_addr(data);
     auto p = reinterpret_cast<wam_instruction_base *>(data);
     memcpy(p, &i, sz*sizeof(code_t));
 
-    if (old_base != new_base) {
-	p->update(old_base, new_base);
-    }
-
-    if (i.type() == EXECUTE || i.type() == CALL) {
+    if (i.type() == EXECUTE || i.type() == CALL ||
+	i.type() == PUT_VALUE_X_EXECUTE) {
 	auto *cp_instr = reinterpret_cast<wam_instruction_code_point *>(p);
 	auto module = cp_instr->cp().module();
 	auto f = cp_instr->cp().name();
@@ -32,47 +165,373 @@ size_t wam_code::add(const wam_instruction_base &i)
 void wam_code::print_code(std::ostream &out)
 {
     static const common::con_cell default_module("[]",0);
-    for (size_t i = 0; i < instrs_size_;) {
-	if (predicate_rev_map_.count(i)) {
-	    auto name = predicate_rev_map_[i];
-	    if (name.first == default_module) {
-		out << interp_.to_string(name.second);
-	    } else {
-		out << interp_.to_string(name.first) << ":"
-		    << interp_.to_string(name.second);
+    for (auto &e : segments_) {
+	auto *seg = e.second;
+	for (size_t i = 0; i < seg->size;) {
+	    size_t offset = seg->base + i;
+	    if (predicate_rev_map_.count(offset)) {
+		auto name = predicate_rev_map_[offset];
+		if (name.first == default_module) {
+		    out << interp_.to_string(name.second);
+		} else {
+		    out << interp_.to_string(name.first) << ":"
+			<< interp_.to_string(name.second);
+		}
+		out << "/" << name.second.arity() << ":" << std::endl;
+	    }
+
+	    wam_instruction_base *instr
+		= reinterpret_cast<wam_instruction_base *>(&seg->data[i]);
+	    out << "[" << std::setw(5) << offset << "]: ";
+	    instr->print(out, interp_);
+	    out << std::endl;
+
+	    i += instr->size();
+	}
+    }
+}
+
+wam_code::segment * wam_code::segment_of(wam_instruction_base *instr) const
+{
+    auto p = reinterpret_cast<code_t *>(instr);
+    auto it = segments_by_data_.upper_bound(p);
+    --it;
+    return it->second;
+}
+
+void wam_code::set_predicate(const qname &qn,
+			     wam_instruction_base *instr,
+			     size_t environment_size)
+{
+    auto it = predicate_map_.find(qn);
+    if (it != predicate_map_.end()) {
+	// Recompiled; the old code is released between queries.
+	predicate_rev_map_.erase(to_code_addr(it->second));
+	retire_segment(predicate_segment_[qn]);
+    }
+
+    size_t predicate_offset = to_code_addr(instr);
+    predicate_map_[qn] = instr;
+    predicate_segment_[qn] = segment_of(instr);
+    predicate_rev_map_[predicate_offset] = qn;
+
+    auto &offsets = calls_[qn];
+    for (auto offset : offsets) {
+	auto *cp_instr = reinterpret_cast<wam_instruction_code_point *>(to_code(offset));
+	cp_instr->cp().set_wam_code(instr);
+    }
+}
+
+void wam_code::unload_predicate(const qname &qn)
+{
+    auto it = predicate_map_.find(qn);
+    if (it == predicate_map_.end()) {
+	return;
+    }
+
+    auto &offsets = calls_[qn];
+    for (auto offset : offsets) {
+	auto *cp_instr = reinterpret_cast<wam_instruction_code_point *>(to_code(offset));
+	cp_instr->cp().set_wam_code(nullptr);
+    }
+
+    predicate_rev_map_.erase(to_code_addr(it->second));
+    retire_segment(predicate_segment_[qn]);
+    predicate_segment_.erase(qn);
+    predicate_map_.erase(it);
+}
+
+void wam_code::retire_segment(segment *seg)
+{
+    // The call sites in the segment are dead; they must not be patched
+    // once the segment is unreachable through the segment maps.
+    auto p = reinterpret_cast<wam_instruction_base *>(seg->data);
+    for (size_t i = 0; i < seg->size;) {
+	switch (p->type()) {
+	case CALL:
+	case EXECUTE:
+	case PUT_VALUE_X_EXECUTE: {
+	    auto *cp_instr = reinterpret_cast<wam_instruction_code_point *>(p);
+	    auto &offsets = calls_[qname(cp_instr->cp().module(),
+					 cp_instr->cp().name())];
+	    offsets.erase(std::remove(offsets.begin(), offsets.end(),
+				      seg->base + i), offsets.end());
+	    break;
 	    }
-	    out << "/" << name.second.arity() << ":" << std::endl;
+	default:
+	    break;
 	}
+	i += p->size();
+	p = reinterpret_cast<wam_instruction_base *>(&seg->data[i]);
+    }
 
-	wam_instruction_base *instr
-	  = reinterpret_cast<wam_instruction_base *>(&instrs_[i]);
-	out << "[" << std::setw(5) << i << "]: ";
-	instr->print(out, interp_);
-	out << std::endl;
-	
-	i += instr->size();
+    if (seg == current_) {
+	current_ = nullptr;
     }
+    segments_.erase(seg->base);
+    segments_by_data_.erase(seg->data);
+    retired_.push_back(seg);
 }
 
-wam_interpreter::wam_interpreter() : wam_code(*this)
+void wam_code::free_segment(segment *seg)
 {
+    delete [] seg->data;
+    delete seg;
+}
+
+void wam_code::free_retired_segments()
+{
+    for (auto *seg : retired_) {
+	free_segment(seg);
+    }
+    retired_.clear();
+}
+
+void wam_instruction_base::init_dispatch()
+{
+    init_dispatch_from<0>();
+    wam_interim_instruction<INTERIM_LABEL>::init();
+    wam_interim_instruction<INTERIM_MERGE>::init();
+}
+
+wam_interpreter::wam_interpreter() : wam_code(*this), shallow_ce_(nullptr, false)
+{
+    static bool init_ = [] {
+	wam_instruction_base::init_dispatch();
+	return true; } ();
+    static_cast<void>(init_);
+
     fail_ = false;
+    native_enabled_ = false;
+    wam_profiling_ = false;
+    prof_last_[0] = prof_last_[1] = LAST;
     mode_ = READ;
     set_num_y_fn( &num_y );
     register_s_ = 0;
-    memset(register_xn_, 0, sizeof(register_xn_));
+    std::fill(std::begin(register_xn_), std::end(register_xn_), term());
+    std::fill(std::begin(register_rn_), std::end(register_rn_), term());
+    shallow_ = false;
 }
 
 wam_interpreter::~wam_interpreter()
 {
-    for (auto m : hash_maps_) {
-	delete m;
+}
+
+std::string wam_interpreter::arith_context(common::con_cell ctx)
+{
+    return atom_name(ctx) + "/" + boost::lexical_cast<std::string>(ctx.arity());
+}
+
+// The slow path of the arithmetic instructions: f(rn, rn+1) is built
+// and given to the generic evaluator.
+void wam_interpreter::arith_eval(common::con_cell ctx, uint32_t rn,
+				 common::con_cell f)
+{
+    term expr = new_term(f, {r(rn), r(rn+1)});
+    term v = arith().eval(expr, arith_context(ctx));
+    if (has_pending_exception()) {
+	fail_builtin();
+	return;
+    }
+    r(rn) = v;
+    goto_next_instruction();
+}
+
+int wam_interpreter::arith_compare_slow(common::con_cell ctx, uint32_t rn)
+{
+    return arith().compare(r(rn), r(rn+1), arith_context(ctx));
+}
+
+//
+// All WAM instructions in enum order. SEQ instructions always continue
+// with the next instruction, so there is nothing to check after them.
+// CTL instructions may call, return, jump or backtrack; these are the
+// only places where we check if we've left the WAM code, hit the top
+// fail or if debugging was switched on.
+//
+#define WAM_INSTRUCTIONS(X) \
+    X(PUT_VARIABLE_X, SEQ) X(PUT_VARIABLE_Y, SEQ) \
+    X(PUT_VALUE_X, SEQ) X(PUT_VALUE_Y, SEQ) X(PUT_UNSAFE_VALUE_Y, SEQ) \
+    X(PUT_STRUCTURE_A, SEQ) X(PUT_STRUCTURE_X, SEQ) X(PUT_STRUCTURE_Y, SEQ) \
+    X(PUT_LIST_A, SEQ) X(PUT_LIST_X, SEQ) X(PUT_LIST_Y, SEQ) \
+    X(PUT_CONSTANT, SEQ) \
+    X(GET_VARIABLE_X, SEQ) X(GET_VARIABLE_Y, SEQ) \
+    X(GET_VALUE_X, CTL) X(GET_VALUE_Y, CTL) \
+    X(GET_STRUCTURE_A, CTL) X(GET_STRUCTURE_X, CTL) X(GET_STRUCTURE_Y, CTL) \
+    X(GET_LIST_A, CTL) X(GET_LIST_X, CTL) X(GET_LIST_Y, CTL) \
+    X(GET_CONSTANT, CTL) \
+    X(SET_VARIABLE_A, SEQ) X(SET_VARIABLE_X, SEQ) X(SET_VARIABLE_Y, SEQ) \
+    X(SET_VALUE_A, SEQ) X(SET_VALUE_X, SEQ) X(SET_VALUE_Y, SEQ) \
+    X(SET_LOCAL_VALUE_X, SEQ) X(SET_LOCAL_VALUE_Y, SEQ) \
+    X(SET_CONSTANT, SEQ) X(SET_VOID, SEQ) \
+    X(UNIFY_VARIABLE_A, SEQ) X(UNIFY_VARIABLE_X, SEQ) \
+    X(UNIFY_VARIABLE_Y, SEQ) \
+    X(UNIFY_VALUE_A, CTL) X(UNIFY_VALUE_X, CTL) X(UNIFY_VALUE_Y, CTL) \
+    X(UNIFY_LOCAL_VALUE_X, CTL) X(UNIFY_LOCAL_VALUE_Y, CTL) \
+    X(UNIFY_CONSTANT, CTL) X(UNIFY_VOID, SEQ) \
+    X(ALLOCATE, SEQ) X(DEALLOCATE, SEQ) \
+    X(CALL, CTL) X(EXECUTE, CTL) X(PROCEED, CTL) \
+    X(BUILTIN, CTL) X(BUILTIN_R, CTL) \
+    X(TRY_ME_ELSE, SEQ) X(RETRY_ME_ELSE, SEQ) X(TRUST_ME, SEQ) \
+    X(TRY, CTL) X(RETRY, CTL) X(TRUST, CTL) \
+    X(SWITCH_ON_TERM, CTL) X(SWITCH_ON_CONSTANT, CTL) \
+    X(SWITCH_ON_STRUCTURE, CTL) \
+    X(NECK_CUT, SEQ) X(GET_LEVEL, SEQ) X(CUT, SEQ) \
+    X(GOTO, CTL) X(RESET_LEVEL, SEQ) \
+    X(COST, SEQ) \
+    X(PUT_VALUE_X2, SEQ) X(PUT_VALUE_X_EXECUTE, CTL) \
+    X(UNIFY_VARIABLE_X2, SEQ) X(ALLOCATE_GET_VARIABLE_Y, SEQ) \
+    X(ARITH_LOAD_X, SEQ) X(ARITH_LOAD_Y, SEQ) X(ARITH_LOAD_CONSTANT, SEQ) \
+    X(ARITH_ADD, CTL) X(ARITH_SUB, CTL) X(ARITH_MUL, CTL) \
+    X(ARITH_LT, CTL) X(ARITH_LE, CTL) X(ARITH_GT, CTL) X(ARITH_GE, CTL) \
+    X(ARITH_EQ, CTL) X(ARITH_NE, CTL) \
+    X(ARITH_GET_VARIABLE_X, SEQ) X(ARITH_GET_VARIABLE_Y, SEQ) \
+    X(ARITH_GET_VALUE_X, CTL) X(ARITH_GET_VALUE_Y, CTL) \
+    X(NATIVE, CTL)
+
+// The dispatch tables below are indexed by opcode, so the list must
+// have exactly one entry per wam_instruction_type, in enum order.
+#define WAM_ORDER(T, K) T,
+static constexpr wam_instruction_type wam_instruction_order[] =
+    { WAM_INSTRUCTIONS(WAM_ORDER) };
+#undef WAM_ORDER
+
+static constexpr bool wam_instructions_in_order(size_t i)
+{
+    return i == LAST ||
+	(static_cast<size_t>(wam_instruction_order[i]) == i &&
+	 wam_instructions_in_order(i+1));
+}
+
+static_assert(sizeof(wam_instruction_order) /
+	      sizeof(wam_instruction_order[0]) == LAST,
+	      "WAM_INSTRUCTIONS must list every wam_instruction_type");
+static_assert(wam_instructions_in_order(0),
+	      "WAM_INSTRUCTIONS must be in wam_instruction_type order");
+
+#define WAM_STEP_SEQ \
+    instr = p().wam_code();
+
+#define WAM_STEP_CTL \
+    instr = p().wam_code(); \
+    if (instr == nullptr || is_top_fail() || is_debug()) return;
+
+#if defined(__GNUC__)
+
+// Direct threading with computed goto: every handler jumps straight to
+// the handler of the next instruction.
+
+#define WAM_LABEL(T, K) &&L_##T,
+#define WAM_HANDLER(T, K) \
+    L_##T: \
+        wam_instruction<T>::invoke(*this, instr); \
+	WAM_STEP_##K \
+	goto *labels[instr->type()];
+
+void wam_interpreter::cont_wam_fast()
+{
+    static void * const labels[LAST] = { WAM_INSTRUCTIONS(WAM_LABEL) };
+
+    wam_instruction_base *instr = p().wam_code();
+    if (instr == nullptr || is_top_fail()) {
+	return;
+    }
+    goto *labels[instr->type()];
+
+    WAM_INSTRUCTIONS(WAM_HANDLER)
+}
+
+#undef WAM_LABEL
+#undef WAM_HANDLER
+
+#else
+
+#define WAM_CASE(T, K) \
+    case T: \
+        wam_instruction<T>::invoke(*this, instr); \
+	WAM_STEP_##K \
+	break;
+
+void wam_interpreter::cont_wam_fast()
+{
+    wam_instruction_base *instr = p().wam_code();
+    if (instr == nullptr || is_top_fail()) {
+	return;
     }
+    for (;;) {
+	switch (instr->type()) {
+	WAM_INSTRUCTIONS(WAM_CASE)
+	default: return;
+	}
+    }
+}
+
+#undef WAM_CASE
+
+#endif
+
+#undef WAM_STEP_SEQ
+#undef WAM_STEP_CTL
+
+#define WAM_NAME(T, K) #T,
+
+const char * wam_interpreter::instruction_name(wam_instruction_type t)
+{
+    static const char * const names[LAST] = { WAM_INSTRUCTIONS(WAM_NAME) };
+    return (t < LAST) ? names[t] : "???";
+}
+
+#undef WAM_NAME
+#undef WAM_INSTRUCTIONS
+
+void wam_interpreter::reset_wam_profile()
+{
+    prof_last_[0] = prof_last_[1] = LAST;
+    prof_pairs_.clear();
+    prof_triples_.clear();
+}
+
+void wam_interpreter::print_wam_profile(std::ostream &out, size_t top) const
+{
+    typedef std::pair<uint64_t, uint32_t> entry;
+
+    auto print_top = [&](const std::unordered_map<uint32_t, uint64_t> &freq,
+			 size_t n) {
+	std::vector<entry> all;
+	for (auto &e : freq) {
+	    all.push_back(entry(e.second, e.first));
+	}
+	std::sort(all.begin(), all.end(), std::greater<entry>());
+	if (all.size() > top) {
+	    all.resize(top);
+	}
+	for (auto &e : all) {
+	    out << std::setw(12) << e.first << ":";
+	    for (size_t i = n; i > 0; i--) {
+		auto t = static_cast<wam_instruction_type>(
+			    (e.second >> (8*(i-1))) & 0xff);
+		out << " " << instruction_name(t);
+	    }
+	    out << "\n";
+	}
+    };
+
+    out << "Instruction pairs:\n";
+    print_top(prof_pairs_, 2);
+    out << "Instruction triples:\n";
+    print_top(prof_triples_, 3);
 }
 
 bool wam_interpreter::cont_wam()
 {
     fail_ = false;
+    shallow_ = false; // Left behind if an exception was thrown
+    prof_last_[0] = prof_last_[1] = LAST;
+    if (!is_debug() && !is_wam_profiling()) {
+	// Returns when we leave WAM code, on top fail or if debugging
+	// gets enabled (then we continue below.)
+	cont_wam_fast();
+    }
     while (p().has_wam_code() && !is_top_fail()) {
 	if (auto instr = p().wam_code()) {
 	    if (is_debug()) {
@@ -81,6 +540,9 @@ bool wam_interpreter::cont_wam()
 		instr->print(std::cout, *this);
 		std::cout << "\n";
 	    }
+	    if (is_wam_profiling()) {
+		profile_instruction(instr->type());
+	    }
 	    instr->invoke(*this);
 	    cnt++;
 	}
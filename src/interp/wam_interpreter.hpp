@@ -5,6 +5,7 @@
 
 #include <istream>
 #include <vector>
+#include <map>
 #include <iomanip>
 #include "interpreter_base.hpp"
 
@@ -12,6 +13,7 @@ namespace prologcoin { namespace interp {
 
 class test_wam_interpreter;
 class test_wam_compiler;
+class wam_native;
 
 struct static_ 
 {
@@ -95,6 +97,32 @@ enum wam_instruction_type {
 
   COST, // Non-standard WAM; for accumulated cost
 
+  // Superinstructions (see wam_compiler::peephole_opt_fuse)
+  PUT_VALUE_X2,
+  PUT_VALUE_X_EXECUTE,
+  UNIFY_VARIABLE_X2,
+  ALLOCATE_GET_VARIABLE_Y,
+
+  // Compiled arithmetic (see wam_compiler::compile_arith)
+  ARITH_LOAD_X,
+  ARITH_LOAD_Y,
+  ARITH_LOAD_CONSTANT,
+  ARITH_ADD,
+  ARITH_SUB,
+  ARITH_MUL,
+  ARITH_LT,
+  ARITH_LE,
+  ARITH_GT,
+  ARITH_GE,
+  ARITH_EQ,
+  ARITH_NE,
+  ARITH_GET_VARIABLE_X,
+  ARITH_GET_VARIABLE_Y,
+  ARITH_GET_VALUE_X,
+  ARITH_GET_VALUE_Y,
+
+  NATIVE, // Entry into ahead-of-time compiled code (see wam_aot.hpp)
+
   LAST
 };
 
@@ -104,82 +132,83 @@ typedef uint64_t code_t;
 
 class wam_instruction_base;
 
-typedef std::unordered_map<common::term, code_point> wam_hash_map;
+typedef std::vector<std::pair<common::term, code_point> > wam_switch_entries;
 
 template<wam_instruction_type I> class wam_instruction;
 
+// Ahead-of-time compiled code for a predicate; entry is the NATIVE
+// instruction execution arrived at.
+typedef void (*native_fn)(wam_interpreter &interp, wam_instruction_base *entry);
+
+//
+// Every instruction starts with a 32-bit header holding its opcode and
+// its size in words. The opcode indexes the dispatch table. Register
+// numbers are kept in 16 bits (there are 1024 X registers), so most
+// register instructions fit in a single word. The compiler refuses
+// clauses that need more registers than that (see
+// wam_exception_too_many_registers.)
+//
 class wam_instruction_base
 {
 protected:
     typedef void (*fn_type)(wam_interpreter &interp, wam_instruction_base *self);
     inline wam_instruction_base(fn_type fn, uint64_t sz_bytes, wam_instruction_type t)
-      : fn_(fn), type_(t), size_((sz_bytes+sizeof(code_t)-1)/sizeof(code_t)) { }
+      : type_(t), size_((sz_bytes+sizeof(code_t)-1)/sizeof(code_t))
+    { static_cast<void>(fn); assert(t >= LAST || fns_[t] == fn); }
+
+    // For instructions that aren't in wam_instruction_type (the ones
+    // only used by the compiler.) Call it once, before any instruction
+    // of the type is made.
+    static inline void register_fn(size_t t, fn_type fn) { fns_[t] = fn; }
 
 public:
+    static const size_t MAX_OPCODES = 256;
+    static const size_t MAX_REG = 0xffff; // Largest register number
+
+    // Fills the dispatch and printer tables. It is done once at
+    // start-up (see wam_interpreter), as instructions are made and
+    // printed on many threads.
+    static void init_dispatch();
+
     inline void invoke(wam_interpreter &interp) {
-        fn_(interp, this);
+        fns_[type_](interp, this);
     }
 
-    inline fn_type fn() const { return fn_; }
-    inline wam_instruction_type type() const { return type_; }
+    inline fn_type fn() const { return fns_[type_]; }
+    inline wam_instruction_type type() const { return static_cast<wam_instruction_type>(type_); }
     inline size_t size() const {return size_; }
     inline size_t size_in_bytes() const { return size() * sizeof(code_t); }
 
-    inline void set_type(fn_type fn, wam_instruction_type t) { fn_ = fn; type_ = t; }
-
     template<wam_instruction_type I> inline void set_type();
 
-protected:
-    inline void update_ptr(code_point &p, code_t *old_base, code_t *new_base)
-    {
-	if (p.wam_code() == nullptr) {
-	    return;
-	}
-	p.set_wam_code(reinterpret_cast<wam_instruction_base *>(reinterpret_cast<code_t *>(p.wam_code()) - old_base + new_base));
-    }
+private:
+    uint32_t type_ : 8;
+    uint32_t size_ : 24;
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	auto it = updater_fns_.find(fn());
-	if (it != updater_fns_.end()) {
-	    auto updater_fn = it->second;
-	    updater_fn(this, old_base, new_base);
-	}
-    }
+    static fn_type fns_[MAX_OPCODES];
 
-private:
-    fn_type fn_;
-    wam_instruction_type type_;
-    uint32_t size_;
+    template<size_t I> static inline void init_dispatch_from();
 
     typedef void (*print_fn_type)(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self);
 
-    typedef void (*updater_fn_type)(wam_instruction_base *self, code_t *old_base, code_t *new_base);
-
 public:
     static void register_printer(fn_type fn, print_fn_type print_fn)
     {
         print_fns_[fn] = print_fn;
     }
 
-    static void register_updater(fn_type fn, updater_fn_type updater_fn)
-    {
-	updater_fns_[fn] = updater_fn;
-    }
-
     void print(std::ostream &out, wam_interpreter &interp)
     {
-        print_fn_type pfn = print_fns_[fn_];
-	if (pfn == nullptr) {
+        auto it = print_fns_.find(fn());
+	if (it == print_fns_.end()) {
 	    std::cout << "???";
 	} else {
-	    pfn(out, interp, this);
+	    it->second(out, interp, this);
 	}
     }
 
 private:
     static std::unordered_map<fn_type, print_fn_type> print_fns_;
-    static std::unordered_map<fn_type, updater_fn_type> updater_fns_;
 
     friend class wam_code;
 };
@@ -196,7 +225,7 @@ class wam_instruction_unary_reg : public wam_instruction_base
 public:
     inline wam_instruction_unary_reg(fn_type fn, uint64_t sz_bytes, wam_instruction_type t, size_t reg)
           : wam_instruction_base(fn, sz_bytes, t),
-	    data_(static_cast<uint32_t>(reg))
+	    data_(static_cast<uint16_t>(reg))
     {
     }
 
@@ -205,11 +234,11 @@ public:
     }
 
     inline void set_reg(size_t t) {
-	data_ = static_cast<uint32_t>(t);
+	data_ = static_cast<uint16_t>(t);
     }
 
 private:
-    uint32_t data_;
+    uint16_t data_;
 };
 
 class wam_instruction_binary_reg : public wam_instruction_base
@@ -239,8 +268,8 @@ public:
     }
 
 private:
-    uint32_t data_1_;
-    uint32_t data_2_;
+    uint16_t data_1_;
+    uint16_t data_2_;
 };
 
 class wam_instruction_con_reg : public wam_instruction_base
@@ -248,8 +277,8 @@ class wam_instruction_con_reg : public wam_instruction_base
 public:
     inline wam_instruction_con_reg(fn_type fn, uint64_t sz_bytes, wam_instruction_type t, common::con_cell c, uint32_t r)
         : wam_instruction_base(fn, sz_bytes, t),
-	  con_(c),
-	  reg_(r)
+	  reg_(r),
+	  con_(c)
     {
     }
 
@@ -270,8 +299,8 @@ public:
     }
 
 private:
+    uint16_t reg_;
     common::con_cell con_;
-    uint32_t reg_;
 };
 
 class wam_instruction_term : public wam_instruction_base
@@ -279,6 +308,7 @@ class wam_instruction_term : public wam_instruction_base
 public:
     inline wam_instruction_term(fn_type fn, uint64_t sz_bytes, wam_instruction_type t, common::term te)
         : wam_instruction_base(fn, sz_bytes, t),
+	  reg_(0),
 	  term_(te)
     {
     }
@@ -291,6 +321,9 @@ public:
 	term_ = t;
     }
 
+protected:
+    uint16_t reg_; // For wam_instruction_term_reg; fits in the header word
+
 private:
     common::term term_;
 };
@@ -299,8 +332,9 @@ class wam_instruction_term_reg : public wam_instruction_term
 {
 public:
     inline wam_instruction_term_reg(fn_type fn, uint64_t sz_bytes, wam_instruction_type t, common::term te, uint32_t r)
-        : wam_instruction_term(fn, sz_bytes, t, te), reg_(r)
+        : wam_instruction_term(fn, sz_bytes, t, te)
     {
+	reg_ = r;
     }
 
     inline uint32_t reg() const {
@@ -310,16 +344,22 @@ public:
     inline void set_reg(uint32_t r) {
 	reg_ = r;
     }
-
-private:
-    uint32_t reg_;
 };
 
+//
+// These still embed a whole code_point (24 bytes.) The plan is to
+// resolve labels at load time and keep a 32-bit offset from the
+// instruction in its place, which is all that jumps within a
+// predicate (the choice point instructions and GOTO) need. Calls
+// need the predicate name too, for the naive interpreter fallback;
+// it would move to a table per code segment that the 32 bits index.
+//
 class wam_instruction_code_point : public wam_instruction_base
 {
 public:
     inline wam_instruction_code_point(fn_type fn, uint64_t sz_bytes, wam_instruction_type t, const code_point &cp)
         : wam_instruction_base(fn, sz_bytes, t),
+	  reg_(0),
 	  cp_(cp)
     {
     }
@@ -337,11 +377,7 @@ public:
     }
 
 protected:
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction_code_point *>(self);
-	self1->update(old_base, new_base);
-    }
+    uint16_t reg_; // For wam_instruction_code_point_reg (as for terms)
 
 private:
     code_point cp_;
@@ -351,69 +387,193 @@ class wam_instruction_code_point_reg : public wam_instruction_code_point
 {
 public:
     inline wam_instruction_code_point_reg(fn_type fn, uint64_t sz_bytes, wam_instruction_type t, const code_point &cp, uint32_t r)
-	: wam_instruction_code_point(fn, sz_bytes, t, cp), reg_(r) { }
+	: wam_instruction_code_point(fn, sz_bytes, t, cp) { reg_ = r; }
 
     inline uint32_t reg() const { return reg_; }
     void set_reg(uint32_t r) { reg_ = r; }
-
-private:
-    uint32_t reg_;
 };
 
-class wam_instruction_hash_map : public wam_instruction_base
+//
+// Switch instructions dispatch on an argument register, or on an
+// argument of the structure held in it (sub is then non-zero.)
+//
+inline void print_switch_arg(std::ostream &out, uint32_t ai, uint32_t sub)
+{
+    if (sub == 0) {
+	out << "a" << ai;
+    } else {
+	out << "arg(" << sub << ", a" << ai << ")";
+    }
+}
+
+//
+// Switch tables (for SWITCH_ON_CONSTANT and SWITCH_ON_STRUCTURE) are
+// laid out inline after the instruction: first all keys packed
+// together, then the code points. The representation is chosen when
+// the table is built:
+//
+//   LINEAR:  Few keys; scan them.
+//   SORTED:  Keys sorted on their raw value; binary search.
+//   HASHED:  Open addressing (linear probing) with a power of two
+//            number of slots. Empty slots hold a zero (REF) key.
+//   DIRECT:  Dense keys with the same tag; the key value minus the
+//            smallest one is the slot (empty slots as for HASHED.)
+//
+class wam_instruction_switch_table : public wam_instruction_base
 {
 public:
-    inline wam_instruction_hash_map(fn_type fn, uint64_t sz_bytes, wam_instruction_type t, wam_hash_map *map)
-	: wam_instruction_base(fn, sz_bytes, t), map_(map) { }
+    enum kind_t { LINEAR, SORTED, HASHED, DIRECT };
 
-    inline wam_hash_map & map() const { return *map_; }
+    static const size_t MAX_LINEAR = 8;
+    static const size_t MAX_SORTED = 64;
 
-    inline void update(code_t *old_base, code_t *new_base)
+    inline kind_t kind() const { return static_cast<kind_t>(kind_); }
+    inline size_t num_slots() const { return num_; }
+    inline uint32_t ai() const { return ai_; }
+    inline uint32_t sub() const { return sub_; }
+
+    inline common::term * keys()
+    {
+	return reinterpret_cast<common::term *>(this + 1);
+    }
+
+    inline code_point * code_points()
+    {
+	return reinterpret_cast<code_point *>(keys() + num_);
+    }
+
+    inline code_point * find(common::term t)
+    {
+	auto *ks = keys();
+	switch (kind()) {
+	case LINEAR:
+	    for (size_t i = 0; i < num_; i++) {
+		if (ks[i] == t) return &code_points()[i];
+	    }
+	    return nullptr;
+	case SORTED: {
+	    size_t lo = 0, hi = num_;
+	    auto raw = t.raw_value();
+	    while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (ks[mid].raw_value() < raw) {
+		    lo = mid + 1;
+		} else {
+		    hi = mid;
+		}
+	    }
+	    return (lo < num_ && ks[lo] == t) ? &code_points()[lo] : nullptr;
+	    }
+	case HASHED: {
+	    size_t mask = num_ - 1;
+	    for (size_t i = hash(t, param_);; i = (i + 1) & mask) {
+		if (ks[i] == t) return &code_points()[i];
+		if (ks[i].raw_value() == 0) return nullptr;
+	    }
+	    }
+	case DIRECT: {
+	    size_t i = (t.raw_value() - param_) >> 3;
+	    return (i < num_ && ks[i] == t) ? &code_points()[i] : nullptr;
+	    }
+	}
+	return nullptr;
+    }
+
+    // Applies f(key, code_point) to all entries
+    template<typename F> inline void for_each(F f)
     {
-	for (auto &v : map()) {
-	    update_ptr(v.second, old_base, new_base);
+	auto *ks = keys();
+	auto *cps = code_points();
+	for (size_t i = 0; i < num_; i++) {
+	    if (ks[i].raw_value() != 0) {
+		f(ks[i], cps[i]);
+	    }
 	}
     }
 
 protected:
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
+    inline wam_instruction_switch_table(fn_type fn, wam_instruction_type t,
+					kind_t k, size_t num, uint64_t param,
+					uint32_t ai, uint32_t sub)
+	: wam_instruction_base(fn, size_in_bytes_for(num), t),
+	  ai_(ai), sub_(sub), kind_(k), num_(static_cast<uint32_t>(num)),
+	  param_(param) { }
+
+    static inline size_t size_in_bytes_for(size_t num)
+    {
+	return sizeof(wam_instruction_switch_table)
+	    + num * (sizeof(common::term) + sizeof(code_point));
+    }
+
+    static inline size_t hash(common::term t, uint64_t shift)
     {
-	auto self1 = reinterpret_cast<wam_instruction_hash_map *>(self);
-	self1->update(old_base, new_base);
+	return (t.raw_value() * 0x9e3779b97f4a7c15ULL) >> shift;
     }
 
+    // Builds the table into buf (which is resized to fit.)
+    static wam_instruction_base & build(fn_type fn, wam_instruction_type t,
+					const wam_switch_entries &entries,
+					std::vector<code_t> &buf,
+					uint32_t ai, uint32_t sub);
+
 private:
-    wam_hash_map *map_;
+    uint16_t ai_;     // Dispatch on this argument register
+    uint16_t sub_;    // or its sub'th argument if non-zero
+    uint32_t kind_;
+    uint32_t num_;
+    uint64_t param_;  // HASHED: hash shift, DIRECT: smallest raw key
 };
 
+//
+// The code space is split into segments, normally one per compiled
+// predicate. Segments never move, so code points into them remain
+// valid while code is being added. Offsets are handed out from a
+// single increasing address space (and are never reused), so code can
+// still be referred to by offset.
+//
+// When a predicate is recompiled or unloaded its segment is retired.
+// Retired segments are freed by free_retired_segments() which must only
+// be called when nothing can refer to them (i.e. between queries.)
+//
 class wam_code
 {
 public:
-    wam_code(wam_interpreter &interp,
-  			     size_t initial_capacity = 1024)
-	: interp_(interp), instrs_size_(0), instrs_capacity_(initial_capacity)
-    { instrs_ = new code_t[instrs_capacity_]; }
+    wam_code(wam_interpreter &interp, size_t segment_size = 1024)
+	: interp_(interp), segment_size_(segment_size), next_base_(0),
+	  current_(nullptr) { }
+    ~wam_code();
 
     inline size_t next_offset() const
     {
-	return instrs_size_;
+	return (current_ != nullptr) ? current_->base + current_->size
+	                             : next_base_;
     }
-    
+
     inline size_t to_code_addr(code_t *p) const
     {
-	return static_cast<size_t>(p - instrs_);
+	auto it = segments_by_data_.upper_bound(p);
+	--it;
+	return it->second->base + static_cast<size_t>(p - it->first);
     }
 
     inline size_t to_code_addr(wam_instruction_base *p) const
     {
-	return static_cast<size_t>(reinterpret_cast<code_t *>(p) - instrs_);
+	return to_code_addr(reinterpret_cast<code_t *>(p));
     }
 
     inline wam_instruction_base * to_code(size_t addr) const
     {
-	return reinterpret_cast<wam_instruction_base *>(&instrs_[addr]);
+	auto it = segments_.upper_bound(addr);
+	--it;
+	return reinterpret_cast<wam_instruction_base *>(
+		      &it->second->data[addr - it->first]);
     }
 
+    // Start a new segment with room for sz words. Code that is added
+    // afterwards is contiguous as long as it fits. Each predicate gets
+    // its own segment, so it can be released on its own.
+    void new_segment(size_t sz);
+
     size_t add(const wam_instruction_base &i);
 
     void print_code(std::ostream &out);
@@ -429,64 +589,82 @@ public:
 	return is_compiled(std::make_pair(module,p));
     }
 
+    // The code of a compiled predicate (it fills a segment of its own.)
+    inline wam_instruction_base * predicate_code(const qname &qn) const
+    {
+	auto it = predicate_map_.find(qn);
+	return (it == predicate_map_.end()) ? nullptr : it->second;
+    }
+
+    inline size_t predicate_code_size(const qname &qn) const
+    {
+	auto it = predicate_segment_.find(qn);
+	return (it == predicate_segment_.end()) ? 0 : it->second->size;
+    }
+
+    inline size_t num_segments() const
+    {
+	return segments_.size();
+    }
+
+    inline size_t num_retired_segments() const
+    {
+	return retired_.size();
+    }
+
+    void free_retired_segments();
+
 protected:
     void set_predicate(const qname &qn,
 		       wam_instruction_base *instr,
-		       size_t environment_size)
-    {
-	size_t predicate_offset = to_code_addr(instr);
-	predicate_map_[qn] = predicate_offset;
-	predicate_rev_map_[predicate_offset] = qn;
+		       size_t environment_size);
 
-	auto &offsets = calls_[qn];
-	for (auto offset : offsets) {
-	    auto *cp_instr = reinterpret_cast<wam_instruction_code_point *>(to_code(offset));
-	    cp_instr->cp().set_wam_code(instr);
-	}
-    }
+    // Calls to the predicate go through the naive interpreter again
+    void unload_predicate(const qname &qn);
 
     wam_instruction_base * resolve_predicate(common::con_cell module,
 					     common::con_cell predicate_name)
     {
-	if (predicate_map_.count(qname(module, predicate_name))) {
-	    return to_code(predicate_map_[qname(module, predicate_name)]);
-	} else {
+	auto it = predicate_map_.find(qname(module, predicate_name));
+	if (it == predicate_map_.end()) {
 	    return nullptr;
 	}
+	return it->second;
     }
 
 private:
+    struct segment {
+	size_t base;
+	size_t size;
+	size_t capacity;
+	code_t *data;
+    };
+
     code_t * ensure_fit(size_t sz)
     {
-        ensure_capacity(instrs_size_ + sz);
-	code_t *data = &instrs_[instrs_size_];
-	instrs_size_ += sz;
+	if (current_ == nullptr || current_->size + sz > current_->capacity) {
+	    new_segment(std::max(sz, segment_size_));
+	}
+	code_t *data = &current_->data[current_->size];
+	current_->size += sz;
 	return data;
     }
 
-    void ensure_capacity(size_t cap)
-    {
-        if (cap > instrs_capacity_) {
-   	    size_t new_cap = 2*std::max(cap, instrs_size_);
-	    code_t *new_instrs = new code_t[new_cap];
-	    memcpy(new_instrs, instrs_, sizeof(code_t)*instrs_size_);
-	    instrs_capacity_ = new_cap;
-
-	    update(instrs_, new_instrs);
-
-	    delete instrs_;
-	    instrs_ = new_instrs;
-        }
-    }
-
-    inline void update(code_t *old_base, code_t *new_base);
+    segment * segment_of(wam_instruction_base *instr) const;
+    void retire_segment(segment *seg);
+    void free_segment(segment *seg);
 
     wam_interpreter &interp_;
-    size_t instrs_size_;
-    size_t instrs_capacity_;
-    code_t *instrs_;
+    size_t segment_size_;
+    size_t next_base_;
+    segment *current_;
 
-    std::unordered_map<qname, size_t> predicate_map_;
+    std::map<size_t, segment *> segments_;
+    std::map<code_t *, segment *> segments_by_data_;
+    std::vector<segment *> retired_;
+
+    std::unordered_map<qname, wam_instruction_base *> predicate_map_;
+    std::unordered_map<qname, segment *> predicate_segment_;
     std::unordered_map<size_t, qname> predicate_rev_map_;
     std::unordered_map<qname, std::vector<size_t> > calls_;
 };
@@ -502,16 +680,10 @@ public:
     inline static void init() {
 	static bool init_ = [] {
 	    register_printer(&invoke, &print);
-	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init_);
     }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	update_ptr(p(), old_base, new_base);
-    }
-
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
@@ -530,7 +702,6 @@ public:
 
     static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self);
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base);
 };
 
 template<> class wam_instruction<BUILTIN> : public wam_instruction_code_point {
@@ -590,6 +761,43 @@ public:
 private:
 };
 
+//
+// The loader puts one of these at the start of a predicate and at
+// every point execution can resume at (after calls and at labels) if
+// native code is enabled. Once a native function is bound, arriving
+// here runs the predicate as C++ until execution leaves it. Unbound
+// (or while debugging) it does nothing.
+//
+template<> class wam_instruction<NATIVE> : public wam_instruction_base {
+public:
+    inline wam_instruction(uint32_t offset) :
+	wam_instruction_base(&invoke, sizeof(*this), NATIVE),
+	offset_(offset), fn_(nullptr) {
+	init();
+    }
+
+    inline static void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    // Words from the start of the predicate
+    inline uint32_t offset() const { return offset_; }
+
+    inline native_fn native() const { return fn_; }
+    inline void set_native(native_fn fn) { fn_ = fn; }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self);
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self);
+
+private:
+    uint32_t offset_;
+    native_fn fn_;
+};
+
 
 class wam_interpreter : public interpreter_base, public wam_code
 {
@@ -599,13 +807,6 @@ public:
 
     typedef common::term term;
 
-    inline wam_hash_map * new_hash_map()
-    {
-	auto *map = new wam_hash_map();
-	hash_maps_.push_back(map);
-	return map;
-    }
-
     inline std::string to_string(const term t,
 				 common::term_emitter::style style
 			  	    = common::term_emitter::STYLE_TERM) const
@@ -625,6 +826,45 @@ public:
 	}
     }
 
+    //
+    // Instruction pair and triple frequencies. Use these to find the
+    // sequences worth fusing into superinstructions. Profiling runs
+    // on the ordinary (slow) WAM loop.
+    //
+    inline void set_wam_profiling(bool on)
+    { wam_profiling_ = on; }
+
+    inline bool is_wam_profiling() const
+    { return wam_profiling_; }
+
+    void reset_wam_profile();
+    void print_wam_profile(std::ostream &out, size_t top = 20) const;
+
+    static const char * instruction_name(wam_instruction_type t);
+
+    //
+    // Ahead-of-time compiled predicates (see wam_aot.hpp.) Native
+    // functions are registered under the fingerprint of the code they
+    // were generated from. With native code enabled the loader adds
+    // NATIVE entries to what it loads and binds the function that
+    // matches, if any.
+    //
+    inline void register_native(uint64_t fingerprint, native_fn fn)
+    { natives_[fingerprint] = fn; }
+
+    inline native_fn find_native(uint64_t fingerprint) const
+    { auto it = natives_.find(fingerprint);
+      return (it == natives_.end()) ? nullptr : it->second; }
+
+    inline size_t num_natives() const
+    { return natives_.size(); }
+
+    inline void set_native_enabled(bool on)
+    { native_enabled_ = on; }
+
+    inline bool is_native_enabled() const
+    { return native_enabled_; }
+
 protected:
 
     inline bool backtrack_wam()
@@ -636,10 +876,34 @@ protected:
     int cnt = 0;
 
     bool cont_wam();
+
 private:
+    void cont_wam_fast();
+
+    inline void profile_instruction(wam_instruction_type t)
+    {
+	if (prof_last_[1] != LAST) {
+	    prof_pairs_[(prof_last_[1] << 8) | t]++;
+	    if (prof_last_[0] != LAST) {
+		prof_triples_[(prof_last_[0] << 16) | (prof_last_[1] << 8) | t]++;
+	    }
+	}
+	prof_last_[0] = prof_last_[1];
+	prof_last_[1] = t;
+    }
+
+    bool wam_profiling_;
+    wam_instruction_type prof_last_[2];
+    std::unordered_map<uint32_t, uint64_t> prof_pairs_;
+    std::unordered_map<uint32_t, uint64_t> prof_triples_;
+
     bool fail_;
 
+    bool native_enabled_;
+    std::unordered_map<uint64_t, native_fn> natives_;
+
     template<wam_instruction_type I> friend class wam_instruction;
+    friend class wam_native;
 
     static inline size_t num_y(interpreter_base *interp, environment_base_t *e)
     {
@@ -662,6 +926,12 @@ private:
 
     inline void backtrack()
     {
+        if (shallow_) {
+	    // Restored by the retry/trust instruction at the alternative
+	    set_b0(shallow_b0_);
+	    set_p(shallow_bp_);
+	    return;
+	}
         if (b() == top_b()) {
 	    if (b() != nullptr) {
 		set_b0(b()->b0);
@@ -682,11 +952,18 @@ private:
 	}
     }
 
+    // Stack address of the newest choice point. Without one there is
+    // nothing to go back to, so no stack variable needs trailing.
+    inline size_t b_stack_addr()
+    {
+        return (b() != nullptr) ? to_stack_addr(base(b())) : 0;
+    }
+
     inline void tidy_trail()
     {
         size_t i = (b() != nullptr) ? b()->tr: 0;
 	size_t tr = trail_size();
-	size_t bb = to_stack_addr(base(b()));
+	size_t bb = b_stack_addr();
 
 	while (i < tr) {
 	    if (trail_get(i) < get_register_hb() ||
@@ -715,7 +992,7 @@ private:
 
     inline void trail(size_t a)
     {
-        size_t bb = to_stack_addr(base(b()));
+        size_t bb = shallow_ ? to_stack_addr(shallow_at_) : b_stack_addr();
 	if (a < get_register_hb() || (is_stack(a) && a < bb)) {
 	    push_trail(a);
 	}
@@ -723,11 +1000,38 @@ private:
 
     enum mode_t { READ, WRITE } mode_;
 
+    //
+    // Shallow backtracking. try_me_else/try only note the alternative
+    // and where its choice point would go; the choice point is written
+    // when the clause gets past its head and guard with the alternative
+    // still there, i.e. before anything that overwrites argument
+    // registers or leaves the clause. A head or guard that fails goes
+    // straight to the alternative. Environments allocated meanwhile are
+    // put above the slot. (qr and pr are only changed by call/execute,
+    // so these are taken as they are when the choice point is written.)
+    //
+    bool shallow_;
+    code_point shallow_bp_;
+    environment_saved_t shallow_ce_;
+    code_point shallow_cp_;
+    choice_point_t *shallow_b0_;
+    size_t shallow_tr_;
+    size_t shallow_h_;
+    size_t shallow_arity_;
+    word_t *shallow_at_;
+
     size_t register_s_;
 
-    std::vector<wam_hash_map *> hash_maps_;
 
-    term register_xn_[1024];
+public:
+    static const size_t MAX_X_REGS = 1024;
+    static const size_t MAX_ARITH_REGS = 256;
+
+private:
+    term register_xn_[MAX_X_REGS];
+
+private:
+    term register_rn_[MAX_ARITH_REGS];
 
   public:
     inline void next_instruction(code_point &p)
@@ -748,13 +1052,20 @@ private:
         next_instruction(p());
     }
 
+    // The instructions only see heap addresses the engine produced
+    // itself, so the heap is accessed unchecked (see term.hpp.)
+    inline term heap_get(size_t index)
+    {
+        return term_env::heap_get<common::heap_unchecked>(index);
+    }
+
     inline term deref_stack(common::ref_cell ref)
     {
         term t1 = to_stack(ref)->term;
         while (t1.tag() == common::tag_t::REF) {
   	    auto &ref1 = static_cast<common::ref_cell &>(t1);
 	    if (!is_stack(ref)) {
-	        return term_env::deref(t1);
+	        return term_env::deref<common::heap_unchecked>(t1);
 	    }
 	    term t2 = heap_get(ref1.index());
 	    if (t1 == t2) {
@@ -771,7 +1082,7 @@ private:
 	    if (is_stack(ref)) {
 	        return deref_stack(ref);
 	    } else {
-	        return term_env::deref(t);
+	        return term_env::deref<common::heap_unchecked>(t);
 	    }
         } else {
 	    return t;
@@ -790,6 +1101,7 @@ private:
 
     inline void put_variable_x(uint32_t xn, uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         term ref = new_ref();
 	x(xn) = ref;
 	a(ai) = ref;
@@ -798,6 +1110,7 @@ private:
 
     inline void put_variable_y(uint32_t yn, uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         term ref = new_ref();
 	y(yn) = ref;
 	a(ai) = ref;
@@ -806,18 +1119,21 @@ private:
 
     inline void put_value_x(uint32_t xn, uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         a(ai) = x(xn);
 	goto_next_instruction();
     }
 
     inline void put_value_y(uint32_t yn, uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         a(ai) = y(yn);
 	goto_next_instruction();
     }
 
     inline void put_unsafe_value_y(uint32_t yn, uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         term t = deref(y(yn));
 
 	if (t.tag() != common::tag_t::REF) {
@@ -838,6 +1154,7 @@ private:
 
     inline void put_structure_a(common::con_cell f, uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         a(ai) = new_term_con(f);
 	goto_next_instruction();
     }
@@ -856,6 +1173,7 @@ private:
   
     inline void put_list_a(uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         a(ai) = new_dotted_pair();
 	goto_next_instruction();
     }
@@ -874,6 +1192,7 @@ private:
 
     inline void put_constant(term c, uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         a(ai) = c;
 	goto_next_instruction();
     }
@@ -942,7 +1261,7 @@ private:
 	  }
 	case common::tag_t::STR: {
   	    auto str = static_cast<common::str_cell &>(t);
-	    common::con_cell c = functor(str);
+	    common::con_cell c = functor<common::heap_unchecked>(str);
 	    if (c == f) {
 	        register_s_ = str.index() + 1;
 		mode_ = READ;
@@ -1006,6 +1325,7 @@ private:
 
     inline void set_variable_a(uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         term t = new_ref();
 	a(ai) = t;
 	goto_next_instruction();
@@ -1091,6 +1411,7 @@ private:
 
     inline void unify_variable_a(uint32_t ai)
     {
+	if (shallow_) write_choice_point();
         switch (mode_) {
 	case READ: a(ai) = heap_get(register_s_); break;
 	case WRITE: a(ai) = new_ref(); break;
@@ -1268,7 +1589,11 @@ private:
 
     inline void allocate()
     {
-        allocate_environment(true);
+        if (shallow_) {
+	    allocate_environment(true, shallow_env_slot());
+	} else {
+	    allocate_environment(true);
+	}
 	goto_next_instruction();
     }
 
@@ -1284,6 +1609,7 @@ private:
 
     inline void call(code_point &p1, size_t arity, uint32_t num_stack)
     {
+	if (shallow_) write_choice_point();
         set_cp(p());
 	next_instruction(cp());
         set_p(p1);
@@ -1294,28 +1620,46 @@ private:
 	    for (size_t i = 0; i < arity; i++) {
 		a(i) = deref(a(i));
 	    }
+	    // Go back to simple interpreter
 	    allocate_environment(false);
 	    set_cp(empty_list());
-	    return; // Go back to simple interpreter
 	}
+	tick();
     }
 
     inline void execute(code_point &p1, size_t arity)
     {
+	if (shallow_) write_choice_point();
         set_num_of_args(arity);
 	set_b0(b());
 	set_p(p1);
+	tick();
     }
 
 protected:
     inline void proceed()
     {
+	if (shallow_) write_choice_point();
         set_p(cp());
     }
 private:
 
+    // An exception raised by the builtin is handled outside the WAM
+    // (see interpreter::fail.)
+    inline void fail_builtin()
+    {
+	if (has_pending_exception()) {
+	    shallow_ = false;
+	    set_p(code_point::fail());
+	    fail_ = true;
+	} else {
+	    backtrack();
+	}
+    }
+
     inline bool builtin_r(wam_instruction_base *p0)
     {
+	if (shallow_) write_choice_point();
         auto bn = reinterpret_cast<wam_instruction<BUILTIN_R> *>(p0);
 	size_t num_args = bn->arity();
 	set_num_of_args(num_args);
@@ -1332,7 +1676,7 @@ private:
 	set_cp(empty_list());
 	bool r = fn(*this, bn->arity(), args);
 	if (!r) {
-	    backtrack();
+	    fail_builtin();
 	}
 	return r;
     }
@@ -1351,11 +1695,173 @@ private:
 	prologcoin::interp::builtin_fn fn = bn->bn();
 	bool r = fn(*this, bn->arity(), args);
 	if (!r) {
-	    backtrack();
+	    fail_builtin();
 	}
 	return r;
     }
 
+    //
+    // Compiled arithmetic. Expressions are evaluated into the R
+    // registers (r0, r1, ...) as on a stack: an operation or
+    // comparison at rn takes rn and rn+1 and leaves its result in rn.
+    // Integers are done inline; anything else (an operand that is
+    // not an integer or a result that doesn't fit) is handed to the
+    // generic evaluator (arithmetics::eval), which also gives the
+    // errors. ctx is the goal we came from (e.g. is/2) for these.
+    //
+    inline term & r(size_t i)
+    {
+        return register_rn_[i];
+    }
+
+    inline void arith_load_x(uint32_t xn, uint32_t rn)
+    {
+        r(rn) = deref(x(xn));
+	goto_next_instruction();
+    }
+
+    inline void arith_load_y(uint32_t yn, uint32_t rn)
+    {
+        r(rn) = deref(y(yn));
+	goto_next_instruction();
+    }
+
+    inline void arith_load_constant(term c, uint32_t rn)
+    {
+        r(rn) = c;
+	goto_next_instruction();
+    }
+
+    inline bool arith_ints(uint32_t rn, int64_t &v1, int64_t &v2)
+    {
+        term t1 = r(rn), t2 = r(rn+1);
+	if (t1.tag() != common::tag_t::INT || t2.tag() != common::tag_t::INT) {
+	    return false;
+	}
+	v1 = static_cast<common::int_cell &>(t1).value();
+	v2 = static_cast<common::int_cell &>(t2).value();
+	return true;
+    }
+
+    inline void arith_result(uint32_t rn, int64_t v, common::con_cell ctx,
+			     common::con_cell f)
+    {
+        if (common::int_cell::fits(v)) {
+	    r(rn) = common::int_cell(v);
+	    goto_next_instruction();
+	} else {
+	    arith_eval(ctx, rn, f);
+	}
+    }
+
+    inline void arith_add(common::con_cell ctx, uint32_t rn)
+    {
+        static const common::con_cell f("+", 2);
+        int64_t v1, v2;
+	if (arith_ints(rn, v1, v2)) {
+	    arith_result(rn, v1 + v2, ctx, f);
+	} else {
+	    arith_eval(ctx, rn, f);
+	}
+    }
+
+    inline void arith_sub(common::con_cell ctx, uint32_t rn)
+    {
+        static const common::con_cell f("-", 2);
+        int64_t v1, v2;
+	if (arith_ints(rn, v1, v2)) {
+	    arith_result(rn, v1 - v2, ctx, f);
+	} else {
+	    arith_eval(ctx, rn, f);
+	}
+    }
+
+    inline void arith_mul(common::con_cell ctx, uint32_t rn)
+    {
+        static const common::con_cell f("*", 2);
+        int64_t v1, v2, v;
+	if (arith_ints(rn, v1, v2) && !__builtin_mul_overflow(v1, v2, &v)) {
+	    arith_result(rn, v, ctx, f);
+	} else {
+	    arith_eval(ctx, rn, f);
+	}
+    }
+
+    // Compare rn with rn+1 and continue if the order (-1, 0 or 1)
+    // satisfies cond.
+    template<typename Cond> inline void arith_compare(common::con_cell ctx,
+						       uint32_t rn, Cond cond)
+    {
+        int64_t v1, v2;
+	int c;
+	if (arith_ints(rn, v1, v2)) {
+	    c = (v1 < v2) ? -1 : (v1 > v2) ? 1 : 0;
+	} else {
+	    c = arith_compare_slow(ctx, rn);
+	    if (has_pending_exception()) {
+		fail_builtin();
+		return;
+	    }
+	}
+	if (cond(c)) {
+	    goto_next_instruction();
+	} else {
+	    backtrack();
+	}
+    }
+
+    inline void arith_lt(common::con_cell ctx, uint32_t rn)
+    { arith_compare(ctx, rn, [](int c) { return c < 0; }); }
+
+    inline void arith_le(common::con_cell ctx, uint32_t rn)
+    { arith_compare(ctx, rn, [](int c) { return c <= 0; }); }
+
+    inline void arith_gt(common::con_cell ctx, uint32_t rn)
+    { arith_compare(ctx, rn, [](int c) { return c > 0; }); }
+
+    inline void arith_ge(common::con_cell ctx, uint32_t rn)
+    { arith_compare(ctx, rn, [](int c) { return c >= 0; }); }
+
+    inline void arith_eq(common::con_cell ctx, uint32_t rn)
+    { arith_compare(ctx, rn, [](int c) { return c == 0; }); }
+
+    inline void arith_ne(common::con_cell ctx, uint32_t rn)
+    { arith_compare(ctx, rn, [](int c) { return c != 0; }); }
+
+    inline void arith_get_variable_x(uint32_t xn, uint32_t rn)
+    {
+        x(xn) = r(rn);
+	goto_next_instruction();
+    }
+
+    inline void arith_get_variable_y(uint32_t yn, uint32_t rn)
+    {
+        y(yn) = r(rn);
+	goto_next_instruction();
+    }
+
+    inline void arith_get_value_x(uint32_t xn, uint32_t rn)
+    {
+        if (!unify(x(xn), r(rn))) {
+	    backtrack();
+	} else {
+	    goto_next_instruction();
+	}
+    }
+
+    inline void arith_get_value_y(uint32_t yn, uint32_t rn)
+    {
+        if (!unify(y(yn), r(rn))) {
+	    backtrack();
+	} else {
+	    goto_next_instruction();
+	}
+    }
+
+    void arith_eval(common::con_cell ctx, uint32_t rn, common::con_cell f);
+    int arith_compare_slow(common::con_cell ctx, uint32_t rn);
+    std::string arith_context(common::con_cell ctx);
+
     void retry_choice_point(code_point &p_else)
     {
         size_t n = b()->arity;
@@ -1383,26 +1889,97 @@ private:
 	trim_trail(b()->tr);
 	trim_heap(b()->h);
         set_b(b()->b);
-	if (b() != nullptr) {
-	    set_register_hb(b()->h);
+	reset_register_hb();
+    }
+
+    // Note the alternative instead of allocating its choice point
+    // (see shallow_.)
+    inline void shallow_try(const code_point &alt)
+    {
+        if (shallow_) {
+	    write_choice_point();
+	}
+	shallow_at_ = choice_point_slot();
+	shallow_bp_ = alt;
+	shallow_ce_ = save_e();
+	shallow_cp_ = cp();
+	shallow_b0_ = b0();
+	shallow_tr_ = trail_size();
+	shallow_h_ = heap_size();
+	shallow_arity_ = num_of_args();
+	set_register_hb(heap_size());
+	shallow_ = true;
+    }
+
+    // As retry_choice_point, but the argument registers are intact.
+    inline void shallow_retry()
+    {
+	set_e(shallow_ce_);
+	set_cp(shallow_cp_);
+	set_num_of_args(shallow_arity_);
+	unwind_trail(shallow_tr_, trail_size());
+	trim_trail(shallow_tr_);
+	trim_heap(shallow_h_);
+	set_register_hb(heap_size());
+    }
+
+    inline void shallow_trust()
+    {
+	shallow_retry();
+	shallow_ = false;
+	reset_register_hb();
+    }
+
+    inline void write_choice_point()
+    {
+	auto *new_b = reinterpret_cast<choice_point_t *>(shallow_at_);
+	new_b->arity = shallow_arity_;
+	for (size_t i = 0; i < shallow_arity_; i++) {
+	    new_b->ai[i] = a(i);
 	}
+	new_b->ce = shallow_ce_;
+	new_b->cp = shallow_cp_;
+	new_b->b = b();
+	new_b->bp = shallow_bp_;
+	new_b->tr = shallow_tr_;
+	new_b->h = shallow_h_;
+	new_b->b0 = shallow_b0_;
+	new_b->qr = qr();
+	new_b->pr = pr();
+	set_b(new_b);
+	shallow_ = false;
+    }
+
+    inline word_t * shallow_env_slot()
+    {
+	return shallow_at_ + words<term>()*shallow_arity_
+	                   + words<choice_point_t>();
     }
 
     inline void try_me_else(code_point &L)
     {
-	allocate_choice_point(L);
+	shallow_try(L);
 	goto_next_instruction();
     }
 
     inline void retry_me_else(code_point &L)
     {
-	retry_choice_point(L);
+	if (shallow_) {
+	    shallow_retry();
+	    shallow_bp_ = L;
+	} else {
+	    retry_choice_point(L);
+	}
 	goto_next_instruction();
     }
 
     inline void trust_me()
     {
-	trust_choice_point();
+	if (shallow_) {
+	    shallow_trust();
+	} else {
+	    trust_choice_point();
+	}
 	goto_next_instruction();
     }
 
@@ -1410,7 +1987,7 @@ private:
     {
         auto p1 = p();
 	next_instruction(p1);
-	allocate_choice_point(p1);
+	shallow_try(p1);
 	set_p(L);
     }
 
@@ -1418,22 +1995,42 @@ private:
     {
         auto p1 = p();
 	next_instruction(p1);
-	retry_choice_point(p1);
-	set_p(L);
+	if (shallow_) {
+	    shallow_retry();
+	    shallow_bp_ = p1;
+	} else {
+	    retry_choice_point(p1);
+	}
+	set_p(L);
     }
 
     inline void trust(code_point &L)
     {
-	trust_choice_point();
+	if (shallow_) {
+	    shallow_trust();
+	} else {
+	    trust_choice_point();
+	}
 	set_p(L);
     }
 
-    inline void switch_on_term(const code_point &pv,
+    // The term a switch instruction dispatches on. A non-zero sub
+    // selects an argument (1-based) of the structure in the register.
+    inline term switch_term(uint32_t ai, uint32_t sub)
+    {
+	term t = deref(a(ai));
+	if (sub != 0) {
+	    t = deref(arg<common::heap_unchecked>(t, sub - 1));
+	}
+	return t;
+    }
+
+    inline void switch_on_term(term t,
+			       const code_point &pv,
 			       const code_point &pc,
 			       const code_point &pl,
 			       const code_point &ps)
     {
-	term t = deref(a(0));
 
 	switch (t.tag()) {
 	case common::tag_t::CON: case common::tag_t::INT:
@@ -1471,34 +2068,37 @@ private:
 	}
     }
 
-    inline void switch_on_constant(wam_hash_map &map)
+    inline void switch_on_constant(wam_instruction_switch_table &table)
     {
-	term t = deref(a(0));
-	auto it = map.find(t);
-	if (it == map.end()) {
+	term t = switch_term(table.ai(), table.sub());
+	auto *cp = table.find(t);
+	if (cp == nullptr) {
 	    backtrack();
 	} else {
-	    set_p(it->second);
+	    set_p(*cp);
 	}
     }
 
-    inline void switch_on_structure(wam_hash_map &map)
+    inline void switch_on_structure(wam_instruction_switch_table &table)
     {
-	term t = functor(deref(a(0)));
-
-	auto it = map.find(t);
-	if (it == map.end()) {
+	term t = functor<common::heap_unchecked>(switch_term(table.ai(), table.sub()));
+	auto *cp = table.find(t);
+	if (cp == nullptr) {
 	    backtrack();
 	} else {
-	    set_p(it->second);
+	    set_p(*cp);
 	}
     }
 
     inline void neck_cut()
     {
+        shallow_ = false;
         if (b() > b0()) {
 	    set_b(b0());
+	    reset_register_hb();
 	    tidy_trail();
+	} else {
+	    reset_register_hb();
 	}
 	goto_next_instruction();
     }
@@ -1513,9 +2113,13 @@ private:
     {
         auto b0 = reinterpret_cast<choice_point_t *>(
 	     to_stack(static_cast<common::int_cell &>(y(yn)).value()));
+	if (shallow_) {
+	    shallow_ = false;
+	    reset_register_hb();
+	}
 	if (b() > b0) {
 	    set_b(b0);
-	    if (b() != nullptr) set_register_hb(b()->h);
+	    reset_register_hb();
 	    tidy_trail();
 	}
 	goto_next_instruction();
@@ -1528,6 +2132,7 @@ private:
 
     inline void reset_level()
     {
+	if (shallow_) write_choice_point();
 	set_b0(b());
 	goto_next_instruction();
 	set_cp(p()); // This means a try_me_else will get the reset_level
@@ -1540,18 +2145,61 @@ private:
 	goto_next_instruction();
     }
 
-    friend class test_wam_interpreter;
-};
+    inline void put_value_x2(uint32_t xn1, uint32_t ai1,
+			     uint32_t xn2, uint32_t ai2)
+    {
+	if (shallow_) write_choice_point();
+        a(ai1) = x(xn1);
+        a(ai2) = x(xn2);
+	goto_next_instruction();
+    }
 
-inline void wam_code::update(code_t *old_base, code_t *new_base)
-{
-    wam_instruction_base *instr = reinterpret_cast<wam_instruction_base *>(new_base);
-    for (size_t i = 0; i < instrs_size_;) {
-	instr->update(old_base, new_base);
-	instr = interp_.next_instruction(instr);
-	i = static_cast<size_t>(reinterpret_cast<code_t *>(instr) - new_base);
+    inline void put_value_x_execute(uint32_t xn, uint32_t ai,
+				    code_point &p1, size_t arity)
+    {
+	if (shallow_) write_choice_point();
+        a(ai) = x(xn);
+	execute(p1, arity);
     }
-}
+
+    inline void unify_variable_x2(uint32_t xn1, uint32_t xn2)
+    {
+        switch (mode_) {
+	case READ:
+	    x(xn1) = heap_get(register_s_);
+	    x(xn2) = heap_get(register_s_+1);
+	    break;
+	case WRITE:
+	    x(xn1) = new_ref();
+	    x(xn2) = new_ref();
+	    break;
+        }
+	register_s_ += 2;
+	goto_next_instruction();
+    }
+
+    inline void allocate_get_variable_y(uint32_t yn, uint32_t ai)
+    {
+        if (shallow_) {
+	    allocate_environment(true, shallow_env_slot());
+	} else {
+	    allocate_environment(true);
+	}
+	y(yn) = a(ai);
+	goto_next_instruction();
+    }
+
+    inline void native(wam_instruction<NATIVE> *p0)
+    {
+	if (p0->native() == nullptr || is_debug() || is_wam_profiling()) {
+	    goto_next_instruction();
+	} else {
+	    p0->native()(*this, p0);
+	}
+    }
+
+    friend class test_wam_interpreter;
+};
 
 template<> class wam_instruction<PUT_VARIABLE_X> : public wam_instruction_binary_reg {
 public:
@@ -2913,12 +3561,6 @@ inline void wam_instruction<CALL>::print(std::ostream &out, wam_interpreter &int
     out << ", " << self1->num_y();
 }
 
-inline void wam_instruction<CALL>::updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-{
-    auto self1 = reinterpret_cast<wam_instruction<CALL> *>(self);
-    self1->update(old_base, new_base);
-}
-
 template<> class wam_instruction<EXECUTE> : public wam_instruction_code_point {
 public:
     inline wam_instruction(common::con_cell l) :
@@ -2926,19 +3568,19 @@ public:
         init();
     }
 
+    inline wam_instruction(common::con_cell module, common::con_cell l) :
+        wam_instruction_code_point(&invoke, sizeof(*this), EXECUTE,
+				   code_point(module, l)) {
+        init();
+    }
+
     static inline void init() {
 	static bool init_ = [] {
 	    register_printer(&invoke, &print);
-	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init_);
     }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	update_ptr(p(), old_base, new_base);
-    }
-
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
@@ -2956,12 +3598,6 @@ public:
 	interp.execute(self1->p(), self1->arity());
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<EXECUTE> *>(self);
-	self1->update(old_base, new_base);	
-    }
-
     static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<EXECUTE> *>(self);
@@ -3034,7 +3670,6 @@ public:
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3042,11 +3677,6 @@ public:
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	update_ptr(p(), old_base, new_base);
-    }
-
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<TRY_ME_ELSE> *>(self);
@@ -3059,11 +3689,6 @@ public:
 	out << "try_me_else " << interp.to_string(self1->p());
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<TRY_ME_ELSE> *>(self);
-	self1->update(old_base, new_base);
-    }
 };
 
 template<> class wam_instruction<RETRY_ME_ELSE> : public wam_instruction_code_point {
@@ -3076,7 +3701,6 @@ public:
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3084,11 +3708,6 @@ public:
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-        update_ptr(p(), old_base, new_base);
-    }
-
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<RETRY_ME_ELSE> *>(self);
@@ -3101,11 +3720,6 @@ public:
 	out << "retry_me_else " << interp.to_string(self1->p());
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<RETRY_ME_ELSE> *>(self);
-	self1->update(old_base, new_base);
-    }
 };
 
 template<> class wam_instruction<TRUST_ME> : public wam_instruction_base {
@@ -3146,7 +3760,6 @@ public:
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3154,11 +3767,6 @@ public:
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	update_ptr(p(), old_base, new_base);
-    }
-
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<TRY> *>(self);
@@ -3171,11 +3779,6 @@ public:
 	out << "try " << interp.to_string(self1->p());
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<TRY> *>(self);
-	self1->update(old_base, new_base);
-    }
 };
 
 template<> class wam_instruction<RETRY> : public wam_instruction_code_point {
@@ -3188,7 +3791,6 @@ public:
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3196,11 +3798,6 @@ public:
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	update_ptr(p(), old_base, new_base);
-    }
-
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<RETRY> *>(self);
@@ -3213,11 +3810,6 @@ public:
 	out << "retry " << interp.to_string(self1->p());
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<RETRY> *>(self);
-	self1->update(old_base, new_base);
-    }
 };
 
 template<> class wam_instruction<TRUST> : public wam_instruction_code_point {
@@ -3230,7 +3822,6 @@ public:
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3238,11 +3829,6 @@ public:
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	update_ptr(p(), old_base, new_base);
-    }
-
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<TRUST> *>(self);
@@ -3255,11 +3841,6 @@ public:
 	out << "trust " << interp.to_string(self1->p());
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<TRUST> *>(self);
-	self1->update(old_base, new_base);
-    }
 };
 
 template<> class wam_instruction<SWITCH_ON_TERM> : public wam_instruction_base {
@@ -3267,16 +3848,17 @@ public:
       inline wam_instruction(code_point pv,
 			     code_point pc,
 			     code_point pl,
-			     code_point ps) :
+			     code_point ps,
+			     uint32_t ai = 0,
+			     uint32_t sub = 0) :
       wam_instruction_base(&invoke, sizeof(*this), SWITCH_ON_TERM),
-      pv_(pv), pc_(pc), pl_(pl), ps_(ps) {
+      ai_(ai), sub_(sub), pv_(pv), pc_(pc), pl_(pl), ps_(ps) {
       init();
     }
 
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3285,25 +3867,22 @@ public:
     inline code_point & pc() { return pc_; }
     inline code_point & pl() { return pl_; }
     inline code_point & ps() { return ps_; }
-
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-        update_ptr(pv_, old_base, new_base);
-	update_ptr(pc_, old_base, new_base);
-	update_ptr(pl_, old_base, new_base);
-	update_ptr(ps_, old_base, new_base);
-    }
+    inline uint32_t ai() const { return ai_; }
+    inline uint32_t sub() const { return sub_; }
 
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_TERM> *>(self);
-	interp.switch_on_term(self1->pv(), self1->pc(), self1->pl(), self1->ps());
+	interp.switch_on_term(interp.switch_term(self1->ai(), self1->sub()),
+			      self1->pv(), self1->pc(), self1->pl(), self1->ps());
     }
 
     static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_TERM> *>(self);
 	out << "switch_on_term ";
+	print_switch_arg(out, self1->ai(), self1->sub());
+	out << ", ";
         if (self1->pv().is_fail()) {
 	    out << "V->fail";
 	} else {
@@ -3329,29 +3908,30 @@ public:
 	}
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_TERM> *>(self);
-	self1->update(old_base, new_base);
-    }
-
+    uint16_t ai_;
+    uint16_t sub_;
     code_point pv_;
     code_point pc_;
     code_point pl_;
     code_point ps_;
 };
 
-template<> class wam_instruction<SWITCH_ON_CONSTANT> : public wam_instruction_hash_map {
+template<> class wam_instruction<SWITCH_ON_CONSTANT> : public wam_instruction_switch_table {
 public:
-    inline wam_instruction(wam_hash_map *map) :
-      wam_instruction_hash_map(&invoke, sizeof(*this), SWITCH_ON_CONSTANT,map){
-        init();
+    // The table is variable sized, so it is built into a buffer and
+    // copied from there.
+    static inline wam_instruction_base & make(const wam_switch_entries &entries,
+					      std::vector<code_t> &buf,
+					      uint32_t ai = 0,
+					      uint32_t sub = 0)
+    {
+	init();
+	return build(&invoke, SWITCH_ON_CONSTANT, entries, buf, ai, sub);
     }
 
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3359,36 +3939,38 @@ public:
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_CONSTANT> *>(self);
-	interp.switch_on_constant(self1->map());
+	interp.switch_on_constant(*self1);
     }
 
     static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_CONSTANT> *>(self);
 	out << "switch_on_constant ";
+	print_switch_arg(out, self1->ai(), self1->sub());
+	out << ", ";
 	bool first = true;
-	for (auto &v : self1->map()) {
-	    if (!first) out << ", ";
-	    out << interp.to_string(v.first) << "->" << interp.to_string(v.second);
-	    first = false;
-	}
+	self1->for_each([&](common::term key, code_point &cp) {
+		if (!first) out << ", ";
+		out << interp.to_string(key) << "->" << interp.to_string(cp);
+		first = false;
+	    });
     }
-
-    wam_hash_map *map_;
 };
 
-template<> class wam_instruction<SWITCH_ON_STRUCTURE> : public wam_instruction_hash_map {
+template<> class wam_instruction<SWITCH_ON_STRUCTURE> : public wam_instruction_switch_table {
 public:
-    inline wam_instruction(wam_hash_map *map) :
-        wam_instruction_hash_map(&invoke, sizeof(*this), SWITCH_ON_STRUCTURE,
-				 map) {
-        init();
+    static inline wam_instruction_base & make(const wam_switch_entries &entries,
+					      std::vector<code_t> &buf,
+					      uint32_t ai = 0,
+					      uint32_t sub = 0)
+    {
+	init();
+	return build(&invoke, SWITCH_ON_STRUCTURE, entries, buf, ai, sub);
     }
 
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3396,27 +3978,23 @@ public:
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_STRUCTURE> *>(self);
-	interp.switch_on_structure(self1->map());
+	interp.switch_on_structure(*self1);
     }
 
     static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_STRUCTURE> *>(self);
 	out << "switch_on_structure ";
+	print_switch_arg(out, self1->ai(), self1->sub());
+	out << ", ";
 	bool first = true;
-	for (auto &v : self1->map()) {
-	    if (!first) out << ", ";
-	    auto str = static_cast<const common::str_cell &>(v.first);
-	    auto f = interp.functor(str);
-	    out << interp.to_string(v.first) << "/" << f.arity() << "->" << interp.to_string(v.second);
-	    first = false;
-	}
-    }
-
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<SWITCH_ON_STRUCTURE> *>(self);
-	self1->update(old_base, new_base);
+	self1->for_each([&](common::term key, code_point &cp) {
+		if (!first) out << ", ";
+		auto str = static_cast<const common::str_cell &>(key);
+		auto f = interp.functor(str);
+		out << interp.to_string(key) << "/" << f.arity() << "->" << interp.to_string(cp);
+		first = false;
+	    });
     }
 };
 
@@ -3516,7 +4094,6 @@ public:
     static inline void init() {
 	static bool init = [] {
  	    register_printer(&invoke, &print);
- 	    register_updater(&invoke, &updater);
 	    return true; } ();
 	static_cast<void>(init);
     }
@@ -3524,11 +4101,6 @@ public:
     inline const code_point & p() const { return cp(); }
     inline code_point & p() { return cp(); }
 
-    inline void update(code_t *old_base, code_t *new_base)
-    {
-	update_ptr(p(), old_base, new_base);
-    }
-
     static void invoke(wam_interpreter &interp, wam_instruction_base *self)
     {
 	auto self1 = reinterpret_cast<wam_instruction<GOTO> *>(self);
@@ -3541,11 +4113,6 @@ public:
 	out << "goto " << interp.to_string(self1->p());
     }
 
-    static void updater(wam_instruction_base *self, code_t *old_base, code_t *new_base)
-    {
-	auto self1 = reinterpret_cast<wam_instruction<GOTO> *>(self);
-	self1->update(old_base, new_base);
-    }
 };
 
 template<> class wam_instruction<RESET_LEVEL> : public wam_instruction_code_point_reg {
@@ -3615,11 +4182,682 @@ public:
     }
 };
 
+template<> class wam_instruction<PUT_VALUE_X2> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t xn1, uint32_t ai1,
+			   uint32_t xn2, uint32_t ai2) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this), PUT_VALUE_X2,
+				   xn1, ai1), xn2_(xn2), ai2_(ai2) {
+        init();
+    }
 
-template<wam_instruction_type I> inline void wam_instruction_base::set_type()
-{
-    wam_instruction<I>::init();
-    set_type(&wam_instruction<I>::invoke, I);
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t xn1() const { return reg_1(); }
+    inline uint32_t ai1() const { return reg_2(); }
+    inline uint32_t xn2() const { return xn2_; }
+    inline uint32_t ai2() const { return ai2_; }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<PUT_VALUE_X2> *>(self);
+        interp.put_value_x2(self1->xn1(), self1->ai1(),
+			    self1->xn2(), self1->ai2());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<PUT_VALUE_X2> *>(self);
+        out << "put_value x" << self1->xn1() << ", a" << self1->ai1()
+	    << " + put_value x" << self1->xn2() << ", a" << self1->ai2();
+    }
+
+private:
+    uint16_t xn2_;
+    uint16_t ai2_;
+};
+
+// Starts with the same layout as EXECUTE so the code point can be
+// bound and patched as any other call.
+template<> class wam_instruction<PUT_VALUE_X_EXECUTE> : public wam_instruction_code_point {
+public:
+    inline wam_instruction(uint32_t xn, uint32_t ai, const code_point &p) :
+        wam_instruction_code_point(&invoke, sizeof(*this),
+				   PUT_VALUE_X_EXECUTE, p),
+	ai_(ai) {
+	reg_ = xn;
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline const code_point & p() const { return cp(); }
+    inline code_point & p() { return cp(); }
+
+    inline common::con_cell pn() const
+    { auto c = p().term_code();
+      common::con_cell &cc = static_cast<common::con_cell &>(c);
+      return cc;
+    }
+
+    inline size_t arity() const { return pn().arity(); }
+    inline uint32_t xn() const { return reg_; }
+    inline uint32_t ai() const { return ai_; }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+	auto self1 = reinterpret_cast<wam_instruction<PUT_VALUE_X_EXECUTE> *>(self);
+	interp.put_value_x_execute(self1->xn(), self1->ai(),
+				   self1->p(), self1->arity());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+	auto self1 = reinterpret_cast<wam_instruction<PUT_VALUE_X_EXECUTE> *>(self);
+	out << "put_value x" << self1->xn() << ", a" << self1->ai()
+	    << " + execute " << interp.to_string(self1->pn()) << "/"
+	    << self1->arity();
+	if (self1->p().wam_code() != nullptr) {
+	    out << " " << interp.to_string(self1->p());
+	}
+    }
+
+private:
+    uint16_t ai_;
+};
+
+template<> class wam_instruction<UNIFY_VARIABLE_X2> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t xn1, uint32_t xn2) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this), UNIFY_VARIABLE_X2,
+				   xn1, xn2) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t xn1() const { return reg_1(); }
+    inline uint32_t xn2() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<UNIFY_VARIABLE_X2> *>(self);
+        interp.unify_variable_x2(self1->xn1(), self1->xn2());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<UNIFY_VARIABLE_X2> *>(self);
+        out << "unify_variable x" << self1->xn1()
+	    << " + unify_variable x" << self1->xn2();
+    }
+};
+
+template<> class wam_instruction<ALLOCATE_GET_VARIABLE_Y> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t yn, uint32_t ai) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this),
+				   ALLOCATE_GET_VARIABLE_Y, yn, ai) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t yn() const { return reg_1(); }
+    inline uint32_t ai() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ALLOCATE_GET_VARIABLE_Y> *>(self);
+        interp.allocate_get_variable_y(self1->yn(), self1->ai());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ALLOCATE_GET_VARIABLE_Y> *>(self);
+        out << "allocate + get_variable y" << self1->yn() << ", a" << self1->ai();
+    }
+};
+
+template<> class wam_instruction<ARITH_LOAD_X> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t xn, uint32_t rn) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this),
+				   ARITH_LOAD_X, xn, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t xn() const { return reg_1(); }
+    inline uint32_t rn() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LOAD_X> *>(self);
+        interp.arith_load_x(self1->xn(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LOAD_X> *>(self);
+        out << "arith_load " << "x" << self1->xn() << ", r" << self1->rn();
+    }
+};
+
+template<> class wam_instruction<ARITH_LOAD_Y> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t yn, uint32_t rn) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this),
+				   ARITH_LOAD_Y, yn, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t yn() const { return reg_1(); }
+    inline uint32_t rn() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LOAD_Y> *>(self);
+        interp.arith_load_y(self1->yn(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LOAD_Y> *>(self);
+        out << "arith_load " << "y" << self1->yn() << ", r" << self1->rn();
+    }
+};
+
+template<> class wam_instruction<ARITH_LOAD_CONSTANT> : public wam_instruction_term_reg {
+public:
+    inline wam_instruction(common::term c, uint32_t rn) :
+	wam_instruction_term_reg(&invoke, sizeof(*this), ARITH_LOAD_CONSTANT,
+				 c, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::term c() const { return get_term(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LOAD_CONSTANT> *>(self);
+        interp.arith_load_constant(self1->c(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LOAD_CONSTANT> *>(self);
+        out << "arith_load " << interp.to_string(self1->c()) << ", r" << self1->rn();
+    }
+};
+
+template<> class wam_instruction<ARITH_ADD> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_ADD, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_ADD> *>(self);
+        interp.arith_add(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_ADD> *>(self);
+        out << "arith_add r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_SUB> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_SUB, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_SUB> *>(self);
+        interp.arith_sub(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_SUB> *>(self);
+        out << "arith_sub r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_MUL> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_MUL, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_MUL> *>(self);
+        interp.arith_mul(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_MUL> *>(self);
+        out << "arith_mul r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_LT> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_LT, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LT> *>(self);
+        interp.arith_lt(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LT> *>(self);
+        out << "arith_lt r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_LE> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_LE, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LE> *>(self);
+        interp.arith_le(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_LE> *>(self);
+        out << "arith_le r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_GT> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_GT, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GT> *>(self);
+        interp.arith_gt(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GT> *>(self);
+        out << "arith_gt r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_GE> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_GE, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GE> *>(self);
+        interp.arith_ge(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GE> *>(self);
+        out << "arith_ge r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_EQ> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_EQ, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_EQ> *>(self);
+        interp.arith_eq(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_EQ> *>(self);
+        out << "arith_eq r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_NE> : public wam_instruction_con_reg {
+public:
+    inline wam_instruction(common::con_cell ctx, uint32_t rn) :
+	wam_instruction_con_reg(&invoke, sizeof(*this), ARITH_NE, ctx, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline common::con_cell ctx() const { return con(); }
+    inline uint32_t rn() const { return reg(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_NE> *>(self);
+        interp.arith_ne(self1->ctx(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_NE> *>(self);
+        out << "arith_ne r" << self1->rn() << ", r" << self1->rn()+1 << " (" << interp.to_string(self1->ctx()) << "/" << self1->ctx().arity() << ")";
+    }
+};
+
+template<> class wam_instruction<ARITH_GET_VARIABLE_X> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t xn, uint32_t rn) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this),
+				   ARITH_GET_VARIABLE_X, xn, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t xn() const { return reg_1(); }
+    inline uint32_t rn() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VARIABLE_X> *>(self);
+        interp.arith_get_variable_x(self1->xn(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VARIABLE_X> *>(self);
+        out << "arith_get_variable " << "x" << self1->xn() << ", r" << self1->rn();
+    }
+};
+
+template<> class wam_instruction<ARITH_GET_VARIABLE_Y> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t yn, uint32_t rn) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this),
+				   ARITH_GET_VARIABLE_Y, yn, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t yn() const { return reg_1(); }
+    inline uint32_t rn() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VARIABLE_Y> *>(self);
+        interp.arith_get_variable_y(self1->yn(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VARIABLE_Y> *>(self);
+        out << "arith_get_variable " << "y" << self1->yn() << ", r" << self1->rn();
+    }
+};
+
+template<> class wam_instruction<ARITH_GET_VALUE_X> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t xn, uint32_t rn) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this),
+				   ARITH_GET_VALUE_X, xn, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t xn() const { return reg_1(); }
+    inline uint32_t rn() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VALUE_X> *>(self);
+        interp.arith_get_value_x(self1->xn(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VALUE_X> *>(self);
+        out << "arith_get_value " << "x" << self1->xn() << ", r" << self1->rn();
+    }
+};
+
+template<> class wam_instruction<ARITH_GET_VALUE_Y> : public wam_instruction_binary_reg {
+public:
+    inline wam_instruction(uint32_t yn, uint32_t rn) :
+	wam_instruction_binary_reg(&invoke, sizeof(*this),
+				   ARITH_GET_VALUE_Y, yn, rn) {
+        init();
+    }
+
+    static inline void init() {
+	static bool init_ = [] {
+	    register_printer(&invoke, &print);
+	    return true; } ();
+	static_cast<void>(init_);
+    }
+
+    inline uint32_t yn() const { return reg_1(); }
+    inline uint32_t rn() const { return reg_2(); }
+
+    static void invoke(wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VALUE_Y> *>(self);
+        interp.arith_get_value_y(self1->yn(), self1->rn());
+    }
+
+    static void print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+    {
+        auto self1 = reinterpret_cast<wam_instruction<ARITH_GET_VALUE_Y> *>(self);
+        out << "arith_get_value " << "y" << self1->yn() << ", r" << self1->rn();
+    }
+};
+
+inline void wam_instruction<NATIVE>::invoke(wam_interpreter &interp, wam_instruction_base *self)
+{
+    auto self1 = reinterpret_cast<wam_instruction<NATIVE> *>(self);
+    interp.native(self1);
+}
+
+inline void wam_instruction<NATIVE>::print(std::ostream &out, wam_interpreter &interp, wam_instruction_base *self)
+{
+    static_cast<void>(interp);
+    auto self1 = reinterpret_cast<wam_instruction<NATIVE> *>(self);
+    out << "native " << self1->offset();
+    if (self1->native() == nullptr) {
+	out << " (unbound)";
+    }
+}
+
+template<wam_instruction_type I> inline void wam_instruction_base::set_type()
+{
+    wam_instruction<I>::init();
+    type_ = I;
+}
+
+template<size_t I> inline void wam_instruction_base::init_dispatch_from()
+{
+    const wam_instruction_type t = static_cast<wam_instruction_type>(I);
+    fns_[I] = &wam_instruction<t>::invoke;
+    wam_instruction<t>::init();
+    init_dispatch_from<I+1>();
+}
+
+template<> inline void wam_instruction_base::init_dispatch_from<LAST>()
+{
 }
 
 }}
@@ -0,0 +1,219 @@
+#pragma once
+
+#ifndef _interp_wam_native_hpp
+#define _interp_wam_native_hpp
+
+#include "wam_interpreter.hpp"
+
+namespace prologcoin { namespace interp {
+
+//
+// What ahead-of-time compiled code (see wam_aot.hpp) runs on. It is
+// bound to one predicate and addresses its instructions by offset (in
+// words) from the start of the predicate. Instructions with register
+// operands only are run with the registers as immediates; the others
+// go through their handler so constants, call targets and switch
+// tables are taken from the loaded code.
+//
+// P is kept up to date as in the WAM loop, except within argument
+// sequences that are split on read/write mode (the *_read and *_write
+// variants below); these are followed by at().
+//
+class wam_native {
+public:
+    static const size_t NONE = static_cast<size_t>(-1);
+
+    inline wam_native(wam_interpreter &interp, wam_instruction_base *entry)
+	: i_(interp),
+	  base_(reinterpret_cast<code_t *>(entry) -
+		reinterpret_cast<wam_instruction<NATIVE> *>(entry)->offset())
+    { }
+
+    inline wam_instruction_base * code(size_t offset) const
+    {
+	return reinterpret_cast<wam_instruction_base *>(base_ + offset);
+    }
+
+    // Where to continue: the offset of P, or NONE if we must return to
+    // the WAM loop (left WAM code, top fail or debugging turned on.)
+    // Offsets outside the predicate are left to the caller to reject.
+    inline size_t resume() const
+    {
+	auto *p = i_.p().wam_code();
+	if (p == nullptr || i_.is_top_fail() || i_.is_debug()) {
+	    return NONE;
+	}
+	return (reinterpret_cast<uintptr_t>(p) -
+		reinterpret_cast<uintptr_t>(base_)) / sizeof(code_t);
+    }
+
+    inline bool next_is(size_t offset) const
+    {
+	return i_.p().wam_code() == code(offset);
+    }
+
+    inline void at(size_t offset)
+    {
+	i_.p().set_wam_code(code(offset));
+    }
+
+    inline void backtrack()
+    {
+	i_.backtrack();
+    }
+
+    inline bool is_read() const
+    {
+	return i_.mode_ == wam_interpreter::READ;
+    }
+
+    template<wam_instruction_type I> inline void invoke(size_t offset)
+    {
+	wam_instruction<I>::invoke(i_, code(offset));
+    }
+
+#define WAM_NATIVE_OP(name) \
+    template<typename... Args> inline void name(Args... args) \
+    { i_.name(args...); }
+
+    WAM_NATIVE_OP(put_variable_x)
+    WAM_NATIVE_OP(put_variable_y)
+    WAM_NATIVE_OP(put_value_x)
+    WAM_NATIVE_OP(put_value_y)
+    WAM_NATIVE_OP(put_unsafe_value_y)
+    WAM_NATIVE_OP(put_list_a)
+    WAM_NATIVE_OP(put_list_x)
+    WAM_NATIVE_OP(put_list_y)
+    WAM_NATIVE_OP(get_variable_x)
+    WAM_NATIVE_OP(get_variable_y)
+    WAM_NATIVE_OP(get_value_x)
+    WAM_NATIVE_OP(get_value_y)
+    WAM_NATIVE_OP(get_list_a)
+    WAM_NATIVE_OP(get_list_x)
+    WAM_NATIVE_OP(get_list_y)
+    WAM_NATIVE_OP(set_variable_a)
+    WAM_NATIVE_OP(set_variable_x)
+    WAM_NATIVE_OP(set_variable_y)
+    WAM_NATIVE_OP(set_value_a)
+    WAM_NATIVE_OP(set_value_x)
+    WAM_NATIVE_OP(set_value_y)
+    WAM_NATIVE_OP(set_local_value_x)
+    WAM_NATIVE_OP(set_local_value_y)
+    WAM_NATIVE_OP(set_void)
+    WAM_NATIVE_OP(unify_variable_a)
+    WAM_NATIVE_OP(unify_variable_x)
+    WAM_NATIVE_OP(unify_variable_y)
+    WAM_NATIVE_OP(unify_value_a)
+    WAM_NATIVE_OP(unify_value_x)
+    WAM_NATIVE_OP(unify_value_y)
+    WAM_NATIVE_OP(unify_local_value_x)
+    WAM_NATIVE_OP(unify_local_value_y)
+    WAM_NATIVE_OP(unify_void)
+    WAM_NATIVE_OP(allocate)
+    WAM_NATIVE_OP(deallocate)
+    WAM_NATIVE_OP(proceed)
+    WAM_NATIVE_OP(trust_me)
+    WAM_NATIVE_OP(neck_cut)
+    WAM_NATIVE_OP(get_level)
+    WAM_NATIVE_OP(cut)
+    WAM_NATIVE_OP(reset_level)
+    WAM_NATIVE_OP(put_value_x2)
+    WAM_NATIVE_OP(unify_variable_x2)
+    WAM_NATIVE_OP(allocate_get_variable_y)
+    WAM_NATIVE_OP(arith_load_x)
+    WAM_NATIVE_OP(arith_load_y)
+    WAM_NATIVE_OP(arith_get_variable_x)
+    WAM_NATIVE_OP(arith_get_variable_y)
+    WAM_NATIVE_OP(arith_get_value_x)
+    WAM_NATIVE_OP(arith_get_value_y)
+
+#undef WAM_NATIVE_OP
+
+    //
+    // Argument sequences after get_structure/get_list with the mode
+    // known. These neither advance P nor backtrack; a failed
+    // unification returns false.
+    //
+    inline void unify_variable_a_read(uint32_t ai)
+    { if (i_.shallow_) i_.write_choice_point();
+      i_.a(ai) = i_.heap_get(i_.register_s_++); }
+
+    inline void unify_variable_x_read(uint32_t xn)
+    { i_.x(xn) = i_.heap_get(i_.register_s_++); }
+
+    inline void unify_variable_y_read(uint32_t yn)
+    { i_.y(yn) = i_.heap_get(i_.register_s_++); }
+
+    inline void unify_variable_a_write(uint32_t ai)
+    { if (i_.shallow_) i_.write_choice_point();
+      i_.a(ai) = i_.new_ref(); i_.register_s_++; }
+
+    inline void unify_variable_x_write(uint32_t xn)
+    { i_.x(xn) = i_.new_ref(); i_.register_s_++; }
+
+    inline void unify_variable_y_write(uint32_t yn)
+    { i_.y(yn) = i_.new_ref(); i_.register_s_++; }
+
+    inline void unify_variable_x2_read(uint32_t xn1, uint32_t xn2)
+    {
+	i_.x(xn1) = i_.heap_get(i_.register_s_);
+	i_.x(xn2) = i_.heap_get(i_.register_s_+1);
+	i_.register_s_ += 2;
+    }
+
+    inline void unify_variable_x2_write(uint32_t xn1, uint32_t xn2)
+    {
+	i_.x(xn1) = i_.new_ref();
+	i_.x(xn2) = i_.new_ref();
+	i_.register_s_ += 2;
+    }
+
+    inline bool unify_value_a_read(uint32_t ai)
+    { return i_.unify(i_.a(ai), i_.heap_get(i_.register_s_++)); }
+
+    inline bool unify_value_x_read(uint32_t xn)
+    { return i_.unify(i_.x(xn), i_.heap_get(i_.register_s_++)); }
+
+    inline bool unify_value_y_read(uint32_t yn)
+    { return i_.unify(i_.y(yn), i_.heap_get(i_.register_s_++)); }
+
+    inline bool unify_local_value_x_read(uint32_t xn)
+    { return i_.unify(i_.x(xn), i_.heap_get(i_.register_s_++)); }
+
+    inline void unify_value_a_write(uint32_t ai)
+    { i_.new_term_copy_cell(i_.a(ai)); i_.register_s_++; }
+
+    inline void unify_value_x_write(uint32_t xn)
+    { i_.new_term_copy_cell(i_.x(xn)); i_.register_s_++; }
+
+    inline void unify_value_y_write(uint32_t yn)
+    { i_.new_term_copy_cell(i_.y(yn)); i_.register_s_++; }
+
+    inline void unify_local_value_x_write(uint32_t xn)
+    {
+	common::term t = i_.deref(i_.x(xn));
+	if (t.tag() == common::tag_t::REF &&
+	    i_.is_stack(static_cast<common::ref_cell &>(t))) {
+	    auto ref = static_cast<common::ref_cell &>(t);
+	    auto h = i_.new_ref();
+	    i_.bind(ref, h);
+	} else {
+	    i_.new_term_copy_cell(t);
+	}
+	i_.register_s_++;
+    }
+
+    inline void unify_void_read(uint32_t n)
+    { i_.register_s_ += n; }
+
+    inline void unify_void_write(uint32_t n)
+    { i_.new_ref(n); }
+
+private:
+    wam_interpreter &i_;
+    code_t *base_;
+};
+
+}}
+
+#endif
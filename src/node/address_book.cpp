@@ -2,6 +2,13 @@
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <algorithm>
+#include <unordered_map>
+#include <limits>
+#include <string.h>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include "address_book.hpp"
 #include "ip_address.hpp"
 #include "../common/random.hpp"
@@ -10,6 +17,8 @@
 
 namespace prologcoin { namespace node {
 
+const size_t address_book::MIN_JOURNAL_RECORDS;
+
 address_entry::address_entry()
     : ip_service(), id_(0), score_(0), time_(0), version_major_(0),
       version_minor_(0)
@@ -21,7 +30,8 @@ address_entry::address_entry(const address_entry &other)
       score_(other.score_), time_(other.time_),
       version_major_(other.version_major_),
       version_minor_(other.version_minor_),
-      comment_(other.comment_)
+      comment_(other.comment_),
+      serialized_(other.serialized_)
 {
 }
 
@@ -70,6 +80,7 @@ void address_entry::set_comment(const common::term t, common::term_env &src)
     term_serializer ser(src);
     comment_.clear();
     ser.write(comment_, t);
+    serialized_.reset();
 }
 
 std::string address_entry::comment_str() const
@@ -107,6 +118,21 @@ common::term address_entry::to_term(common::term_env &env) const
     return term_entry;
 }
 
+const std::shared_ptr<const address_entry::buffer_t> &
+address_entry::serialized() const
+{
+    using namespace prologcoin::common;
+
+    if (!serialized_) {
+	term_env env;
+	term_serializer ser(env);
+	auto buf = std::make_shared<buffer_t>();
+	ser.write(*buf, to_term(env));
+	serialized_ = buf;
+    }
+    return serialized_;
+}
+
 bool address_entry::from_term(common::term_env &env, const common::term t) 
 {
     using namespace prologcoin::common;
@@ -329,7 +355,7 @@ std::string address_entry::str() const
 
 // --- address_book ---
 
-address_book::address_book() : id_count_(0), num_spilled_(0), spill_enabled_(true)
+address_book::address_book() : id_count_(0), num_spilled_(0), spill_enabled_(true), generation_(0), journal_records_(0)
 {
 }
 
@@ -364,21 +390,16 @@ void address_book::print(std::ostream &out, const std::vector<address_entry> &en
 
 void address_book::print(std::ostream &out, size_t n)
 {
-    std::vector<address_entry> entries;
-    size_t i = 0;
-    for (auto e : id_to_entry_) {
-	if (i >= n) {
-	    break;
-	}
-	entries.push_back(e.second);
-	i++;
+    auto entries = get_all();
+    if (entries.size() > n) {
+	entries.resize(n);
     }
     print(out, entries);
 }
 
 void address_book::print(std::ostream &out)
 {
-    print(out, id_to_entry_.size());
+    print(out, entries_.size());
 }
 
 std::string address_book::stat() const
@@ -405,7 +426,7 @@ void address_book::spill_check(const address_entry &e, address_book::spill_area
 	    auto spilled = top_10_collection_.spill(group);
 	    auto spill_id = ip_to_id_[spilled];
 	    num_spilled_++;
-	    remove(spill_id);
+	    erase(spill_id);
 	}
 	break;
     case SPILL_IN_90:
@@ -413,93 +434,131 @@ void address_book::spill_check(const address_entry &e, address_book::spill_area
 	    auto spilled = bottom_90_collection_.spill(group);
 	    auto spill_id = ip_to_id_[spilled];
 	    num_spilled_++;
-	    remove(spill_id);
+	    erase(spill_id);
 	}
 	break;
     case SPILL_IN_UNVERIFIED: {
-	auto key = e.source().group();
-	ip_collection &coll = unverified_[key];
+	ip_collection &coll = unverified_source(e.source().group());
 	if (coll.size() >= MAX_SOURCE_SIZE) {
- 	    auto to_spill = coll.spill();
-	    remove(to_spill);
+	    auto spilled = coll.spill();
 	    num_spilled_++;
+	    erase(ip_to_id_[spilled]);
 	}
 	if (coll.size(e.group()) >= MAX_GROUP_SIZE) {
-	    remove(coll.spill(e.group()));
+	    auto spilled = coll.spill(e.group());
 	    num_spilled_++;
+	    erase(ip_to_id_[spilled]);
 	}
 	break;
         }
     }
 }
 
+ip_collection & address_book::unverified_source(uint64_t group)
+{
+    auto it = unverified_index_.find(group);
+    if (it != unverified_index_.end()) {
+	return *unverified_[it->second].second;
+    }
+    unverified_index_[group] = unverified_.size();
+    unverified_.push_back(std::make_pair(group, std::unique_ptr<ip_collection>(new ip_collection())));
+    return *unverified_.back().second;
+}
+
+void address_book::swap_unverified(size_t i, size_t j)
+{
+    if (i == j) {
+	return;
+    }
+    std::swap(unverified_[i], unverified_[j]);
+    unverified_index_[unverified_[i].first] = i;
+    unverified_index_[unverified_[j].first] = j;
+}
+
 void address_book::add(const address_entry &e)
 {
-    if (ip_to_id_.find(e) != ip_to_id_.end()) {
+    if (ip_to_id_.count(e) != 0) {
 	// Already exists. Exit.
 	return;
     }
 
-    size_t new_id = ++id_count_;
-    e.set_id(new_id);
-    id_to_entry_.insert(std::make_pair(new_id, e));
-    ip_to_id_.insert(std::make_pair(e, new_id));
+    e.set_id(++id_count_);
+    insert(e);
+    calibrate();
+    journal_done();
+}
+
+// Insert an entry that already has an id
+void address_book::insert(const address_entry &e)
+{
+    id_count_ = std::max(id_count_, e.id());
+    id_to_index_.insert(std::make_pair(e.id(), entries_.size()));
+    entries_.push_back(e);
+    ip_to_id_.insert(std::make_pair(e, e.id()));
+    journal_add(e);
 
     if (e.source().is_zero()) {
-	score_entry sce = score_entry(e.score(),new_id);
-	if (top_10_.empty() || sce < top_10_.rbegin()->first) {
-	    spill_check(e, SPILL_IN_10);
-	    top_10_.insert(std::make_pair(sce, new_id));
-	    top_10_collection_.add(e, e.score());
-	} else {
-	    spill_check(e, SPILL_IN_90);
-	    bottom_90_.insert(std::make_pair(sce, new_id));
-	    bottom_90_collection_.add(e, e.score());
-	}
+	insert_verified(e);
     } else {
 	auto key = e.source().group();
-	auto it = unverified_group_to_gid_.find(key);
-	if (it == unverified_group_to_gid_.end()) {
-	    auto gid = new_gid();
-	    unverified_group_to_gid_[key] = gid;
-	    unverified_gid_to_group_[gid] = key;
-	}
 	spill_check(e, SPILL_IN_UNVERIFIED);
-	unverified_[key].add(e, 0);
-	unverified_id_to_gid_[e.id()] = key;
+	unverified_source(key).add(e, 0);
+	unverified_id_to_group_[e.id()] = key;
     }
+}
 
-    calibrate();
+// Put the entry on the right side of the top 10% boundary. It is
+// up to calibrate() to restore the sizes.
+void address_book::insert_verified(const address_entry &e)
+{
+    score_entry sce = score_entry(e.score(), e.id());
+    if (top_10_.empty() || sce < *top_10_.rbegin()) {
+	spill_check(e, SPILL_IN_10);
+	top_10_.insert(sce);
+	top_10_collection_.add(e, e.score());
+    } else {
+	spill_check(e, SPILL_IN_90);
+	bottom_90_.insert(sce);
+	bottom_90_collection_.add(e, e.score());
+    }
+}
+
+// Number of verified entries that make up the top 10%
+static inline size_t top_10_size(size_t tot)
+{
+    size_t n = 10 * tot / 100;
+    if (tot > 0 && n == 0) n = 1;
+    return n;
 }
 
+//
+// Recalibrate top 10% and bottom 90%. Entries are moved one at a time
+// across the boundary, so after a single change it is only a step or
+// two, each O(log N).
+//
 void address_book::calibrate()
 {
-    // Recalibrate top 10% and bottom 90&
-    size_t tot = top_10_.size() + bottom_90_.size();
-    size_t top_10_threshold = 10 * tot / 100;
-    if (tot > 0 && top_10_threshold == 0) top_10_threshold = 1;
-    if (top_10_.size() > top_10_threshold) {
-	auto it = top_10_.rbegin();
-        auto last_pair = *it;
-	auto score_entry = last_pair.first;
-	auto id = last_pair.second;
-	auto entry = id_to_entry_[id];
-	top_10_.erase(score_entry);
-	top_10_collection_.remove(entry, entry.score());
-	spill_check(entry, SPILL_IN_90);
-	bottom_90_.insert(last_pair);
-	bottom_90_collection_.add(entry, entry.score());
-    } else if (top_10_.size() < top_10_threshold && bottom_90_.size() > 0) {
-	auto it = bottom_90_.begin();
-	auto first_pair = *it;
-	auto score_entry = first_pair.first;
-	auto id = first_pair.second;
-	auto entry = id_to_entry_[id];
-	bottom_90_.erase(score_entry);
-	bottom_90_collection_.remove(entry, entry.score());
-	spill_check(entry, SPILL_IN_10);
-	top_10_.insert(first_pair);
-	top_10_collection_.add(entry, entry.score());
+    for (;;) {
+	size_t top_10_threshold = top_10_size(top_10_.size() + bottom_90_.size());
+	if (top_10_.size() > top_10_threshold) {
+	    auto sce = *top_10_.rbegin();
+	    auto entry = entry_of(sce.id());
+	    top_10_.erase(sce);
+	    top_10_collection_.remove(entry);
+	    spill_check(entry, SPILL_IN_90);
+	    bottom_90_.insert(sce);
+	    bottom_90_collection_.add(entry, entry.score());
+	} else if (top_10_.size() < top_10_threshold && bottom_90_.size() > 0) {
+	    auto sce = *bottom_90_.begin();
+	    auto entry = entry_of(sce.id());
+	    bottom_90_.erase(sce);
+	    bottom_90_collection_.remove(entry);
+	    spill_check(entry, SPILL_IN_10);
+	    top_10_.insert(sce);
+	    top_10_collection_.add(entry, entry.score());
+	} else {
+	    break;
+	}
     }
 }
 
@@ -515,26 +574,48 @@ void address_book::remove(const ip_service &ip)
 
 void address_book::remove(size_t id)
 {
-    auto it = id_to_entry_.find(id);
-    if (it == id_to_entry_.end()) {
+    erase(id);
+    calibrate();
+    journal_done();
+}
+
+void address_book::erase(size_t id)
+{
+    auto it = id_to_index_.find(id);
+    if (it == id_to_index_.end()) {
 	assert(false);
 	// Not found
 	return;
     }
-    ip_service ip = it->second;
-    int score = it->second.score();
-    id_to_entry_.erase(it);
+    auto index = it->second;
+    ip_service ip = entries_[index];
+    int score = entries_[index].score();
+    id_to_index_.erase(it);
+    if (index != entries_.size() - 1) {
+	entries_[index] = std::move(entries_.back());
+	id_to_index_[entries_[index].id()] = index;
+    }
+    entries_.pop_back();
     ip_to_id_.erase(ip);
-    top_10_.erase(score_entry(score, id));
-    top_10_collection_.remove(ip, score);
-    bottom_90_collection_.remove(ip, score);
-    bottom_90_.erase(score_entry(score, id));
+    journal_remove(ip);
+    if (top_10_.erase(score_entry(score, id)) != 0) {
+	top_10_collection_.remove(ip);
+    }
+    if (bottom_90_.erase(score_entry(score, id)) != 0) {
+	bottom_90_collection_.remove(ip);
+    }
 
-    auto it2 = unverified_id_to_gid_.find(id);
-    if (it2 != unverified_id_to_gid_.end()) {
-	auto key = it2->second;
-	unverified_[key].remove(ip, 0);
-	unverified_id_to_gid_.erase(it2);
+    auto it2 = unverified_id_to_group_.find(id);
+    if (it2 != unverified_id_to_group_.end()) {
+	auto index = unverified_index_[it2->second];
+	auto &coll = *unverified_[index].second;
+	coll.remove(ip);
+	unverified_id_to_group_.erase(it2);
+	if (coll.size() == 0) {
+	    swap_unverified(index, unverified_.size() - 1);
+	    unverified_index_.erase(unverified_.back().first);
+	    unverified_.pop_back();
+	}
     }
 }
 
@@ -551,33 +632,74 @@ bool address_book::exists(const ip_service &ip)
 	return true;
     }
     auto id = it->second;
-    auto it2 = unverified_id_to_gid_.find(id);
-    if (it2 == unverified_id_to_gid_.end()) {
+    auto it2 = unverified_id_to_group_.find(id);
+    if (it2 == unverified_id_to_group_.end()) {
 	return false;
     }
-    auto key = it2->second;
-    return unverified_[key].exists(ip);
+    auto it3 = unverified_index_.find(it2->second);
+    return it3 != unverified_index_.end() &&
+	   unverified_[it3->second].second->exists(ip);
 }
 
 void address_book::add_score(address_entry &e, int change)
 {
+    auto it = ip_to_id_.find(e);
+    if (it == ip_to_id_.end()) {
+	return;
+    }
+    auto id = it->second;
+    auto &entry = entry_of(id);
+    int64_t score = static_cast<int64_t>(entry.score()) + change;
+    score = std::max(score, static_cast<int64_t>(address_entry::MIN_SCORE));
+    score = std::min(score, static_cast<int64_t>(address_entry::MAX_SCORE));
+    if (score == entry.score()) {
+	e.set_score(entry.score());
+	return;
+    }
+
+    if (is_unverified(entry)) {
+	entry.set_score(static_cast<int32_t>(score));
+	e.set_score(entry.score());
+	journal_score(entry);
+    } else {
+	// Take it out, and put it back in with its new score
+	score_entry old_sce(entry.score(), id);
+	if (top_10_.erase(old_sce) != 0) {
+	    top_10_collection_.remove(entry);
+	}
+	if (bottom_90_.erase(old_sce) != 0) {
+	    bottom_90_collection_.remove(entry);
+	}
+	entry.set_score(static_cast<int32_t>(score));
+	e.set_score(entry.score());
+	address_entry updated = entry;
+	journal_score(updated);
+	insert_verified(updated);
+	calibrate();
+    }
+    journal_done();
 }
 
 size_t address_book::size() const
 {
-    return id_to_entry_.size();
+    return entries_.size();
 }
 
 std::vector<address_entry> address_book::get_all_true(std::function<bool (const address_entry &e)> predicate)
 {
     std::vector<address_entry> result;
     
-    for (auto e : id_to_entry_) {
-	if (!predicate(e.second)) {
+    for (auto &e : entries_) {
+	if (!predicate(e)) {
 	    continue;
 	}
-	result.push_back(e.second);
+	result.push_back(e);
     }
+
+    // In the order they were added
+    std::sort(result.begin(), result.end(),
+	      [](const address_entry &e1, const address_entry &e2) {
+		  return e1.id() < e2.id(); });
     return result;
 }
 
@@ -598,16 +720,15 @@ std::vector<address_entry> address_book::get_all_unverified()
 
 std::vector<address_entry> address_book::get_from_top_10_pt(size_t n)
 {
-    assert(n < id_to_entry_.size());
+    assert(n < entries_.size());
 
     std::vector<address_entry> result;
     size_t cnt = 0;
-    for (auto ips = top_10_.begin(); ips != top_10_.end(); ++ips) {
-	auto p = *ips;
+    for (auto &sce : top_10_) {
 	if (++cnt > n) {
 	    break;
 	}
-	result.push_back(id_to_entry_[p.second]);
+	result.push_back(entry_of(sce.id()));
     }
 
     return result;
@@ -620,7 +741,7 @@ std::vector<address_entry> address_book::get_randomly_from_top_10_pt(size_t n)
     std::vector<address_entry> result;
     auto ips = top_10_collection_.select(n);
     for (auto &ip : ips) {
-	result.push_back(id_to_entry_[ip_to_id_[ip]]);
+	result.push_back(entry_of(ip_to_id_[ip]));
     }
 
     return result;
@@ -631,44 +752,43 @@ std::vector<address_entry> address_book::get_randomly_from_bottom_90_pt(size_t n
     std::vector<address_entry> result;
     auto ips = bottom_90_collection_.select(n);
     for (auto &ip : ips) {
-	result.push_back(id_to_entry_[ip_to_id_[ip]]);
+	result.push_back(entry_of(ip_to_id_[ip]));
     }
 
     return result;
 }
 
+std::shared_ptr<const address_entry::buffer_t> address_book::serialized(size_t id)
+{
+    return entry_of(id).serialized();
+}
+
+//
+// First select a source uniformly among the sources with entries
+// left, then an entry from it (as ip_collection::select does.) A
+// source that runs out is moved behind the others.
+//
 std::vector<address_entry> address_book::get_randomly_from_unverified(size_t n)
 {
     std::vector<address_entry> result;
-    
-    std::unordered_set<int> selected;
-    size_t fail_count = 0;
-    for (size_t i = 0; i < n && fail_count < MAX_FAIL_COUNT; i++) {
-
-        // First select a random group
-	auto gid = random_gid();
-	auto it = unverified_gid_to_group_.lower_bound(gid);
-	if (it == unverified_gid_to_group_.end()) {
-	    it = unverified_gid_to_group_.begin();
-	    if (it == unverified_gid_to_group_.end()) {
-		fail_count++;
-		continue;
-	    }
+
+    std::unordered_map<ip_collection *, ip_collection::sampler> samplers;
+    size_t active = unverified_.size();
+    while (result.size() < n && active > 0) {
+	auto index = static_cast<size_t>(
+		    common::random::next_int(static_cast<int>(active)));
+	auto *coll = unverified_[index].second.get();
+	auto it = samplers.find(coll);
+	if (it == samplers.end()) {
+	    it = samplers.emplace(coll, ip_collection::sampler(*coll)).first;
 	}
-	auto &group = it->second;
-	auto tmp = unverified_[group].select(1);
-	if (tmp.empty()) {
-	    fail_count++;
-	    continue;
+	auto &s = it->second;
+	ip_service ip;
+	if (s.next(ip)) {
+	    result.push_back(entry_of(ip_to_id_[ip]));
 	}
-	for (auto e : tmp) {
-	    auto id = ip_to_id_[e];
-	    if (selected.find(id) != selected.end()) {
-		fail_count++;
-		continue;
-    	    }
-	    selected.insert(id);
-	    result.push_back(id_to_entry_[id]);
+	if (s.exhausted()) {
+	    swap_unverified(index, --active);
 	}
     }
 
@@ -683,12 +803,10 @@ void address_book::update_time(const ip_service &ip)
     if (it == ip_to_id_.end()) {
 	return;
     }
-    auto it2 = id_to_entry_.find(it->second);
-    if (it2 == id_to_entry_.end()) {
-	return;
-    }
-    auto &entry = it2->second;
+    auto &entry = entry_of(it->second);
     entry.set_time(utime::now_seconds());
+    journal_time(entry);
+    journal_done();
 }
 
 void address_book::save(const std::string &path)
@@ -699,8 +817,7 @@ void address_book::save(const std::string &path)
     term_env env;
     term_emitter emitter(out, env);
     emitter.set_option_nl(false);
-    for (auto &p : id_to_entry_) {
-	auto &e = p.second;
+    for (auto &e : get_all()) {
 	e.write(env, emitter);
     }
 }
@@ -725,39 +842,548 @@ void address_book::load(const std::string &path)
     set_spill_enabled(true);
 }
 
-bool address_book::operator == (const address_book &other) const
+// --- binary snapshot and journal ---
+//
+// All integers are little endian. A snapshot is a header followed by
+// one fixed size record per entry (in id order) and then the blob area
+// with the comments:
+//
+//   header: magic[8] version:4 record_size:4 generation:8 count:8
+//           id_count:8 num_spilled:8 blob_size:8
+//   record: id:8 addr:16 port:2 src_addr:16 src_port:2 score:4 time:8
+//           version_major:4 version_minor:4 comment_offset:4
+//           comment_size:4
+//
+// The journal starts with magic[8] version:4 reserved:4 generation:8
+// and only applies to the snapshot of the same generation. Each change
+// is then appended as size:4 checksum:4 type:1 followed by the record
+// (and comment) for an add, or the address, port and new value for a
+// removal, score or time change. A torn record at the end (a crash
+// while appending) is cut off when the journal is replayed.
+//
+
+static const char SNAPSHOT_MAGIC[8] = { 'P','L','C','B','O','O','K','\0' };
+static const char JOURNAL_MAGIC[8] = { 'P','L','C','J','R','N','L','\0' };
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const size_t SNAPSHOT_HEADER_SIZE = 64;
+static const size_t JOURNAL_HEADER_SIZE = 24;
+static const size_t JOURNAL_RECORD_HEADER_SIZE = 8;
+static const size_t RECORD_SIZE = 72;
+static const size_t SERVICE_SIZE = 18;
+
+static inline void put_u16(uint8_t *p, uint16_t v)
 {
-    auto it1 = id_to_entry_.begin();
-    auto it2 = other.id_to_entry_.begin();
-    
-    size_t index = 0;
+    p[0] = static_cast<uint8_t>(v);
+    p[1] = static_cast<uint8_t>(v >> 8);
+}
 
-    while (it1 != id_to_entry_.end()) {
-	if (it2 == other.id_to_entry_.end()) {
-	    return false;
+static inline void put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, static_cast<uint16_t>(v));
+    put_u16(p + 2, static_cast<uint16_t>(v >> 16));
+}
+
+static inline void put_u64(uint8_t *p, uint64_t v)
+{
+    put_u32(p, static_cast<uint32_t>(v));
+    put_u32(p + 4, static_cast<uint32_t>(v >> 32));
+}
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+    return static_cast<uint32_t>(get_u16(p)) |
+	   (static_cast<uint32_t>(get_u16(p + 2)) << 16);
+}
+
+static inline uint64_t get_u64(const uint8_t *p)
+{
+    return static_cast<uint64_t>(get_u32(p)) |
+	   (static_cast<uint64_t>(get_u32(p + 4)) << 32);
+}
+
+static inline void put_service(uint8_t *p, const ip_service &ip)
+{
+    memcpy(p, ip.addr().to_bytes(), 16);
+    put_u16(p + 16, ip.port());
+}
+
+static inline ip_service get_service(const uint8_t *p)
+{
+    ip_address addr;
+    addr.set_addr(p, 16);
+    return ip_service(addr, get_u16(p + 16));
+}
+
+static void put_record(uint8_t *p, const address_entry &e,
+		       uint32_t comment_offset)
+{
+    put_u64(p, e.id());
+    put_service(p + 8, e);
+    put_service(p + 26, e.source());
+    put_u32(p + 44, static_cast<uint32_t>(e.score()));
+    put_u64(p + 48, e.time().in_us());
+    put_u32(p + 56, static_cast<uint32_t>(e.version_major()));
+    put_u32(p + 60, static_cast<uint32_t>(e.version_minor()));
+    put_u32(p + 64, comment_offset);
+    put_u32(p + 68, static_cast<uint32_t>(e.comment().size()));
+}
+
+// Returns false if the record is not valid.
+static bool get_record(const uint8_t *p, address_entry &e, size_t &id,
+		       uint32_t &comment_offset, uint32_t &comment_size)
+{
+    id = get_u64(p);
+    auto score = static_cast<int32_t>(get_u32(p + 44));
+    auto version_major = static_cast<int32_t>(get_u32(p + 56));
+    auto version_minor = static_cast<int32_t>(get_u32(p + 60));
+    if (id == 0 ||
+	score < address_entry::MIN_SCORE || score > address_entry::MAX_SCORE ||
+	version_major < 0 || version_major > 1000 ||
+	version_minor < 0 || version_minor > 1000) {
+	return false;
+    }
+    ip_service ip = get_service(p + 8);
+    e.set_addr(ip.addr());
+    e.set_port(ip.port());
+    e.set_source(get_service(p + 26));
+    e.set_score(score);
+    e.set_time(common::utime(get_u64(p + 48)));
+    e.set_version(version_major, version_minor);
+    comment_offset = get_u32(p + 64);
+    comment_size = get_u32(p + 68);
+    return true;
+}
+
+void address_book::clear()
+{
+    id_count_ = 0;
+    num_spilled_ = 0;
+    entries_.clear();
+    id_to_index_.clear();
+    ip_to_id_.clear();
+    top_10_.clear();
+    top_10_collection_.clear();
+    bottom_90_.clear();
+    bottom_90_collection_.clear();
+    unverified_.clear();
+    unverified_index_.clear();
+    unverified_id_to_group_.clear();
+}
+
+void address_book::save_snapshot(const std::string &path)
+{
+    auto entries = get_all();
+
+    uint64_t blob_size = 0;
+    for (auto &e : entries) {
+	blob_size += e.comment().size();
+    }
+    if (blob_size > std::numeric_limits<uint32_t>::max()) {
+	throw address_book_snapshot_exception(path, "Comments exceed 4 GB");
+    }
+
+    // Write to a temporary file and then rename it, so a crash never
+    // leaves a half written snapshot behind.
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+	throw address_book_snapshot_exception(path, "Couldn't create " + tmp_path);
+    }
+
+    uint8_t header[SNAPSHOT_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put_u32(header + 8, SNAPSHOT_VERSION);
+    put_u32(header + 12, RECORD_SIZE);
+    put_u64(header + 16, generation_);
+    put_u64(header + 24, entries.size());
+    put_u64(header + 32, id_count_);
+    put_u64(header + 40, num_spilled_);
+    put_u64(header + 48, blob_size);
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+    uint8_t record[RECORD_SIZE];
+    uint32_t comment_offset = 0;
+    for (auto &e : entries) {
+	put_record(record, e, comment_offset);
+	out.write(reinterpret_cast<const char *>(record), sizeof(record));
+	comment_offset += static_cast<uint32_t>(e.comment().size());
+    }
+    for (auto &e : entries) {
+	if (!e.comment().empty()) {
+	    out.write(reinterpret_cast<const char *>(&e.comment()[0]),
+		      e.comment().size());
 	}
+    }
+    out.close();
+    if (!out) {
+	throw address_book_snapshot_exception(path, "Failed to write " + tmp_path);
+    }
 
-	auto &e1 = it1->second;
-	auto &e2 = it2->second;
+    boost::filesystem::rename(tmp_path, path);
+}
 
-	if (e1 != e2) {
-	    return false;
+void address_book::load_snapshot(const std::string &path)
+{
+    namespace bip = boost::interprocess;
+
+    bip::file_mapping file;
+    bip::mapped_region region;
+    try {
+	file = bip::file_mapping(path.c_str(), bip::read_only);
+	region = bip::mapped_region(file, bip::read_only);
+    } catch (bip::interprocess_exception &ex) {
+	throw address_book_snapshot_exception(path, ex.what());
+    }
+    region.advise(bip::mapped_region::advice_sequential);
+
+    auto *data = static_cast<const uint8_t *>(region.get_address());
+    size_t data_size = region.get_size();
+
+    if (data_size < SNAPSHOT_HEADER_SIZE ||
+	memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+	throw address_book_snapshot_exception(path, "Not a snapshot");
+    }
+    if (get_u32(data + 8) != SNAPSHOT_VERSION ||
+	get_u32(data + 12) != RECORD_SIZE) {
+	throw address_book_snapshot_exception(path, "Unsupported version");
+    }
+    uint64_t count = get_u64(data + 24);
+    uint64_t blob_size = get_u64(data + 48);
+    if (count > (data_size - SNAPSHOT_HEADER_SIZE) / RECORD_SIZE ||
+	SNAPSHOT_HEADER_SIZE + count * RECORD_SIZE + blob_size != data_size) {
+	throw address_book_snapshot_exception(path, "Truncated or corrupt");
+    }
+    const uint8_t *records = data + SNAPSHOT_HEADER_SIZE;
+    const uint8_t *blob = records + count * RECORD_SIZE;
+
+    clear();
+    generation_ = get_u64(data + 16);
+    id_count_ = get_u64(data + 32);
+    num_spilled_ = get_u64(data + 40);
+
+    entries_.reserve(count);
+    id_to_index_.reserve(count);
+    ip_to_id_.reserve(count);
+
+    // The entries are inserted as is, and the top 10% is then taken
+    // from the sorted verified entries.
+    std::vector<std::pair<score_entry, ip_service> > verified;
+    verified.reserve(count);
+
+    // Records are in id order
+    size_t prev_id = 0;
+    for (uint64_t i = 0; i < count; i++) {
+	address_entry e;
+	size_t id;
+	uint32_t comment_offset, comment_size;
+	if (!get_record(records + i * RECORD_SIZE, e, id,
+			comment_offset, comment_size) ||
+	    static_cast<uint64_t>(comment_offset) + comment_size > blob_size ||
+	    id <= prev_id || id > id_count_ ||
+	    !ip_to_id_.insert(std::make_pair(e, id)).second) {
+	    clear();
+	    throw address_book_snapshot_exception(path, "Bad record at index " + boost::lexical_cast<std::string>(i));
+	}
+	prev_id = id;
+	e.set_id(id);
+	if (comment_size > 0) {
+	    e.set_comment(address_entry::buffer_t(blob + comment_offset,
+					  blob + comment_offset + comment_size));
+	}
+	if (is_verified(e)) {
+	    verified.push_back(std::make_pair(score_entry(e.score(), id), e));
+	} else {
+	    auto key = e.source().group();
+	    unverified_source(key).add(e, 0);
+	    unverified_id_to_group_.insert(std::make_pair(id, key));
+	}
+	id_to_index_.insert(std::make_pair(id, entries_.size()));
+	entries_.push_back(std::move(e));
+    }
+
+    std::sort(verified.begin(), verified.end(),
+	      [](const std::pair<score_entry, ip_service> &a,
+		 const std::pair<score_entry, ip_service> &b) {
+		  return a.first < b.first; });
+    size_t num_top_10 = top_10_size(verified.size());
+    for (size_t i = 0; i < verified.size(); i++) {
+	auto &p = verified[i];
+	if (i < num_top_10) {
+	    top_10_.insert(top_10_.end(), p.first);
+	    top_10_collection_.add(p.second, p.first.score());
+	} else {
+	    bottom_90_.insert(bottom_90_.end(), p.first);
+	    bottom_90_collection_.add(p.second, p.first.score());
+	}
+    }
+}
+
+void address_book::open(const std::string &path)
+{
+    close();
+
+    // Without a snapshot the book keeps what it has (e.g. addresses
+    // added before the node was started), and saves it as the first
+    // snapshot below.
+    bool keep = !boost::filesystem::exists(path) && size() > 0;
+    if (boost::filesystem::exists(path)) {
+	load_snapshot(path);
+    } else {
+	generation_ = 0;
+    }
+    path_ = path;
+
+    std::string journal_path = path + ".journal";
+    if (boost::filesystem::exists(journal_path)) {
+	replay(journal_path);
+    }
+    if (journal_records_ > 0) {
+	journal_.open(journal_path, std::ios::binary | std::ios::app);
+    } else {
+	journal_create();
+    }
+    if (keep) {
+	compact();
+    }
+}
+
+void address_book::close()
+{
+    if (journal_.is_open()) {
+	journal_.close();
+    }
+    path_.clear();
+    journal_records_ = 0;
+}
+
+void address_book::compact()
+{
+    if (path_.empty()) {
+	return;
+    }
+    generation_++;
+    save_snapshot(path_);
+    journal_create();
+}
+
+void address_book::journal_create()
+{
+    if (journal_.is_open()) {
+	journal_.close();
+    }
+    std::string journal_path = path_ + ".journal";
+    journal_.open(journal_path, std::ios::binary | std::ios::trunc);
+    if (!journal_) {
+	throw address_book_snapshot_exception(journal_path, "Couldn't create journal");
+    }
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    put_u32(header + 8, SNAPSHOT_VERSION);
+    put_u64(header + 16, generation_);
+    journal_.write(reinterpret_cast<const char *>(header), sizeof(header));
+    journal_.flush();
+    journal_records_ = 0;
+}
+
+void address_book::journal_append(const std::string &payload)
+{
+    common::fast_hash h;
+    h << payload;
+    uint8_t header[JOURNAL_RECORD_HEADER_SIZE];
+    put_u32(header, static_cast<uint32_t>(payload.size()));
+    put_u32(header + 4, static_cast<uint32_t>(h));
+    journal_.write(reinterpret_cast<const char *>(header), sizeof(header));
+    journal_.write(payload.data(), payload.size());
+    journal_records_++;
+}
+
+void address_book::journal_add(const address_entry &e)
+{
+    if (!journal_.is_open()) {
+	return;
+    }
+    std::string payload(1 + RECORD_SIZE, '\0');
+    payload[0] = static_cast<char>(JOURNAL_ADD);
+    put_record(reinterpret_cast<uint8_t *>(&payload[1]), e, 0);
+    payload.append(e.comment().begin(), e.comment().end());
+    journal_append(payload);
+}
+
+void address_book::journal_remove(const ip_service &ip)
+{
+    if (!journal_.is_open()) {
+	return;
+    }
+    std::string payload(1 + SERVICE_SIZE, '\0');
+    payload[0] = static_cast<char>(JOURNAL_REMOVE);
+    put_service(reinterpret_cast<uint8_t *>(&payload[1]), ip);
+    journal_append(payload);
+}
+
+void address_book::journal_score(const address_entry &e)
+{
+    if (!journal_.is_open()) {
+	return;
+    }
+    std::string payload(1 + SERVICE_SIZE + 4, '\0');
+    auto *p = reinterpret_cast<uint8_t *>(&payload[0]);
+    p[0] = JOURNAL_SCORE;
+    put_service(p + 1, e);
+    put_u32(p + 1 + SERVICE_SIZE, static_cast<uint32_t>(e.score()));
+    journal_append(payload);
+}
+
+void address_book::journal_time(const address_entry &e)
+{
+    if (!journal_.is_open()) {
+	return;
+    }
+    std::string payload(1 + SERVICE_SIZE + 8, '\0');
+    auto *p = reinterpret_cast<uint8_t *>(&payload[0]);
+    p[0] = JOURNAL_TIME;
+    put_service(p + 1, e);
+    put_u64(p + 1 + SERVICE_SIZE, e.time().in_us());
+    journal_append(payload);
+}
+
+// Called when a change is complete
+void address_book::journal_done()
+{
+    if (!journal_.is_open()) {
+	return;
+    }
+    journal_.flush();
+    if (journal_records_ >= std::max(MIN_JOURNAL_RECORDS, size())) {
+	compact();
+    }
+}
+
+void address_book::replay(const std::string &journal_path)
+{
+    std::string data;
+    {
+	std::ifstream in(journal_path, std::ios::binary);
+	data.assign(std::istreambuf_iterator<char>(in),
+		    std::istreambuf_iterator<char>());
+    }
+    auto *p = reinterpret_cast<const uint8_t *>(data.data());
+    if (data.size() < JOURNAL_HEADER_SIZE ||
+	memcmp(p, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 ||
+	get_u32(p + 8) != SNAPSHOT_VERSION ||
+	get_u64(p + 16) != generation_) {
+	// Not for this snapshot (e.g. a crash right after compacting)
+	return;
+    }
+
+    // Like load(), the journal already has the entries that were spilled
+    set_spill_enabled(false);
+
+    size_t offset = JOURNAL_HEADER_SIZE;
+    while (offset + JOURNAL_RECORD_HEADER_SIZE <= data.size()) {
+	size_t size = get_u32(p + offset);
+	uint32_t checksum = get_u32(p + offset + 4);
+	const uint8_t *payload = p + offset + JOURNAL_RECORD_HEADER_SIZE;
+	if (size == 0 ||
+	    offset + JOURNAL_RECORD_HEADER_SIZE + size > data.size()) {
+	    break;
+	}
+	common::fast_hash h;
+	h.update(payload, size);
+	if (static_cast<uint32_t>(h) != checksum) {
+	    break;
+	}
+
+	bool ok = true;
+	switch (payload[0]) {
+	case JOURNAL_ADD: {
+	    address_entry e;
+	    size_t id;
+	    uint32_t comment_offset, comment_size;
+	    ok = size >= 1 + RECORD_SIZE &&
+		 get_record(payload + 1, e, id, comment_offset, comment_size) &&
+		 size == 1 + RECORD_SIZE + comment_size;
+	    if (ok && ip_to_id_.count(e) == 0 && id_to_index_.count(id) == 0) {
+		e.set_id(id);
+		const uint8_t *comment = payload + 1 + RECORD_SIZE;
+		e.set_comment(address_entry::buffer_t(comment, comment + comment_size));
+		insert(e);
+		calibrate();
+	    }
+	    break;
+	}
+	case JOURNAL_REMOVE:
+	    ok = size == 1 + SERVICE_SIZE;
+	    if (ok) {
+		remove(get_service(payload + 1));
+	    }
+	    break;
+	case JOURNAL_SCORE: {
+	    ok = size == 1 + SERVICE_SIZE + 4;
+	    auto it = ok ? ip_to_id_.find(get_service(payload + 1))
+		         : ip_to_id_.end();
+	    if (it != ip_to_id_.end()) {
+		auto score = static_cast<int32_t>(get_u32(payload + 1 + SERVICE_SIZE));
+		address_entry e = entry_of(it->second);
+		add_score(e, score - e.score());
+	    }
+	    break;
+	}
+	case JOURNAL_TIME: {
+	    ok = size == 1 + SERVICE_SIZE + 8;
+	    auto it = ok ? ip_to_id_.find(get_service(payload + 1))
+		         : ip_to_id_.end();
+	    if (it != ip_to_id_.end()) {
+		auto time = get_u64(payload + 1 + SERVICE_SIZE);
+		entry_of(it->second).set_time(common::utime(time));
+	    }
+	    break;
+	}
+	default:
+	    ok = false;
+	    break;
 	}
+	if (!ok) {
+	    break;
+	}
+	offset += JOURNAL_RECORD_HEADER_SIZE + size;
+	journal_records_++;
+    }
+
+    set_spill_enabled(true);
+
+    if (offset < data.size()) {
+	// Cut off what couldn't be read, so new records follow directly
+	boost::filesystem::resize_file(journal_path, offset);
+    }
+}
+
+bool address_book::operator == (const address_book &other) const
+{
+    if (size() != other.size()) {
+	return false;
+    }
 
-	++it1;
-	++it2;
-	++index;
+    for (auto &p : ip_to_id_) {
+	if (other.ip_to_id_.count(p.first) == 0) {
+	    return false;
+	}
     }
 
-    return it2 == other.id_to_entry_.end();
+    return true;
 }
 
 void address_book::integrity_check()
 {
     // Build score_to_id map
     std::map<score_entry, size_t> score_to_id;
-    for (auto p : id_to_entry_) {
-	auto e = p.second;
+    for (auto &e : entries_) {
 	if (is_unverified(e)) {
 	    continue;
 	}
@@ -775,7 +1401,7 @@ void address_book::integrity_check()
     size_t i = 0;
     for (i = 0; i < num_top_10; i++, ++it0, ++it1) {
 	auto e0 = it0->first;
-	auto e1 = it1->first;
+	auto e1 = *it1;
 	if (e0 != e1) {
 	    std::cout << "Failed at entry index " << i << " (on top 10%)" << std::endl;
 	    std::cout << "e0=" << e0.str() << std::endl;
@@ -795,9 +1421,8 @@ void address_book::integrity_check()
 	}
 	assert(e0 == e1);
 	auto id = it0->second;
-	auto eit = id_to_entry_.find(id);
-	assert(eit != id_to_entry_.end());
-	auto &entry = eit->second;
+	assert(id_to_index_.count(id) != 0);
+	auto &entry = entry_of(id);
 	if (top_10_collection_.size(entry.group()) > MAX_GROUP_SIZE) {
 	    std::cout << "While processing index " << i << std::endl;
 	    std::cout << "Group size for " << entry.str() << " exceeded maximum " << MAX_GROUP_SIZE << "; was " << top_10_collection_.size(entry.group()) << std::endl;
@@ -808,7 +1433,7 @@ void address_book::integrity_check()
     it1 = bottom_90_.begin();
     for (; i < score_to_id.size(); i++, ++it0, ++it1) {
 	auto e0 = it0->first;
-	auto e1 = it1->first;
+	auto e1 = *it1;
 	if (e0 != e1) {
 	    std::cout << "Failed at entry index " << i << " (on bottom 90%)" << std::endl;
 	    std::cout << "e0=" << e0.str() << std::endl;
@@ -816,9 +1441,8 @@ void address_book::integrity_check()
 	}
 	assert(e0 == e1);
 	auto id = it0->second;
-	auto eit = id_to_entry_.find(id);
-	assert(eit != id_to_entry_.end());
-	auto &entry = eit->second;
+	assert(id_to_index_.count(id) != 0);
+	auto &entry = entry_of(id);
 
 	if (bottom_90_collection_.size(entry.group()) > MAX_GROUP_SIZE) {
 	    std::cout << "While processing index " << i << std::endl;
@@ -830,25 +1454,21 @@ void address_book::integrity_check()
     assert(it1 == bottom_90_.end());
     assert(it0 == score_to_id.end());
 
+    assert(top_10_collection_.size() == top_10_.size());
+    assert(bottom_90_collection_.size() == bottom_90_.size());
     top_10_collection_.integrity_check();
     bottom_90_collection_.integrity_check();
-}
 
-int address_book::random_gid()
-{
-    return prologcoin::common::random::next_int(MAX_GID);
-}
-
-int address_book::new_gid()
-{
-    int gid = random_gid();
-    while (unverified_gid_to_group_.find(gid) != unverified_gid_to_group_.end()) {
-	gid++;
-	if (gid == MAX_GID) {
-	    gid = 0;
-	}
+    size_t num_unverified = 0;
+    assert(unverified_index_.size() == unverified_.size());
+    for (size_t i = 0; i < unverified_.size(); i++) {
+	assert(unverified_index_[unverified_[i].first] == i);
+	auto &coll = *unverified_[i].second;
+	assert(coll.size() > 0);
+	coll.integrity_check();
+	num_unverified += coll.size();
     }
-    return gid;
+    assert(num_unverified == unverified_id_to_group_.size());
 }
 
 }}
@@ -4,12 +4,16 @@
 #define _node_address_book_hpp
 
 #include <iostream>
+#include <fstream>
 #include <map>
+#include <memory>
+#include <set>
 #include <unordered_set>
 #include "ip_address.hpp"
 #include "ip_service.hpp"
 #include "ip_collection.hpp"
 #include "../common/term_serializer.hpp"
+#include "../common/flat_hash_map.hpp"
 
 namespace prologcoin { namespace node {
 
@@ -22,6 +26,14 @@ public:
 			   + msg) { }
 };
 
+class address_book_snapshot_exception : public std::runtime_error
+{
+public:
+    address_book_snapshot_exception(const std::string &path,
+				    const std::string &msg) :
+	std::runtime_error("Snapshot " + path + ": " + msg) { }
+};
+
 class address_book;
 
 //
@@ -35,6 +47,8 @@ class address_book;
 class address_entry : public ip_service {
 public:
     static const int32_t VERIFIED_INITIAL_SCORE = 100;
+    static const int32_t MIN_SCORE = -1000000;
+    static const int32_t MAX_SCORE = 1000000;
     
     using buffer_t = prologcoin::common::term_serializer::buffer_t;
     using utime = prologcoin::common::utime;
@@ -56,15 +70,19 @@ public:
     std::string comment_str() const;
 
     inline void set_source(const ip_address &addr, unsigned short port)
-    { source_ = ip_service(addr, port); }
-    inline void set_source(const ip_service &src) { source_ = src; }
-    inline void set_score(int32_t score) { score_ = score; }
-    inline void set_time(const utime time) { time_ = time; }
+    { source_ = ip_service(addr, port); serialized_.reset(); }
+    inline void set_source(const ip_service &src)
+    { source_ = src; serialized_.reset(); }
+    inline void set_score(int32_t score)
+    { score_ = score; serialized_.reset(); }
+    inline void set_time(const utime time)
+    { time_ = time; serialized_.reset(); }
     inline void set_version(int32_t major, int32_t minor)
-    { version_major_ = major; version_minor_ = minor; }
+    { version_major_ = major; version_minor_ = minor; serialized_.reset(); }
 
     void set_comment(const common::term t, common::term_env &src);
-    inline void set_comment(buffer_t comment) { comment_ = comment; }
+    inline void set_comment(buffer_t comment)
+    { comment_ = comment; serialized_.reset(); }
 
     // Very expensive! But good for debugging/testing.
     // (It invokes the parser and then the serializer...)
@@ -96,6 +114,10 @@ public:
     common::term to_term(common::term_env &env) const;
     bool from_term(common::term_env &env, const common::term t);
 
+    // The term (see to_term) serialized. It is kept until the entry
+    // changes, so entries can be sent to peers without building terms.
+    const std::shared_ptr<const buffer_t> & serialized() const;
+
     std::string str() const;
 
 private:
@@ -108,6 +130,7 @@ private:
     int32_t version_major_;   // Major version
     int32_t version_minor_;   // Minor version
     buffer_t comment_;        // Extra information
+    mutable std::shared_ptr<const buffer_t> serialized_; // Cached term
 
     friend class address_book;
 };
@@ -139,6 +162,8 @@ public:
     void add( const address_entry &entry );
     void remove( size_t id );
     void remove( const ip_service &ip );
+    // Changes the score (within MIN_SCORE..MAX_SCORE) of the entry in
+    // the book with the same address, and updates 'entry' to match.
     void add_score(address_entry &entry, int change );
     size_t size() const;
     bool exists( const ip_service &ip );
@@ -154,9 +179,35 @@ public:
     std::vector<address_entry> get_randomly_from_bottom_90_pt(size_t n);
     std::vector<address_entry> get_randomly_from_unverified(size_t n);
 
+    // The serialized term of the entry with this id, which is kept
+    // with the entry in the book (see address_entry::serialized.)
+    std::shared_ptr<const address_entry::buffer_t> serialized(size_t id);
+
     void load( const std::string &path );
     void save( const std::string &path );
 
+    //
+    // Binary snapshot: fixed size records followed by a blob area for
+    // the comments. Loading maps the file into memory and builds the
+    // book in bulk (no parsing, no spilling.) It replaces the contents
+    // of the book.
+    //
+    void load_snapshot( const std::string &path );
+    void save_snapshot( const std::string &path );
+
+    //
+    // Keep the book in the snapshot at 'path'. Loads it (if it exists)
+    // and replays the journal (path + ".journal"). From then on every
+    // change is appended to the journal, and once the journal is as
+    // big as the book it is compacted into a new snapshot. If there is
+    // no snapshot yet, the entries already in the book are kept.
+    //
+    void open( const std::string &path );
+    void close();
+    void compact();
+    inline bool is_open() const { return journal_.is_open(); }
+    inline size_t journal_size() const { return journal_records_; }
+
     // Compare if two address books are identical in contents
     bool operator == (const address_book &other) const;
     inline bool operator != (const address_book &other) const
@@ -172,10 +223,10 @@ public:
     inline size_t num_groups() const {
 	return top_10_collection_.num_groups() +
 	    bottom_90_collection_.num_groups() +
-	    unverified_gid_to_group_.size();
+	    unverified_.size();
     }
     inline size_t num_unverified() const
-        { return unverified_id_to_gid_.size(); }
+        { return unverified_id_to_group_.size(); }
 
     inline bool is_unverified(const address_entry &e)
     { return !is_verified(e); }
@@ -239,30 +290,57 @@ private:
     size_t num_spilled_;
     bool spill_enabled_;
 
-    std::map<size_t, address_entry> id_to_entry_;
-    std::map<ip_service, size_t> ip_to_id_;
+    // The entries are kept in a dense array; removing moves the last one
+    // into the hole.
+    std::vector<address_entry> entries_;
+    common::flat_hash_map<size_t, size_t> id_to_index_;
+    common::flat_hash_map<ip_service, size_t> ip_to_id_;
 
-    std::map<score_entry, size_t> top_10_;
+    std::set<score_entry> top_10_;
     ip_collection top_10_collection_;
-    std::map<score_entry, size_t> bottom_90_;
+    std::set<score_entry> bottom_90_;
     ip_collection bottom_90_collection_;
 
-    // The key is the source group
-    std::map<uint64_t, ip_collection> unverified_;
-    std::map<int, uint64_t> unverified_gid_to_group_;
-    std::map<uint64_t, int> unverified_group_to_gid_;
-    std::map<size_t, uint64_t> unverified_id_to_gid_;
-
-    static const int MAX_GID = 1000000000;
-    static const size_t MAX_FAIL_COUNT = 1000;
+    // One collection per source group, kept in a dense array so that
+    // a source can be picked uniformly at random.
+    std::vector<std::pair<uint64_t, std::unique_ptr<ip_collection> > > unverified_;
+    common::flat_hash_map<uint64_t, size_t> unverified_index_;
+    common::flat_hash_map<size_t, uint64_t> unverified_id_to_group_;
 
     // Not more than 100 addesses per group. We'll spill
     // (the worst) one before adding.
     static const size_t MAX_GROUP_SIZE = 100;
     static const size_t MAX_SOURCE_SIZE = 400;
 
-    int random_gid();
-    int new_gid();
+    inline address_entry & entry_of(size_t id)
+        { return entries_[id_to_index_.find(id)->second]; }
+
+    void clear();
+    void insert(const address_entry &e);
+
+    ip_collection & unverified_source(uint64_t group);
+    void swap_unverified(size_t i, size_t j);
+
+    void insert_verified(const address_entry &e);
+    void erase(size_t id);
+
+    enum journal_type { JOURNAL_ADD = 1, JOURNAL_REMOVE = 2,
+			JOURNAL_SCORE = 3, JOURNAL_TIME = 4 };
+    void journal_append(const std::string &payload);
+    void journal_add(const address_entry &e);
+    void journal_remove(const ip_service &ip);
+    void journal_score(const address_entry &e);
+    void journal_time(const address_entry &e);
+    void journal_done();
+    void journal_create();
+    void replay(const std::string &journal_path);
+
+    static const size_t MIN_JOURNAL_RECORDS = 10000;
+
+    std::string path_;
+    uint64_t generation_;
+    std::ofstream journal_;
+    size_t journal_records_;
 
     friend class test_address_book;
 };
@@ -8,9 +8,7 @@ using namespace prologcoin::common;
 namespace prologcoin { namespace node {
 
 task_address_downloader::task_address_downloader(out_connection &out)
-    : out_task("address_downloader", out, &task_address_downloader::process_fn),
-      count_(0),
-      last_checked_()
+    : out_task("address_downloader", out, &task_address_downloader::process_fn)
 {
 }
 
@@ -105,6 +103,11 @@ void task_address_downloader::process()
 	    }
 	    peers = e.arg(peers, 1);
 	}
+
+	// Download again later
+	count_++;
+	last_checked_ = utime::now();
+	reschedule_last();
     }
 }
 
@@ -15,9 +15,6 @@ private:
     static void process_fn(out_task &out);
 
     void process();
-
-    size_t count_;
-    utime last_checked_;
 };
 
 }}
@@ -8,6 +8,8 @@ using namespace prologcoin::common;
 
 namespace prologcoin { namespace node {
 
+const con_cell connection::MSG("msg", 2);
+
 connection::connection(self_node &self,
 		       connection::connection_type type,
 		       term_env &env)
@@ -16,18 +18,28 @@ connection::connection(self_node &self,
       env_(env),
       strand_(self.get_io_service()),
       socket_(self.get_io_service()),
-      timer_(self.get_io_service()),
-      state_(IDLE),
-      received_bytes_(0),
+      killed_(false),
+      closed_(false),
+      receiving_(false),
+      reading_(false),
+      got_length_(false),
       receive_length_(0),
+      more_chunks_(false),
+      in_message_(false),
+      message_size_(0),
+      frame_buffer_(self_node::MAX_BUFFER_SIZE),
+      frame_start_(0),
+      frame_end_(0),
+      writing_(false),
       sent_bytes_(0),
-      send_length_(0),
+      started_(false),
       auto_send_(false)
 {
 }
 
 void connection::start()
 {
+    started_ = true;
     run();
 }
 
@@ -45,46 +57,78 @@ void connection::delete_connection(connection *conn)
     }
 }
 
+//
+// Outstanding operations are cancelled here, so their handlers run
+// (and see closed_) before the node deletes the connection.
+//
 void connection::close()
 {
+    if (closed_) {
+	return;
+    }
+    closed_ = true;
+    boost::system::error_code ec;
+    socket_.close(ec);
     self().close(this);
 }
 
-void connection::send_error(const term t)
+bool connection::send_error(const term t)
 {
-    send(env_.new_term(env_.functor("error",1),{t}));
+    return send(env_.new_term(env_.functor("error",1),{t}));
 }
 
-void connection::send_ok(const term t)
+bool connection::send_ok(const term t, const fragments_t *fragments)
 {
-    send(env_.new_term(env_.functor("ok",1),{t}));
+    return send(env_.new_term(env_.functor("ok",1),{t}), fragments);
 }
 
-void connection::send(const term t)
+bool connection::send(const term t, const fragments_t *fragments)
 {
     term_serializer ser(env_);
-    buffer_.clear();
-    ser.write(buffer_, t);
-    buffer_len_.resize(sizeof(cell));
-    ser.write_cell(buffer_len_, 0, int_cell(buffer_.size()));
-    sent_bytes_ = 0;
-    send_length_ = buffer_.size();
-    state_ = SEND_LENGTH;
+    ser.set_fragments(fragments);
+    std::vector<uint8_t> payload;
+    ser.write(payload, t);
+
+    // The receiver would drop it anyway
+    if (payload.size() > self_node::MAX_MESSAGE_SIZE) {
+	return false;
+    }
+
+    // Big messages are split into chunks that fit in a frame
+    const size_t chunk_size = self_node::MAX_BUFFER_SIZE - sizeof(cell);
+    size_t offset = 0;
+    do {
+	size_t n = std::min(chunk_size, payload.size() - offset);
+	bool last = offset + n == payload.size();
+	std::vector<uint8_t> buf;
+	ser.write_cell(buf, 0, int_cell(last ? static_cast<int64_t>(n)
+					     : -static_cast<int64_t>(n)));
+	buf.insert(buf.end(), payload.begin() + offset,
+		   payload.begin() + offset + n);
+	send_queue_.push_back(std::move(buf));
+	offset += n;
+    } while (offset < payload.size());
+    return true;
 }
 
 bool connection::received_length()
 {
     auto &e = env_;
 
-    cell c = term_serializer::read_cell(buffer_len_, 0,
+    cell c = term_serializer::read_cell(frame_buffer_, frame_start_,
 	"node::connection::received_length");
+    frame_start_ += sizeof(cell);
     if (c.tag() != tag_t::INT) {
 	if (auto_send()) {
 	    send_error(e.functor("error_query_length_was_not_integer",0));
 	}
 	return false;
     } else {
-	auto &ic=reinterpret_cast<const int_cell &>(c);
+	auto ic=reinterpret_cast<const int_cell &>(c);
+	more_chunks_ = ic.value() < 0;
+	if (more_chunks_) {
+	    ic = int_cell(-ic.value());
+	}
 	size_t max = self_node::MAX_BUFFER_SIZE-sizeof(cell);
 	if (ic.value() > static_cast<int>(max)) {
 	    if (auto_send()) {
@@ -104,9 +148,7 @@ bool connection::received_length()
 	    return false;
 	} else {
 	    receive_length_ = ic.value();
-	    state_ = RECEIVE;
-	    received_bytes_ = 0;
-	    buffer_.resize(receive_length_);
+	    got_length_ = true;
 	    return true;
 	}
     }
@@ -117,7 +159,7 @@ term connection::received()
     auto &e = env_;
     term_serializer ser(e);
     try {
-	auto t = ser.read(buffer_, receive_length_);
+	auto t = ser.read(buffer_, buffer_.size());
 	return t;
     } catch (serializer_exception &ex) {
 	if (auto_send()) {
@@ -128,116 +170,177 @@ term connection::received()
     }
 }
 
+//
+// Parses the next message from the frame buffer into buffer_. Returns
+// false if the complete message hasn't been read yet. (A bad length
+// is skipped, i.e. the next cell is taken as the length.) Chunks are
+// appended to buffer_ until the last one; a message that gets bigger
+// than MAX_MESSAGE_SIZE is read to its end and then dropped.
+//
+bool connection::next_frame()
+{
+    auto &e = env_;
+
+    for (;;) {
+	if (!got_length_) {
+	    if (frame_end_ - frame_start_ < sizeof(cell)) {
+		return false;
+	    }
+	    received_length();
+	    continue;
+	}
+	if (frame_end_ - frame_start_ < receive_length_) {
+	    return false;
+	}
+	if (!in_message_) {
+	    in_message_ = true;
+	    message_size_ = 0;
+	    if (buffer_.capacity() > self_node::MAX_BUFFER_SIZE) {
+		std::vector<uint8_t>().swap(buffer_);
+	    }
+	    buffer_.clear();
+	}
+	message_size_ += receive_length_;
+	if (message_size_ <= self_node::MAX_MESSAGE_SIZE) {
+	    buffer_.insert(buffer_.end(),
+		   frame_buffer_.begin() + frame_start_,
+		   frame_buffer_.begin() + frame_start_ + receive_length_);
+	} else {
+	    std::vector<uint8_t>().swap(buffer_);
+	}
+	frame_start_ += receive_length_;
+	got_length_ = false;
+	if (more_chunks_) {
+	    continue;
+	}
+	in_message_ = false;
+	if (message_size_ > self_node::MAX_MESSAGE_SIZE) {
+	    if (auto_send()) {
+		send_error(e.new_term(
+			    e.functor("error_message_size_exceeds_max",1),
+			    {e.new_term(e.functor(">",2),
+					{int_cell(message_size_),
+					 int_cell(self_node::MAX_MESSAGE_SIZE)})}));
+	    }
+	    continue;
+	}
+	return true;
+    }
+}
+
+void connection::process_frames()
+{
+    while (receiving_ && !closed_ && !killed_ && next_frame()) {
+	receiving_ = false;
+	dispatch();
+    }
+}
+
+//
+// Starts whatever is not already going on: reading the next message
+// and writing the send queue. Always called on the strand. Nothing
+// happens before the connection is started (i.e. connected.)
+//
 void connection::run()
+{
+    if (closed_ || !started_) {
+	return;
+    }
+    process_frames();
+    if (killed_) {
+	close();
+	return;
+    }
+    if (receiving_ && !reading_) {
+	start_receive();
+    }
+    if (!send_queue_.empty() && !writing_) {
+	start_send();
+    }
+}
+
+//
+// Reads as much as the socket has (and the frame buffer can take.)
+// The unparsed bytes are first moved to the front of the buffer, and
+// as a message is at most MAX_BUFFER_SIZE bytes it always fits.
+//
+void connection::start_receive()
 {
     using namespace boost::asio;
     using namespace boost::system;
 
-    switch (state_) {
-    case RECEIVE_LENGTH:
-        buffer_len_.resize(sizeof(cell));
-	get_socket().async_read_some(buffer(&buffer_len_[received_bytes_],
-					    sizeof(cell) - received_bytes_),
+    if (frame_start_ > 0) {
+	std::copy(frame_buffer_.begin() + frame_start_,
+		  frame_buffer_.begin() + frame_end_,
+		  frame_buffer_.begin());
+	frame_end_ -= frame_start_;
+	frame_start_ = 0;
+    }
+
+    reading_ = true;
+    get_socket().async_read_some(buffer(&frame_buffer_[frame_end_],
+					frame_buffer_.size() - frame_end_),
 	     strand_.wrap(
 		  [this](const error_code &ec, size_t n) {
-			 if (!ec) {
-			     received_bytes_ += n;
-			     if (received_bytes_ >= sizeof(cell)) {
-				 bool r = received_length();
-				 if (!r && !auto_send()) {
-				     set_state(IDLE);
-				 }
-			     }
-			     run();
-			 } else {
-			     close();
+			 reading_ = false;
+			 if (closed_) {
+			     return;
 			 }
-		  }));
-	break;
-    case RECEIVE: {
-	size_t to_read = buffer_.size() - received_bytes_;
-	if (to_read > receive_length_ - received_bytes_) {
-	    to_read = receive_length_ - received_bytes_;
-	}
-	get_socket().async_read_some(buffer(&buffer_[received_bytes_],to_read),
-	     strand_.wrap(
-		  [this](const error_code &ec, size_t n) {
-			 if (!ec) {
-			     received_bytes_ += n;
-			     if (received_bytes_ >= receive_length_) {
-				 state_ = RECEIVED;
-			     }
-			     dispatch();
-			     run();
-			 } else {
+			 if (ec) {
 			     close();
+			     return;
 			 }
+			 frame_end_ += n;
+			 run();
 		  }));
-	break;
-        }
-    case SEND_LENGTH:
-	get_socket().async_write_some(buffer(&buffer_len_[sent_bytes_],
-					     sizeof(cell) - sent_bytes_),
-             strand_.wrap(
-		  [this](const error_code &ec, size_t n) {
-		      if (!ec) {
-			  sent_bytes_ += n;
-			  if (sent_bytes_ >= sizeof(cell)) {
-			      state_ = SEND;
-			      sent_bytes_ = 0;
-			  }
-			  run();
-		      } else {
-			  close();
-		      }
-		  }));
-	break;
-    case SEND:
-	get_socket().async_write_some(buffer(&buffer_[sent_bytes_],
-					     send_length_ - sent_bytes_),
+}
+
+//
+// Writes everything in the send queue with one gather write. Messages
+// queued while it is going on are taken by the next one.
+//
+void connection::start_send()
+{
+    using namespace boost::asio;
+    using namespace boost::system;
+
+    writing_ = true;
+    gather_.clear();
+    size_t offset = sent_bytes_;
+    for (auto &buf : send_queue_) {
+	gather_.push_back(buffer(&buf[offset], buf.size() - offset));
+	offset = 0;
+    }
+    get_socket().async_write_some(gather_,
 	     strand_.wrap(
 		  [this](const error_code &ec, size_t n) {
-		         if (!ec) {
-			     sent_bytes_ += n;
-			     if (sent_bytes_ >= buffer_.size()) {
-				 state_ = SENT;
-				 received_bytes_ = 0;
-				 sent_bytes_ = 0;
-				 dispatch();
-			     }
-			     run();
-		         } else {
+		         writing_ = false;
+			 if (closed_) {
+			     return;
+			 }
+			 if (ec) {
 			     close();
+			     return;
+			 }
+			 sent_bytes_ += n;
+			 while (!send_queue_.empty() &&
+				sent_bytes_ >= send_queue_.front().size()) {
+			     sent_bytes_ -= send_queue_.front().size();
+			     send_queue_.pop_front();
 			 }
+			 run();
 		  }));
-	break;
-    case RECEIVED:
-    case SENT:
-	break;
-    case KILLED:
-	close();
-	break;
-    case IDLE:
-	timer_.expires_from_now(boost::posix_time::microseconds(
-			self().get_fast_timer_interval_microseconds()));
-	timer_.async_wait(
-	     strand_.wrap(
-		     [this](const error_code &ec) {
-		        dispatch();
-		        run();
-		     }));
-	break;
-    }
 }
 
 in_connection::in_connection(self_node &self)
     : connection(self, CONNECTION_IN, env_),
-      session_(nullptr)
+      session_(nullptr),
+      executing_(false)
 {
     setup_commands();
     prepare_receive();
     set_auto_send(true);
-    set_dispatcher( [this]() { this->on_state(); } );
+    set_dispatcher( [this]() { this->on_message(); } );
     // std::cout << "in_connection::in_connection()\n";
 }
 
@@ -254,23 +357,40 @@ void in_connection::setup_commands()
     commands_[con_cell("next",0)] = [this](const term cmd){ command_next(cmd); };
 }
 
-void in_connection::on_state()
+// The next request is read once this one has been answered
+void in_connection::on_message()
 {
-    switch (get_state()) {
-    case RECEIVED: process_query(); break;
-    case SENT: prepare_receive(); break;
-    default: break;
+    process_query();
+    if (!executing_) {
+	prepare_receive();
     }
 }
 
-void in_connection::reply_ok(const term t)
+void in_connection::reply_ok(const term t, const fragments_t *fragments)
 {
-    send_ok(t);
+    bool sent;
+    if (request_id_ == term()) {
+	sent = send_ok(t, fragments);
+    } else {
+	sent = send(env_.new_term(MSG, {request_id_,
+			env_.new_term(env_.functor("ok",1),{t})}),
+		    fragments);
+    }
+    if (!sent) {
+	auto &e = env_;
+	reply_error(e.new_term(e.functor("error_reply_size_exceeds_max",1),
+			       {int_cell(self_node::MAX_MESSAGE_SIZE)}));
+    }
 }
 
 void in_connection::reply_error(const term t)
 {
-    send_error(t);
+    if (request_id_ == term()) {
+	send_error(t);
+    } else {
+	send(env_.new_term(MSG, {request_id_,
+			env_.new_term(env_.functor("error",1),{t})}));
+    }
 }
 
 void in_connection::command_new(const term)
@@ -317,7 +437,10 @@ void in_connection::command_connect(const term cmd)
     if (s == nullptr) {
 	return;
     }
-    self().in_session_connect(s, this);
+    if (!self().in_session_connect(s, this)) {
+	reply_error(e.functor("session_busy",0));
+	return;
+    }
     session_ = s;
     reply_ok(e.new_term(e.functor("session_resumed",2),
 			{id_term, get_state_atom()}));
@@ -358,9 +481,19 @@ void in_connection::process_query()
 {
     auto &e = env_;
     auto t = received();
+    request_id_ = term();
     if (t == term()) {
 	return;
     }
+    if (t.tag() == tag_t::STR && e.functor(t) == MSG) {
+	term id = e.arg(t, 0);
+	if (id.tag() != tag_t::INT) {
+	    reply_error(e.new_term(e.functor("erroneous_request_id",1),{id}));
+	    return;
+	}
+	request_id_ = id;
+	t = e.arg(t, 1);
+    }
     if (t.tag() != tag_t::STR) {
 	reply_error(e.new_term(e.functor("unrecognized_command",1),{t}));
 	return;
@@ -371,6 +504,8 @@ void in_connection::process_query()
     } else if (f == con_cell("query",1)) {
 	if (session_ == nullptr) {
 	    reply_error(e.functor("no_running_session",0));
+	} else if (session_->is_running()) {
+	    reply_error(e.functor("session_busy",0));
 	} else {
 	    term qr;
 	    try {
@@ -388,24 +523,44 @@ void in_connection::process_query()
     }
 }
 
+//
+// The query runs on the worker pool of the node. Meanwhile no further
+// request is read until the result is handed back to execution_done
+// on our strand.
+//
 void in_connection::process_execution(const term cmd, bool in_query)
+{
+    auto &e = env_;
+    if (session_ == nullptr) {
+	reply_error(e.functor("no_running_session",0));
+	return;
+    }
+    if (session_->is_running()) {
+	reply_error(e.functor("session_busy",0));
+	return;
+    }
+    if (in_query) {
+	if (cmd != con_cell("next",0)) {
+	    uint64_t cost = 0;
+	    reply_error(e.new_term(e.functor("unrecognized_command",1)
+				   ,{e.copy(cmd, session_->env(),cost)}));
+	    return;
+	}
+    }
+    executing_ = true;
+    self().run_in_session(session_,
+			  in_query ? self_node::NEXT : self_node::EXECUTE);
+}
+
+void in_connection::execution_done(bool r, const std::string &error)
 {
     auto &e = env_;
     try {
-	if (session_ == nullptr) {
-	    reply_error(e.functor("no_running_session",0));
+	if (!error.empty()) {
+	    reply_error(e.new_term(e.functor("remote_exception",1),
+				   {e.functor(error,0)}));
 	} else {
 	    uint64_t cost = 0;
-	    if (in_query) {
-		if (cmd != con_cell("next",0)) {
-		    uint64_t cost = 0;
-		    reply_error(e.new_term(e.functor("unrecognized_command",1)
-				   ,{e.copy(cmd, session_->env(),cost)}));
-		    return;
-		}
-	    }
-	    auto qr = session_->query();
-	    bool r = in_query ? session_->next() : session_->execute(qr);
 	    if (!r) {
 		reply_ok(e.new_term(e.functor("result",3),
 				    {e.functor("false",0),
@@ -422,13 +577,19 @@ void in_connection::process_execution(const term cmd, bool in_query)
 		result = e.new_term(e.functor("result",3),
 				    {result, vars_term, get_state_atom()});
 
-		reply_ok(result);
+		reply_ok(result, &session_->fragments());
 	    }
 	}
     } catch (std::exception &ex) {
 	reply_error(e.new_term(e.functor("remote_exception",1),
 			       {e.functor(ex.what(),0)}));
     }
+    // We may go on with a request we already have, so the session must
+    // not look busy.
+    self().session_idle(session_);
+    executing_ = false;
+    prepare_receive();
+    run();
 }
 
 //
@@ -436,18 +597,20 @@ void in_connection::process_execution(const term cmd, bool in_query)
 //
 
 out_connection::out_connection(self_node &self, out_connection::out_type_t t, const ip_service &ip)
-    :  connection(self, CONNECTION_OUT, env_), out_type_(t), ip_(ip), init_in_progress_(false), use_heartbeat_(true), connected_(false)
+    :  connection(self, CONNECTION_OUT, env_), out_type_(t), ip_(ip), init_in_progress_(false), use_heartbeat_(true), connected_(false), num_scheduled_(0), next_request_id_(0)
 {
     using namespace boost::system;
 
-    set_dispatcher( [this]() { this->on_state(); } );
+    set_dispatcher( [this]() { this->on_message(); } );
 
     boost::asio::ip::tcp::endpoint endpoint(ip.to_addr(), ip.port());
     get_socket().async_connect(endpoint,
          strand().wrap(
 		[this](const error_code &ec) {
 		    if (!ec) {
-			this->run();
+			this->prepare_receive();
+			this->start();
+			this->on_connected();
 		    } else {
 			this->close();
 		    }
@@ -534,6 +697,11 @@ void out_connection::handle_init_connection_task(out_task &task)
 		auto hbtask = create_heartbeat_task();
 		schedule(hbtask);
 	    }
+	    auto waiting = std::move(waiting_);
+	    waiting_.clear();
+	    for (auto &w : waiting) {
+		reschedule_last(w);
+	    }
 	}
 	break;
         }
@@ -551,9 +719,8 @@ void out_connection::handle_init_connection_task(out_task &task)
     }
 }
 
-void out_connection::idle_state()
+void out_connection::on_connected()
 {
-    set_state(IDLE);
     // If 'id' is empty, then we don't have a session, so we need to
     // issue a command to create one.
     if (id_.empty() && !init_in_progress_) {
@@ -561,74 +728,115 @@ void out_connection::idle_state()
 	auto task = create_init_connection_task();
 	schedule(task);
     }
+    send_next_tasks();
+    run();
 }
 
-void out_connection::error(const std::string &msg)
+void out_connection::reschedule(out_task &task, utime t)
 {
-    std::cout << "ERROR: " << msg << std::endl;
+    task.set_when(t);
+    if (t > last_in_work_) {
+	last_in_work_ = t;
+    }
+    num_scheduled_++;
+    self().schedule(this, task);
 }
 
-void out_connection::send_next_task()
+//
+// Before the session is connected this parks the task, rather than
+// have it come back every tick to find it still isn't.
+//
+void out_connection::reschedule_last(out_task &task)
 {
-    // Don't pop work queue on send operations,
-    // as send operations expect an answer. Once
-    // the answer is processed, the task is done
-    // and can be popped.
-    if (work_.empty()) {
-	idle_state();
-	return;
-    }
-    auto next_task = work_.top();
-    if (!next_task.expiring()) {
-	idle_state();
+    if (!connected_) {
+	waiting_.push_back(task);
 	return;
     }
-
-    next_task.set_state(out_task::SEND);
-    next_task.set_term(term());
-    next_task.run();
-    if (next_task.get_term() == term()) {
-	set_state(IDLE);
+    if (num_scheduled_ == 0 && ready_.empty()) {
+	schedule(task);
     } else {
-	send(next_task.get_term());
-    }
-    if (get_state() == IDLE) {
-	idle_state();
+	reschedule(task, last_in_work_ + utime::us(1));
     }
 }
 
-void out_connection::on_state()
+void out_connection::tasks_due(const std::vector<out_task> &tasks)
 {
-    switch (get_state()) {
-    case IDLE: send_next_task(); break;
-    case RECEIVED: {
-	auto task = work_.top();
-	work_.pop();
-	auto r = received();
-	task.set_state(out_task::RECEIVED);
-	task.set_term(r);
-	task.run();
-	if (get_state() != KILLED) {
-	    send_next_task();
+    num_scheduled_ -= tasks.size();
+    size_t start = ready_.size();
+    ready_.insert(ready_.end(), tasks.begin(), tasks.end());
+    std::stable_sort(ready_.begin() + start, ready_.end());
+    send_next_tasks();
+    run();
+}
+
+void out_connection::error(const std::string &msg)
+{
+    std::cout << "ERROR: " << msg << std::endl;
+}
+
+//
+// Send the tasks that are due without waiting for the replies of the
+// ones before them (up to MAX_IN_FLIGHT.) A sent task waits in
+// in_flight_ for the reply with its request id.
+//
+void out_connection::send_next_tasks()
+{
+    while (!is_killed() && in_flight_.size() < MAX_IN_FLIGHT &&
+	   !ready_.empty()) {
+	auto next_task = ready_.front();
+	ready_.pop_front();
+
+	next_task.set_state(out_task::SEND);
+	next_task.set_term(term());
+	next_task.run();
+	if (next_task.get_term() != term()) {
+	    int64_t id = next_request_id_++;
+	    if (!send(env_.new_term(MSG, {int_cell(id),
+					  next_task.get_term()}))) {
+		error(std::string("Request too big for ")
+		      + next_task.description());
+		continue;
+	    }
+	    in_flight_.insert(std::make_pair(id, next_task));
 	}
-	break;
-        }
-    case SENT:
-	prepare_receive();
-	break;
-    default:
-	break;
     }
 }
 
+void out_connection::on_message()
+{
+    prepare_receive();
+
+    auto r = received();
+    if (r.tag() != tag_t::STR || env_.functor(r) != MSG ||
+	env_.arg(r, 0).tag() != tag_t::INT) {
+	error("Unexpected reply: " + env_.to_string(r));
+	return;
+    }
+    auto id_term = env_.arg(r, 0);
+    int64_t id = reinterpret_cast<int_cell &>(id_term).value();
+    auto it = in_flight_.find(id);
+    if (it == in_flight_.end()) {
+	error("Reply to unknown request: " + env_.to_string(r));
+	return;
+    }
+    auto task = it->second;
+    in_flight_.erase(it);
+    task.set_state(out_task::RECEIVED);
+    task.set_term(env_.arg(r, 1));
+    task.run();
+    send_next_tasks();
+}
+
 void out_connection::print_task_queue() const
 {
-    auto temp = work_;
-    while (!temp.empty()) {
-	auto task = temp.top();
+    for (auto &p : in_flight_) {
+	std::cout << "in flight (" << p.first << "): "
+		  << p.second.description() << std::endl;
+    }
+    for (auto &task : ready_) {
 	std::cout << task.get_when().str() << ": " << task.description() << std::endl;
-	temp.pop();
     }
+    std::cout << num_scheduled_ << " more scheduled" << std::endl;
 }
 
 }}
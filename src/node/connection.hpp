@@ -6,6 +6,8 @@
 #include "asio_win32_check.hpp"
 
 #include <queue>
+#include <deque>
+#include <map>
 #include <boost/thread.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/strand.hpp>
@@ -15,6 +17,7 @@
 #include <boost/asio/deadline_timer.hpp>
 #include "../common/term.hpp"
 #include "../common/term_env.hpp"
+#include "../common/term_serializer.hpp"
 #include "../common/utime.hpp"
 #include "ip_address.hpp"
 #include "ip_service.hpp"
@@ -25,6 +28,26 @@ namespace prologcoin { namespace node {
 class self_node;
 class in_session_state;
 
+namespace test {
+class test_node_connection;
+}
+
+//
+// Messages are length prefixed serialized terms. A connection is full
+// duplex: sent messages are queued and written in order, independently
+// of reading. Reads take whatever the socket has into a frame buffer
+// from which any number of complete messages are parsed, and all
+// queued messages are written with one gather write.
+//
+// A message bigger than a frame (MAX_BUFFER_SIZE) is sent in chunks.
+// Every chunk but the last has a negative length, and the receiver
+// puts the chunks together. Messages are at most MAX_MESSAGE_SIZE
+// bytes, on both sides.
+//
+// A request can be tagged as msg(Id, Request), and then the reply is
+// tagged msg(Id, Reply) with the same Id. This way several requests
+// can be in flight on the same connection.
+//
 class connection {
 protected:
     using socket = boost::asio::ip::tcp::socket;
@@ -32,6 +55,7 @@ protected:
     using deadline_timer = boost::asio::deadline_timer;
     using term = prologcoin::common::term;
     using term_env = prologcoin::common::term_env;
+    using fragments_t = prologcoin::common::term_serializer::fragments_t;
 
 public:
     enum connection_type { CONNECTION_IN, CONNECTION_OUT };
@@ -47,40 +71,36 @@ public:
     inline socket & get_socket() { return socket_; }
     io_service & get_io_service();
 
-    inline void stop() { set_state(KILLED); }
+    inline void stop() { killed_ = true; }
 
     void close();
 
-    inline void prepare_receive() { set_state(RECEIVE_LENGTH); }
-    inline void prepare_send() { set_state(SEND_LENGTH); }
+    // Read the next message. Reading stops after each received
+    // message until this is called again.
+    inline void prepare_receive() { receiving_ = true; }
 
-    void send_error(const term t);
-    void send_ok(const term t);
-    void send(const term t);
+    // Fragments (if any) are spliced into the message, see
+    // term_serializer::set_fragments. A message bigger than
+    // MAX_MESSAGE_SIZE is not sent, and then false is returned.
+    bool send_error(const term t);
+    bool send_ok(const term t, const fragments_t *fragments = nullptr);
+    bool send(const term t, const fragments_t *fragments = nullptr);
     term received();
 
+    // Called for each received message
     inline void set_dispatcher( std::function<void ()> dispatcher )
     { dispatcher_ = dispatcher; }
 
+
     inline bool auto_send() const
     { return auto_send_; }
     inline void set_auto_send(bool auto_send)
     { auto_send_ = auto_send; }
 
+    static const common::con_cell MSG;
+
 protected:
-    enum state {
-	IDLE,
-	RECEIVE_LENGTH,
-	RECEIVE,
-	RECEIVED,
-	SEND_LENGTH,
-	SEND,
-	SENT,
-	KILLED
-    };
-
-    inline state get_state() const { return state_; }
-    inline void set_state(state state) { state_ = state; }
+    inline bool is_killed() const { return killed_; }
 
     void start();
     void run();
@@ -90,7 +110,14 @@ protected:
     boost::asio::io_service::strand strand() { return strand_; }
 
 private:
+    friend class self_node;
+    friend class test::test_node_connection;
+
     bool received_length();
+    bool next_frame();
+    void process_frames();
+    void start_receive();
+    void start_send();
 
     self_node &self_node_;
     connection_type type_;
@@ -98,16 +125,35 @@ private:
 
     boost::asio::io_service::strand strand_;
     socket socket_;
-    deadline_timer timer_;
 
-    state state_;
-    size_t received_bytes_;
+    bool killed_;
+    bool closed_;
+
+    // Receiving side. Bytes between frame_start_ and frame_end_ in
+    // frame_buffer_ have been read but not yet parsed. buffer_ holds
+    // the last parsed message.
+    bool receiving_;
+    bool reading_;
+    bool got_length_;
     size_t receive_length_;
-    size_t sent_bytes_;
-    size_t send_length_;
-    std::vector<uint8_t> buffer_len_;
+    bool more_chunks_;
+    bool in_message_;
+    size_t message_size_;
+    std::vector<uint8_t> frame_buffer_;
+    size_t frame_start_;
+    size_t frame_end_;
     std::vector<uint8_t> buffer_;
 
+    // Sending side. Each queued buffer is a complete message with its
+    // length. sent_bytes_ is how much of the first one has been
+    // written.
+    bool writing_;
+    size_t sent_bytes_;
+    std::vector<boost::asio::const_buffer> gather_;
+    std::deque<std::vector<uint8_t> > send_queue_;
+
+    bool started_;
+
     std::function<void ()> dispatcher_;
     bool auto_send_;
 };
@@ -123,7 +169,7 @@ private:
     in_session_state * get_session(const term id_term);
     inline in_session_state * get_session() { return session_; }
 
-    void on_state();
+    void on_message();
 
     void command_new(const term cmd);
     void command_connect(const term cmd);
@@ -133,9 +179,11 @@ private:
     void process_query();
     void process_query_reply();
     void process_execution(const term cmd, bool in_query);
+    void execution_done(bool result, const std::string &error);
 
     void reply_error(const common::term t);
-    void reply_ok(const common::term t);
+    void reply_ok(const common::term t,
+		  const fragments_t *fragments = nullptr);
 
     friend class self_node;
 
@@ -143,6 +191,11 @@ private:
 		       std::function<void(common::term cmd)> > commands_;
     in_session_state *session_;
     term_env env_;
+
+    // Requests are processed one at a time, in order. The id of the
+    // current one (if it was tagged) goes into the reply.
+    term request_id_;
+    bool executing_;
 };
 
 //
@@ -177,38 +230,22 @@ public:
     template<uint64_t C> inline void reschedule(out_task &task, utime::dt<C> dt)
     { reschedule(task, utime::now()+dt); }
 
-    inline void reschedule(out_task &task, utime t)
-    {
-        // If task issues a reschedule on SEND, which normally it doesn't
-        // as it doesn't pop the work queue, then we'll pop the work queue
-        // to remove it first.
-        if (task.get_state() == out_task::SEND) {
-  	    work_.pop();
-        }
-
-	task.set_when(t);
-	if (t > last_in_work_) {
-	    last_in_work_ = t;
-	}
-	work_.push(task);
-    }
+    // Tasks are scheduled in the node's timing wheel, which hands
+    // them back to tasks_due when they are due.
+    void reschedule(out_task &task, utime t);
 
-    inline void reschedule_last(out_task &task)
-    { if (work_.empty()) {
-          schedule(task);
-      } else {
-	  utime next_t = last_in_work_+utime::us(1);
-          reschedule(task, next_t);
-      }
-    }
+    // Schedule after the last scheduled task
+    void reschedule_last(out_task &task);
 
     inline bool is_connected() const
     { return connected_; }
 
     void print_task_queue() const;
 
+    // Maximum number of requests waiting for a reply
+    static const size_t MAX_IN_FLIGHT = 8;
+
 protected:
-    void idle_state();
     void error(const std::string &msg);
 
 private:
@@ -218,8 +255,10 @@ private:
     void handle_init_connection_task(out_task &task);
     static void handle_init_connection_task_fn(out_task &task);
 
-    void send_next_task();
-    void on_state();
+    void tasks_due(const std::vector<out_task> &tasks);
+    void send_next_tasks();
+    void on_message();
+    void on_connected();
 
     void reply_error(const common::term t);
     void reply_ok(const common::term t);
@@ -233,8 +272,14 @@ private:
     bool use_heartbeat_;
     bool connected_;
     term_env env_;
-    std::priority_queue<out_task, std::vector<out_task>, std::greater<out_task> > work_;
+    std::deque<out_task> ready_;
+    size_t num_scheduled_;
     utime last_in_work_;
+    std::vector<out_task> waiting_; // For the session to be connected
+
+    // Sent tasks by request id, waiting for their reply
+    std::map<int64_t, out_task> in_flight_;
+    int64_t next_request_id_;
 };
 
 }}
@@ -5,173 +5,158 @@ namespace prologcoin { namespace node {
 
 using namespace prologcoin::common;
 
-int ip_collection::random_id()
+static size_t random_index(size_t n)
 {
-    return random::next_int(1000000000);
+    return static_cast<size_t>(random::next_int(static_cast<int>(n)));
 }
 
-int ip_collection::new_id(group_prop &gprop)
+void ip_collection::swap_groups(size_t i, size_t j)
 {
-    int r = random_id();
-    while (gprop.id_to_ip_.find(r) != gprop.id_to_ip_.end()) {
-	r++;
+    if (i == j) {
+	return;
     }
-    return r;
+    std::swap(groups_[i], groups_[j]);
+    group_index_[groups_[i].group_] = i;
+    group_index_[groups_[j].group_] = j;
 }
 
-int ip_collection::new_gid()
+void ip_collection::swap_members(group_prop &gprop, size_t i, size_t j)
 {
-    int r = random_id();
-    while (gid_to_group_prop_.find(r) != gid_to_group_prop_.end()) {
-	r++;
+    if (i == j) {
+	return;
     }
-    return r;
+    auto &members = gprop.members_;
+    std::swap(members[i], members[j]);
+    index_[members[i].ip_] = i;
+    index_[members[j].ip_] = j;
 }
 
 void ip_collection::add(const ip_service &ip, int score)
 {
-    auto it = group_to_gid_.find(ip.group());
-    if (it == group_to_gid_.end()) {
-	auto gid = new_gid();
-	gid_to_group_prop_[gid] = group_prop{gid, ip.group(), 0};
-	group_to_gid_[ip.group()] = gid;
-    }
-
-    auto gid = group_to_gid_[ip.group()];
-    auto &gprop = gid_to_group_prop_[gid];
-
-    if (gprop.ip_to_id_.find(ip) != gprop.ip_to_id_.end()) {
+    if (exists(ip)) {
 	// IP service already exists. Exit.
 	return;
     }
 
-    auto id = new_id(gprop);
-    gprop.ip_to_id_[ip] = id;
-    gprop.id_to_ip_[id] = ip;
-    gprop.score_to_id_[std::make_pair(score, id)] = id;
-    gprop.count_++;
-
-    scores_.insert(std::make_pair(score,ip));
+    auto group = ip.group();
+    auto it = group_index_.find(group);
+    size_t gi;
+    if (it == group_index_.end()) {
+	gi = groups_.size();
+	groups_.push_back(group_prop{group});
+	group_index_[group] = gi;
+    } else {
+	gi = it->second;
+    }
 
-    count_++;
+    auto &gprop = groups_[gi];
+    index_[ip] = gprop.members_.size();
+    gprop.members_.push_back(member{ip, score});
 }
 
 ip_service ip_collection::spill(uint64_t group)
 {
-    auto gid = group_to_gid_[group];
-    auto &gprop = gid_to_group_prop_[gid];
-
-    // Pick the IP with lowest score
-    auto it = gprop.score_to_id_.begin();
-    if (it == gprop.score_to_id_.end()) {
+    auto it = group_index_.find(group);
+    if (it == group_index_.end()) {
 	return ip_service();
     }
-    auto id = it->second;
-    auto score = it->first.first;
-    auto ip = gprop.id_to_ip_[id];
-    remove(ip, score);
+
+    // Pick the IP with lowest score
+    auto &gprop = groups_[it->second];
+    auto ip = gprop.members_[lowest(gprop)].ip_;
+    remove(ip);
     return ip;
 }
 
 ip_service ip_collection::spill()
 {
-    if (scores_.empty()){
+    if (groups_.empty()) {
 	return ip_service();
     }
-    auto it = scores_.begin();
-    auto score = it->first;
-    auto ip = it->second;
-    remove(ip, score);
+
+    // Pick the IP with lowest score among the lowest of each group
+    size_t gi_lowest = 0, i_lowest = lowest(groups_[0]);
+    for (size_t gi = 1; gi < groups_.size(); gi++) {
+	auto i = lowest(groups_[gi]);
+	if (groups_[gi].members_[i].score_ <
+	    groups_[gi_lowest].members_[i_lowest].score_) {
+	    gi_lowest = gi;
+	    i_lowest = i;
+	}
+    }
+    auto ip = groups_[gi_lowest].members_[i_lowest].ip_;
+    remove(ip);
 
     return ip;
 }
 
-void ip_collection::remove(const ip_service &ip, int score)
+size_t ip_collection::lowest(const group_prop &gprop)
 {
-    scores_.erase(std::make_pair(score, ip));
-
-    auto it = group_to_gid_.find(ip.group());
-    if (it == group_to_gid_.end()) {
-	// Not found
-	return;
+    auto &members = gprop.members_;
+    size_t i_lowest = 0;
+    for (size_t i = 1; i < members.size(); i++) {
+	if (members[i].score_ < members[i_lowest].score_) {
+	    i_lowest = i;
+	}
     }
-    auto gid = it->second;
-    auto &gprop = gid_to_group_prop_[gid];
+    return i_lowest;
+}
 
-    auto it2 = gprop.ip_to_id_.find(ip);
-    if (it2 == gprop.ip_to_id_.end()) {
+void ip_collection::remove(const ip_service &ip)
+{
+    auto it = index_.find(ip);
+    if (it == index_.end()) {
 	// Not found
 	return;
     }
-
-    auto id = it2->second;
-    gprop.ip_to_id_.erase(ip);
-    gprop.id_to_ip_.erase(id);
-    gprop.score_to_id_.erase(std::make_pair(score, id));
-    gprop.count_--;
-    count_--;
+    auto pos = it->second;
+    auto gi = group_index_[ip.group()];
+    auto &gprop = groups_[gi];
+
+    swap_members(gprop, pos, gprop.members_.size() - 1);
+    gprop.members_.pop_back();
+    index_.erase(ip);
+
+    if (gprop.members_.empty()) {
+	swap_groups(gi, groups_.size() - 1);
+	group_index_.erase(groups_.back().group_);
+	groups_.pop_back();
+    }
 }
 
-bool ip_collection::exists(const ip_service &ip)
+bool ip_collection::sampler::next(ip_service &ip)
 {
-    auto it = group_to_gid_.find(ip.group());
-    if (it == group_to_gid_.end()) {
+    if (active_ == 0) {
 	return false;
     }
-    auto gid = it->second;
-    auto &gprop = gid_to_group_prop_[gid];
-    auto it2 = gprop.ip_to_id_.find(ip);
-    if (it2 == gprop.ip_to_id_.end()) {
-	return false;
+
+    auto gi = random_index(active_);
+    auto &gprop = coll_.groups_[gi];
+    auto &taken = taken_[gprop.group_];
+    auto left = gprop.members_.size() - taken;
+
+    // Move the drawn member behind the ones left
+    coll_.swap_members(gprop, random_index(left), left - 1);
+    ip = gprop.members_[left - 1].ip_;
+    taken++;
+
+    if (left == 1) {
+	coll_.swap_groups(gi, active_ - 1);
+	active_--;
     }
 
-    return gprop.ip_to_id_.find(ip) != gprop.ip_to_id_.end();
+    return true;
 }
 
 // Select N services from collection. Prefer from different groups.
 std::vector<ip_service> ip_collection::select(size_t n)
 {
     std::vector<ip_service> result;
-    
-    std::unordered_set<int> selected;
-    size_t fail_count = 0;
-    for (size_t i = 0; i < n && fail_count < MAX_FAIL_COUNT;) {
-
-        // First select a random group
-
-	auto gid = random_id();
-	auto it = gid_to_group_prop_.lower_bound(gid);
-	if (it == gid_to_group_prop_.end()) {
-	    fail_count++;
-	    continue;
-	}
-	auto &gprop = it->second;
 
-	// Then select a random IP in this group
-
-	auto id = random_id();
-	auto it2 = gprop.id_to_ip_.lower_bound(id);
-	if (it2 == gprop.id_to_ip_.end()) {
-	    it2 = gprop.id_to_ip_.begin();
-	}
-	if (it2 == gprop.id_to_ip_.end()) {
-	    fail_count++;
-	    continue;
-	}
-	
-	id = it2->first;
-	auto &ip = it2->second;
-	
-	// Fail if it has already been selected
-	
-	if (selected.find(id) != selected.end()) {
-	    fail_count++;
-	    continue;
-	}
-	
-	selected.insert(id);
+    sampler s(*this);
+    ip_service ip;
+    while (result.size() < n && s.next(ip)) {
 	result.push_back(ip);
-	i++;
     }
 
     return result;
@@ -179,13 +164,22 @@ std::vector<ip_service> ip_collection::select(size_t n)
 
 void ip_collection::integrity_check()
 {
-    for (auto p : group_to_gid_) {
-	auto it = gid_to_group_prop_.find(p.second);
-	assert(it != gid_to_group_prop_.end());
-	auto &gprop = gid_to_group_prop_[p.second];
-	assert(gprop.count_ == gprop.id_to_ip_.size());
+    size_t n = 0;
+    assert(group_index_.size() == groups_.size());
+    for (size_t gi = 0; gi < groups_.size(); gi++) {
+	auto &gprop = groups_[gi];
+	assert(!gprop.members_.empty());
+	auto it = group_index_.find(gprop.group_);
+	assert(it != group_index_.end() && it->second == gi);
+	for (size_t i = 0; i < gprop.members_.size(); i++) {
+	    auto &m = gprop.members_[i];
+	    assert(m.ip_.group() == gprop.group_);
+	    auto it2 = index_.find(m.ip_);
+	    assert(it2 != index_.end() && it2->second == i);
+	}
+	n += gprop.members_.size();
     }
+    assert(n == index_.size());
 }
 
 }}
-
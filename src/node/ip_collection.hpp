@@ -4,8 +4,8 @@
 #define _node_ip_collection_hpp
 
 #include "ip_service.hpp"
-#include <map>
-#include <set>
+#include "../common/flat_hash_map.hpp"
+#include <vector>
 
 namespace prologcoin { namespace node {
 
@@ -16,71 +16,93 @@ namespace prologcoin { namespace node {
 // it should be at most O(log N) to add/remove elements of
 // the collection while maintaining the group property.
 //
+// The groups are kept in a dense array, and so are the members of
+// each group. Removing swaps the last element into the hole. This way
+// the i:th group (or member) is found directly, so picking one
+// uniformly at random is a single draw. Spilling scans for the lowest
+// score, which is fine as it is only used on small collections (or
+// on a single group.)
+//
 
 class ip_collection : public boost::noncopyable {
 public:
-    inline ip_collection() : count_(0) { }
+    inline ip_collection() { }
 
     inline ip_collection(ip_collection &&other) :
-     count_(std::move(other.count_)),
-     gid_to_group_prop_(std::move(other.gid_to_group_prop_)),
-     group_to_gid_(std::move(other.group_to_gid_)),
-     scores_(std::move(other.scores_)) 
+     groups_(std::move(other.groups_)),
+     group_index_(std::move(other.group_index_)),
+     index_(std::move(other.index_))
        {  }
 
-   
-    void add( const ip_service &ip, int score );
-    void remove( const ip_service &ip, int score );
-    bool exists( const ip_service &ip );
+    inline void clear()
+        { groups_.clear(); group_index_.clear(); index_.clear(); }
 
-    inline size_t size() const { return count_; }
-    inline size_t size(uint64_t group)
-       { auto it = group_to_gid_.find(group);
-	 if (it == group_to_gid_.end()) {
-	     return 0;
-	 }
-	 auto gid = it->second;
-	 auto it2 = gid_to_group_prop_.find(gid);
-	 if (it2 == gid_to_group_prop_.end()) {
+    void add( const ip_service &ip, int score );
+    void remove( const ip_service &ip );
+    inline bool exists( const ip_service &ip ) const
+        { return index_.count(ip) != 0; }
+
+    inline size_t size() const { return index_.size(); }
+    inline size_t size(uint64_t group) const
+       { auto it = group_index_.find(group);
+	 if (it == group_index_.end()) {
 	     return 0;
 	 }
-	 return it2->second.count_;
+	 return groups_[it->second].members_.size();
        }
 
     inline size_t num_groups() const
-        { return gid_to_group_prop_.size(); }
+        { return groups_.size(); }
 
     std::vector<ip_service> select(size_t n);
     ip_service spill(uint64_t group);
     ip_service spill();
 
+    //
+    // Draws members without replacement: first a group uniformly among
+    // the groups with members left, then a member uniformly within that
+    // group. Each draw is O(1). Drawn members are moved behind the ones
+    // left (and exhausted groups behind the others), so the collection
+    // must not be changed while a sampler is in use.
+    //
+    class sampler {
+    public:
+	inline sampler(ip_collection &coll)
+	    : coll_(coll), active_(coll.groups_.size()) { }
+
+	inline bool exhausted() const { return active_ == 0; }
+	bool next(ip_service &ip);
+
+    private:
+	ip_collection &coll_;
+	size_t active_; // Groups [0, active_) have members left
+	common::flat_hash_map<uint64_t, size_t> taken_; // Drawn per group
+    };
+
     void integrity_check();
 
 private:
-    static const size_t MAX_FAIL_COUNT = 1000;
+    struct member {
+	ip_service ip_;
+	int score_;
+    };
 
     struct group_prop {
-	int id_;
 	uint64_t group_;
-	size_t count_;
-
-	std::map<int, ip_service> id_to_ip_;
-	std::map<ip_service, int> ip_to_id_;
-	std::map<std::pair<int,int>, int> score_to_id_;
+	std::vector<member> members_;
     };
 
-    size_t count_;
+    static size_t lowest(const group_prop &gprop);
+    void swap_groups(size_t i, size_t j);
+    void swap_members(group_prop &gprop, size_t i, size_t j);
 
-    int random_id();
-    int new_id(group_prop &prop);
-    int new_gid();
-
-    std::map<int, group_prop> gid_to_group_prop_;
-    std::map<uint64_t, int> group_to_gid_;
-    std::set<std::pair<int,ip_service> > scores_;
+    std::vector<group_prop> groups_;
+    // Group to index in groups_
+    common::flat_hash_map<uint64_t, size_t> group_index_;
+    // IP service to index in the members of its group
+    common::flat_hash_map<ip_service, size_t> index_;
 };
 
 }}
 
 #endif
-
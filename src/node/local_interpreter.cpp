@@ -44,18 +44,39 @@ bool me_builtins::comment_1(interpreter_base &interp0, size_t arity, term args[]
     return interp.unify(args[0], comment);
 }
 
+//
+// The usual peer exchange is the query me:peers(N, X) on its own. Then
+// nothing but the reply looks at X, so the entries can be left as
+// term_serializer::FRAGMENT(I) placeholders for their serialized terms.
+//
+static bool is_peer_exchange(local_interpreter &interp, term result)
+{
+    term_env &env = interp.session().env();
+    term q = env.deref(interp.session().query());
+    if (q.tag() != tag_t::STR || env.functor(q) != local_interpreter::COLON
+	|| env.deref(env.arg(q, 0)) != local_interpreter::ME) {
+	return false;
+    }
+    term g = env.deref(env.arg(q, 1));
+    if (g.tag() != tag_t::STR || env.functor(g) != con_cell("peers",2)) {
+	return false;
+    }
+    term x = env.deref(env.arg(g, 1));
+    return x.tag() == tag_t::REF && x == env.deref(result);
+}
+
 bool me_builtins::peers_2(interpreter_base &interp0, size_t arity, term args[] )
 {
     auto &interp = to_local(interp0);
 
     auto n_term = args[0];
     if (n_term.tag() != tag_t::INT) {
-	interp.abort(interpreter_exception_wrong_arg_type("peers/2: First argument must be an integer; was " + interp.to_string(n_term)));
+	return interp.abort(interpreter_exception_wrong_arg_type("peers/2: First argument must be an integer; was " + interp.to_string(n_term)));
     }
 
     int64_t n = reinterpret_cast<int_cell &>(n_term).value();
     if (n < 1 || n > 100) {
-	interp.abort(interpreter_exception_wrong_arg_type("peers/2: First argument must be a number within 1..100; was " + boost::lexical_cast<std::string>(n)));
+	return interp.abort(interpreter_exception_wrong_arg_type("peers/2: First argument must be a number within 1..100; was " + boost::lexical_cast<std::string>(n)));
     }
 
     auto book = interp.self().book();
@@ -64,12 +85,21 @@ bool me_builtins::peers_2(interpreter_base &interp0, size_t arity, term args[] )
     auto rest = book().get_randomly_from_bottom_90_pt(static_cast<size_t>(n-best.size()));
 
     // Create a list out of entries
+    bool use_fragments = is_peer_exchange(interp, args[1]);
+    auto entry_term = [&](const address_entry &e) {
+	if (!use_fragments) {
+	    return e.to_term(interp);
+	}
+	auto i = interp.session().add_fragment(book().serialized(e.id()));
+	return interp.new_term(term_serializer::FRAGMENT,
+			       {int_cell(static_cast<int64_t>(i))});
+    };
     term result = interp.empty_list();
     for (auto &e : best) {
-	result = interp.new_dotted_pair(e.to_term(interp), result);
+	result = interp.new_dotted_pair(entry_term(e), result);
     }
     for (auto &e : rest) {
-	result = interp.new_dotted_pair(e.to_term(interp), result);
+	result = interp.new_dotted_pair(entry_term(e), result);
     }
     
     // Unify second arg with result
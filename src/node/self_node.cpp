@@ -20,13 +20,18 @@ self_node::self_node(unsigned short port)
       socket_(ioservice_),
       strand_(ioservice_),
       timer_(ioservice_),
+      wheel_timer_(ioservice_),
       comment_(env_.empty_list()),
+      wheel_timer_running_(false),
       recent_in_connection_(nullptr),
       preferred_num_standard_out_connections_(DEFAULT_NUM_STANDARD_OUT_CONNECTIONS),
       preferred_num_verifier_connections_(DEFAULT_NUM_VERIFIER_CONNECTIONS),
       num_standard_out_connections_(0),
       num_verifier_connections_(0),
       num_download_addresses_(DEFAULT_NUM_DOWNLOAD_ADDRESSES),
+      num_io_threads_(DEFAULT_NUM_IO_THREADS),
+      num_workers_(DEFAULT_NUM_WORKERS),
+      time_slice_(DEFAULT_TIME_SLICE),
       address_downloader_fast_mode_(false)
 {
     set_timer_interval(utime::ss(DEFAULT_TIMER_INTERVAL_SECONDS));
@@ -37,10 +42,30 @@ void self_node::start()
 {
     stopped_ = false;
 
+    if (!book_path_.empty()) {
+	book()().open(book_path_);
+    }
+
     acceptor_.set_option(acceptor::reuse_address(true));
     acceptor_.set_option(socket_base::enable_connection_aborted(true));
     acceptor_.listen();
 
+    workers_work_.reset(new io_service::work(workers_));
+    for (size_t i = 0; i < num_workers_; i++) {
+	worker_threads_.create_thread([this](){ workers_.run(); });
+    }
+
+    // The main I/O thread starts accepting and ticking; the others
+    // just run handlers.
+    size_t n = num_io_threads_;
+    if (n == 0) {
+	n = std::max(1u, boost::thread::hardware_concurrency());
+    }
+    ioservice_work_.reset(new io_service::work(ioservice_));
+    for (size_t i = 1; i < n; i++) {
+	io_threads_.create_thread([this](){ ioservice_.run(); });
+    }
+
     thread_ = boost::thread([&](){ run(); });
 }
 
@@ -48,6 +73,10 @@ void self_node::stop()
 {
     stopped_ = true;
     ioservice_.stop();
+    workers_.stop();
+
+    // Changes made after this are not journaled
+    book()().close();
 }
 
 void self_node::run()
@@ -59,8 +88,12 @@ void self_node::run()
 
 void self_node::close(connection *conn)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);    
-    closed_.push_back(conn);
+    boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
+    if (std::find(closed_.begin(), closed_.end(), conn) == closed_.end()) {
+	closed_.push_back(conn);
+    }
+    // Don't wait for the next tick to clean up
+    strand_.post([this](){ prune_dead_connections(); });
 }
 
 void self_node::set_comment(const std::string &str)
@@ -70,7 +103,7 @@ void self_node::set_comment(const std::string &str)
 
 void self_node::for_each_in_session(const std::function<void (in_session_state *session)> &fn)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
 
     for (auto p : in_states_) {
 	auto *session = p.second;
@@ -80,7 +113,7 @@ void self_node::for_each_in_session(const std::function<void (in_session_state *
 
 void self_node::for_each_standard_out_connection(const std::function<void (out_connection *out)> &fn)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
 
     for (auto *conn : out_connections_) {
 	auto *out_conn = reinterpret_cast<out_connection *>(conn);
@@ -94,14 +127,14 @@ in_session_state * self_node::new_in_session(in_connection *conn)
 {
     auto *ss = new in_session_state(this, conn);
 
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
     in_states_[ss->id()] = ss;
     return ss;
 }
 
 in_session_state * self_node::find_in_session(const std::string &id)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
     
     auto it = in_states_.find(id);
     if (it == in_states_.end()) {
@@ -111,47 +144,62 @@ in_session_state * self_node::find_in_session(const std::string &id)
     return it->second;
 }
 
-void self_node::in_session_connect(in_session_state *sess, in_connection *conn)
+bool self_node::in_session_connect(in_session_state *sess, in_connection *conn)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
-
-    auto *old_conn = sess->get_connection();
-
-    if (old_conn == conn) {
-	return;
+    in_connection *old_conn = nullptr;
+    {
+	boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
+	// The old connection gets the result of a running query
+	if (sess->is_running()) {
+	    return false;
+	}
+	old_conn = sess->get_connection();
+	if (old_conn == conn) {
+	    return true;
+	}
+	sess->set_connection(conn);
     }
 
-    disconnect(old_conn);
-    sess->set_connection(conn);
+    if (old_conn != nullptr) {
+	boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
+	disconnect(old_conn);
+    }
+    return true;
 }
 
 out_connection * self_node::new_standard_out_connection(const ip_service &ip)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
 
     auto *out = new out_connection(*this, out_connection::STANDARD, ip);
     out_connections_.insert(out);
     out_standard_ips_.insert(ip);
     num_standard_out_connections_++;
-    task_address_downloader task(*out);
-    out->schedule(task);
+    // The connection may already be running on another I/O thread
+    out->strand().post([out](){
+	    task_address_downloader task(*out);
+	    out->schedule(task);
+	});
     return out;
 }
 
 bool self_node::has_standard_out_connection(const ip_service &ip)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
 
     return out_standard_ips_.find(ip) != out_standard_ips_.end();
 }
 
 out_connection * self_node::new_verifier_connection(const ip_service &ip)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
 
     auto *out = new out_connection(*this, out_connection::VERIFIER, ip);
-    task_address_verifier task(*out);
-    out->schedule(task);
+    out->strand().post([out](){
+	    out->set_use_heartbeat(false);
+	    task_address_verifier task(*out);
+	    out->schedule(task);
+	});
     out_connections_.insert(out);
     num_verifier_connections_++;
     return out;
@@ -159,10 +207,91 @@ out_connection * self_node::new_verifier_connection(const ip_service &ip)
 
 void self_node::kill_in_session(in_session_state *sess)
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
 
     in_states_.erase(sess->id());
-    delete sess;
+    if (sess->is_running()) {
+	sess->set_killed();
+    } else {
+	delete sess;
+    }
+}
+
+void self_node::run_in_session(in_session_state *sess, execution_t what)
+{
+    {
+	boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
+	sess->set_running(true);
+    }
+    workers_.post([this,sess,what](){ run_slice(sess, what); });
+}
+
+//
+// Runs on a worker thread. A query that yields is put at the back of
+// the work queue, so long queries take turns with everything else.
+//
+void self_node::run_slice(in_session_state *sess, execution_t what)
+{
+    bool r = false;
+    std::string error;
+
+    try {
+	switch (what) {
+	case EXECUTE: r = sess->execute(sess->query()); break;
+	case NEXT: r = sess->next(); break;
+	case RESUME: r = sess->resume(); break;
+	}
+    } catch (std::exception &ex) {
+	error = ex.what();
+    }
+
+    in_connection *conn = nullptr;
+    {
+	boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
+
+	if (error.empty() && sess->is_yielded() && !sess->is_killed()) {
+	    workers_.post([this,sess](){ run_slice(sess, RESUME); });
+	    return;
+	}
+	conn = sess->get_connection();
+    }
+
+    // The session is still busy, so the connection is still there
+    if (conn == nullptr) {
+	executed(sess, conn, r, error);
+	return;
+    }
+    conn->strand().post([this,sess,conn,r,error](){
+	    executed(sess, conn, r, error);
+	});
+}
+
+// The connection may have been replaced while the query was running,
+// so it only gets the result if the session still has it.
+void self_node::executed(in_session_state *sess, in_connection *conn,
+			 bool result, const std::string &error)
+{
+    bool deliver = false;
+    {
+	boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
+	deliver = !sess->is_killed() && conn != nullptr &&
+	          sess->get_connection() == conn;
+    }
+    if (deliver) {
+	conn->execution_done(result, error);
+    } else {
+	session_idle(sess);
+    }
+}
+
+void self_node::session_idle(in_session_state *sess)
+{
+    boost::lock_guard<boost::recursive_mutex> guard(sessions_lock_);
+    if (sess->is_killed()) {
+	delete sess;
+	return;
+    }
+    sess->set_running(false);
 }
 
 void self_node::start_accept()
@@ -171,7 +300,10 @@ void self_node::start_accept()
     using namespace boost::system;
 
     in_connection *conn = new in_connection(*this);
-    in_connections_.insert(conn);
+    {
+	boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
+	in_connections_.insert(conn);
+    }
     recent_in_connection_ = conn;
     acceptor_.async_accept(conn->get_socket(),
 		   strand_.wrap(
@@ -201,12 +333,20 @@ void self_node::start_tick()
 
 void self_node::prune_dead_connections()
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
+    // Connections that will still get the result of a query
+    std::vector<connection *> busy;
     while (!closed_.empty()) {
 	auto *c = closed_.back();
+	closed_.pop_back();
 	if (c->type() == connection::CONNECTION_IN) {
 	    auto *s = reinterpret_cast<in_connection *>(c)->get_session();
-	    if (s != nullptr) {
+	    boost::lock_guard<boost::recursive_mutex> sguard(sessions_lock_);
+	    if (s != nullptr && s->get_connection() == c) {
+		if (s->is_running()) {
+		    busy.push_back(c);
+		    continue;
+		}
 		s->reset_connection();
 	    }
 	} else {
@@ -218,8 +358,9 @@ void self_node::prune_dead_connections()
 	    }
 	}
 	disconnect(c);
-	closed_.pop_back();
     }
+    // Pruned on a later tick
+    closed_.insert(closed_.end(), busy.begin(), busy.end());
 }
 
 void self_node::connect_to(const std::vector<address_entry> &entries)
@@ -240,8 +381,8 @@ void self_node::check_standard_out_connections()
     size_t remaining = preferred_num_standard_out_connections_ - num_standard_out_connections_;
     size_t num_top10 = (remaining + 1) / 2;
     size_t num_bot90 = remaining - num_top10;
-    auto top10 = address_book_.get_randomly_from_top_10_pt(num_top10);
-    auto bot90 = address_book_.get_randomly_from_bottom_90_pt(num_bot90);
+    auto top10 = book()().get_randomly_from_top_10_pt(num_top10);
+    auto bot90 = book()().get_randomly_from_bottom_90_pt(num_bot90);
     // std::cout << "Top10%: n=" << top10.size() << " bot90%%: n=" << bot90.size() << std::endl;
     connect_to(top10);
     connect_to(bot90);
@@ -254,10 +395,9 @@ void self_node::check_verifier_connections()
     }
 
     size_t remaining = preferred_num_verifier_connections_ - num_verifier_connections_;
-    auto unverified = address_book_.get_randomly_from_unverified(remaining);
+    auto unverified = book()().get_randomly_from_unverified(remaining);
     for (auto &addr : unverified) {
-	auto *out = new_verifier_connection(addr);
-	out->set_use_heartbeat(false);
+	new_verifier_connection(addr);
     }
 }
 
@@ -268,7 +408,7 @@ void self_node::check_verifier_connections()
 //
 void self_node::check_out_connections()
 {
-    boost::lock_guard<boost::recursive_mutex> guard(lock_);
+    boost::lock_guard<boost::recursive_mutex> guard(connections_lock_);
 
     check_standard_out_connections();
     check_verifier_connections();
@@ -277,11 +417,18 @@ void self_node::check_out_connections()
 void self_node::join()
 {
     thread_.join();
+    io_threads_.join_all();
+    worker_threads_.join_all();
 }
 
 bool self_node::join_us(uint64_t us)
 {
-    return thread_.timed_join(boost::posix_time::microseconds(us));
+    if (!thread_.timed_join(boost::posix_time::microseconds(us))) {
+	return false;
+    }
+    io_threads_.join_all();
+    worker_threads_.join_all();
+    return true;
 }
 
 void self_node::disconnect(connection *conn)
@@ -297,7 +444,105 @@ void self_node::disconnect(connection *conn)
 	    out_standard_ips_.erase(out_conn->ip());
 	}
     }
-    connection::delete_connection(conn);
+    closed_.erase(std::remove(closed_.begin(), closed_.end(), conn),
+		  closed_.end());
+    if (conn->type() == connection::CONNECTION_OUT) {
+	boost::lock_guard<boost::recursive_mutex> guard(wheel_lock_);
+	wheel_.cancel_all(reinterpret_cast<out_connection *>(conn));
+    }
+    delete_connection(conn);
+}
+
+void self_node::schedule(out_connection *out, const out_task &task)
+{
+    boost::lock_guard<boost::recursive_mutex> guard(wheel_lock_);
+    wheel_.insert(out, task.get_when(), task);
+    arm_wheel_timer();
+}
+
+//
+// Arms the wheel timer if it isn't already armed for the next expiry
+// (or earlier.) Rearming cancels the previous wait. Called with
+// wheel_lock_ held.
+//
+void self_node::arm_wheel_timer()
+{
+    using namespace boost::system;
+
+    if (wheel_.empty()) {
+	return;
+    }
+    utime next = wheel_.next_expiry();
+    if (wheel_timer_running_ && next >= wheel_timer_at_) {
+	return;
+    }
+    wheel_timer_running_ = true;
+    wheel_timer_at_ = next;
+    auto now = utime::now();
+    uint64_t dt = next > now ? (next - now).in_us() : 0;
+    wheel_timer_.expires_from_now(boost::posix_time::microseconds(dt));
+    wheel_timer_.async_wait(
+	      strand_.wrap(
+		   [this](const error_code &ec) {
+		       if (ec == boost::asio::error::operation_aborted) {
+			   return;
+		       }
+		       fire_tasks();
+		   }));
+}
+
+//
+// The due tasks are posted while wheel_lock_ is held, so nothing can
+// be posted to a connection after disconnect() has cancelled its
+// tasks (and posted its deletion.)
+//
+void self_node::fire_tasks()
+{
+    boost::lock_guard<boost::recursive_mutex> guard(wheel_lock_);
+
+    wheel_timer_running_ = false;
+    std::unordered_map<out_connection *, std::vector<out_task> > due;
+    wheel_.advance(utime::now(),
+		   [&due](void *owner, const out_task &task) {
+		       due[reinterpret_cast<out_connection *>(owner)].push_back(task);
+		   });
+    for (auto &d : due) {
+	auto *out = d.first;
+	auto tasks = d.second;
+	out->strand().post([out, tasks](){ out->tasks_due(tasks); });
+    }
+    arm_wheel_timer();
+}
+
+size_t self_node::num_scheduled_tasks()
+{
+    boost::lock_guard<boost::recursive_mutex> guard(wheel_lock_);
+    return wheel_.size();
+}
+
+uint64_t self_node::num_fired_tasks()
+{
+    boost::lock_guard<boost::recursive_mutex> guard(wheel_lock_);
+    return wheel_.num_fired();
+}
+
+uint64_t self_node::task_max_lateness_us()
+{
+    boost::lock_guard<boost::recursive_mutex> guard(wheel_lock_);
+    return wheel_.max_lateness_us();
+}
+
+uint64_t self_node::task_avg_lateness_us()
+{
+    boost::lock_guard<boost::recursive_mutex> guard(wheel_lock_);
+    return wheel_.avg_lateness_us();
+}
+
+// With several I/O threads a handler of the connection may still be
+// running, so it is deleted from its own strand.
+void self_node::delete_connection(connection *conn)
+{
+    conn->strand().post([conn](){ connection::delete_connection(conn); });
 }
 
 void self_node::master_hook()
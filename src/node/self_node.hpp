@@ -18,6 +18,7 @@
 #include "../interp/interpreter.hpp"
 #include "connection.hpp"
 #include "address_book.hpp"
+#include "timing_wheel.hpp"
 
 namespace prologcoin { namespace node {
 
@@ -62,9 +63,13 @@ public:
 
     static const unsigned short DEFAULT_PORT = 8783;
     static const size_t MAX_BUFFER_SIZE = 65536;
+    static const size_t MAX_MESSAGE_SIZE = 16*1024*1024; // Sent in chunks
     static const size_t DEFAULT_NUM_STANDARD_OUT_CONNECTIONS = 8;
     static const size_t DEFAULT_NUM_VERIFIER_CONNECTIONS = 3;
     static const size_t DEFAULT_NUM_DOWNLOAD_ADDRESSES = 100;
+    static const size_t DEFAULT_NUM_WORKERS = 2;
+    static const size_t DEFAULT_NUM_IO_THREADS = 0; // One per core
+    static const uint64_t DEFAULT_TIME_SLICE = 10000;
 
     self_node(unsigned short port = DEFAULT_PORT);
 
@@ -82,6 +87,12 @@ public:
 	return address_book_wrapper(*this, address_book_);
     }
 
+    // If set, the address book is kept in this file (see
+    // address_book::open) from start() to stop(). Must be set before
+    // start().
+    inline const std::string & book_path() const { return book_path_; }
+    inline void set_book_path(const std::string &path) { book_path_ = path; }
+
     inline void set_master_hook(const std::function<void (self_node &)> &hook)
     { master_hook_ = hook; }
 
@@ -121,11 +132,38 @@ public:
 	return num_download_addresses_;
     }
 
-    inline bool is_self(const ip_service &ip) const {
+    // Number of threads running the I/O service. Each connection has
+    // its own strand, so connections are served in parallel. Must be
+    // set before start().
+    inline size_t num_io_threads() const {
+	return num_io_threads_;
+    }
+    inline void set_num_io_threads(size_t n) {
+	num_io_threads_ = n;
+    }
+
+    // Queries of in sessions run on a pool of worker threads, in time
+    // slices of this many calls. Both must be set before start().
+    inline size_t num_workers() const {
+	return num_workers_;
+    }
+    inline void set_num_workers(size_t n) {
+	num_workers_ = n;
+    }
+    inline uint64_t time_slice() const {
+	return time_slice_;
+    }
+    inline void set_time_slice(uint64_t n) {
+	time_slice_ = n;
+    }
+
+    inline bool is_self(const ip_service &ip) {
+	boost::lock_guard<boost::recursive_mutex> guard(book_lock_);
 	return self_ips_.find(ip) != self_ips_.end();
     }
 
     inline void add_self(const ip_service &ip) {
+	boost::lock_guard<boost::recursive_mutex> guard(book_lock_);
 	self_ips_.insert(ip);
     }
 
@@ -136,27 +174,30 @@ public:
     in_session_state * new_in_session(in_connection *conn);
     in_session_state * find_in_session(const std::string &id);
     void kill_in_session(in_session_state *sess);
-    void in_session_connect(in_session_state *sess, in_connection *conn);
+    // Fails if the session is running a query
+    bool in_session_connect(in_session_state *sess, in_connection *conn);
+
+    // Run the query of the session (or look for its next solution) on
+    // the worker pool. The connection of the session gets the result
+    // (see in_connection::execution_done) and then calls session_idle.
+    // Until then the session is busy, and its connection is kept even
+    // if it is closed.
+    enum execution_t { EXECUTE, NEXT, RESUME };
+    void run_in_session(in_session_state *sess, execution_t what);
+    void session_idle(in_session_state *sess);
 
     out_connection * new_standard_out_connection(const ip_service &ip);
     out_connection * new_verifier_connection(const ip_service &ip);
 
-    class locker;
-    friend class locker;
-
-    class locker : public boost::noncopyable {
-    public:
-	inline locker(self_node &node) : lock_(&node.lock_) { lock_->lock(); }
-	inline locker(locker &&other) : lock_(std::move(other.lock_)) { }
-	inline ~locker() { lock_->unlock(); }
+    // The tasks of all out connections are kept in one timing wheel.
+    // Due tasks are handed in batches to their connection (on its
+    // strand, see out_connection::tasks_due.)
+    void schedule(out_connection *out, const out_task &task);
 
-    private:
-	boost::recursive_mutex *lock_;
-    };
-
-    inline locker locked() {
-	return locker(*this);
-    }
+    size_t num_scheduled_tasks();
+    uint64_t num_fired_tasks();
+    uint64_t task_max_lateness_us();
+    uint64_t task_avg_lateness_us();
 
 private:
     bool join_us(uint64_t microsec);
@@ -164,6 +205,7 @@ private:
     static const int DEFAULT_TIMER_INTERVAL_SECONDS = 10;
 
     void disconnect(connection *conn);
+    void delete_connection(connection *conn);
     void run();
     void start_accept();
     void start_tick();
@@ -175,6 +217,11 @@ private:
     void check_verifier_connections();
     void close(connection *conn);
     void master_hook();
+    void arm_wheel_timer();
+    void fire_tasks();
+    void run_slice(in_session_state *sess, execution_t what);
+    void executed(in_session_state *sess, in_connection *conn,
+		  bool result, const std::string &error);
 
     io_service & get_io_service() { return ioservice_; }
 
@@ -192,25 +239,53 @@ private:
     bool stopped_;
     boost::thread thread_;
     io_service ioservice_;
+    std::unique_ptr<io_service::work> ioservice_work_;
+    boost::thread_group io_threads_;
     endpoint endpoint_;
     acceptor acceptor_;
     socket socket_;
     strand strand_;
     deadline_timer timer_;
+    deadline_timer wheel_timer_;
     common::term comment_;
 
+    io_service workers_;
+    std::unique_ptr<io_service::work> workers_work_;
+    boost::thread_group worker_threads_;
+
+    //
+    // There is no global lock. Each of these guards its own part of
+    // the node; when two are needed they're taken in this order. None
+    // of them is held while calling into a connection, since it may go
+    // on with its next request (and take any of them.)
+    //
+    // connections_lock_: the connection sets, closed_ and the counts
+    // sessions_lock_: in_states_ and the connection/running state of
+    //                 the sessions
+    // book_lock_: the address book and self_ips_
+    // wheel_lock_: wheel_ and wheel_timer_
+    //
+    boost::recursive_mutex connections_lock_;
+    boost::recursive_mutex sessions_lock_;
+    boost::recursive_mutex book_lock_;
+    boost::recursive_mutex wheel_lock_;
+
+    timing_wheel<out_task> wheel_;
+    bool wheel_timer_running_;
+    utime wheel_timer_at_;
+
     std::unordered_set<ip_service> self_ips_;
 
     in_connection *recent_in_connection_;
     std::unordered_set<connection *> in_connections_;
     std::unordered_set<connection *> out_connections_;
     std::unordered_set<ip_service> out_standard_ips_;
+    std::vector<connection *> closed_;
 
-    boost::recursive_mutex lock_;
     std::unordered_map<std::string, in_session_state *> in_states_;
-    std::vector<connection *> closed_;
 
     address_book address_book_;
+    std::string book_path_;
 
     std::function<void (self_node &self)> master_hook_;
 
@@ -222,18 +297,21 @@ private:
     uint64_t timer_interval_microseconds_;
     uint64_t fast_timer_interval_microseconds_;
     size_t num_download_addresses_;
+    size_t num_io_threads_;
+    size_t num_workers_;
+    uint64_t time_slice_;
 
     bool address_downloader_fast_mode_;
 };
 
 inline address_book_wrapper::address_book_wrapper(self_node &self, address_book &book) : self_(self), book_(book)
 {
-    self_.lock_.lock();
+    self_.book_lock_.lock();
 }
 
 inline address_book_wrapper::~address_book_wrapper()
 {
-    self_.lock_.unlock();
+    self_.book_lock_.unlock();
 }
 
 }}
@@ -1,4 +1,5 @@
 #include "../common/random.hpp"
+#include "self_node.hpp"
 #include "session.hpp"
 
 namespace prologcoin { namespace node {
@@ -10,9 +11,12 @@ in_session_state::in_session_state(self_node *self, in_connection *conn)
     connection_(conn),
     interp_(*this),
     in_query_(false),
+    running_(false),
+    killed_(false),
     heartbeat_count_(0)
 {
     id_ = "s" + random::next();
+    interp_.set_time_slice(self->time_slice());
 }
 
 bool in_session_state::execute(const term query)
@@ -21,8 +25,9 @@ bool in_session_state::execute(const term query)
 
     query_ = query;
     in_query_ = true;
+    fragments_.clear();
     bool r = interp_.execute(query);
-    if (!r) {
+    if (!r && !interp_.is_yielded()) {
 	in_query_ = false;
     }
     return r;
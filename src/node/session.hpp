@@ -4,6 +4,7 @@
 #define _node_session_hpp
 
 #include "../common/utime.hpp"
+#include "../common/term_serializer.hpp"
 #include "local_interpreter.hpp"
 
 namespace prologcoin { namespace node {
@@ -46,18 +47,47 @@ public:
     
     inline common::term get_result() { return interp_.get_result_term(); }
 
+    // Serialized terms that the result refers to as FRAGMENT(I); they
+    // are spliced into the reply (see term_serializer::set_fragments.)
+    inline const common::term_serializer::fragments_t & fragments() const
+    { return fragments_; }
+    inline size_t add_fragment(
+	   const std::shared_ptr<const common::term_serializer::buffer_t> &f)
+    { fragments_.push_back(f); return fragments_.size() - 1; }
+
     inline bool in_query() const { return in_query_; }
 
     inline bool has_more() const { return in_query() && interp_.has_more(); }
 
     inline bool next() {
+	fragments_.clear();
 	bool r = interp_.next();
-	if (!r) {
+	if (!r && !interp_.is_yielded()) {
 	    in_query_ = false;
 	}
 	return r;
     }
 
+    // Queries run in time slices (see self_node::run_in_session)
+    inline bool is_yielded() const { return interp_.is_yielded(); }
+
+    inline bool resume() {
+	bool r = interp_.resume();
+	if (!r && !interp_.is_yielded()) {
+	    in_query_ = false;
+	}
+	return r;
+    }
+
+    // Set while a worker thread runs the query; the session must not
+    // be touched from the network thread until it is cleared.
+    inline bool is_running() const { return running_; }
+    inline void set_running(bool b) { running_ = b; }
+
+    // Killed while running; the worker deletes it when done.
+    inline bool is_killed() const { return killed_; }
+    inline void set_killed() { killed_ = true; }
+
     void heartbeat();
 
 private:
@@ -70,7 +100,10 @@ private:
     bool interp_initialized_;
     common::term query_;
     bool in_query_;
+    bool running_;
+    bool killed_;
     common::term vars_;
+    common::term_serializer::fragments_t fragments_;
     common::utime heartbeat_;
     size_t heartbeat_count_;
 };
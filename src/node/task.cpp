@@ -7,7 +7,8 @@ using namespace prologcoin::common;
 
 out_task::out_task(const char *description, out_connection &out,
 		   void (*fn)(out_task &task) )
-    : description_(description), out_(&out), env_(&out.env()), fn_(fn),
+    : count_(0), last_checked_(),
+      description_(description), out_(&out), env_(&out.env()), fn_(fn),
       state_(IDLE), when_(utime::now())
 {
 }
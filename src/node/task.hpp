@@ -86,6 +86,11 @@ protected:
     std::string reason_str(reason_t reason);
     void fail(reason_t t);
 
+    // Tasks are copied (and scheduled) as out_task, so subclasses
+    // can't have state of their own. This is for those that repeat.
+    size_t count_;
+    utime last_checked_;
+
 private:
     const char *description_;
     out_connection *out_;
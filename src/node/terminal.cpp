@@ -32,7 +32,11 @@ session::~session()
 
 void session::send_buffer(term_serializer::buffer_t &buf, size_t n)
 {
-    size_t off = 0;
+    send_buffer(buf, 0, n);
+}
+
+void session::send_buffer(term_serializer::buffer_t &buf, size_t off, size_t n)
+{
     while (n > 0) {
 	boost::system::error_code ec;
 	size_t r = socket_.write_some(boost::asio::buffer(&buf[off],n),ec);
@@ -41,6 +45,7 @@ void session::send_buffer(term_serializer::buffer_t &buf, size_t n)
 	    off += r;
 	} else {
 	    connected_ = false;
+	    return;
 	}
     }
 }
@@ -61,68 +66,93 @@ void session::send_query(const term t, term_env &src)
     term_serializer ser(src);
     buffer_.clear();
     ser.write(buffer_, t);
-    send_length(buffer_.size());
-    send_buffer(buffer_, buffer_.size());
-}
 
-term session::read_reply()
-{
-    term_serializer ser(env_);
-    size_t n = sizeof(cell);
+    // Big queries are sent in chunks that fit in a frame
+    const size_t chunk_size = self_node::MAX_BUFFER_SIZE - sizeof(cell);
     size_t off = 0;
+    do {
+	size_t n = std::min(chunk_size, buffer_.size() - off);
+	bool last = off + n == buffer_.size();
+	term_serializer::write_cell(buffer_len_, 0,
+		    int_cell(last ? static_cast<int64_t>(n)
+			          : -static_cast<int64_t>(n)));
+	send_buffer(buffer_len_, sizeof(cell));
+	send_buffer(buffer_, off, n);
+	off += n;
+    } while (off < buffer_.size());
+}
 
-    buffer_len_.resize(sizeof(cell));
+bool session::read_bytes(term_serializer::buffer_t &buf, size_t off, size_t n)
+{
+    n += off;
     while (off < n) {
 	boost::system::error_code ec;
-	size_t r = socket_.read_some(boost::asio::buffer(&buffer_len_[off],
-						 sizeof(cell)-off), ec);
+	size_t r = socket_.read_some(boost::asio::buffer(&buf[off],
+							 n - off), ec);
 	if (ec) {
 	    std::stringstream ss;
 	    ss << "Error while reading: " << ec.message();
 	    add_error(ss.str());
 	    connected_ = false;
-	    return term();
+	    return false;
 	}
 	off += r;
     }
-    auto c = ser.read_cell(buffer_len_, 0, "");
-    if (c.tag() != tag_t::INT) {
-	add_error("Erreoneous encoding of reply length.");
-	return term();
-    }
+    return true;
+}
 
-    auto &ic = reinterpret_cast<int_cell &>(c);
-    if (ic.value() < static_cast<int>(sizeof(cell))) {
-	std::stringstream ss;
-	ss << "Length of reply too small (" << ic.value() << " < "
-	   << sizeof(cell) << std::endl;
-	add_error(ss.str());
-	return term();
-    }
+//
+// A reply bigger than a frame comes in chunks, where all but the last
+// one have a negative length.
+//
+term session::read_reply()
+{
+    term_serializer ser(env_);
+    bool more = true;
 
-    if (ic.value() > static_cast<int>(self_node::MAX_BUFFER_SIZE)) {
-	std::stringstream ss;
-	ss << "Length of reply too big (" << ic.value() << " > " << self_node::MAX_BUFFER_SIZE;
-	add_error(ss.str());
-	return term();
-    }
+    buffer_.clear();
+    buffer_len_.resize(sizeof(cell));
+    while (more) {
+	if (!read_bytes(buffer_len_, 0, sizeof(cell))) {
+	    return term();
+	}
+	auto c = ser.read_cell(buffer_len_, 0, "");
+	if (c.tag() != tag_t::INT) {
+	    add_error("Erreoneous encoding of reply length.");
+	    return term();
+	}
 
-    n = ic.value();
-    off = 0;
+	auto len = reinterpret_cast<int_cell &>(c).value();
+	more = len < 0;
+	if (more) {
+	    len = -len;
+	}
+	if (len < static_cast<int>(sizeof(cell))) {
+	    std::stringstream ss;
+	    ss << "Length of reply too small (" << len << " < "
+	       << sizeof(cell) << std::endl;
+	    add_error(ss.str());
+	    return term();
+	}
 
-    buffer_.resize(n);
+	if (len > static_cast<int>(self_node::MAX_BUFFER_SIZE)) {
+	    std::stringstream ss;
+	    ss << "Length of reply too big (" << len << " > " << self_node::MAX_BUFFER_SIZE;
+	    add_error(ss.str());
+	    return term();
+	}
 
-    while (off < n) {
-	boost::system::error_code ec;
-	size_t r = socket_.read_some(boost::asio::buffer(&buffer_[off],
-						 n - off), ec);
-	if (ec) {
+	size_t off = buffer_.size();
+	if (off + len > self_node::MAX_MESSAGE_SIZE) {
 	    std::stringstream ss;
-	    ss << "Error while reading: " << ec.message();
+	    ss << "Reply bigger than " << self_node::MAX_MESSAGE_SIZE;
 	    add_error(ss.str());
 	    return term();
 	}
-	off += r;
+	buffer_.resize(off + len);
+	if (!read_bytes(buffer_, off, len)) {
+	    return term();
+	}
     }
 
     term t = ser.read(buffer_);
@@ -59,6 +59,7 @@ public:
     void send_query(const common::term t);
     void send_query(const common::term t, term_env &src_env);
     void send_buffer(common::term_serializer::buffer_t &buf, size_t n);
+    void send_buffer(common::term_serializer::buffer_t &buf, size_t off, size_t n);
     void send_length(size_t n);
     common::term read_reply();
     inline bool has_errors() const { return !errors_.empty(); }
@@ -74,6 +75,7 @@ private:
     using term_serializer = prologcoin::common::term_serializer;
 
     void add_error(const std::string &msg);
+    bool read_bytes(term_serializer::buffer_t &buf, size_t off, size_t n);
 
     std::string id_;
 
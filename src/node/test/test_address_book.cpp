@@ -1,7 +1,11 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <iomanip>
+#include <algorithm>
+#include <unordered_set>
+#include <boost/filesystem.hpp>
 #include <common/fast_hash.hpp>
 #include <common/test/test_home_dir.hpp>
 #include <node/address_book.hpp>
@@ -220,7 +224,373 @@ static void test_address_book_medium()
     auto r = book.get_randomly_from_top_10_pt(50);
     std::cout << "Got " << r.size() << " entries out of 50." << std::endl;
 
-    assert(r.size() <= 10);
+    // Sampling is without replacement, so we get all of them (half of
+    // the entries are verified.)
+    assert(r.size() == book.get_all_verified().size() / 10);
+    std::unordered_set<ip_service> unique(r.begin(), r.end());
+    assert(unique.size() == r.size());
+}
+
+static void test_address_book_score()
+{
+    header("test_address_book_score");
+
+    address_book book;
+    fill_with_random(book, 1000);
+    book.integrity_check();
+
+    // Push the worst verified entries to the top and the best ones to
+    // the bottom; the top 10% must follow.
+
+    auto verified = book.get_all_verified();
+    std::sort(verified.begin(), verified.end(),
+	      [](const address_entry &e1, const address_entry &e2) {
+		  return e1.score() < e2.score(); });
+    for (size_t i = 0; i < 10; i++) {
+	book.add_score(verified[i], 20000);
+	book.add_score(verified[verified.size()-1-i], -20000);
+    }
+    book.integrity_check();
+
+    auto top = book.get_from_top_10_pt(10);
+    for (auto &e : top) {
+	assert(e.score() >= 20000);
+    }
+
+    // Scores are bounded
+    book.add_score(verified[0], 2*address_entry::MAX_SCORE);
+    assert(verified[0].score() == address_entry::MAX_SCORE);
+    assert(book.get_from_top_10_pt(1)[0] == verified[0]);
+
+    // Removing keeps the 10% split
+    for (auto &e : book.get_all()) {
+	if (e.id() % 3 == 0) book.remove(e);
+    }
+    book.integrity_check();
+    std::cout << book.stat() << std::endl;
+}
+
+// Serializes the entries as a list, either built from their terms or
+// spliced from their cached serialized terms.
+static void write_peers(address_book &book,
+			const std::vector<address_entry> &entries,
+			bool use_fragments, term_serializer::buffer_t &buf)
+{
+    term_env env;
+    term_serializer::fragments_t fragments;
+    term list = env.empty_list();
+    for (auto &e : entries) {
+	term t;
+	if (use_fragments) {
+	    fragments.push_back(book.serialized(e.id()));
+	    t = env.new_term(term_serializer::FRAGMENT,
+			     {int_cell(static_cast<int64_t>(fragments.size()-1))});
+	} else {
+	    t = e.to_term(env);
+	}
+	list = env.new_dotted_pair(t, list);
+    }
+    term_serializer ser(env);
+    ser.set_fragments(&fragments);
+    ser.write(buf, list);
+}
+
+static std::string peers_reply(address_book &book,
+			       const std::vector<address_entry> &entries,
+			       bool use_fragments)
+{
+    term_serializer::buffer_t buf;
+    write_peers(book, entries, use_fragments, buf);
+    term_env env;
+    term_serializer ser(env);
+    return env.to_string(ser.read(buf));
+}
+
+static void test_address_book_serialized()
+{
+    header("test_address_book_serialized");
+
+    address_book book;
+    fill_with_random(book, 1000);
+
+    auto entries = book.get_randomly_from_top_10_pt(20);
+    auto rest = book.get_randomly_from_bottom_90_pt(80);
+    entries.insert(entries.end(), rest.begin(), rest.end());
+
+    auto str = peers_reply(book, entries, false);
+    assert(peers_reply(book, entries, true) == str);
+
+    // The cached term follows changes to the entry
+    auto &e = entries[0];
+    auto before = book.serialized(e.id());
+    assert(book.serialized(e.id()) == before);
+    book.add_score(e, 1);
+    assert(book.serialized(e.id()) != before);
+    assert(peers_reply(book, entries, true) != str);
+    assert(peers_reply(book, entries, true) ==
+	   peers_reply(book, entries, false));
+
+    const size_t N = 1000;
+    for (bool use_fragments : {false, true}) {
+	utime t1 = utime::now();
+	for (size_t i = 0; i < N; i++) {
+	    term_serializer::buffer_t buf;
+	    write_peers(book, entries, use_fragments, buf);
+	}
+	utime t2 = utime::now();
+	std::cout << N << " replies of " << entries.size() << " entries "
+		  << (use_fragments ? "spliced" : "from terms") << ": "
+		  << (t2 - t1).in_ms() << " ms" << std::endl;
+    }
+}
+
+static bool same_entries(address_book &book1, address_book &book2)
+{
+    auto all1 = book1.get_all();
+    auto all2 = book2.get_all();
+    if (all1.size() != all2.size()) {
+	return false;
+    }
+    for (size_t i = 0; i < all1.size(); i++) {
+	if (!all1[i].deep_equal(all2[i])) {
+	    std::cout << "Differs: " << all1[i].str() << " and "
+		      << all2[i].str() << std::endl;
+	    return false;
+	}
+    }
+    return true;
+}
+
+static void test_address_book_snapshot()
+{
+    header("test_address_book_snapshot");
+
+    const std::string &home_dir = find_home_dir();
+    std::string path = home_dir + "/bin/test/node/address_book.bin";
+
+    address_book book;
+    fill_with_random(book, 10000);
+    auto verified = book.get_all_verified();
+    for (size_t i = 0; i < verified.size(); i += 7) {
+	book.add_score(verified[i], 1000);
+    }
+
+    utime t1 = utime::now();
+    book.save_snapshot(path);
+    utime t2 = utime::now();
+    std::cout << "Save " << book.size() << " entries: "
+	      << (t2-t1).in_ms() << " ms" << std::endl;
+
+    address_book book2;
+    book2.add("127.0.0.1", 1234); // Replaced by the snapshot
+    t1 = utime::now();
+    book2.load_snapshot(path);
+    t2 = utime::now();
+    std::cout << "Load " << book2.size() << " entries: "
+	      << (t2-t1).in_ms() << " ms" << std::endl;
+    book2.integrity_check();
+    assert(book2.stat() == book.stat());
+    assert(same_entries(book, book2));
+    assert(book2.get_from_top_10_pt(10).size() == 10);
+
+    // Not a snapshot
+    std::string bad_path = home_dir + "/bin/test/node/address_book.txt";
+    bool thrown = false;
+    try {
+	book2.load_snapshot(bad_path);
+    } catch (address_book_snapshot_exception &ex) {
+	std::cout << "Expected exception: " << ex.what() << std::endl;
+	thrown = true;
+    }
+    assert(thrown);
+}
+
+static void test_address_book_journal()
+{
+    header("test_address_book_journal");
+
+    const std::string &home_dir = find_home_dir();
+    std::string path = home_dir + "/bin/test/node/address_book_journal.bin";
+    std::string journal_path = path + ".journal";
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(journal_path);
+
+    // All changes go to the journal (nothing has been compacted yet)
+    address_book book;
+    book.open(path);
+    fill_with_random(book, 2000);
+    auto all = book.get_all();
+    for (size_t i = 0; i < all.size(); i += 3) {
+	book.add_score(all[i], -50);
+	book.update_time(all[i+1]);
+	book.remove(all[i+2]);
+    }
+    std::cout << "journal_size=" << book.journal_size() << std::endl;
+    assert(!boost::filesystem::exists(path));
+    book.close();
+
+    address_book book2;
+    book2.open(path);
+    book2.integrity_check();
+    assert(same_entries(book, book2));
+
+    // A torn record at the end is dropped, and the book continues
+    book2.close();
+    {
+	std::ofstream out(journal_path, std::ios::binary | std::ios::app);
+	out << "garbage";
+    }
+    address_book book3;
+    book3.open(path);
+    assert(same_entries(book, book3));
+    book3.add("10.0.0.1", 1234);
+    book3.compact();
+    assert(boost::filesystem::exists(path));
+    assert(book3.journal_size() == 0);
+    book3.add("10.0.0.2", 1234);
+    book3.remove(book3.get_all().front());
+    book3.close();
+
+    address_book book4;
+    book4.open(path);
+    std::cout << "journal_size=" << book4.journal_size() << std::endl;
+    assert(book4.journal_size() == 2);
+    book4.integrity_check();
+    assert(same_entries(book3, book4));
+    book4.close();
+}
+
+//
+// A node keeps its book in a file from start() to stop(). What it had
+// before the first start is kept as well.
+//
+static void test_address_book_node()
+{
+    header("test_address_book_node");
+
+    const std::string &home_dir = find_home_dir();
+    std::string path = home_dir + "/bin/test/node/address_book_node.bin";
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(path + ".journal");
+
+    const unsigned short port = self_node::DEFAULT_PORT + 200;
+    ip_service ip1("10.0.0.1", 1234), ip2("10.0.0.2", 1234),
+	       ip3("10.0.0.3", 1234);
+    {
+	self_node self(port);
+	self.set_book_path(path);
+	self.book()().add(ip1.addr().str(), ip1.port());
+	self.start();
+	assert(boost::filesystem::exists(path));
+	self.book()().add(ip2.addr().str(), ip2.port());
+	self.stop();
+	self.join();
+	assert(!self.book()().is_open());
+	self.book()().add(ip3.addr().str(), ip3.port());
+    }
+
+    {
+	address_book book;
+	book.open(path);
+	book.integrity_check();
+	assert(book.exists(ip1));
+	assert(book.exists(ip2));
+	assert(!book.exists(ip3));
+	book.close();
+    }
+
+    // The next run starts from there
+    {
+	self_node self(port);
+	self.set_book_path(path);
+	self.start();
+	bool found = self.book()().exists(ip1) && self.book()().exists(ip2);
+	self.stop();
+	self.join();
+	assert(found);
+    }
+}
+
+static void test_address_book_million()
+{
+    header("test_address_book_million");
+
+    const size_t N = 1000000;
+
+    // Random IPv4 addresses, every other one verified.
+    address_book book;
+    fast_hash h;
+    ip_service src("192.168.1.1", 1234);
+    utime t1 = utime::now();
+    for (size_t i = 0; i < N; i++) {
+	h << i;
+	ip_address ip;
+	ip.set_addr(static_cast<uint32_t>(h));
+	bool verified = (i % 2) == 0;
+	if ((i % 400) == 1) {
+	    ip_address src_addr;
+	    src_addr.set_addr(static_cast<uint32_t>(h) ^ 0x5a5a5a5a);
+	    src = ip_service(src_addr, 1234);
+	}
+	address_entry e(ip, self_node::DEFAULT_PORT,
+			verified ? ip_address() : src.addr(),
+			verified ? 0 : src.port());
+	e.set_score(static_cast<uint32_t>(h) % 10000);
+	book.add(e);
+    }
+    utime t2 = utime::now();
+    std::cout << "Add " << N << " entries: " << (t2-t1).in_ms() << " ms"
+	      << std::endl;
+    std::cout << "stat=" << book.stat() << std::endl;
+
+    const std::string &home_dir = find_home_dir();
+    std::string path = home_dir + "/bin/test/node/address_book_million.bin";
+    t1 = utime::now();
+    book.save_snapshot(path);
+    t2 = utime::now();
+    std::cout << "Save snapshot: " << (t2-t1).in_ms() << " ms" << std::endl;
+    {
+	address_book book2;
+	t1 = utime::now();
+	book2.load_snapshot(path);
+	t2 = utime::now();
+	std::cout << "Load snapshot: " << (t2-t1).in_ms() << " ms" << std::endl;
+	assert(book2.stat() == book.stat());
+    }
+    boost::filesystem::remove(path);
+
+    const size_t M = 10000;
+    t1 = utime::now();
+    size_t n = 0;
+    for (size_t i = 0; i < M; i++) {
+	n += book.get_randomly_from_top_10_pt(10).size();
+	n += book.get_randomly_from_bottom_90_pt(10).size();
+	n += book.get_randomly_from_unverified(10).size();
+    }
+    t2 = utime::now();
+    assert(n == 3*10*M);
+    std::cout << "Sample " << 3*M << " x 10 entries: "
+	      << (t2-t1).in_ms() << " ms" << std::endl;
+
+    auto all = book.get_all();
+    t1 = utime::now();
+    for (size_t i = 0; i < all.size(); i += 2) {
+	book.add_score(all[i], (i % 4) == 0 ? 5000 : -5000);
+    }
+    t2 = utime::now();
+    std::cout << "Change score of " << all.size()/2 << " entries: "
+	      << (t2-t1).in_ms() << " ms" << std::endl;
+
+    t1 = utime::now();
+    for (size_t i = 1; i < all.size(); i += 2) {
+	book.remove(all[i]);
+    }
+    t2 = utime::now();
+    std::cout << "Remove " << all.size()/2 << " entries: "
+	      << (t2-t1).in_ms() << " ms" << std::endl;
+
+    std::cout << "stat=" << book.stat() << std::endl;
+    book.integrity_check();
 }
 
 
@@ -309,9 +679,20 @@ int main(int argc, char *argv[] )
 {
     find_home_dir(argv[0]);
 
+    // A benchmark rather than a test, so it only runs when asked for
+    if (argc == 2 && strcmp(argv[1], "-million") == 0) {
+	test_address_book_million();
+	return 0;
+    }
+
     test_address_book_simple();
     test_address_book_big();
     test_address_book_medium();
+    test_address_book_score();
+    test_address_book_serialized();
+    test_address_book_snapshot();
+    test_address_book_journal();
+    test_address_book_node();
     test_address_book::test_address_book_spilling();
 
     return 0;
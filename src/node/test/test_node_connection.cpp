@@ -0,0 +1,670 @@
+#include <boost/asio/read.hpp>
+#include <common/term_tools.hpp>
+#include <common/term_serializer.hpp>
+#include <node/self_node.hpp>
+
+using namespace prologcoin::common;
+using namespace prologcoin::node;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static const unsigned short TEST_PORT = self_node::DEFAULT_PORT + 100;
+
+static const int TIMEOUT_SECONDS = 120;
+
+// The biggest chunk that fits in a frame
+static const size_t CHUNK_SIZE = self_node::MAX_BUFFER_SIZE - sizeof(cell);
+
+//
+// A blocking client that talks to a node directly, so the tests decide
+// how messages are chunked and how the bytes are written.
+//
+class test_client {
+public:
+    using buffer_t = term_serializer::buffer_t;
+
+    test_client() : socket_(ioservice_), num_chunks_(0) { }
+
+    test_client(unsigned short port) : test_client()
+    {
+	using namespace boost::asio::ip;
+	socket_.connect(tcp::endpoint(address::from_string("127.0.0.1"),
+				      port));
+	set_timeout(TIMEOUT_SECONDS);
+    }
+
+    // Plays the peer of an out connection instead: listens on port
+    // (before the node connects) and then waits for the node.
+    void listen(unsigned short port)
+    {
+	using namespace boost::asio::ip;
+	acceptor_.reset(new tcp::acceptor(ioservice_,
+		  tcp::endpoint(address::from_string("127.0.0.1"), port)));
+    }
+
+    void accept()
+    {
+	acceptor_->non_blocking(true);
+	auto deadline = utime::now() + utime::ss(TIMEOUT_SECONDS);
+	boost::system::error_code ec;
+	do {
+	    acceptor_->accept(socket_, ec);
+	    if (ec) {
+		assert(utime::now() < deadline);
+		utime::sleep(utime::ms(10));
+	    }
+	} while (ec);
+	socket_.non_blocking(false);
+	set_timeout(TIMEOUT_SECONDS);
+    }
+
+    // A read that times out throws, so a test fails rather than hangs
+    // if the node doesn't answer.
+    void set_timeout(int seconds)
+    {
+#ifdef _WIN32
+	DWORD tv = seconds * 1000;
+#else
+	struct timeval tv = { seconds, 0 };
+#endif
+	setsockopt(socket_.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
+		   reinterpret_cast<const char *>(&tv), sizeof(tv));
+    }
+
+    inline term_env & env() { return env_; }
+
+    inline buffer_t serialize(const term t)
+    {
+	term_serializer ser(env_);
+	buffer_t bytes;
+	ser.write(bytes, t);
+	return bytes;
+    }
+
+    // Length prefixed chunks of at most chunk_size bytes each
+    static buffer_t frame(const buffer_t &payload, size_t chunk_size)
+    {
+	buffer_t bytes;
+	size_t off = 0;
+	do {
+	    size_t n = std::min(chunk_size, payload.size() - off);
+	    bool last = off + n == payload.size();
+	    term_serializer::write_cell(bytes, bytes.size(),
+			int_cell(last ? static_cast<int64_t>(n)
+				      : -static_cast<int64_t>(n)));
+	    bytes.insert(bytes.end(), payload.begin() + off,
+			 payload.begin() + off + n);
+	    off += n;
+	} while (off < payload.size());
+	return bytes;
+    }
+
+    inline void write(const buffer_t &bytes)
+    {
+	write(bytes, 0, bytes.size());
+    }
+
+    inline void write(const buffer_t &bytes, size_t off, size_t n)
+    {
+	boost::asio::write(socket_, boost::asio::buffer(&bytes[off], n));
+    }
+
+    inline void send(const term t, size_t chunk_size = CHUNK_SIZE)
+    {
+	write(frame(serialize(t), chunk_size));
+    }
+
+    // Puts the chunks of the next message together. Every chunk but
+    // the last must have a negative length, and all of them must fit
+    // in a frame.
+    term read_message()
+    {
+	buffer_t len(sizeof(cell));
+	buffer_t payload;
+	num_chunks_ = 0;
+	for (;;) {
+	    boost::asio::read(socket_, boost::asio::buffer(len));
+	    cell c = term_serializer::read_cell(len, 0, "read_message");
+	    assert(c.tag() == tag_t::INT);
+	    int64_t n = reinterpret_cast<int_cell &>(c).value();
+	    bool more = n < 0;
+	    if (more) n = -n;
+	    assert(n >= static_cast<int64_t>(sizeof(cell)));
+	    assert(n <= static_cast<int64_t>(CHUNK_SIZE));
+	    size_t off = payload.size();
+	    payload.resize(off + n);
+	    boost::asio::read(socket_,
+			      boost::asio::buffer(&payload[off], n));
+	    num_chunks_++;
+	    if (!more) {
+		break;
+	    }
+	}
+	term_serializer ser(env_);
+	return ser.read(payload);
+    }
+
+    inline size_t num_chunks() const { return num_chunks_; }
+
+    // Bytes that can be read without blocking
+    inline size_t available() { return socket_.available(); }
+
+    inline term request(const term t, size_t chunk_size = CHUNK_SIZE)
+    {
+	send(t, chunk_size);
+	return read_message();
+    }
+
+    // Creates a session and connects to it
+    void new_session()
+    {
+	auto &e = env_;
+	term r = request(e.parse("command(new)."));
+	assert(e.functor(r) == con_cell("ok",1));
+	term id = e.arg(r, 0);
+	r = request(e.new_term(con_cell("command",1),
+			       {e.new_term(con_cell("connect",1), {id})}));
+	assert(e.functor(r) == con_cell("ok",1));
+    }
+
+    term new_list(size_t n)
+    {
+	term lst = env_.empty_list();
+	for (size_t i = 0; i < n; i++) {
+	    lst = env_.new_dotted_pair(int_cell(i % 1000), lst);
+	}
+	return lst;
+    }
+
+    inline term list_query(term lst)
+    {
+	return env_.new_term(con_cell("query",1),
+			     {env_.new_term(con_cell("is_list",1), {lst})});
+    }
+
+    inline term tagged(int64_t id, term req)
+    {
+	return env_.new_term(connection::MSG, {int_cell(id), req});
+    }
+
+    // Each write goes out as a segment of its own
+    inline void set_no_delay()
+    {
+	socket_.set_option(boost::asio::ip::tcp::no_delay(true));
+    }
+
+    inline void set_receive_buffer_size(int n)
+    {
+	socket_.set_option(boost::asio::socket_base::receive_buffer_size(n));
+    }
+
+    // The biggest list length whose query serializes to at most
+    // max_size bytes.
+    size_t list_length_for(size_t max_size)
+    {
+	size_t base = serialize(list_query(new_list(0))).size();
+	size_t per = serialize(list_query(new_list(1))).size() - base;
+	size_t n = (max_size - base) / per;
+	while (serialize(list_query(new_list(n))).size() > max_size) {
+	    n--;
+	}
+	return n;
+    }
+
+private:
+    boost::asio::io_service ioservice_;
+    boost::asio::ip::tcp::socket socket_;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+    term_env env_;
+    size_t num_chunks_;
+};
+
+static size_t result_list_length(test_client &c, term r)
+{
+    auto &e = c.env();
+    assert(e.functor(r) == con_cell("ok",1));
+    term result = e.arg(r, 0);
+    assert(e.functor(result) == con_cell("result",3));
+    term goal = e.arg(result, 0);
+    assert(e.functor(goal) == con_cell("is_list",1));
+    return e.list_length(e.arg(goal, 0));
+}
+
+//
+// Messages with sizes just below and above one and two chunks, sent
+// in chunks of several sizes. The replies echo the lists, so they come
+// back in chunks too.
+//
+static void test_chunk_boundaries()
+{
+    header("test_chunk_boundaries()");
+
+    self_node self(TEST_PORT);
+    self.start();
+
+    {
+	test_client c(TEST_PORT);
+	c.new_session();
+
+	for (size_t target : {CHUNK_SIZE, 2*CHUNK_SIZE}) {
+	    size_t n0 = c.list_length_for(target);
+	    for (size_t n : {n0 - 1, n0, n0 + 1, n0 + 2}) {
+		term q = c.list_query(c.new_list(n));
+		size_t size = c.serialize(q).size();
+		for (size_t chunk_size : {CHUNK_SIZE, CHUNK_SIZE - 8,
+			                  size_t(4096), sizeof(cell)}) {
+		    std::cout << "Length " << n << " (" << size
+			      << " bytes) in chunks of " << chunk_size
+			      << std::endl;
+		    term r = c.request(q, chunk_size);
+		    assert(result_list_length(c, r) == n);
+		    assert(c.num_chunks() >= 1 + size / (CHUNK_SIZE+1));
+		}
+	    }
+	}
+    }
+
+    self.stop();
+    self.join();
+}
+
+//
+// A message may be up to MAX_MESSAGE_SIZE bytes. A bigger one is read
+// to its end and dropped, and the connection goes on with the next
+// message. Replies are capped the same way.
+//
+static void test_message_size_cap()
+{
+    header("test_message_size_cap()");
+
+    self_node self(TEST_PORT);
+    self.start();
+
+    {
+	test_client c(TEST_PORT);
+	auto &e = c.env();
+	c.new_session();
+
+	// One cell too many. The contents don't matter as it is dropped.
+	std::cout << "Send " << self_node::MAX_MESSAGE_SIZE + sizeof(cell)
+		  << " bytes" << std::endl;
+	test_client::buffer_t junk(self_node::MAX_MESSAGE_SIZE + sizeof(cell));
+	c.write(test_client::frame(junk, CHUNK_SIZE));
+	term r = c.read_message();
+	std::cout << "Reply: " << e.to_string(r) << std::endl;
+	assert(e.functor(r) == con_cell("error",1));
+	assert(e.functor(e.arg(r, 0)) ==
+	       e.functor("error_message_size_exceeds_max",1));
+
+	// The connection still works
+	r = c.request(c.list_query(c.new_list(3)));
+	assert(result_list_length(c, r) == 3);
+
+	// The biggest message we may send gets through, but the reply
+	// (which echoes it) is too big.
+	size_t n = c.list_length_for(self_node::MAX_MESSAGE_SIZE);
+	term q = c.list_query(c.new_list(n));
+	std::cout << "Send " << c.serialize(q).size() << " bytes"
+		  << std::endl;
+	r = c.request(q);
+	std::cout << "Reply: " << e.to_string(r) << std::endl;
+	assert(e.functor(r) == con_cell("error",1));
+	assert(e.functor(e.arg(r, 0)) ==
+	       e.functor("error_reply_size_exceeds_max",1));
+
+	// And the connection still works
+	r = c.request(c.list_query(c.new_list(3)));
+	assert(result_list_length(c, r) == 3);
+    }
+
+    self.stop();
+    self.join();
+}
+
+// Checks that r is msg(Id, ok(result(is_list(L), _, _))) and returns
+// the length of L.
+static size_t tagged_list_length(test_client &c, term r, int64_t id)
+{
+    auto &e = c.env();
+    assert(e.functor(r) == connection::MSG);
+    term id_term = e.arg(r, 0);
+    assert(id_term.tag() == tag_t::INT);
+    assert(reinterpret_cast<int_cell &>(id_term).value() == id);
+    return result_list_length(c, e.arg(r, 1));
+}
+
+//
+// Messages whose bytes come in many reads, split inside the length
+// cell, right after it and inside the payload.
+//
+static void test_split_frames()
+{
+    header("test_split_frames()");
+
+    self_node self(TEST_PORT);
+    self.start();
+
+    {
+	test_client c(TEST_PORT);
+	c.set_no_delay();
+	c.new_session();
+
+	int64_t id = 0;
+	for (size_t piece : {size_t(1), size_t(3), size_t(8), size_t(13),
+		             size_t(1000)}) {
+	    auto bytes = test_client::frame(c.serialize(
+		    c.tagged(id, c.list_query(c.new_list(100)))), CHUNK_SIZE);
+	    std::cout << "Write " << bytes.size() << " bytes in pieces of "
+		      << piece << std::endl;
+	    for (size_t off = 0; off < bytes.size(); off += piece) {
+		c.write(bytes, off, std::min(piece, bytes.size() - off));
+		utime::sleep(utime::us(100));
+	    }
+	    assert(tagged_list_length(c, c.read_message(), id) == 100);
+	    id++;
+	}
+
+	// A chunked message split at the chunk boundary, and then in
+	// the middle of the next length cell.
+	auto bytes = test_client::frame(c.serialize(
+		c.tagged(id, c.list_query(c.new_list(1000)))), 4096);
+	std::cout << "Write " << bytes.size() << " bytes in chunks of 4096"
+		  << std::endl;
+	size_t at = 4096 + sizeof(cell);
+	c.write(bytes, 0, at);
+	utime::sleep(utime::ms(10));
+	c.write(bytes, at, 4);
+	utime::sleep(utime::ms(10));
+	c.write(bytes, at + 4, bytes.size() - at - 4);
+	assert(tagged_list_length(c, c.read_message(), id) == 1000);
+    }
+
+    self.stop();
+    self.join();
+}
+
+//
+// Several messages in one write, followed by the start of a message
+// that fills a whole frame. The node can only read all of it if it
+// moves the unparsed bytes to the front of its frame buffer.
+//
+static void test_frame_compaction()
+{
+    header("test_frame_compaction()");
+
+    self_node self(TEST_PORT);
+    self.start();
+
+    {
+	test_client c(TEST_PORT);
+	c.new_session();
+
+	const int64_t num_small = 5;
+	test_client::buffer_t bytes;
+	for (int64_t id = 0; id < num_small; id++) {
+	    auto msg = test_client::frame(c.serialize(
+		c.tagged(id, c.list_query(c.new_list(10)))), CHUNK_SIZE);
+	    bytes.insert(bytes.end(), msg.begin(), msg.end());
+	}
+	// The longest list that fits in one frame
+	size_t n = c.list_length_for(CHUNK_SIZE);
+	test_client::buffer_t big;
+	for (;; n--) {
+	    big = test_client::frame(c.serialize(
+		c.tagged(num_small, c.list_query(c.new_list(n)))), CHUNK_SIZE);
+	    if (big.size() <= self_node::MAX_BUFFER_SIZE) {
+		break;
+	    }
+	}
+	std::cout << "Big message: " << big.size() << " bytes" << std::endl;
+	assert(big.size() > self_node::MAX_BUFFER_SIZE - 64);
+	size_t half = big.size() / 2;
+	bytes.insert(bytes.end(), big.begin(), big.begin() + half);
+
+	c.write(bytes);
+	for (int64_t id = 0; id < num_small; id++) {
+	    assert(tagged_list_length(c, c.read_message(), id) == 10);
+	}
+	c.write(big, half, big.size() - half);
+	assert(tagged_list_length(c, c.read_message(), num_small) == n);
+    }
+
+    self.stop();
+    self.join();
+}
+
+//
+// Replies pile up in the send queue of the node while the client
+// doesn't read. There is more than the socket buffers can take (the
+// client's receive buffer is small, and the send buffer is at most a
+// few MB), so gather writes only write part of the queue and end in
+// the middle of a message. The client then reads everything back.
+//
+static void test_partial_writes()
+{
+    header("test_partial_writes()");
+
+    self_node self(TEST_PORT);
+    self.start();
+
+    {
+	test_client c(TEST_PORT);
+	c.set_receive_buffer_size(65536);
+	c.new_session();
+
+	const int64_t num_requests = 8;
+	size_t n = c.list_length_for(1024*1024);
+	term lst = c.new_list(n);
+	for (int64_t id = 0; id < num_requests; id++) {
+	    c.send(c.tagged(id, c.list_query(lst)));
+	}
+	std::cout << "Sent " << num_requests << " requests of "
+		  << c.serialize(c.list_query(lst)).size() << " bytes"
+		  << std::endl;
+	utime::sleep(utime::ss(5));
+	for (int64_t id = 0; id < num_requests; id++) {
+	    assert(tagged_list_length(c, c.read_message(), id) == n);
+	    std::cout << "Got reply " << id << std::endl;
+	}
+    }
+
+    self.stop();
+    self.join();
+}
+
+namespace prologcoin { namespace node { namespace test {
+
+class test_node_connection {
+public:
+    // Like all its state, the tasks of a connection are only touched
+    // on its strand.
+    static void schedule(out_connection *out, const out_task &task)
+    {
+	out->strand().post([out, task]() {
+		out_task t = task;
+		out->schedule(t);
+	    });
+    }
+};
+
+}}}
+
+using prologcoin::node::test::test_node_connection;
+
+static const size_t NUM_PIPELINED_TASKS = 2*out_connection::MAX_IN_FLIGHT;
+static std::vector<std::string> pipelined_names;
+static boost::mutex pipelined_lock;
+static std::map<size_t, int64_t> pipelined_replies;
+
+static size_t pipelined_index(const out_task &task)
+{
+    for (size_t i = 0; i < pipelined_names.size(); i++) {
+	if (pipelined_names[i].c_str() == task.description()) {
+	    return i;
+	}
+    }
+    assert("not a pipelined task" == nullptr);
+    return 0;
+}
+
+// Task I asks for I and records what it got back
+static void pipelined_task_fn(out_task &task)
+{
+    auto &e = task.env();
+    size_t i = pipelined_index(task);
+    switch (task.get_state()) {
+    case out_task::IDLE:
+	break;
+    case out_task::SEND:
+	task.set_query(e.new_term(con_cell("echo",1), {int_cell(i)}));
+	break;
+    case out_task::RECEIVED: {
+	term r = task.get_term();
+	assert(e.functor(r) == con_cell("ok",1));
+	term v = e.arg(r, 0);
+	assert(v.tag() == tag_t::INT);
+	boost::lock_guard<boost::mutex> guard(pipelined_lock);
+	pipelined_replies[i] = reinterpret_cast<int_cell &>(v).value();
+	break;
+        }
+    }
+}
+
+//
+// Plays the peer of an out connection. The node's own requests (to set
+// up the session etc.) are answered at once; the echo requests are
+// held until MAX_IN_FLIGHT of them are waiting and then answered in
+// another order than they were sent. Every task must get the reply to
+// its own request.
+//
+static void test_pipelined_requests()
+{
+    header("test_pipelined_requests()");
+
+    const unsigned short peer_port = TEST_PORT + 1;
+    const size_t max_in_flight = out_connection::MAX_IN_FLIGHT;
+
+    for (size_t i = 0; i < NUM_PIPELINED_TASKS; i++) {
+	pipelined_names.push_back("pipelined_" + std::to_string(i));
+    }
+
+    test_client peer;
+    peer.listen(peer_port);
+
+    self_node self(TEST_PORT);
+    self.start();
+
+    auto *out = self.new_standard_out_connection(
+		       ip_service("127.0.0.1", peer_port));
+    peer.accept();
+    auto &e = peer.env();
+    auto is = [&e](term t, const std::string &str) {
+	uint64_t cost = 0;
+	return e.equal(t, e.parse(str), cost);
+    };
+
+    bool scheduled = false;
+    size_t num_answered = 0;
+    size_t round = 0;
+    std::vector<std::pair<term, int64_t> > held; // (Id, I)
+    while (num_answered < NUM_PIPELINED_TASKS) {
+	term m = peer.read_message();
+	assert(e.functor(m) == connection::MSG);
+	term id = e.arg(m, 0);
+	term req = e.arg(m, 1);
+	term reply;
+	if (is(req, "command(new).")) {
+	    reply = e.parse("ok(s1).");
+	} else if (is(req, "command(connect(s1)).")) {
+	    reply = e.parse("ok(session_resumed(s1,ask)).");
+	    if (!scheduled) {
+		scheduled = true;
+		for (auto &name : pipelined_names) {
+		    test_node_connection::schedule(out,
+			   out_task(name.c_str(), *out, &pipelined_task_fn));
+		}
+	    }
+	} else if (e.functor(req) == con_cell("query",1) &&
+		   e.functor(e.arg(req, 0)) == con_cell("echo",1)) {
+	    term v = e.arg(e.arg(req, 0), 0);
+	    held.push_back(std::make_pair(id,
+				reinterpret_cast<int_cell &>(v).value()));
+	    assert(held.size() <= max_in_flight);
+	} else {
+	    reply = e.new_term(e.functor("error",1),
+			       {e.functor("unknown_request",0)});
+	}
+	if (reply != term()) {
+	    peer.send(e.new_term(connection::MSG, {id, reply}));
+	}
+	if (held.size() < max_in_flight &&
+	    num_answered + held.size() < NUM_PIPELINED_TASKS) {
+	    continue;
+	}
+
+	// The connection must wait for replies now
+	utime::sleep(utime::ms(200));
+	assert(peer.available() == 0);
+
+	std::cout << "Round " << round << ": " << held.size()
+		  << " requests in flight" << std::endl;
+	// First round in reverse, then odd ones before even ones
+	if (round == 0) {
+	    std::reverse(held.begin(), held.end());
+	} else {
+	    std::stable_partition(held.begin(), held.end(),
+		  [](const std::pair<term, int64_t> &p) {
+		      return p.second % 2 == 1; });
+	}
+	for (auto &h : held) {
+	    std::cout << "Reply to " << h.second << std::endl;
+	    peer.send(e.new_term(connection::MSG,
+				 {h.first, e.new_term(con_cell("ok",1),
+						      {int_cell(h.second)})}));
+	}
+	num_answered += held.size();
+	held.clear();
+	round++;
+    }
+
+    // Wait for the tasks to get their replies
+    auto deadline = utime::now() + utime::ss(TIMEOUT_SECONDS);
+    for (;;) {
+	{
+	    boost::lock_guard<boost::mutex> guard(pipelined_lock);
+	    if (pipelined_replies.size() == NUM_PIPELINED_TASKS) {
+		break;
+	    }
+	}
+	assert(utime::now() < deadline);
+	utime::sleep(utime::ms(10));
+    }
+
+    self.stop();
+    self.join();
+
+    for (auto &p : pipelined_replies) {
+	std::cout << "Task " << p.first << " got " << p.second << std::endl;
+	assert(p.second == static_cast<int64_t>(p.first));
+    }
+    assert(round == 2);
+}
+
+int main(int argc, char *argv[])
+{
+    header("test_node_connection()");
+
+    test_chunk_boundaries();
+    test_message_size_cap();
+    test_split_frames();
+    test_frame_compaction();
+    test_partial_writes();
+    test_pipelined_requests();
+
+    return 0;
+}
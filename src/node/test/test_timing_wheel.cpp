@@ -0,0 +1,131 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <assert.h>
+#include <common/fast_hash.hpp>
+#include <node/timing_wheel.hpp>
+
+using namespace prologcoin::common;
+using namespace prologcoin::node;
+
+static void header( const std::string &str )
+{
+    std::cout << "\n";
+    std::cout << "--- [" + str + "] " + std::string(60 - str.length(), '-') << "\n";
+    std::cout << "\n";
+}
+
+static void test_timing_wheel_order()
+{
+    header("test_timing_wheel_order");
+
+    utime start(1000000000);
+    timing_wheel<size_t> wheel(start);
+
+    // Deadlines from now up to a few days ahead (beyond the last level
+    // of the wheel.)
+    const size_t N = 50000;
+    fast_hash h;
+    std::vector<utime> when(N);
+    for (size_t i = 0; i < N; i++) {
+	h << i;
+	uint64_t r = static_cast<uint32_t>(h);
+	uint64_t dt;
+	switch (i % 4) {
+	case 0: dt = r % 200000; break;              // < 200 ms
+	case 1: dt = r % 60000000; break;            // < 1 minute
+	case 2: dt = r % 3600000000ULL; break;       // < 1 hour
+	default: dt = (r % 100) * 3600000000ULL; break; // days
+	}
+	when[i] = start + dt;
+	wheel.insert(nullptr, when[i], i);
+    }
+    assert(wheel.size() == N);
+
+    // Advance to each next expiry and check that nothing fires early
+    // and everything fires within a tick of being due. (The ones due
+    // right at the start fire on the next tick.)
+    std::vector<bool> fired(N, false);
+    size_t num_fired = 0, num_steps = 0;
+    utime now = start;
+    while (!wheel.empty()) {
+	utime next = wheel.next_expiry();
+	assert(next > now);
+	now = next;
+	num_steps++;
+	wheel.advance(now, [&](void *, size_t i) {
+		assert(!fired[i]);
+		assert(when[i] <= now);
+		assert(now - when[i] <= utime(timing_wheel<size_t>::RESOLUTION));
+		fired[i] = true;
+		num_fired++;
+	    });
+    }
+    assert(num_fired == N);
+
+    std::cout << "Fired " << num_fired << " in " << num_steps << " steps; "
+	      << "avg lateness " << wheel.avg_lateness_us() << "us, "
+	      << "max lateness " << wheel.max_lateness_us() << "us" << std::endl;
+    assert(wheel.max_lateness_us() <= timing_wheel<size_t>::RESOLUTION);
+}
+
+static void test_timing_wheel_cancel()
+{
+    header("test_timing_wheel_cancel");
+
+    utime start(1000000000);
+    timing_wheel<size_t> wheel(start);
+
+    int a = 0, b = 0;
+    std::vector<timing_wheel<size_t>::handle> handles;
+    for (size_t i = 0; i < 1000; i++) {
+	handles.push_back(wheel.insert(&a, start + i * 1000000, i));
+	wheel.insert(&b, start + i * 1000000, i);
+    }
+    for (size_t i = 0; i < 1000; i += 2) {
+	wheel.cancel(handles[i]);
+    }
+    assert(wheel.size() == 1500);
+    assert(wheel.cancel_all(&b) == 1000);
+    assert(wheel.size() == 500);
+
+    size_t n = 0;
+    wheel.advance(start + static_cast<uint64_t>(2000000000), [&](void *owner, size_t i) {
+	    assert(owner == &a);
+	    assert(i % 2 == 1);
+	    n++;
+	});
+    assert(n == 500);
+    assert(wheel.empty());
+    assert(wheel.cancel_all(&a) == 0);
+
+    // Entries in the past fire at the next tick
+    wheel.insert(&a, start, 42);
+    n = 0;
+    wheel.advance(start + static_cast<uint64_t>(3000000000), [&](void *, size_t i) {
+	    assert(i == 42);
+	    n++;
+	});
+    assert(n == 1);
+
+    // Beyond the reach of the wheel (about 50 days)
+    utime far = start + static_cast<uint64_t>(3000000000 + 60 * 86400000000ULL);
+    wheel.insert(&a, far, 4711);
+    n = 0;
+    while (!wheel.empty()) {
+	utime next = wheel.next_expiry();
+	wheel.advance(next, [&](void *, size_t i) {
+		assert(i == 4711);
+		assert(next >= far);
+		n++;
+	    });
+    }
+    assert(n == 1);
+}
+
+int main(int argc, char *argv[])
+{
+    test_timing_wheel_order();
+    test_timing_wheel_cancel();
+    return 0;
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+#ifndef _node_timing_wheel_hpp
+#define _node_timing_wheel_hpp
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <boost/noncopyable.hpp>
+#include "../common/utime.hpp"
+
+namespace prologcoin { namespace node {
+
+//
+// Hierarchical timing wheel. Level 0 has one slot per tick (RESOLUTION
+// microseconds), and each slot of level L+1 covers a full turn of
+// level L. Insert and cancel are O(1). Advancing moves the entries of
+// a higher level slot down (cascades) when the level below has turned
+// around, and fires the entries of each passed level 0 slot.
+//
+// Every entry has an owner. The entries of an owner are also kept in a
+// list of their own, so they can all be cancelled when it goes away.
+// The wheel is not synchronized.
+//
+template<typename T> class timing_wheel : private boost::noncopyable {
+public:
+    using utime = prologcoin::common::utime;
+
+    static const size_t LEVELS = 4;
+    static const size_t SLOT_BITS = 8;
+    static const size_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t RESOLUTION = 1000; // 1 ms per tick
+
+    class entry : private boost::noncopyable {
+    public:
+	inline const T & value() const { return value_; }
+	inline T & value() { return value_; }
+	inline utime when() const { return when_; }
+	inline void * owner() const { return owner_; }
+
+    private:
+	friend class timing_wheel;
+
+	entry(void *owner, utime when, const T &value)
+	  : value_(value), when_(when), owner_(owner), tick_(0),
+	    slot_(nullptr), prev_(nullptr), next_(nullptr),
+	    owner_prev_(nullptr), owner_next_(nullptr) { }
+
+	T value_;
+	utime when_;
+	void *owner_;
+	uint64_t tick_;
+	entry **slot_;
+	entry *prev_, *next_;
+	entry *owner_prev_, *owner_next_;
+    };
+
+    using handle = entry *;
+
+    timing_wheel(utime now = utime::now())
+      : current_tick_(now.in_us() / RESOLUTION), size_(0), num_fired_(0),
+	total_lateness_(0), max_lateness_(0)
+    {
+	for (size_t i = 0; i < LEVELS; i++) {
+	    std::fill(&slots_[i][0], &slots_[i][SLOTS], nullptr);
+	}
+    }
+
+    ~timing_wheel()
+    {
+	for (size_t i = 0; i < LEVELS; i++) {
+	    for (size_t j = 0; j < SLOTS; j++) {
+		while (slots_[i][j] != nullptr) {
+		    entry *e = slots_[i][j];
+		    slots_[i][j] = e->next_;
+		    delete e;
+		}
+	    }
+	}
+    }
+
+    inline size_t size() const { return size_; }
+    inline bool empty() const { return size_ == 0; }
+
+    // Lateness is the time between when an entry was due and when the
+    // wheel was advanced past it.
+    inline uint64_t num_fired() const { return num_fired_; }
+    inline uint64_t max_lateness_us() const { return max_lateness_; }
+    inline uint64_t avg_lateness_us() const
+    { return num_fired_ == 0 ? 0 : total_lateness_ / num_fired_; }
+
+    handle insert(void *owner, utime when, const T &value)
+    {
+	entry *e = new entry(owner, when, value);
+	e->tick_ = (when.in_us() + RESOLUTION - 1) / RESOLUTION;
+	place(e, current_tick_ + 1);
+	entry *&first = owners_[owner];
+	e->owner_next_ = first;
+	if (first != nullptr) {
+	    first->owner_prev_ = e;
+	}
+	first = e;
+	size_++;
+	return e;
+    }
+
+    void cancel(handle e)
+    {
+	unlink(e);
+	unlink_owner(e);
+	delete e;
+	size_--;
+    }
+
+    size_t cancel_all(void *owner)
+    {
+	auto it = owners_.find(owner);
+	if (it == owners_.end()) {
+	    return 0;
+	}
+	size_t n = 0;
+	entry *e = it->second;
+	while (e != nullptr) {
+	    entry *next = e->owner_next_;
+	    unlink(e);
+	    delete e;
+	    e = next;
+	    n++;
+	}
+	owners_.erase(it);
+	size_ -= n;
+	return n;
+    }
+
+    //
+    // Fires (and removes) everything due at 'now' by calling
+    // fn(owner, value) in order of ticks. Returns the number fired.
+    //
+    template<typename Fn> size_t advance(utime now, Fn fn)
+    {
+	uint64_t target = now.in_us() / RESOLUTION;
+	if (size_ == 0) {
+	    current_tick_ = std::max(current_tick_, target);
+	    return 0;
+	}
+	size_t n = 0;
+	while (current_tick_ < target && size_ > 0) {
+	    // Skip the ticks where nothing happens
+	    uint64_t next = next_tick();
+	    if (next > target) {
+		break;
+	    }
+	    current_tick_ = next;
+	    cascade();
+	    entry *e = slots_[0][current_tick_ & (SLOTS - 1)];
+	    slots_[0][current_tick_ & (SLOTS - 1)] = nullptr;
+	    while (e != nullptr) {
+		entry *next = e->next_;
+		if (e->tick_ > current_tick_) {
+		    // Put beyond the last level; not due yet
+		    place(e, current_tick_ + 1);
+		} else {
+		    fire(e, now, fn);
+		    n++;
+		}
+		e = next;
+	    }
+	}
+	current_tick_ = std::max(current_tick_, target);
+	return n;
+    }
+
+    //
+    // The earliest time the wheel should be advanced, i.e. when the
+    // first entry is due or a non empty slot has to be cascaded.
+    // Returns utime() when empty.
+    //
+    utime next_expiry() const
+    {
+	if (size_ == 0) {
+	    return utime();
+	}
+	return utime(next_tick() * RESOLUTION);
+    }
+
+private:
+    // The first tick after current_tick_ with a non empty level 0 slot
+    // or where a non empty slot of a higher level is cascaded.
+    uint64_t next_tick() const
+    {
+	uint64_t best = std::numeric_limits<uint64_t>::max();
+	for (size_t level = 0; level < LEVELS; level++) {
+	    uint64_t base = current_tick_ >> (SLOT_BITS*level);
+	    for (uint64_t k = 1; k <= SLOTS; k++) {
+		if (slots_[level][(base + k) & (SLOTS-1)] != nullptr) {
+		    best = std::min(best, (base + k) << (SLOT_BITS*level));
+		    break;
+		}
+	    }
+	}
+	return best;
+    }
+
+    // Entries earlier than 'from' are put at 'from'
+    void place(entry *e, uint64_t from)
+    {
+	uint64_t tick = std::max(e->tick_, from);
+	uint64_t delta = tick - current_tick_;
+	size_t level = 0;
+	while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS*(level+1)))) {
+	    level++;
+	}
+	if (delta >= (1ULL << (SLOT_BITS*LEVELS))) {
+	    // Too far away; park it at the furthest slot for now
+	    tick = current_tick_ + (1ULL << (SLOT_BITS*LEVELS)) - 1;
+	}
+	entry *&first = slots_[level][(tick >> (SLOT_BITS*level)) & (SLOTS-1)];
+	e->slot_ = &first;
+	e->prev_ = nullptr;
+	e->next_ = first;
+	if (first != nullptr) {
+	    first->prev_ = e;
+	}
+	first = e;
+    }
+
+    void unlink(entry *e)
+    {
+	if (e->prev_ != nullptr) {
+	    e->prev_->next_ = e->next_;
+	} else {
+	    *e->slot_ = e->next_;
+	}
+	if (e->next_ != nullptr) {
+	    e->next_->prev_ = e->prev_;
+	}
+    }
+
+    void unlink_owner(entry *e)
+    {
+	if (e->owner_prev_ != nullptr) {
+	    e->owner_prev_->owner_next_ = e->owner_next_;
+	} else if (e->owner_next_ != nullptr) {
+	    owners_[e->owner_] = e->owner_next_;
+	} else {
+	    owners_.erase(e->owner_);
+	}
+	if (e->owner_next_ != nullptr) {
+	    e->owner_next_->owner_prev_ = e->owner_prev_;
+	}
+    }
+
+    // Moves entries down from the levels that turned over at
+    // current_tick_ (top level first.)
+    void cascade()
+    {
+	size_t top = 0;
+	while (top < LEVELS - 1 &&
+	       ((current_tick_ >> (SLOT_BITS*(top+1))) << (SLOT_BITS*(top+1))) == current_tick_) {
+	    top++;
+	}
+	for (size_t level = top; level > 0; level--) {
+	    entry *&first = slots_[level][(current_tick_ >> (SLOT_BITS*level)) & (SLOTS-1)];
+	    entry *e = first;
+	    first = nullptr;
+	    while (e != nullptr) {
+		entry *next = e->next_;
+		place(e, current_tick_);
+		e = next;
+	    }
+	}
+    }
+
+    template<typename Fn> void fire(entry *e, utime now, Fn &fn)
+    {
+	unlink_owner(e);
+	size_--;
+	uint64_t late = now > e->when_ ? (now - e->when_).in_us() : 0;
+	num_fired_++;
+	total_lateness_ += late;
+	max_lateness_ = std::max(max_lateness_, late);
+	fn(e->owner_, e->value_);
+	delete e;
+    }
+
+    uint64_t current_tick_;
+    size_t size_;
+    entry *slots_[LEVELS][SLOTS];
+    std::unordered_map<void *, entry *> owners_;
+
+    uint64_t num_fired_;
+    uint64_t total_lateness_;
+    uint64_t max_lateness_;
+};
+
+}}
+
+#endif